@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include "arena.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+static size_t round_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+int arena_init(arena_t *arena, size_t size, int hugepages) {
+    size = round_up(size > 0 ? size : 1, ARENA_HUGEPAGE_SIZE);
+    arena->size = size;
+    arena->used = 0;
+
+    if (hugepages) {
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (mem != MAP_FAILED) {
+            arena->base = mem;
+            arena->mapping = mem;
+            arena->mapping_size = size;
+            arena->backing = ARENA_HUGETLB;
+            return 0;
+        }
+    }
+
+    /* Over-map by one hugepage so the arena can start on a 2 MB boundary. */
+    size_t mapping_size = size + ARENA_HUGEPAGE_SIZE;
+    void *mem = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        arena->base = NULL;
+        return -1;
+    }
+    arena->mapping = mem;
+    arena->mapping_size = mapping_size;
+    arena->base = (char*)round_up((uintptr_t)mem, ARENA_HUGEPAGE_SIZE);
+
+    if (hugepages && madvise(arena->base, size, MADV_HUGEPAGE) == 0) {
+        arena->backing = ARENA_THP;
+    } else {
+        madvise(arena->base, size, MADV_NOHUGEPAGE);
+        arena->backing = ARENA_SMALL_PAGES;
+    }
+    return 0;
+}
+
+int arena_map_file(arena_t *arena, int fd, size_t offset, size_t used) {
+    size_t size = used > 0 ? used : 1;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)offset);
+    if (mem == MAP_FAILED) {
+        arena->base = NULL;
+        return -1;
+    }
+    /* Start reading ahead now; restore touches the session table first. */
+    madvise(mem, size, MADV_WILLNEED);
+    arena->base = mem;
+    arena->size = size;
+    arena->used = 0;
+    arena->mapping = mem;
+    arena->mapping_size = size;
+    arena->backing = ARENA_FILE;
+    return 0;
+}
+
+void arena_destroy(arena_t *arena) {
+    if (arena->mapping) {
+        munmap(arena->mapping, arena->mapping_size);
+    }
+    arena->mapping = NULL;
+    arena->base = NULL;
+}
+
+void* arena_alloc(arena_t *arena, size_t size, size_t align) {
+    size_t offset = round_up(arena->used, align);
+    if (!arena->base) {
+        arena->used = offset + size;
+        return NULL;
+    }
+    if (offset + size > arena->size) {
+        return NULL;
+    }
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+const char* arena_backing_name(arena_backing_t backing) {
+    switch (backing) {
+        case ARENA_HUGETLB: return "2 MB hugetlb pages";
+        case ARENA_THP: return "transparent hugepages";
+        case ARENA_FILE: return "snapshot file";
+        default: return "4 KB pages";
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator over one anonymous mapping, used for all of the engine's
+ * runtime-sized tables. The mapping is backed by 2 MB hugetlb pages when the
+ * system has them reserved, otherwise by transparent hugepages, and is never
+ * pre-faulted: memory comes back zeroed and each page is only paid for when
+ * it is first touched, so setup cost does not grow with capacity.
+ *
+ * An arena with a NULL base only counts: arena_alloc returns NULL and bumps
+ * `used`, which lets callers size the real arena with the same layout code.
+ */
+#define ARENA_HUGEPAGE_SIZE (2u << 20)
+
+typedef enum {
+    ARENA_HUGETLB,
+    ARENA_THP,
+    ARENA_SMALL_PAGES,
+    ARENA_FILE
+} arena_backing_t;
+
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+    void *mapping;          /* what to munmap, may start before base */
+    size_t mapping_size;
+    arena_backing_t backing;
+} arena_t;
+
+/* Map size bytes; hugepages = 0 asks for small pages only. */
+int arena_init(arena_t *arena, size_t size, int hugepages);
+void arena_destroy(arena_t *arena);
+
+/*
+ * Map used bytes of fd at offset (page aligned) as an arena holding earlier
+ * contents, for the caller to lay out again with the same allocations. The
+ * mapping is private: pages are read from the file when first touched and
+ * writes never reach it.
+ */
+int arena_map_file(arena_t *arena, int fd, size_t offset, size_t used);
+
+/* Zeroed, align must be a power of two. NULL when full or counting. */
+void* arena_alloc(arena_t *arena, size_t size, size_t align);
+
+const char* arena_backing_name(arena_backing_t backing);
+
+#endif
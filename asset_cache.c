@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include "asset_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define ASSET_HEAD_MAX 512
+
+enum { PLAIN, GZIP, ENCODINGS };
+
+/* One loaded copy of a file, immutable once published. */
+typedef struct {
+    int refs;                   /* the cache's, plus one per response being sent */
+    char etag[ENCODINGS][32];
+    char *body[ENCODINGS];      /* body[GZIP] is NULL when compression does not pay */
+    size_t body_len[ENCODINGS];
+    char head[ENCODINGS][ASSET_HEAD_MAX];
+    size_t head_len[ENCODINGS];
+    char not_modified[ENCODINGS][ASSET_HEAD_MAX];
+    size_t not_modified_len[ENCODINGS];
+} asset_version_t;
+
+typedef struct {
+    char url_path[256];
+    char file[PATH_MAX];
+    const char *name;           /* last component of file */
+    char content_type[64];
+    int wd;                     /* inotify watch on the file's directory */
+    asset_version_t *current;   /* NULL until the file could be read */
+} asset_t;
+
+struct asset_cache {
+    asset_t assets[ASSET_MAX];
+    int count;
+    pthread_mutex_t lock;       /* guards current pointers and their first reference */
+    int inotify_fd;
+    int wakefd;
+    pthread_t watcher;
+};
+
+static void version_release(asset_version_t *v) {
+    if (v && __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(v->body[PLAIN]);
+        free(v->body[GZIP]);
+        free(v);
+    }
+}
+
+static char* read_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (data = malloc((size_t)st.st_size + 1))) {
+        size_t got = 0;
+        while (got < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + got, (size_t)st.st_size - got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            got += (size_t)n;
+        }
+        *len = got;
+    }
+    close(fd);
+    return data;
+}
+
+/* gzip copy of data, or NULL if it would not be smaller. */
+static char* gzip_compress(const char *data, size_t len, size_t *out_len) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t bound = deflateBound(&z, (uLong)len);
+    char *out = malloc(bound);
+    if (out) {
+        z.next_in = (Bytef*)data;
+        z.avail_in = (uInt)len;
+        z.next_out = (Bytef*)out;
+        z.avail_out = (uInt)bound;
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out >= len) {
+            free(out);
+            out = NULL;
+        } else {
+            *out_len = z.total_out;
+        }
+    }
+    deflateEnd(&z);
+    return out;
+}
+
+/* FNV-1a: only needs to change when the contents do. */
+static uint64_t content_hash(const char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)data[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static asset_version_t* version_load(const asset_t *a) {
+    asset_version_t *v = calloc(1, sizeof(asset_version_t));
+    if (!v || !(v->body[PLAIN] = read_file(a->file, &v->body_len[PLAIN]))) {
+        free(v);
+        return NULL;
+    }
+    v->refs = 1;
+    v->body[GZIP] = gzip_compress(v->body[PLAIN], v->body_len[PLAIN], &v->body_len[GZIP]);
+
+    uint64_t hash = content_hash(v->body[PLAIN], v->body_len[PLAIN]);
+    for (int e = PLAIN; e < ENCODINGS; e++) {
+        /* Each encoding is a different representation, so it gets its own strong ETag. */
+        snprintf(v->etag[e], sizeof(v->etag[e]), "\"%016llx%s\"", (unsigned long long)hash, e == GZIP ? "-gz" : "");
+        if (!v->body[e]) {
+            continue;
+        }
+        v->head_len[e] = (size_t)snprintf(v->head[e], ASSET_HEAD_MAX,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "%s"
+            "ETag: %s\r\n"
+            "Vary: Accept-Encoding\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Access-Control-Allow-Origin: *\r\n",
+            a->content_type, v->body_len[e], e == GZIP ? "Content-Encoding: gzip\r\n" : "", v->etag[e]);
+        v->not_modified_len[e] = (size_t)snprintf(v->not_modified[e], ASSET_HEAD_MAX,
+            "HTTP/1.1 304 Not Modified\r\n"
+            "ETag: %s\r\n"
+            "Vary: Accept-Encoding\r\n"
+            "Cache-Control: no-cache\r\n",
+            v->etag[e]);
+    }
+    return v;
+}
+
+static void asset_reload(asset_cache_t *cache, asset_t *a) {
+    asset_version_t *v = version_load(a);
+    if (!v) {
+        /* Mid-replace or gone: keep serving the last good copy. */
+        if (errno != ENOENT) {
+            fprintf(stderr, "[WEB] Could not load %s: %s\n", a->file, strerror(errno));
+        }
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    asset_version_t *old = a->current;
+    a->current = v;
+    pthread_mutex_unlock(&cache->lock);
+    if (old) {
+        printf("[WEB] Reloaded %s (%zu bytes, %zu gzipped)\n", a->file, v->body_len[PLAIN],
+               v->body[GZIP] ? v->body_len[GZIP] : v->body_len[PLAIN]);
+    }
+    version_release(old);
+}
+
+static void* watcher_main(void *arg) {
+    asset_cache_t *cache = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = cache->inotify_fd, .events = POLLIN },
+        { .fd = cache->wakefd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        ssize_t n = read(cache->inotify_fd, buf, sizeof(buf));
+        for (char *p = buf; n > 0 && p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+            int count = __atomic_load_n(&cache->count, __ATOMIC_ACQUIRE);
+            for (int i = 0; i < count; i++) {
+                asset_t *a = &cache->assets[i];
+                if (ev->len && a->wd == ev->wd && strcmp(ev->name, a->name) == 0) {
+                    asset_reload(cache, a);
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+asset_cache_t* asset_cache_open(void) {
+    asset_cache_t *cache = calloc(1, sizeof(asset_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    cache->wakefd = eventfd(0, EFD_CLOEXEC);
+    if (cache->inotify_fd < 0 || cache->wakefd < 0 ||
+        pthread_create(&cache->watcher, NULL, watcher_main, cache) != 0) {
+        perror("[WEB] Asset watcher");
+        if (cache->inotify_fd >= 0) close(cache->inotify_fd);
+        if (cache->wakefd >= 0) close(cache->wakefd);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+int asset_cache_add(asset_cache_t *cache, const char *url_path, const char *file, const char *content_type) {
+    if (cache->count == ASSET_MAX || strlen(url_path) >= sizeof(cache->assets[0].url_path) ||
+        strlen(file) >= sizeof(cache->assets[0].file) ||
+        strlen(content_type) >= sizeof(cache->assets[0].content_type)) {
+        return -1;
+    }
+    asset_t a;
+    memset(&a, 0, sizeof(a));
+    strcpy(a.url_path, url_path);
+    strcpy(a.file, file);
+    strcpy(a.content_type, content_type);
+
+    /* Watch the directory: editors and deploys usually replace a file by renaming over it. */
+    char dir[PATH_MAX];
+    const char *slash = strrchr(file, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - file > 0 ? slash - file : 1), file);
+    } else {
+        strcpy(dir, ".");
+    }
+    a.wd = inotify_add_watch(cache->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (a.wd < 0) {
+        fprintf(stderr, "[WEB] Cannot watch %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    /* Publish the slot before the watcher can match it; count is read without the lock. */
+    pthread_mutex_lock(&cache->lock);
+    asset_t *slot = &cache->assets[cache->count];
+    *slot = a;
+    slot->name = slash ? slot->file + (slash - file) + 1 : slot->file;
+    __atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cache->lock);
+
+    asset_reload(cache, slot);
+    if (!slot->current) {
+        fprintf(stderr, "[WEB] %s not found; serving it once it appears\n", file);
+    }
+    return 0;
+}
+
+static int accepts_gzip(const http_request_t *req) {
+    char value[256];
+    if (!http_header(req, "Accept-Encoding", value, sizeof(value))) {
+        return 0;
+    }
+    for (char *save, *item = strtok_r(value, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        while (*item == ' ' || *item == '\t') item++;
+        size_t name_len = strcspn(item, " \t;");
+        if (!((name_len == 4 && strncasecmp(item, "gzip", 4) == 0) || (name_len == 1 && item[0] == '*'))) {
+            continue;
+        }
+        const char *q = strstr(item + name_len, "q=");
+        return !q || strtod(q + 2, NULL) > 0;
+    }
+    return 0;
+}
+
+/* If-None-Match lists this version in either encoding (weak comparison, as RFC 9110 asks). */
+static int etag_matches(const http_request_t *req, const asset_version_t *v) {
+    char value[1024];
+    if (!http_header(req, "If-None-Match", value, sizeof(value))) {
+        return 0;
+    }
+    for (char *save, *tag = strtok_r(value, ",", &save); tag; tag = strtok_r(NULL, ",", &save)) {
+        while (*tag == ' ' || *tag == '\t') tag++;
+        size_t len = strcspn(tag, " \t");
+        if (len == 1 && tag[0] == '*') {
+            return 1;
+        }
+        if (len > 2 && strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+            len -= 2;
+        }
+        for (int e = PLAIN; e < ENCODINGS; e++) {
+            if (strlen(v->etag[e]) == len && strncmp(tag, v->etag[e], len) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int asset_cache_serve(asset_cache_t *cache, http_conn_t *conn, const http_request_t *req) {
+    int count = __atomic_load_n(&cache->count, __ATOMIC_ACQUIRE);
+    asset_t *a = NULL;
+    for (int i = 0; i < count && !a; i++) {
+        if (strcmp(cache->assets[i].url_path, req->path) == 0) {
+            a = &cache->assets[i];
+        }
+    }
+    if (!a) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    asset_version_t *v = a->current;
+    if (v) {
+        __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (!v) {
+        return -1;
+    }
+
+    int e = v->body[GZIP] && accepts_gzip(req) ? GZIP : PLAIN;
+    if (etag_matches(req, v)) {
+        http_respond_prepared(conn, v->not_modified[e], v->not_modified_len[e], NULL, 0);
+    } else {
+        http_respond_prepared(conn, v->head[e], v->head_len[e], v->body[e], v->body_len[e]);
+    }
+    version_release(v);
+    return 0;
+}
+
+void asset_cache_close(asset_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(cache->wakefd, &one, sizeof(one)) != sizeof(one)) {
+        perror("[WEB] Asset watcher wakeup");
+    }
+    pthread_join(cache->watcher, NULL);
+    for (int i = 0; i < cache->count; i++) {
+        version_release(cache->assets[i].current);
+    }
+    close(cache->inotify_fd);
+    close(cache->wakefd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
@@ -0,0 +1,37 @@
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include "http_server.h"
+
+/*
+ * Static files for the management server, held in memory. Each file is
+ * read once, given an ETag (a hash of its contents) and, when it shrinks,
+ * a gzip copy, and its response headers are formatted up front, so a
+ * request costs one writev and no file system calls. Conditional requests
+ * whose If-None-Match lists the current ETag get 304.
+ *
+ * A watcher thread follows the files' directories with inotify and reloads
+ * a file when it is written or renamed into place. Requests in flight keep
+ * the version they started with.
+ */
+#define ASSET_MAX 16
+
+typedef struct asset_cache asset_cache_t;
+
+/* Starts the watcher. NULL on failure. */
+asset_cache_t* asset_cache_open(void);
+
+/*
+ * Serve file at url_path. A file that cannot be read now is still watched
+ * and served once it appears. -1 if the table is full or the directory
+ * cannot be watched.
+ */
+int asset_cache_add(asset_cache_t *cache, const char *url_path, const char *file, const char *content_type);
+
+/* Respond to req if url_path is a loaded asset; -1 (nothing sent) otherwise. */
+int asset_cache_serve(asset_cache_t *cache, http_conn_t *conn, const http_request_t *req);
+
+/* Stops the watcher and frees everything; stop the HTTP server first. */
+void asset_cache_close(asset_cache_t *cache);
+
+#endif
@@ -0,0 +1,765 @@
+#define _GNU_SOURCE
+#include "cgnat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ * Engine benchmark with a workload model. Each worker thread is pinned to a
+ * core and owns the subscribers that steer to its shards, as RSS would give
+ * it. Before the clock starts, it builds its whole packet vector:
+ *
+ *   - the simulated timeline runs at -r packets per second per thread for
+ *     -d seconds
+ *   - a packet opens a new session with probability -n, otherwise it belongs
+ *     to a live flow and goes inbound with probability -i
+ *   - subscribers are picked by Zipf popularity (-z), and a subscriber's
+ *     flows by Zipf over its -f flow slots (-Z)
+ *   - a flow carries packets for an exponentially distributed lifetime
+ *     (mean -L seconds) and is then left to the engine's idle timeout
+ *
+ * The measured loop only copies a prepared packet (inbound replies take the
+ * public address their flow was given) and times the translate call with the
+ * TSC. Every delta is kept, in arrays sized from the vector, and the
+ * percentiles are exact ranks over all of them. The main thread moves the engine clock along with the slowest worker
+ * and runs the reaper, as in production. The first -W simulated seconds are
+ * warm-up and are not recorded.
+ */
+
+#define INSIDE_BASE 0x64400000u     /* 100.64.0.0 */
+#define PUBLIC_BASE 0xCB007101u     /* 203.0.113.1 */
+#define REMOTE_BASE 0xC6330000u     /* 198.51.0.0 */
+#define CLOCK_TICK_NS 1000000
+#define OVERHEAD_SAMPLES 1000000
+#define MAX_FLOWS_PER_SUBSCRIBER 1024
+#define DET_BLOCK_SIZE 1024         /* room for a popular subscriber's idle sessions */
+#define ESTABLISHED_DRAWS 8         /* subscribers tried for a live flow before opening one */
+
+enum {
+    KIND_NEW,
+    KIND_ESTABLISHED,
+    KIND_INBOUND,
+    KINDS
+};
+
+static const char *kind_names[KINDS] = { "outbound_new", "outbound_established", "inbound" };
+
+typedef struct {
+    uint32_t threads;
+    uint32_t shards;
+    cgnat_mode_t mode;
+    uint32_t subscribers;
+    uint32_t flows_per_subscriber;
+    double zipf_subscribers;
+    double zipf_flows;
+    double new_ratio;
+    double inbound_ratio;
+    double udp_ratio;
+    double lifetime;
+    uint32_t rate;
+    uint32_t seconds;
+    uint32_t warmup;
+    uint32_t sessions;
+    uint64_t seed;
+    int pin;
+} bench_config_t;
+
+typedef struct {
+    packet_info_t pkt;      /* outbound packet, or the reply with its public side left blank */
+    uint32_t flow;
+    uint32_t second;
+    uint8_t kind;
+} bench_packet_t;
+
+typedef struct {
+    double *cdf;
+    uint32_t n;
+} zipf_t;
+
+/* Raw TSC deltas of one kind of translation, sorted before reading ranks. */
+typedef struct {
+    uint32_t *ticks;
+    uint64_t count;
+    uint64_t sum;
+} samples_t;
+
+typedef struct {
+    uint32_t flow;          /* UINT32_MAX when empty */
+    uint32_t ends;          /* simulated second the flow stops sending */
+} flow_slot_t;
+
+typedef struct {
+    const bench_config_t *config;
+    cgnat_t *cgnat;
+    int id;
+    int cpu;
+    pthread_barrier_t *ready;
+
+    uint32_t *subscribers;      /* private IPs, in popularity order */
+    uint32_t num_subscribers;
+
+    bench_packet_t *packets;
+    uint32_t num_packets;
+    uint32_t num_flows;
+    uint32_t *pub_ip;           /* per flow, from its latest outbound translation */
+    uint16_t *pub_port;
+
+    uint32_t progress;          /* simulated second reached, read by the clock thread */
+    int done;
+
+    samples_t samples[KINDS];
+    uint64_t generated[KINDS];
+    uint64_t recorded;
+    uint64_t failures[KINDS];
+    double seconds;             /* wall time of the recorded part */
+} bench_worker_t;
+
+static int samples_alloc(samples_t *s, uint64_t capacity) {
+    s->ticks = malloc((capacity ? capacity : 1) * sizeof(uint32_t));
+    s->count = 0;
+    s->sum = 0;
+    return s->ticks ? 0 : -1;
+}
+
+static inline void samples_add(samples_t *s, uint64_t ticks) {
+    s->ticks[s->count++] = ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks;
+    s->sum += ticks;
+}
+
+static int compare_ticks(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Concatenate the sources into dst and sort it. */
+static int samples_merge(samples_t *dst, const samples_t *const *src, int n) {
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += src[i]->count;
+    }
+    if (samples_alloc(dst, total) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (src[i]->count) {
+            memcpy(dst->ticks + dst->count, src[i]->ticks, src[i]->count * sizeof(uint32_t));
+        }
+        dst->count += src[i]->count;
+        dst->sum += src[i]->sum;
+    }
+    qsort(dst->ticks, dst->count, sizeof(uint32_t), compare_ticks);
+    return 0;
+}
+
+/* Nearest rank: the smallest sample with at least q of them at or below it. */
+static double samples_quantile(const samples_t *s, double q) {
+    if (s->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(q * (double)s->count);
+    return s->ticks[rank > 0 ? rank - 1 : 0];
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*: the vectors only depend on the seed. */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_uniform(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* P(rank k) proportional to 1 / (k + 1)^s; s = 0 is uniform. */
+static int zipf_init(zipf_t *z, uint32_t n, double s) {
+    z->n = n;
+    z->cdf = malloc((size_t)n * sizeof(double));
+    if (!z->cdf) {
+        return -1;
+    }
+    double sum = 0;
+    for (uint32_t k = 0; k < n; k++) {
+        sum += pow((double)k + 1, -s);
+        z->cdf[k] = sum;
+    }
+    for (uint32_t k = 0; k < n; k++) {
+        z->cdf[k] /= sum;
+    }
+    return 0;
+}
+
+static uint32_t zipf_draw(const zipf_t *z, uint64_t *state) {
+    double u = next_uniform(state);
+    uint32_t lo = 0, hi = z->n - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (z->cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static uint32_t draw_lifetime(const bench_config_t *config, uint64_t *state) {
+    return (uint32_t)(-log(1.0 - next_uniform(state)) * config->lifetime);
+}
+
+/*
+ * Build this worker's vector. New flows take the subscriber's first free
+ * slot, or its least popular one when all are live. A packet for a slot
+ * whose flow has ended goes to the next live slot; when the subscriber has
+ * none, another subscriber is drawn, and after a few misses the packet
+ * opens a flow instead, so the new ratio is a floor until flows build up.
+ */
+static int generate_packets(bench_worker_t *w) {
+    const bench_config_t *config = w->config;
+    uint32_t slots = config->flows_per_subscriber;
+    zipf_t subs, flows;
+    flow_slot_t *table = malloc((size_t)w->num_subscribers * slots * sizeof(flow_slot_t));
+    uint16_t *next_port = calloc(w->num_subscribers, sizeof(uint16_t));
+    w->num_packets = config->rate * config->seconds;
+    w->packets = malloc((size_t)w->num_packets * sizeof(bench_packet_t));
+    packet_info_t *flow_pkts = malloc((size_t)w->num_packets * sizeof(packet_info_t));
+    if (!table || !next_port || !w->packets || !flow_pkts ||
+        zipf_init(&subs, w->num_subscribers, config->zipf_subscribers) != 0 ||
+        zipf_init(&flows, slots, config->zipf_flows) != 0) {
+        return -1;
+    }
+    memset(table, 0xFF, (size_t)w->num_subscribers * slots * sizeof(flow_slot_t));
+
+    uint64_t state = config->seed * 0x9E3779B97F4A7C15ULL + (uint64_t)w->id + 1;
+    for (uint32_t i = 0; i < w->num_packets; i++) {
+        uint32_t second = i / config->rate;
+        uint32_t sub = zipf_draw(&subs, &state);
+        flow_slot_t *own = &table[(size_t)sub * slots];
+        uint8_t kind = next_uniform(&state) < config->new_ratio ? KIND_NEW : KIND_ESTABLISHED;
+
+        flow_slot_t *slot = NULL;
+        for (int draws = 0; kind == KIND_ESTABLISHED && !slot && draws < ESTABLISHED_DRAWS; draws++) {
+            if (draws > 0) {
+                sub = zipf_draw(&subs, &state);
+                own = &table[(size_t)sub * slots];
+            }
+            uint32_t s = zipf_draw(&flows, &state);
+            for (uint32_t tries = 0; tries < slots && !slot; tries++, s = (s + 1) % slots) {
+                if (own[s].flow != UINT32_MAX && own[s].ends > second) {
+                    slot = &own[s];
+                }
+            }
+        }
+        if (kind == KIND_ESTABLISHED) {
+            if (!slot) {
+                kind = KIND_NEW;
+            } else if (next_uniform(&state) < config->inbound_ratio) {
+                kind = KIND_INBOUND;
+            }
+        }
+        if (kind == KIND_NEW) {
+            slot = &own[slots - 1];
+            for (uint32_t s = 0; s < slots; s++) {
+                if (own[s].flow == UINT32_MAX || own[s].ends <= second) {
+                    slot = &own[s];
+                    break;
+                }
+            }
+            int udp = next_uniform(&state) < config->udp_ratio;
+            packet_info_t pkt = {
+                .src_ip = w->subscribers[sub],
+                .src_port = (uint16_t)(1024 + next_port[sub]++ % 64000),
+                .dst_ip = REMOTE_BASE + (uint32_t)(next_random(&state) % 65536),
+                .dst_port = udp ? 53 : 443,
+                .protocol = udp ? PROTO_UDP : PROTO_TCP,
+                .payload_len = 100,
+            };
+            slot->flow = w->num_flows;
+            slot->ends = second + 1 + draw_lifetime(config, &state);
+            flow_pkts[w->num_flows++] = pkt;
+        }
+
+        bench_packet_t *bp = &w->packets[i];
+        bp->flow = slot->flow;
+        bp->second = second;
+        bp->kind = kind;
+        bp->pkt = flow_pkts[slot->flow];
+        if (kind == KIND_INBOUND) {
+            packet_info_t *out = &flow_pkts[slot->flow];
+            bp->pkt = (packet_info_t){
+                .src_ip = out->dst_ip, .src_port = out->dst_port,
+                .protocol = out->protocol, .payload_len = 1400,
+            };
+        }
+        w->generated[kind]++;
+    }
+
+    w->pub_ip = calloc(w->num_flows, sizeof(uint32_t));
+    w->pub_port = calloc(w->num_flows, sizeof(uint16_t));
+    free(subs.cdf);
+    free(flows.cdf);
+    free(flow_pkts);
+    free(next_port);
+    free(table);
+    return w->pub_ip && w->pub_port ? 0 : -1;
+}
+
+static void* bench_worker(void *arg) {
+    bench_worker_t *w = arg;
+    const bench_config_t *config = w->config;
+    int ok = generate_packets(w) == 0;
+    for (int k = 0; k < KINDS && ok; k++) {
+        ok = samples_alloc(&w->samples[k], w->generated[k]) == 0;
+    }
+    pthread_barrier_wait(w->ready);
+    if (!ok) {
+        __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    uint32_t second = 0;
+    double start = 0;
+    uint32_t recorded_from = UINT32_MAX;
+    for (uint32_t i = 0; i < w->num_packets; i++) {
+        const bench_packet_t *bp = &w->packets[i];
+        if (bp->second != second) {
+            second = bp->second;
+            __atomic_store_n(&w->progress, second, __ATOMIC_RELEASE);
+            if (second == config->warmup) {
+                start = monotonic_seconds();
+                recorded_from = i;
+            }
+        }
+        packet_info_t pkt = bp->pkt;
+        int result;
+        uint64_t t0, t1;
+        if (bp->kind == KIND_INBOUND) {
+            pkt.dst_ip = w->pub_ip[bp->flow];
+            pkt.dst_port = w->pub_port[bp->flow];
+            t0 = latency_ticks();
+            result = cgnat_translate_inbound(w->cgnat, &pkt);
+            t1 = latency_ticks_end();
+        } else {
+            t0 = latency_ticks();
+            result = cgnat_translate_outbound(w->cgnat, &pkt);
+            t1 = latency_ticks_end();
+            if (result == 0) {
+                w->pub_ip[bp->flow] = pkt.src_ip;
+                w->pub_port[bp->flow] = pkt.src_port;
+            }
+        }
+        if (second >= config->warmup) {
+            samples_add(&w->samples[bp->kind], t1 - t0);
+            w->failures[bp->kind] += result != 0;
+        }
+    }
+    w->seconds = recorded_from == UINT32_MAX ? 0 : monotonic_seconds() - start;
+    w->recorded = recorded_from == UINT32_MAX ? 0 : w->num_packets - recorded_from;
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Cost of the timing itself: back-to-back reads of the two TSC stamps. */
+static double timer_overhead_ns(void) {
+    samples_t s;
+    if (samples_alloc(&s, OVERHEAD_SAMPLES) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < OVERHEAD_SAMPLES; i++) {
+        uint64_t t0 = latency_ticks();
+        uint64_t t1 = latency_ticks_end();
+        samples_add(&s, t1 - t0);
+    }
+    qsort(s.ticks, s.count, sizeof(uint32_t), compare_ticks);
+    double ns = samples_quantile(&s, 0.5) * 1e9 / latency_ticks_per_sec();
+    free(s.ticks);
+    return ns;
+}
+
+static cgnat_t* create_engine(const bench_config_t *config) {
+    cgnat_config_t engine;
+    cgnat_config_default(&engine);
+    engine.max_sessions = config->sessions;
+    engine.num_shards = (int)config->shards;
+    engine.mode = config->mode;
+    engine.max_public_ips = (int)(((uint64_t)config->sessions * 11 / 10 + 64511) / 64512);
+    if (config->mode == CGNAT_MODE_DETERMINISTIC) {
+        engine.det_inside_base = INSIDE_BASE;
+        engine.det_subscribers = config->subscribers;
+        engine.block_size = DET_BLOCK_SIZE;
+        engine.max_public_ips = (int)(((uint64_t)config->subscribers * DET_BLOCK_SIZE + 64511) / 64512 + 1);
+    } else if (config->mode == CGNAT_MODE_PORT_BLOCKS) {
+        engine.block_size = 64;
+        engine.max_public_ips *= 4;
+    }
+    cgnat_t *cgnat = cgnat_init_config(&engine);
+    if (!cgnat) {
+        return NULL;
+    }
+    for (int i = 0; i < engine.max_public_ips; i++) {
+        struct in_addr addr = { .s_addr = htonl(PUBLIC_BASE + (uint32_t)i) };
+        if (cgnat_add_public_ip(cgnat, inet_ntoa(addr)) != 0) {
+            cgnat_destroy(cgnat);
+            return NULL;
+        }
+    }
+    return cgnat;
+}
+
+/* Subscribers go to the worker that owns their shard, in a shuffled popularity order. */
+static int assign_subscribers(const bench_config_t *config, cgnat_t *cgnat, bench_worker_t *workers) {
+    for (uint32_t t = 0; t < config->threads; t++) {
+        workers[t].subscribers = malloc((size_t)config->subscribers * sizeof(uint32_t));
+        if (!workers[t].subscribers) {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < config->subscribers; i++) {
+        packet_info_t pkt = { .src_ip = INSIDE_BASE + i };
+        bench_worker_t *w = &workers[(uint32_t)cgnat_outbound_shard(cgnat, &pkt) % config->threads];
+        w->subscribers[w->num_subscribers++] = pkt.src_ip;
+    }
+    uint64_t state = config->seed;
+    for (uint32_t t = 0; t < config->threads; t++) {
+        bench_worker_t *w = &workers[t];
+        if (w->num_subscribers == 0) {
+            fprintf(stderr, "Worker %u has no subscribers; use more subscribers or fewer threads\n", t);
+            return -1;
+        }
+        for (uint32_t i = w->num_subscribers - 1; i > 0; i--) {
+            uint32_t j = (uint32_t)(next_random(&state) % (i + 1));
+            uint32_t tmp = w->subscribers[i];
+            w->subscribers[i] = w->subscribers[j];
+            w->subscribers[j] = tmp;
+        }
+    }
+    return 0;
+}
+
+/* Engine time follows the slowest worker; the reaper runs after every step. */
+static void run_clock(cgnat_t *cgnat, bench_worker_t *workers, uint32_t threads, time_t base) {
+    uint32_t current = 0;
+    cgnat_set_time(cgnat, base);
+    for (;;) {
+        uint32_t slowest = UINT32_MAX;
+        int running = 0;
+        for (uint32_t t = 0; t < threads; t++) {
+            if (!__atomic_load_n(&workers[t].done, __ATOMIC_ACQUIRE)) {
+                uint32_t p = __atomic_load_n(&workers[t].progress, __ATOMIC_ACQUIRE);
+                slowest = p < slowest ? p : slowest;
+                running = 1;
+            }
+        }
+        if (!running) {
+            return;
+        }
+        if (slowest > current) {
+            current = slowest;
+            cgnat_set_time(cgnat, base + current);
+            cgnat_expire_sessions(cgnat);
+        }
+        struct timespec wait = { 0, CLOCK_TICK_NS };
+        nanosleep(&wait, NULL);
+    }
+}
+
+static void print_json_samples(FILE *out, const char *name, const samples_t *s, uint64_t failures,
+                               double ns_per_tick, int last) {
+    fprintf(out,
+            "    \"%s\": {\"count\": %lu, \"failures\": %lu, \"mean_ns\": %.1f, \"p50_ns\": %.1f, "
+            "\"p99_ns\": %.1f, \"p999_ns\": %.1f, \"max_ns\": %.1f}%s\n",
+            name, s->count, failures, s->count ? s->sum * ns_per_tick / s->count : 0.0,
+            samples_quantile(s, 0.5) * ns_per_tick, samples_quantile(s, 0.99) * ns_per_tick,
+            samples_quantile(s, 0.999) * ns_per_tick, samples_quantile(s, 1.0) * ns_per_tick,
+            last ? "" : ",");
+}
+
+static void print_json(FILE *out, const bench_config_t *config, bench_worker_t *workers,
+                       const samples_t *samples, const samples_t *all, const uint64_t *failures,
+                       const uint64_t *generated, double rate, double overhead_ns,
+                       const cgnat_counters_t *counters) {
+    static const char *modes[] = { "dynamic", "deterministic", "blocks", "apdm" };
+    double ns_per_tick = 1e9 / latency_ticks_per_sec();
+    uint64_t total_generated = generated[KIND_NEW] + generated[KIND_ESTABLISHED] + generated[KIND_INBOUND];
+    uint64_t all_failures = 0;
+    for (int k = 0; k < KINDS; k++) {
+        all_failures += failures[k];
+    }
+
+    fprintf(out, "{\n  \"benchmark\": \"cgnat\",\n  \"version\": 1,\n  \"timestamp\": %ld,\n", (long)time(NULL));
+    fprintf(out,
+            "  \"config\": {\"threads\": %u, \"shards\": %u, \"mode\": \"%s\", \"subscribers\": %u, "
+            "\"flows_per_subscriber\": %u, \"zipf_subscribers\": %.2f, \"zipf_flows\": %.2f, "
+            "\"new_ratio\": %.3f, \"inbound_ratio\": %.3f, \"udp_ratio\": %.3f, \"lifetime_s\": %.1f, "
+            "\"packets_per_second_per_thread\": %u, \"seconds\": %u, \"warmup_seconds\": %u, "
+            "\"max_sessions\": %u, \"seed\": %lu, \"pinned\": %s},\n",
+            config->threads, config->shards, modes[config->mode], config->subscribers,
+            config->flows_per_subscriber, config->zipf_subscribers, config->zipf_flows, config->new_ratio,
+            config->inbound_ratio, config->udp_ratio, config->lifetime, config->rate, config->seconds,
+            config->warmup, config->sessions, config->seed, config->pin ? "true" : "false");
+    fprintf(out,
+            "  \"workload\": {\"packets\": %lu, \"new\": %lu, \"established\": %lu, \"inbound\": %lu},\n",
+            total_generated, generated[KIND_NEW], generated[KIND_ESTABLISHED], generated[KIND_INBOUND]);
+    fprintf(out, "  \"tsc_ghz\": %.3f,\n  \"timer_overhead_ns\": %.1f,\n", latency_ticks_per_sec() / 1e9,
+            overhead_ns);
+    fprintf(out, "  \"translations_per_second\": %.0f,\n  \"threads\": [", rate);
+    for (uint32_t t = 0; t < config->threads; t++) {
+        fprintf(out, "%s{\"cpu\": %d, \"subscribers\": %u, \"translations\": %lu, \"seconds\": %.3f}",
+                t ? ", " : "", workers[t].cpu, workers[t].num_subscribers, workers[t].recorded,
+                workers[t].seconds);
+    }
+    fprintf(out, "],\n  \"latency\": {\n");
+    for (int k = 0; k < KINDS; k++) {
+        print_json_samples(out, kind_names[k], &samples[k], failures[k], ns_per_tick, 0);
+    }
+    print_json_samples(out, "all", all, all_failures, ns_per_tick, 1);
+    fprintf(out,
+            "  },\n  \"engine\": {\"active_connections\": %lu, \"total_connections\": %lu, "
+            "\"ports_in_use\": %lu, \"port_exhaustion\": %lu}\n}\n",
+            counters->active_connections, counters->total_connections, counters->ports_in_use,
+            counters->port_exhaustion_events);
+}
+
+static int parse_mode(const char *s, cgnat_mode_t *mode) {
+    static const char *names[] = { "dynamic", "deterministic", "blocks", "apdm" };
+    static const cgnat_mode_t modes[] = {
+        CGNAT_MODE_DYNAMIC, CGNAT_MODE_DETERMINISTIC, CGNAT_MODE_PORT_BLOCKS, CGNAT_MODE_APDM,
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(s, names[i]) == 0) {
+            *mode = modes[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-w shards] [-M mode] [-s subscribers] [-f flows] [-z zipf] [-Z zipf]\n"
+            "          [-n new-ratio] [-i inbound-ratio] [-u udp-ratio] [-L lifetime] [-r rate] [-d seconds]\n"
+            "          [-W warmup] [-m sessions] [-S seed] [-P] [-j json-path]\n"
+            "  -t  worker threads, pinned to cores in order (default: online CPUs)\n"
+            "  -w  engine shards (default: one per thread)\n"
+            "  -M  dynamic, deterministic, blocks or apdm (default dynamic)\n"
+            "  -s  subscribers (default 100000)\n"
+            "  -f  flow slots per subscriber (default 16)\n"
+            "  -z  Zipf exponent of subscriber popularity (default 1.0, 0 is uniform)\n"
+            "  -Z  Zipf exponent of flow popularity within a subscriber (default 1.0)\n"
+            "  -n  share of packets that open a session (default 0.1)\n"
+            "  -i  share of other packets that are inbound replies (default 0.5)\n"
+            "  -u  share of new sessions that are UDP (default 0.25)\n"
+            "  -L  mean flow lifetime in simulated seconds (default 10)\n"
+            "  -r  packets per simulated second per thread (default 20000)\n"
+            "  -d  simulated seconds (default 150)\n"
+            "  -W  warm-up seconds left out of the results (default 50)\n"
+            "  -m  session capacity (default 1000000 per thread)\n"
+            "  -S  random seed (default 1)\n"
+            "  -P  do not pin threads\n"
+            "  -j  also write the results as JSON to a file, or - for stdout\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bench_config_t config = {
+        .threads = cpus > 0 ? (uint32_t)cpus : 1,
+        .mode = CGNAT_MODE_DYNAMIC,
+        .subscribers = 100000,
+        .flows_per_subscriber = 16,
+        .zipf_subscribers = 1.0,
+        .zipf_flows = 1.0,
+        .new_ratio = 0.1,
+        .inbound_ratio = 0.5,
+        .udp_ratio = 0.25,
+        .lifetime = 10,
+        .rate = 20000,
+        .seconds = 150,
+        .warmup = 50,
+        .seed = 1,
+        .pin = 1,
+    };
+    const char *json_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:M:s:f:z:Z:n:i:u:L:r:d:W:m:S:Pj:")) != -1) {
+        switch (opt) {
+            case 't': config.threads = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'w': config.shards = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'M':
+                if (parse_mode(optarg, &config.mode) != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's': config.subscribers = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'f': config.flows_per_subscriber = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'z': config.zipf_subscribers = atof(optarg); break;
+            case 'Z': config.zipf_flows = atof(optarg); break;
+            case 'n': config.new_ratio = atof(optarg); break;
+            case 'i': config.inbound_ratio = atof(optarg); break;
+            case 'u': config.udp_ratio = atof(optarg); break;
+            case 'L': config.lifetime = atof(optarg); break;
+            case 'r': config.rate = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'd': config.seconds = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'W': config.warmup = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'm': config.sessions = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'S': config.seed = strtoull(optarg, NULL, 10); break;
+            case 'P': config.pin = 0; break;
+            case 'j': json_path = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (config.shards == 0) {
+        config.shards = config.threads;
+    }
+    if (config.sessions == 0) {
+        config.sessions = 1000000 * config.threads;
+    }
+    if (config.threads < 1 || config.threads > CGNAT_MAX_SHARDS || config.shards < 1 ||
+        config.shards > CGNAT_MAX_SHARDS || config.subscribers == 0 || config.flows_per_subscriber == 0 ||
+        config.flows_per_subscriber > MAX_FLOWS_PER_SUBSCRIBER || config.new_ratio < 0 ||
+        config.new_ratio > 1 || config.inbound_ratio < 0 || config.inbound_ratio > 1 ||
+        config.udp_ratio < 0 || config.udp_ratio > 1 || config.lifetime < 0 || config.rate == 0 ||
+        config.warmup >= config.seconds || (uint64_t)config.rate * config.seconds > UINT32_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cgnat_t *cgnat = create_engine(&config);
+    bench_worker_t *workers = calloc(config.threads, sizeof(bench_worker_t));
+    pthread_t *threads = calloc(config.threads, sizeof(pthread_t));
+    if (!cgnat || !workers || !threads || assign_subscribers(&config, cgnat, workers) != 0) {
+        return 1;
+    }
+    double overhead_ns = timer_overhead_ns();
+
+    pthread_barrier_t ready;
+    pthread_barrier_init(&ready, NULL, config.threads + 1);
+    for (uint32_t t = 0; t < config.threads; t++) {
+        bench_worker_t *w = &workers[t];
+        w->config = &config;
+        w->cgnat = cgnat;
+        w->id = (int)t;
+        w->cpu = config.pin ? (int)(t % (uint32_t)(cpus > 0 ? cpus : 1)) : -1;
+        w->ready = &ready;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (config.pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        pthread_create(&threads[t], &attr, bench_worker, w);
+        pthread_attr_destroy(&attr);
+    }
+    printf("[BENCH] Generating %u packets per thread on %u thread%s...\n",
+           config.rate * config.seconds, config.threads, config.threads == 1 ? "" : "s");
+    fflush(stdout);
+    pthread_barrier_wait(&ready);
+    run_clock(cgnat, workers, config.threads, time(NULL));
+
+    uint64_t failures[KINDS] = { 0 }, generated[KINDS] = { 0 };
+    double rate = 0;
+    int status = 0;
+    for (uint32_t t = 0; t < config.threads; t++) {
+        bench_worker_t *w = &workers[t];
+        pthread_join(threads[t], NULL);
+        if (!w->packets || !w->pub_ip || !w->samples[KINDS - 1].ticks) {
+            fprintf(stderr, "Worker %u could not build its packet vector\n", t);
+            status = 1;
+        }
+        for (int k = 0; k < KINDS; k++) {
+            failures[k] += w->failures[k];
+            generated[k] += w->generated[k];
+        }
+        rate += w->seconds > 0 ? w->recorded / w->seconds : 0;
+    }
+    pthread_barrier_destroy(&ready);
+
+    samples_t samples[KINDS], all;
+    const samples_t **parts = calloc((size_t)config.threads * KINDS, sizeof(samples_t*));
+    if (!parts) {
+        return 1;
+    }
+    for (int k = 0; k < KINDS; k++) {
+        for (uint32_t t = 0; t < config.threads; t++) {
+            parts[t] = &workers[t].samples[k];
+        }
+        if (samples_merge(&samples[k], parts, (int)config.threads) != 0) {
+            return 1;
+        }
+    }
+    for (int k = 0; k < KINDS; k++) {
+        parts[k] = &samples[k];
+    }
+    if (samples_merge(&all, parts, KINDS) != 0) {
+        return 1;
+    }
+    free(parts);
+
+    cgnat_counters_t counters;
+    cgnat_get_counters(cgnat, &counters);
+    double ns_per_tick = 1e9 / latency_ticks_per_sec();
+    printf("[BENCH] %s mode, %u threads, %u shards, %u subscribers, timer overhead %.1f ns\n",
+           config.mode == CGNAT_MODE_DYNAMIC ? "dynamic" : config.mode == CGNAT_MODE_DETERMINISTIC ?
+           "deterministic" : config.mode == CGNAT_MODE_PORT_BLOCKS ? "blocks" : "apdm",
+           config.threads, config.shards, config.subscribers, overhead_ns);
+    printf("[BENCH] %.2f M translations/s, %.1f%% new sessions, %lu sessions active at the end\n",
+           rate / 1e6, 100.0 * generated[KIND_NEW] / (generated[KIND_NEW] + generated[KIND_ESTABLISHED] +
+           generated[KIND_INBOUND]), counters.active_connections);
+    printf("  %-22s %10s %8s %9s %9s %9s %9s\n", "", "count", "failed", "p50 ns", "p99 ns", "p999 ns",
+           "max ns");
+    for (int k = 0; k < KINDS; k++) {
+        const samples_t *s = &samples[k];
+        printf("  %-22s %10lu %8lu %9.0f %9.0f %9.0f %9.0f\n", kind_names[k], s->count, failures[k],
+               samples_quantile(s, 0.5) * ns_per_tick, samples_quantile(s, 0.99) * ns_per_tick,
+               samples_quantile(s, 0.999) * ns_per_tick, samples_quantile(s, 1.0) * ns_per_tick);
+    }
+
+    if (json_path) {
+        FILE *out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (!out) {
+            perror(json_path);
+            status = 1;
+        } else {
+            print_json(out, &config, workers, samples, &all, failures, generated, rate, overhead_ns, &counters);
+            if (out != stdout) {
+                fclose(out);
+            }
+        }
+    }
+
+    for (uint32_t t = 0; t < config.threads; t++) {
+        free(workers[t].packets);
+        free(workers[t].pub_ip);
+        free(workers[t].pub_port);
+        free(workers[t].subscribers);
+        for (int k = 0; k < KINDS; k++) {
+            free(workers[t].samples[k].ticks);
+        }
+    }
+    for (int k = 0; k < KINDS; k++) {
+        free(samples[k].ticks);
+    }
+    free(all.ticks);
+    free(workers);
+    free(threads);
+    cgnat_destroy(cgnat);
+    return status;
+}
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include "flow_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Lookup microbenchmark: the open-addressing flow table against the chained
+ * hash buckets it replaced. The chained entry mirrors the old 56-byte
+ * nat_entry_t, linked through next_outbound, so lookups pay the same pointer
+ * chase. "shipped" is the old fixed 65,536-bucket table, "sized" gives the
+ * chained table one bucket per entry.
+ */
+
+typedef struct chain_entry {
+    uint32_t priv_ip;
+    uint16_t priv_port;
+    uint32_t pub_ip;
+    uint16_t pub_port;
+    uint8_t protocol;
+    int state;
+    time_t last_activity;
+    uint8_t in_use;
+    struct chain_entry *next_outbound;
+    struct chain_entry *next_inbound;
+} chain_entry_t;
+
+typedef struct {
+    chain_entry_t **heads;
+    uint32_t mask;
+} chain_table_t;
+
+#define LOOKUPS 1000000
+
+static uint32_t chain_hash(uint32_t priv_ip, uint16_t priv_port, uint8_t protocol) {
+    uint64_t key = ((uint64_t)priv_ip << 24) | ((uint64_t)priv_port << 8) | protocol;
+    key = (~key) + (key << 21);
+    key = key ^ (key >> 24);
+    key = (key + (key << 3)) + (key << 8);
+    key = key ^ (key >> 14);
+    key = (key + (key << 2)) + (key << 4);
+    key = key ^ (key >> 28);
+    key = key + (key << 31);
+    return (uint32_t)key;
+}
+
+static chain_entry_t* chain_find(const chain_table_t *t, uint32_t priv_ip, uint16_t priv_port, uint8_t protocol) {
+    chain_entry_t *entry = t->heads[chain_hash(priv_ip, priv_port, protocol) & t->mask];
+    while (entry) {
+        if (entry->in_use &&
+            entry->priv_ip == priv_ip &&
+            entry->priv_port == priv_port &&
+            entry->protocol == protocol) {
+            return entry;
+        }
+        entry = entry->next_outbound;
+    }
+    return NULL;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Subscriber i, flow j: spread like real CGNAT keys, 16 flows per subscriber. */
+static void make_key(uint32_t n, uint32_t *ip, uint16_t *port, uint8_t *proto) {
+    *ip = 0x0A000000u + n / 16;
+    *port = (uint16_t)(20000 + (n % 16) * 7);
+    *proto = (n % 3 == 0) ? 17 : 6;
+}
+
+static uint64_t pack(uint32_t ip, uint16_t port, uint8_t proto) {
+    return ((uint64_t)ip << 24) | ((uint64_t)port << 8) | proto;
+}
+
+static double bench_chain(chain_entry_t *entries, uint32_t n, uint32_t buckets,
+                          const uint32_t *probe, uint32_t lookups, int hits) {
+    chain_table_t t;
+    t.mask = buckets - 1;
+    t.heads = calloc(buckets, sizeof(chain_entry_t*));
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t h = chain_hash(entries[i].priv_ip, entries[i].priv_port, entries[i].protocol) & t.mask;
+        entries[i].next_outbound = t.heads[h];
+        t.heads[h] = &entries[i];
+    }
+
+    uint64_t found = 0;
+    double start = now_ns();
+    for (uint32_t i = 0; i < lookups; i++) {
+        uint32_t ip; uint16_t port; uint8_t proto;
+        make_key(probe[i], &ip, &port, &proto);
+        if (!hits) {
+            port++;
+        }
+        found += chain_find(&t, ip, port, proto) != NULL;
+    }
+    double elapsed = now_ns() - start;
+
+    if (found != (hits ? lookups : 0)) {
+        fprintf(stderr, "chained lookup mismatch: %lu\n", (unsigned long)found);
+    }
+    free(t.heads);
+    return elapsed / lookups;
+}
+
+static double bench_flow(const flow_table_t *t, const uint32_t *probe, uint32_t lookups, int hits) {
+    uint64_t found = 0;
+    double start = now_ns();
+    for (uint32_t i = 0; i < lookups; i++) {
+        uint32_t ip; uint16_t port; uint8_t proto;
+        make_key(probe[i], &ip, &port, &proto);
+        if (!hits) {
+            port++;
+        }
+        uint64_t key = pack(ip, port, proto);
+        found += flow_table_find(t, key, flow_table_hash(key)) != FT_NOT_FOUND;
+    }
+    double elapsed = now_ns() - start;
+
+    if (found != (hits ? lookups : 0)) {
+        fprintf(stderr, "flow table lookup mismatch: %lu\n", (unsigned long)found);
+    }
+    return elapsed / lookups;
+}
+
+static void run_size(uint32_t n) {
+    chain_entry_t *entries = calloc(n, sizeof(chain_entry_t));
+    uint32_t *probe = malloc(LOOKUPS * sizeof(uint32_t));
+    flow_table_t flows;
+    if (!entries || !probe || flow_table_init(&flows, n) != 0) {
+        fprintf(stderr, "out of memory at %u entries\n", n);
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        make_key(i, &entries[i].priv_ip, &entries[i].priv_port, &entries[i].protocol);
+        entries[i].in_use = 1;
+        uint64_t key = pack(entries[i].priv_ip, entries[i].priv_port, entries[i].protocol);
+        flow_table_insert(&flows, key, flow_table_hash(key), i);
+    }
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        probe[i] = (uint32_t)(rng_next() % n);
+    }
+
+    uint32_t sized = 1;
+    while (sized < n) {
+        sized <<= 1;
+    }
+    /* The shipped table degrades with chain length; keep its run bounded. */
+    uint32_t shipped_lookups = LOOKUPS / (n / 65536 + 1);
+
+    printf("%-10u %-8s %12.1f %12.1f %12.1f\n", n, "hit",
+           bench_chain(entries, n, 65536, probe, shipped_lookups, 1),
+           bench_chain(entries, n, sized, probe, LOOKUPS, 1),
+           bench_flow(&flows, probe, LOOKUPS, 1));
+    printf("%-10u %-8s %12.1f %12.1f %12.1f\n", n, "miss",
+           bench_chain(entries, n, 65536, probe, shipped_lookups, 0),
+           bench_chain(entries, n, sized, probe, LOOKUPS, 0),
+           bench_flow(&flows, probe, LOOKUPS, 0));
+
+    flow_table_free(&flows);
+    free(entries);
+    free(probe);
+}
+
+int main(int argc, char **argv) {
+    uint32_t sizes[] = {50000, 1000000, 10000000};
+    int count = 3;
+    if (argc > 1) {
+        sizes[0] = (uint32_t)strtoul(argv[1], NULL, 10);
+        count = 1;
+    }
+
+    printf("Flow index lookup cost (ns/op, %d random lookups)\n\n", LOOKUPS);
+    printf("%-10s %-8s %12s %12s %12s\n", "entries", "lookup", "chain/64K", "chain/sized", "flow_table");
+    for (int i = 0; i < count; i++) {
+        run_size(sizes[i]);
+    }
+    return 0;
+}
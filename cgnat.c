@@ -1,399 +1,2189 @@
+#define _GNU_SOURCE
 #include "cgnat.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
-static uint32_t hash_outbound(uint32_t priv_ip, uint16_t priv_port, uint8_t protocol) {
-    uint64_t key = ((uint64_t)priv_ip << 24) | ((uint64_t)priv_port << 8) | protocol;
-    key = (~key) + (key << 21);
-    key = key ^ (key >> 24);
-    key = (key + (key << 3)) + (key << 8);
-    key = key ^ (key >> 14);
-    key = (key + (key << 2)) + (key << 4);
-    key = key ^ (key >> 28);
-    key = key + (key << 31);
-    return (uint32_t)(key & (HASH_TABLE_SIZE - 1));
-}
-
-static uint32_t hash_inbound(uint32_t pub_ip, uint16_t pub_port, uint8_t protocol) {
-    uint64_t key = ((uint64_t)pub_ip << 24) | ((uint64_t)pub_port << 8) | protocol;
-    key = (~key) + (key << 21);
-    key = key ^ (key >> 24);
-    key = (key + (key << 3)) + (key << 8);
-    key = key ^ (key >> 14);
-    key = (key + (key << 2)) + (key << 4);
-    key = key ^ (key >> 28);
-    key = key + (key << 31);
-    return (uint32_t)(key & (HASH_TABLE_SIZE - 1));
+/*
+ * Flow keys pack (ip, port, protocol) into the low 56 bits. Under APDM the
+ * remote endpoint fills the high half; every other mode leaves it zero.
+ */
+static flow_key_t outbound_key(uint32_t priv_ip, uint16_t priv_port, uint8_t protocol, uint64_t remote) {
+    flow_key_t key = { ((uint64_t)priv_ip << 24) | ((uint64_t)priv_port << 8) | protocol, remote };
+    return key;
 }
 
-cgnat_t* cgnat_init(void) {
+static flow_key_t inbound_key(uint32_t pub_ip, uint16_t pub_port, uint8_t protocol, uint64_t remote) {
+    flow_key_t key = { ((uint64_t)pub_ip << 24) | ((uint64_t)pub_port << 8) | protocol, remote };
+    return key;
+}
+
+static uint64_t remote_part(const cgnat_shard_t *shard, uint32_t remote_ip, uint16_t remote_port) {
+    return shard->endpoint_dependent ? ((uint64_t)remote_ip << 16) | remote_port : 0;
+}
+
+static time_t engine_now(const cgnat_t *cgnat) {
+    return cgnat->manual_now ? cgnat->manual_now : time(NULL);
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* The shard lock holder is the only writer; the store just keeps lock-free readers from seeing a torn value. */
+#define STAT_ADD(shard, field, n) \
+    __atomic_store_n(&(shard)->stats.field, (shard)->stats.field + (uint64_t)(n), __ATOMIC_RELAXED)
+
+static __thread uint32_t latency_calls;
+
+/* Start of a timed translation, or 0 if this call is not sampled. */
+static inline uint64_t latency_start(void) {
+    return (++latency_calls & (CGNAT_LATENCY_SAMPLE - 1)) == 0 ? latency_ticks() : 0;
+}
+
+static inline void latency_end(cgnat_shard_t *shard, cgnat_direction_t dir, uint64_t start) {
+    if (start) {
+        latency_record(&shard->translate_latency[dir], latency_ticks_end() - start);
+    }
+}
+
+/* A sampled burst chunk is timed whole and recorded per packet by the last shard it locks. */
+static inline void burst_latency_end(cgnat_shard_t *shard, cgnat_direction_t dir, uint64_t start, int count) {
+    if (start) {
+        latency_record(&shard->burst_latency[dir], (latency_ticks_end() - start) / (uint64_t)count);
+    }
+}
+
+/* Mapping log records; only session setup and teardown ever get here. */
+static void log_session(cgnat_shard_t *shard, const nat_entry_t *entry, event_type_t type, uint32_t now) {
+    if (!shard->events || shard->blocks) {
+        return;
+    }
+    event_record_t record = {
+        .time = now, .type = (uint8_t)type, .protocol = entry->protocol,
+        .priv_port = entry->priv_port, .priv_ip = entry->priv_ip,
+        .pub_ip = entry->pub_ip, .pub_port = entry->pub_port, .port_count = 1,
+        .remote_ip = entry->remote_ip, .remote_port = entry->remote_port, .shard = (uint16_t)shard->id,
+    };
+    event_ring_push(shard->events, &record);
+}
+
+static void log_block(cgnat_shard_t *shard, uint32_t b, event_type_t type, uint32_t pub_ip, uint32_t now) {
+    if (!shard->events) {
+        return;
+    }
+    uint32_t first = (b % (uint32_t)shard->blocks_per_ip) * (uint32_t)shard->block_size;
+    event_record_t record = {
+        .time = now, .type = (uint8_t)type, .priv_ip = shard->blocks[b].owner, .pub_ip = pub_ip,
+        .pub_port = (uint16_t)(PORT_RANGE_START + shard->port_base + first),
+        .port_count = (uint16_t)shard->block_size, .shard = (uint16_t)shard->id,
+    };
+    event_ring_push(shard->events, &record);
+}
+
+/*
+ * HA sync records. Creation, TCP state changes and deletion go out at once;
+ * otherwise a session is refreshed at most once per sync_refresh seconds,
+ * however many packets it carries.
+ */
+static void sync_session(cgnat_shard_t *shard, nat_entry_t *entry, sync_type_t type, uint32_t now) {
+    if (!shard->sync) {
+        return;
+    }
+    sync_record_t record = {
+        .type = (uint8_t)type, .protocol = entry->protocol, .state = (uint8_t)entry->state,
+        .priv_port = entry->priv_port, .pub_port = entry->pub_port, .priv_ip = entry->priv_ip,
+        .pub_ip = entry->pub_ip, .remote_ip = entry->remote_ip, .remote_port = entry->remote_port,
+        .time = (uint32_t)entry->last_activity,
+    };
+    sync_ring_push(shard->sync, &record);
+    entry->synced = now;
+}
+
+static inline void sync_refresh(cgnat_shard_t *shard, nat_entry_t *entry, uint32_t now) {
+    if (shard->sync && now - entry->synced >= shard->sync_refresh) {
+        sync_session(shard, entry, SYNC_REFRESH, now);
+    }
+}
+
+/*
+ * Deterministic mode deals subscriber blocks out round-robin over the shards'
+ * port slices, then fills one public IP before moving to the next, so both
+ * directions of the mapping are plain arithmetic on the subscriber index.
+ */
+typedef struct {
+    int ip_idx;
+    int shard;
+    int first;      /* first port offset within the shard's slice */
+} det_block_t;
+
+static int det_block_for(const cgnat_t *cgnat, uint32_t priv_ip, det_block_t *block) {
+    uint32_t sub = priv_ip - cgnat->det_inside_base;
+    if (sub >= cgnat->det_subscribers) {
+        return -1;
+    }
+    uint32_t shards = (uint32_t)cgnat->num_shards;
+    uint32_t per_ip = (uint32_t)cgnat->det_blocks_per_slice * shards;
+    uint32_t r = sub % per_ip;
+    block->ip_idx = (int)(sub / per_ip);
+    block->shard = (int)(r % shards);
+    block->first = (int)(r / shards) * cgnat->block_size;
+    return 0;
+}
+
+/*
+ * Subscribers are steered as a whole so all of their sessions share a shard.
+ * The dataplane's fanout program (steering_program) repeats this and
+ * shard_for_public_port in classic BPF; change them together.
+ */
+static int shard_for_subscriber(const cgnat_t *cgnat, uint32_t priv_ip) {
+    det_block_t block;
+    if (cgnat->mode == CGNAT_MODE_DETERMINISTIC && det_block_for(cgnat, priv_ip, &block) == 0) {
+        return block.shard;
+    }
+    uint32_t h = priv_ip * 2654435761u;
+    return (int)((h >> 16) % (uint32_t)cgnat->num_shards);
+}
+
+static int shard_for_public_port(const cgnat_t *cgnat, uint16_t pub_port) {
+    if (pub_port < PORT_RANGE_START) {
+        return -1;
+    }
+    int span = TOTAL_PORTS_PER_IP / cgnat->num_shards;
+    int shard = (pub_port - PORT_RANGE_START) / span;
+    return shard < cgnat->num_shards ? shard : cgnat->num_shards - 1;
+}
+
+/* Pools are a handful of addresses; a scan beats hashing them. */
+static int public_ip_index(const cgnat_t *cgnat, uint32_t ip) {
+    for (int i = 0; i < cgnat->num_public_ips; i++) {
+        if (cgnat->public_ips[i] == ip) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Carve one shard's tables out of the arena. Run once against a counting
+ * arena to size it and once for real. Nothing is touched here: the arena is
+ * zeroed memory, which is already an empty portmap, flow table and NAT table.
+ */
+static int shard_layout(cgnat_shard_t *shard, arena_t *arena, int id, const cgnat_config_t *config) {
+    int num_shards = config->num_shards;
+    int span = TOTAL_PORTS_PER_IP / num_shards;
+    uint32_t entries = config->max_sessions / num_shards;
+    size_t max_ips = (size_t)config->max_public_ips;
+
+    shard->id = id;
+    shard->port_base = id * span;
+    shard->port_count = (id == num_shards - 1) ? TOTAL_PORTS_PER_IP - shard->port_base : span;
+    shard->nat_capacity = (int)((id == num_shards - 1) ? config->max_sessions - id * entries : entries);
+    shard->port_map_words = portmap_storage_words(shard->port_count);
+
+    shard->nat_table = arena_alloc(arena, (size_t)shard->nat_capacity * sizeof(nat_entry_t), 64);
+    shard->free_stack = arena_alloc(arena, (size_t)shard->nat_capacity * sizeof(uint32_t), 64);
+    shard->port_maps = arena_alloc(arena, max_ips * sizeof(portmap_t), 64);
+    shard->next_port_index = arena_alloc(arena, max_ips * sizeof(int), 64);
+    shard->port_bits = arena_alloc(arena, max_ips * shard->port_map_words * sizeof(uint64_t), 64);
+    int wide = config->mode == CGNAT_MODE_APDM;
+    shard->endpoint_dependent = wide;
+    void *outbound = arena_alloc(arena, flow_table_storage_size(shard->nat_capacity, wide), 64);
+    void *sessions_by_subscriber = arena_alloc(arena, flow_table_storage_size(shard->nat_capacity, 0), 64);
+    shard->session_links = arena_alloc(arena, (size_t)shard->nat_capacity * sizeof(session_link_t), 64);
+
+    /* Deterministic mode finds inbound sessions by public port, not by hash. */
+    void *inbound = NULL;
+    shard->port_slots = NULL;
+    if (config->mode == CGNAT_MODE_DETERMINISTIC) {
+        shard->port_slots = arena_alloc(arena, max_ips * shard->port_count * sizeof(uint32_t), 64);
+    } else {
+        inbound = arena_alloc(arena, flow_table_storage_size(shard->nat_capacity, wide), 64);
+    }
+
+    /* APDM: how many sessions share each public port. */
+    shard->port_refs = NULL;
+    if (wide) {
+        shard->port_refs = arena_alloc(arena, max_ips * shard->port_count * sizeof(uint16_t), 64);
+        if (arena->base && !shard->port_refs) {
+            return -1;
+        }
+    }
+
+    /* Port-block mode: a free-block map per IP, the blocks and a subscriber index. */
+    void *subscribers = NULL;
+    shard->blocks = NULL;
+    if (config->mode == CGNAT_MODE_PORT_BLOCKS) {
+        shard->block_size = config->block_size;
+        shard->blocks_per_ip = shard->port_count / config->block_size;
+        shard->block_map_words = portmap_storage_words(shard->blocks_per_ip);
+        size_t total_blocks = max_ips * shard->blocks_per_ip;
+        uint32_t max_subscribers = total_blocks < (size_t)shard->nat_capacity ?
+                                   (uint32_t)total_blocks : (uint32_t)shard->nat_capacity;
+        shard->block_maps = arena_alloc(arena, max_ips * sizeof(portmap_t), 64);
+        shard->block_bits = arena_alloc(arena, max_ips * shard->block_map_words * sizeof(uint64_t), 64);
+        shard->blocks = arena_alloc(arena, total_blocks * sizeof(port_block_t), 64);
+        subscribers = arena_alloc(arena, flow_table_storage_size(max_subscribers, 0), 64);
+        if (arena->base && (!shard->block_maps || !shard->block_bits || !shard->blocks || !subscribers)) {
+            return -1;
+        }
+        if (subscribers) {
+            flow_table_init_storage(&shard->subscribers, max_subscribers, subscribers, 0);
+        }
+    }
+
+    if (!arena->base) {
+        return 0;
+    }
+    if (!shard->nat_table || !shard->free_stack || !shard->port_maps || !shard->next_port_index ||
+        !shard->port_bits || !outbound || !sessions_by_subscriber || !shard->session_links ||
+        (!inbound && !shard->port_slots)) {
+        return -1;
+    }
+
+    flow_table_init_storage(&shard->outbound_flows, shard->nat_capacity, outbound, wide);
+    flow_table_init_storage(&shard->subscriber_sessions, shard->nat_capacity, sessions_by_subscriber, 0);
+    if (inbound) {
+        flow_table_init_storage(&shard->inbound_flows, shard->nat_capacity, inbound, wide);
+    }
+    if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+        return -1;
+    }
+    timer_wheel_init(&shard->wheel, shard->nat_table, sizeof(nat_entry_t), offsetof(nat_entry_t, timer));
+    return 0;
+}
+
+static int engine_layout(cgnat_t *cgnat, arena_t *arena, const cgnat_config_t *config) {
+    cgnat->public_ips = arena_alloc(arena, (size_t)config->max_public_ips * sizeof(uint32_t), 64);
+    for (int s = 0; s < config->num_shards; s++) {
+        if (shard_layout(&cgnat->shards[s], arena, s, config) != 0) {
+            fprintf(stderr, "Failed to initialize shard %d\n", s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void cgnat_config_default(cgnat_config_t *config) {
+    config->max_sessions = MAX_NAT_ENTRIES;
+    config->max_public_ips = MAX_PUBLIC_IPS;
+    config->num_shards = 1;
+    config->hugepages = 1;
+    config->mode = CGNAT_MODE_DYNAMIC;
+    config->det_inside_base = 0;
+    config->det_subscribers = 0;
+    config->block_size = 0;
+    config->max_blocks_per_subscriber = 0;
+}
+
+/* Fix the deterministic block size and check the pool can hold every block. */
+static int det_configure(cgnat_t *cgnat, const cgnat_config_t *config) {
+    int span = TOTAL_PORTS_PER_IP / config->num_shards;
+    int block = config->block_size;
+    uint32_t subscribers = config->det_subscribers;
+
+    if (subscribers == 0) {
+        fprintf(stderr, "Deterministic NAT needs a subscriber range\n");
+        return -1;
+    }
+    if (block == 0) {
+        uint32_t per_ip = (subscribers + config->max_public_ips - 1) / config->max_public_ips;
+        uint32_t per_slice = (per_ip + config->num_shards - 1) / config->num_shards;
+        block = per_slice > (uint32_t)span ? 0 : span / (int)per_slice;
+    }
+    if (block < 1 || block > span) {
+        fprintf(stderr, "Invalid deterministic block of %d ports (1-%d)\n", block, span);
+        return -1;
+    }
+
+    uint64_t blocks = (uint64_t)(span / block) * config->num_shards * config->max_public_ips;
+    if (blocks < subscribers) {
+        fprintf(stderr, "Deterministic NAT: %d public IPs hold %lu blocks of %d ports, %u subscribers\n",
+                config->max_public_ips, (unsigned long)blocks, block, subscribers);
+        return -1;
+    }
+
+    cgnat->det_inside_base = config->det_inside_base;
+    cgnat->det_subscribers = subscribers;
+    cgnat->block_size = block;
+    cgnat->det_blocks_per_slice = span / block;
+    return 0;
+}
+
+static int port_blocks_configure(cgnat_t *cgnat, const cgnat_config_t *config) {
+    int span = TOTAL_PORTS_PER_IP / config->num_shards;
+    int block = config->block_size ? config->block_size : 64;
+    if (block < 1 || block > span || config->max_blocks_per_subscriber < 0) {
+        fprintf(stderr, "Invalid port block of %d ports (1-%d)\n", block, span);
+        return -1;
+    }
+    cgnat->block_size = block;
+    cgnat->max_blocks_per_subscriber = config->max_blocks_per_subscriber;
+    return 0;
+}
+
+/*
+ * An engine with its limits and mode set but no arena yet; layout receives
+ * the configuration to lay the arena out with.
+ */
+static cgnat_t* engine_create(const cgnat_config_t *config, cgnat_config_t *layout) {
+    if (config->num_shards < 1 || config->num_shards > CGNAT_MAX_SHARDS) {
+        fprintf(stderr, "Invalid shard count %d (1-%d)\n", config->num_shards, CGNAT_MAX_SHARDS);
+        return NULL;
+    }
+    if (config->max_public_ips < 1 || config->max_public_ips > 0xFFFF ||
+        config->max_sessions < (uint32_t)config->num_shards) {
+        fprintf(stderr, "Invalid engine limits: %u sessions, %d public IPs\n",
+                config->max_sessions, config->max_public_ips);
+        return NULL;
+    }
+
     cgnat_t *cgnat = (cgnat_t*)calloc(1, sizeof(cgnat_t));
     if (!cgnat) {
         fprintf(stderr, "Failed to allocate CGNAT structure\n");
         return NULL;
     }
-    
-    if (pthread_mutex_init(&cgnat->lock, NULL) != 0) {
-        fprintf(stderr, "Failed to initialize mutex\n");
-        free(cgnat);
-        return NULL;
+
+    if (pthread_mutex_init(&cgnat->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize mutex\n");
+        free(cgnat);
+        return NULL;
+    }
+
+    cgnat->num_public_ips = 0;
+    cgnat->max_public_ips = config->max_public_ips;
+    cgnat->max_sessions = config->max_sessions;
+    cgnat->num_shards = config->num_shards;
+    cgnat->mode = config->mode;
+    if ((cgnat->mode == CGNAT_MODE_DETERMINISTIC && det_configure(cgnat, config) != 0) ||
+        (cgnat->mode == CGNAT_MODE_PORT_BLOCKS && port_blocks_configure(cgnat, config) != 0)) {
+        pthread_mutex_destroy(&cgnat->lock);
+        free(cgnat);
+        return NULL;
+    }
+    *layout = *config;
+    layout->block_size = cgnat->block_size;
+    return cgnat;
+}
+
+static void engine_free(cgnat_t *cgnat) {
+    arena_destroy(&cgnat->arena);
+    pthread_mutex_destroy(&cgnat->lock);
+    free(cgnat);
+}
+
+cgnat_t* cgnat_init_config(const cgnat_config_t *config) {
+    cgnat_config_t layout;
+    cgnat_t *cgnat = engine_create(config, &layout);
+    if (!cgnat) {
+        return NULL;
+    }
+
+    /* Size the arena with a counting pass over the same layout. */
+    arena_t sizing = { 0 };
+    engine_layout(cgnat, &sizing, &layout);
+
+    if (arena_init(&cgnat->arena, sizing.used, config->hugepages) != 0 ||
+        engine_layout(cgnat, &cgnat->arena, &layout) != 0) {
+        fprintf(stderr, "Failed to map %.1f MB of engine state\n", sizing.used / 1048576.0);
+        engine_free(cgnat);
+        return NULL;
+    }
+
+    printf("[CGNAT] Initialized with support for %d customers (%d shard%s)\n",
+           MAX_CUSTOMERS, cgnat->num_shards, cgnat->num_shards == 1 ? "" : "s");
+    printf("[CGNAT] State arena: %.1f MB for %u sessions and %d public IPs (%s)\n",
+           cgnat->arena.size / 1048576.0, cgnat->max_sessions, cgnat->max_public_ips,
+           arena_backing_name(cgnat->arena.backing));
+    if (cgnat->mode == CGNAT_MODE_DETERMINISTIC) {
+        struct in_addr first = { .s_addr = htonl(cgnat->det_inside_base) };
+        printf("[CGNAT] Deterministic NAT: %u subscribers from %s, %d ports each (%d per public IP)\n",
+               cgnat->det_subscribers, inet_ntoa(first), cgnat->block_size,
+               cgnat->det_blocks_per_slice * cgnat->num_shards);
+    }
+    if (cgnat->mode == CGNAT_MODE_PORT_BLOCKS) {
+        printf("[CGNAT] Port blocks: %d ports per block, %s blocks per subscriber\n",
+               cgnat->block_size, cgnat->max_blocks_per_subscriber ? "limited" : "unlimited");
+    }
+    if (cgnat->mode == CGNAT_MODE_APDM) {
+        printf("[CGNAT] Address-and-port-dependent mapping: public ports are shared across remotes\n");
+    }
+    return cgnat;
+}
+
+cgnat_t* cgnat_init_sharded(int num_shards) {
+    cgnat_config_t config;
+    cgnat_config_default(&config);
+    config.num_shards = num_shards;
+    return cgnat_init_config(&config);
+}
+
+cgnat_t* cgnat_init(void) {
+    return cgnat_init_sharded(1);
+}
+
+void cgnat_destroy(cgnat_t *cgnat) {
+    if (!cgnat) return;
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        pthread_mutex_destroy(&cgnat->shards[s].lock);
+        flow_table_free(&cgnat->shards[s].outbound_flows);
+        flow_table_free(&cgnat->shards[s].inbound_flows);
+    }
+    arena_destroy(&cgnat->arena);
+    pthread_mutex_destroy(&cgnat->lock);
+    free(cgnat);
+    printf("[CGNAT] Destroyed and cleaned up\n");
+}
+
+/*
+ * Snapshot file: a header padded to SNAPSHOT_ALIGN, then the arena byte for
+ * byte. All-zero stretches of the arena are left as holes. The header holds
+ * what lives outside the arena: the configuration it was laid out with and
+ * each shard's scalars, flow table fill and counters. Byte order and struct
+ * sizes are checked on restore, so a file only loads into the build that
+ * wrote it or one with the same layout.
+ */
+#define SNAPSHOT_MAGIC "CGNATSNP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_ALIGN 65536u
+#define SNAPSHOT_CHUNK 65536u
+#define SNAPSHOT_FLOW_TABLES 4
+
+typedef struct {
+    int32_t ports_free;
+    int32_t next_ip_index;
+    int32_t nat_entries_count;
+    uint32_t free_top;
+    uint32_t high_water;
+    uint32_t wheel_current;
+    int32_t wheel_started;
+    uint32_t flow_size[SNAPSHOT_FLOW_TABLES];
+    cgnat_counters_t stats;
+} snapshot_shard_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t entry_size;
+    uint32_t counters_size;
+    uint32_t max_sessions;
+    int32_t max_public_ips;
+    int32_t num_shards;
+    int32_t mode;
+    uint32_t det_inside_base;
+    uint32_t det_subscribers;
+    int32_t block_size;
+    int32_t max_blocks_per_subscriber;
+    int32_t num_public_ips;
+    int64_t saved_at;
+    uint64_t arena_offset;
+    uint64_t arena_used;
+    snapshot_shard_t shards[CGNAT_MAX_SHARDS];
+} snapshot_header_t;
+
+static void shard_flow_tables(cgnat_shard_t *shard, flow_table_t *tables[SNAPSHOT_FLOW_TABLES]) {
+    tables[0] = &shard->outbound_flows;
+    tables[1] = &shard->inbound_flows;
+    tables[2] = &shard->subscriber_sessions;
+    tables[3] = &shard->subscribers;
+}
+
+static void snapshot_fill_header(cgnat_t *cgnat, snapshot_header_t *header) {
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->byte_order = SNAPSHOT_BYTE_ORDER;
+    header->header_size = sizeof(snapshot_header_t);
+    header->entry_size = sizeof(nat_entry_t);
+    header->counters_size = sizeof(cgnat_counters_t);
+    header->max_sessions = cgnat->max_sessions;
+    header->max_public_ips = cgnat->max_public_ips;
+    header->num_shards = cgnat->num_shards;
+    header->mode = cgnat->mode;
+    header->det_inside_base = cgnat->det_inside_base;
+    header->det_subscribers = cgnat->det_subscribers;
+    header->block_size = cgnat->block_size;
+    header->max_blocks_per_subscriber = cgnat->max_blocks_per_subscriber;
+    header->num_public_ips = cgnat->num_public_ips;
+    header->saved_at = engine_now(cgnat);
+    header->arena_offset = (sizeof(snapshot_header_t) + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+    header->arena_used = cgnat->arena.used;
+
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        snapshot_shard_t *saved = &header->shards[s];
+        flow_table_t *tables[SNAPSHOT_FLOW_TABLES];
+        shard_flow_tables(shard, tables);
+        saved->ports_free = shard->ports_free;
+        saved->next_ip_index = shard->next_ip_index;
+        saved->nat_entries_count = shard->nat_entries_count;
+        saved->free_top = shard->free_top;
+        saved->high_water = shard->high_water;
+        saved->wheel_current = shard->wheel.current;
+        saved->wheel_started = shard->wheel.started;
+        for (int t = 0; t < SNAPSHOT_FLOW_TABLES; t++) {
+            saved->flow_size[t] = tables[t]->size;
+        }
+        saved->stats = shard->stats;
+    }
+}
+
+static int write_full(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int all_zero(const char *p, size_t len) {
+    const uint64_t *w = (const uint64_t*)p;
+    for (size_t i = 0; i < len / 8; i++) {
+        if (w[i]) {
+            return 0;
+        }
+    }
+    for (size_t i = len & ~(size_t)7; i < len; i++) {
+        if (p[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Runs in the forked child, which shares nothing with the parent's other
+ * threads: no locks, no stdio, no allocation.
+ */
+static int snapshot_write(int fd, const snapshot_header_t *header, const char *arena) {
+    if (write_full(fd, header, sizeof(*header), 0) != 0) {
+        return -1;
+    }
+    for (uint64_t off = 0; off < header->arena_used; off += SNAPSHOT_CHUNK) {
+        size_t len = header->arena_used - off < SNAPSHOT_CHUNK ? header->arena_used - off : SNAPSHOT_CHUNK;
+        if (!all_zero(arena + off, len) &&
+            write_full(fd, arena + off, len, (off_t)(header->arena_offset + off)) != 0) {
+            return -1;
+        }
+    }
+    if (ftruncate(fd, (off_t)(header->arena_offset + header->arena_used)) != 0) {
+        return -1;
+    }
+    return fsync(fd);
+}
+
+int cgnat_snapshot_save(cgnat_t *cgnat, const char *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "[CGNAT] Snapshot path too long: %s\n", path);
+        return -1;
+    }
+    snapshot_header_t *header = calloc(1, sizeof(snapshot_header_t));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!header || fd < 0) {
+        fprintf(stderr, "[CGNAT] Cannot write snapshot %s: %s\n", tmp, strerror(errno));
+        free(header);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    /*
+     * Stop every shard just long enough to fork. The child sees the tables
+     * exactly as they were here and writes them out from its copy-on-write
+     * view while the shards carry on in the parent.
+     */
+    pthread_mutex_lock(&cgnat->lock);
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        pthread_mutex_lock(&cgnat->shards[s].lock);
+    }
+    uint64_t start = monotonic_ns();
+    snapshot_fill_header(cgnat, header);
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(snapshot_write(fd, header, cgnat->arena.base) == 0 ? 0 : 1);
+    }
+    uint64_t paused = monotonic_ns() - start;
+    for (int s = cgnat->num_shards - 1; s >= 0; s--) {
+        pthread_mutex_unlock(&cgnat->shards[s].lock);
+    }
+    pthread_mutex_unlock(&cgnat->lock);
+    close(fd);
+
+    int status = 0;
+    if (pid < 0) {
+        fprintf(stderr, "[CGNAT] Snapshot fork failed: %s\n", strerror(errno));
+        status = -1;
+    } else {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    if (status != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "[CGNAT] Snapshot to %s failed\n", path);
+        unlink(tmp);
+        free(header);
+        return -1;
+    }
+
+    int sessions = 0;
+    for (int s = 0; s < header->num_shards; s++) {
+        sessions += header->shards[s].nat_entries_count;
+    }
+    printf("[CGNAT] Snapshot: %d sessions, %.1f MB of state to %s (shards paused %.2f ms)\n",
+           sessions, header->arena_used / 1048576.0, path, paused / 1e6);
+    free(header);
+    return 0;
+}
+
+static int snapshot_header_valid(const snapshot_header_t *header, off_t file_size) {
+    return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == SNAPSHOT_VERSION &&
+           header->byte_order == SNAPSHOT_BYTE_ORDER &&
+           header->header_size == sizeof(snapshot_header_t) &&
+           header->entry_size == sizeof(nat_entry_t) &&
+           header->counters_size == sizeof(cgnat_counters_t) &&
+           header->num_shards >= 1 && header->num_shards <= CGNAT_MAX_SHARDS &&
+           header->num_public_ips >= 0 && header->num_public_ips <= header->max_public_ips &&
+           header->arena_offset % SNAPSHOT_ALIGN == 0 && header->arena_offset >= sizeof(snapshot_header_t) &&
+           (uint64_t)file_size >= header->arena_offset + header->arena_used;
+}
+
+/* Shard state kept outside the arena, and session time shifted by delta. */
+static void restore_shard(cgnat_t *cgnat, cgnat_shard_t *shard, const snapshot_shard_t *saved, time_t delta) {
+    for (int ip_idx = 0; ip_idx < cgnat->num_public_ips; ip_idx++) {
+        portmap_attach(&shard->port_maps[ip_idx], shard->port_bits + (size_t)ip_idx * shard->port_map_words);
+        if (shard->blocks) {
+            portmap_attach(&shard->block_maps[ip_idx], shard->block_bits + (size_t)ip_idx * shard->block_map_words);
+        }
+    }
+    shard->ports_free = saved->ports_free;
+    shard->next_ip_index = saved->next_ip_index;
+    shard->nat_entries_count = saved->nat_entries_count;
+    shard->free_top = saved->free_top;
+    shard->high_water = saved->high_water;
+    flow_table_t *tables[SNAPSHOT_FLOW_TABLES];
+    shard_flow_tables(shard, tables);
+    for (int t = 0; t < SNAPSHOT_FLOW_TABLES; t++) {
+        tables[t]->size = saved->flow_size[t];
+    }
+    shard->stats = saved->stats;
+
+    /* The wheel's slots live in the shard, so every armed session is linked in again. */
+    if (saved->wheel_started) {
+        timer_wheel_start(&shard->wheel, saved->wheel_current + (uint32_t)delta);
+    }
+    for (uint32_t idx = 0; idx < shard->high_water; idx++) {
+        nat_entry_t *entry = &shard->nat_table[idx];
+        if (!entry->in_use) {
+            continue;
+        }
+        entry->last_activity += delta;
+        if (entry->timer.slot != TW_UNARMED) {
+            entry->timer.slot = TW_UNARMED;
+            timer_wheel_arm(&shard->wheel, idx, entry->timer.expires + (uint32_t)delta);
+        }
+    }
+}
+
+cgnat_t* cgnat_restore(const char *path, time_t now) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "[CGNAT] Cannot open snapshot %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    snapshot_header_t *header = calloc(1, sizeof(snapshot_header_t));
+    struct stat st;
+    if (!header || fstat(fd, &st) != 0 ||
+        pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) ||
+        !snapshot_header_valid(header, st.st_size)) {
+        fprintf(stderr, "[CGNAT] %s is not a snapshot this build can load\n", path);
+        free(header);
+        close(fd);
+        return NULL;
+    }
+
+    cgnat_config_t config;
+    cgnat_config_default(&config);
+    config.max_sessions = header->max_sessions;
+    config.max_public_ips = header->max_public_ips;
+    config.num_shards = header->num_shards;
+    config.mode = (cgnat_mode_t)header->mode;
+    config.det_inside_base = header->det_inside_base;
+    config.det_subscribers = header->det_subscribers;
+    config.block_size = header->block_size;
+    config.max_blocks_per_subscriber = header->max_blocks_per_subscriber;
+
+    uint64_t start = monotonic_ns();
+    cgnat_config_t layout;
+    cgnat_t *cgnat = engine_create(&config, &layout);
+    if (!cgnat) {
+        free(header);
+        close(fd);
+        return NULL;
+    }
+    if (arena_map_file(&cgnat->arena, fd, header->arena_offset, header->arena_used) != 0 ||
+        engine_layout(cgnat, &cgnat->arena, &layout) != 0 || cgnat->arena.used != header->arena_used) {
+        fprintf(stderr, "[CGNAT] Snapshot %s does not match its configuration\n", path);
+        engine_free(cgnat);
+        free(header);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    if (now == 0) {
+        now = time(NULL);
+    }
+    time_t delta = now - (time_t)header->saved_at;
+    cgnat->num_public_ips = header->num_public_ips;
+    int sessions = 0;
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        restore_shard(cgnat, &cgnat->shards[s], &header->shards[s], delta);
+        sessions += cgnat->shards[s].nat_entries_count;
+    }
+
+    printf("[CGNAT] Restored %d sessions on %d public IPs from %s in %.1f ms (saved %ld s earlier)\n",
+           sessions, cgnat->num_public_ips, path, (monotonic_ns() - start) / 1e6, (long)delta);
+    free(header);
+    return cgnat;
+}
+
+int cgnat_add_public_ip(cgnat_t *cgnat, const char *ip_str) {
+    pthread_mutex_lock(&cgnat->lock);
+
+    if (cgnat->num_public_ips >= cgnat->max_public_ips) {
+        pthread_mutex_unlock(&cgnat->lock);
+        fprintf(stderr, "[CGNAT] Cannot add more than %d public IPs\n", cgnat->max_public_ips);
+        return -1;
+    }
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip_str, &addr) != 1) {
+        pthread_mutex_unlock(&cgnat->lock);
+        fprintf(stderr, "[CGNAT] Invalid IP address: %s\n", ip_str);
+        return -1;
+    }
+
+    uint32_t ip = ntohl(addr.s_addr);
+    int ip_idx = cgnat->num_public_ips;
+    cgnat->public_ips[ip_idx] = ip;
+
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        portmap_init(&shard->port_maps[ip_idx], shard->port_count,
+                     shard->port_bits + (size_t)ip_idx * shard->port_map_words);
+        shard->ports_free += shard->port_maps[ip_idx].nfree;
+        if (shard->blocks) {
+            portmap_init(&shard->block_maps[ip_idx], shard->blocks_per_ip,
+                         shard->block_bits + (size_t)ip_idx * shard->block_map_words);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    printf("[CGNAT] Added public IP: %s (%d ports available)\n", ip_str, TOTAL_PORTS_PER_IP);
+    /* Lock-free readers (cgnat_get_pool_usage) only look at initialized maps. */
+    __atomic_store_n(&cgnat->num_public_ips, cgnat->num_public_ips + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cgnat->lock);
+    return 0;
+}
+
+int cgnat_outbound_shard(const cgnat_t *cgnat, const packet_info_t *pkt) {
+    return shard_for_subscriber(cgnat, pkt->src_ip);
+}
+
+int cgnat_inbound_shard(const cgnat_t *cgnat, const packet_info_t *pkt) {
+    return shard_for_public_port(cgnat, pkt->dst_port);
+}
+
+/* A port nobody is using, round-robin over the public IPs. */
+static int take_free_port(cgnat_t *cgnat, cgnat_shard_t *shard, int num_public_ips, nat_entry_t *entry) {
+    if (shard->ports_free > 0) {
+        for (int attempt = 0; attempt < num_public_ips; attempt++) {
+            int ip_idx = (shard->next_ip_index + attempt) % num_public_ips;
+            portmap_t *map = &shard->port_maps[ip_idx];
+            if (map->nfree == 0) {
+                continue;
+            }
+
+            int port_idx = portmap_alloc_from(map, shard->next_port_index[ip_idx]);
+            if (port_idx < 0) {
+                continue;
+            }
+
+            entry->pub_ip = cgnat->public_ips[ip_idx];
+            entry->pub_ip_index = ip_idx;
+            entry->pub_port = PORT_RANGE_START + shard->port_base + port_idx;
+
+            shard->ports_free--;
+            STAT_ADD(shard, ports_in_use, 1);
+            shard->next_port_index[ip_idx] = (port_idx + 1) % shard->port_count;
+            shard->next_ip_index = (ip_idx + 1) % num_public_ips;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int allocate_port(cgnat_t *cgnat, cgnat_shard_t *shard, int num_public_ips, nat_entry_t *entry) {
+    if (take_free_port(cgnat, shard, num_public_ips, entry) == 0) {
+        return 0;
+    }
+    STAT_ADD(shard, port_exhaustion_events, 1);
+    fprintf(stderr, "[CGNAT] Port exhaustion! All ports in use.\n");
+    return -1;
+}
+
+/* Deterministic mode: a free port inside the subscriber's own block, nowhere else. */
+static int allocate_block_port(cgnat_t *cgnat, cgnat_shard_t *shard, nat_entry_t *entry) {
+    det_block_t block;
+    if (det_block_for(cgnat, entry->priv_ip, &block) != 0 || block.ip_idx >= cgnat->num_public_ips) {
+        return -1;
+    }
+
+    int size = cgnat->block_size;
+    int port_idx = portmap_alloc_range(&shard->port_maps[block.ip_idx], (uint32_t)block.first,
+                                       (uint32_t)size, entry->priv_port % (uint32_t)size);
+    if (port_idx < 0) {
+        STAT_ADD(shard, port_exhaustion_events, 1);
+        return -1;
+    }
+
+    entry->pub_ip = cgnat->public_ips[block.ip_idx];
+    entry->pub_ip_index = block.ip_idx;
+    entry->pub_port = PORT_RANGE_START + shard->port_base + port_idx;
+    shard->ports_free--;
+    STAT_ADD(shard, ports_in_use, 1);
+    return 0;
+}
+
+/* Port-block mode: take a free block, round-robin over the public IPs. */
+static uint32_t claim_block(cgnat_shard_t *shard, int num_public_ips) {
+    for (int attempt = 0; attempt < num_public_ips; attempt++) {
+        int ip_idx = (shard->next_ip_index + attempt) % num_public_ips;
+        portmap_t *map = &shard->block_maps[ip_idx];
+        if (map->nfree == 0) {
+            continue;
+        }
+        /* next_port_index is the block cursor in this mode. */
+        int block = portmap_alloc_from(map, shard->next_port_index[ip_idx]);
+        if (block < 0) {
+            continue;
+        }
+        shard->next_port_index[ip_idx] = (block + 1) % shard->blocks_per_ip;
+        shard->next_ip_index = (ip_idx + 1) % num_public_ips;
+        return (uint32_t)(ip_idx * shard->blocks_per_ip + block);
+    }
+    return PORT_BLOCK_NIL;
+}
+
+/*
+ * Port-block mode: give claimed block b to subscriber owner, whose chain
+ * starts at head (FT_NOT_FOUND if it holds no block yet).
+ */
+static int adopt_block(cgnat_t *cgnat, cgnat_shard_t *shard, uint32_t b, uint32_t owner, uint32_t head,
+                       uint32_t now) {
+    uint64_t key = owner;
+    uint64_t hash = flow_table_hash(key);
+    port_block_t *block = &shard->blocks[b];
+    block->owner = owner;
+    block->sessions = 0;
+    if (head == FT_NOT_FOUND) {
+        block->next = PORT_BLOCK_NIL;
+        if (flow_table_insert(&shard->subscribers, key, hash, b) != 0) {
+            portmap_release(&shard->block_maps[b / shard->blocks_per_ip], b % shard->blocks_per_ip);
+            return -1;
+        }
+    } else {
+        block->next = shard->blocks[head].next;
+        shard->blocks[head].next = b;
+    }
+    STAT_ADD(shard, block_allocs, 1);
+    log_block(shard, b, EVENT_BLOCK_ALLOC, cgnat->public_ips[b / shard->blocks_per_ip], now);
+    return 0;
+}
+
+/*
+ * Port-block mode: a port from one of the subscriber's blocks, claiming a
+ * new block only when every block it holds is full. Only that claim touches
+ * anything shared between subscribers.
+ */
+static int allocate_from_blocks(cgnat_t *cgnat, cgnat_shard_t *shard, int num_public_ips, nat_entry_t *entry,
+                                uint32_t now) {
+    uint32_t size = (uint32_t)shard->block_size;
+    uint64_t key = entry->priv_ip;
+    uint64_t hash = flow_table_hash(key);
+    uint32_t head = flow_table_find(&shard->subscribers, key, hash);
+    uint32_t b = PORT_BLOCK_NIL;
+    int held = 0;
+
+    for (uint32_t cur = head == FT_NOT_FOUND ? PORT_BLOCK_NIL : head; cur != PORT_BLOCK_NIL;
+         cur = shard->blocks[cur].next, held++) {
+        if (shard->blocks[cur].sessions < size) {
+            b = cur;
+            break;
+        }
+    }
+
+    if (b == PORT_BLOCK_NIL) {
+        if (cgnat->max_blocks_per_subscriber && held >= cgnat->max_blocks_per_subscriber) {
+            STAT_ADD(shard, port_exhaustion_events, 1);
+            return -1;
+        }
+        b = claim_block(shard, num_public_ips);
+        if (b == PORT_BLOCK_NIL) {
+            STAT_ADD(shard, port_exhaustion_events, 1);
+            fprintf(stderr, "[CGNAT] Port exhaustion! No free port blocks.\n");
+            return -1;
+        }
+        if (adopt_block(cgnat, shard, b, entry->priv_ip, head, now) != 0) {
+            return -1;
+        }
+    }
+
+    int ip_idx = (int)(b / shard->blocks_per_ip);
+    uint32_t first = (b % shard->blocks_per_ip) * size;
+    int port_idx = portmap_alloc_range(&shard->port_maps[ip_idx], first, size, entry->priv_port % size);
+    if (port_idx < 0) {
+        return -1;
+    }
+
+    entry->pub_ip = cgnat->public_ips[ip_idx];
+    entry->pub_ip_index = ip_idx;
+    entry->pub_port = PORT_RANGE_START + shard->port_base + port_idx;
+    shard->blocks[b].sessions++;
+    shard->ports_free--;
+    STAT_ADD(shard, ports_in_use, 1);
+    return 0;
+}
+
+/* Port-block mode: the block goes back to the pool with its last session. */
+static void release_block_port(cgnat_shard_t *shard, const nat_entry_t *entry, int port_idx, uint32_t now) {
+    uint32_t b = (uint32_t)(entry->pub_ip_index * shard->blocks_per_ip + port_idx / shard->block_size);
+    port_block_t *block = &shard->blocks[b];
+    if (--block->sessions > 0) {
+        return;
+    }
+
+    uint64_t key = block->owner;
+    uint64_t hash = flow_table_hash(key);
+    uint32_t head = flow_table_find(&shard->subscribers, key, hash);
+    if (head == b) {
+        if (block->next != PORT_BLOCK_NIL) {
+            flow_table_update(&shard->subscribers, key, hash, block->next);
+        } else {
+            flow_table_remove(&shard->subscribers, key, hash);
+        }
+    } else {
+        uint32_t prev = head;
+        while (shard->blocks[prev].next != b) {
+            prev = shard->blocks[prev].next;
+        }
+        shard->blocks[prev].next = block->next;
+    }
+    portmap_release(&shard->block_maps[entry->pub_ip_index], b % shard->blocks_per_ip);
+    STAT_ADD(shard, block_frees, 1);
+    log_block(shard, b, EVENT_BLOCK_RELEASE, entry->pub_ip, now);
+}
+
+static long entry_port_index(const cgnat_shard_t *shard, const nat_entry_t *entry) {
+    return (long)entry->pub_ip_index * shard->port_count + (entry->pub_port - PORT_RANGE_START - shard->port_base);
+}
+
+/*
+ * APDM: a public port carries one session per remote endpoint. Fresh ports
+ * are used while the shard has them; after that a session shares a busy
+ * port, picked by hash, on which no session talks to the same remote.
+ */
+#define APDM_PORT_ATTEMPTS 16
+
+static int allocate_shared_port(cgnat_t *cgnat, cgnat_shard_t *shard, int num_public_ips, nat_entry_t *entry) {
+    if (take_free_port(cgnat, shard, num_public_ips, entry) == 0) {
+        shard->port_refs[entry_port_index(shard, entry)] = 1;
+        return 0;
+    }
+
+    uint64_t remote = remote_part(shard, entry->remote_ip, entry->remote_port);
+    uint64_t h = flow_table_hash_key(outbound_key(entry->priv_ip, entry->priv_port, entry->protocol, remote));
+    uint32_t ports = (uint32_t)num_public_ips * (uint32_t)shard->port_count;
+    for (int attempt = 0; attempt < APDM_PORT_ATTEMPTS; attempt++) {
+        /* port_refs is laid out ip-major, so pos is also (ip, port) */
+        uint32_t pos = (uint32_t)(((h >> 16) + (uint64_t)attempt * 7919) % ports);
+        if (shard->port_refs[pos] == 0 || shard->port_refs[pos] == UINT16_MAX) {
+            continue;
+        }
+        int ip_idx = (int)(pos / (uint32_t)shard->port_count);
+        uint32_t pub_ip = cgnat->public_ips[ip_idx];
+        uint16_t pub_port = (uint16_t)(PORT_RANGE_START + shard->port_base + pos % (uint32_t)shard->port_count);
+        flow_key_t key = inbound_key(pub_ip, pub_port, entry->protocol, remote);
+        if (flow_table_find_key(&shard->inbound_flows, key, flow_table_hash_key(key)) != FT_NOT_FOUND) {
+            continue;
+        }
+
+        entry->pub_ip = pub_ip;
+        entry->pub_ip_index = ip_idx;
+        entry->pub_port = pub_port;
+        shard->port_refs[pos]++;
+        STAT_ADD(shard, shared_ports, 1);
+        return 0;
+    }
+
+    STAT_ADD(shard, port_exhaustion_events, 1);
+    fprintf(stderr, "[CGNAT] Port exhaustion! No shareable port for this remote.\n");
+    return -1;
+}
+
+static void release_port(cgnat_shard_t *shard, const nat_entry_t *entry, uint32_t now) {
+    int port_idx = entry->pub_port - PORT_RANGE_START - shard->port_base;
+    if (port_idx >= 0 && port_idx < shard->port_count &&
+        portmap_in_use(&shard->port_maps[entry->pub_ip_index], port_idx)) {
+        if (shard->port_refs && --shard->port_refs[entry_port_index(shard, entry)] > 0) {
+            return;
+        }
+        portmap_release(&shard->port_maps[entry->pub_ip_index], port_idx);
+        shard->ports_free++;
+        STAT_ADD(shard, ports_in_use, -1);
+        if (shard->blocks) {
+            release_block_port(shard, entry, port_idx, now);
+        }
+    }
+}
+
+static nat_entry_t* find_outbound_entry(cgnat_shard_t *shard, uint32_t priv_ip, uint16_t priv_port,
+                                        uint8_t protocol, uint64_t remote) {
+    flow_key_t key = outbound_key(priv_ip, priv_port, protocol, remote);
+    uint32_t idx = flow_table_find_key(&shard->outbound_flows, key, flow_table_hash_key(key));
+    return idx == FT_NOT_FOUND ? NULL : &shard->nat_table[idx];
+}
+
+/* Deterministic mode: index into shard->port_slots for a public address, -1 if outside every block. */
+static long block_port_index(const cgnat_t *cgnat, const cgnat_shard_t *shard, uint32_t pub_ip, uint16_t pub_port) {
+    int ip_idx = public_ip_index(cgnat, pub_ip);
+    int port_idx = pub_port - PORT_RANGE_START - shard->port_base;
+    if (ip_idx < 0 || port_idx < 0 || port_idx >= cgnat->det_blocks_per_slice * cgnat->block_size) {
+        return -1;
+    }
+    return (long)ip_idx * shard->port_count + port_idx;
+}
+
+static nat_entry_t* find_inbound_entry(const cgnat_t *cgnat, cgnat_shard_t *shard, uint32_t pub_ip,
+                                       uint16_t pub_port, uint8_t protocol, uint64_t remote) {
+    if (shard->port_slots) {
+        long pos = block_port_index(cgnat, shard, pub_ip, pub_port);
+        uint32_t slot = pos < 0 ? 0 : shard->port_slots[pos];
+        if (slot == 0 || shard->nat_table[slot - 1].protocol != protocol) {
+            return NULL;
+        }
+        return &shard->nat_table[slot - 1];
+    }
+
+    flow_key_t key = inbound_key(pub_ip, pub_port, protocol, remote);
+    uint32_t idx = flow_table_find_key(&shard->inbound_flows, key, flow_table_hash_key(key));
+    return idx == FT_NOT_FOUND ? NULL : &shard->nat_table[idx];
+}
+
+/*
+ * Free slots live on a per-shard stack of 32-bit indices. Slots that were
+ * never used are handed out from a high-water mark, so neither the stack nor
+ * the table has to be touched up front.
+ */
+static nat_entry_t* allocate_nat_entry(cgnat_shard_t *shard) {
+    uint32_t idx;
+    if (shard->free_top > 0) {
+        idx = shard->free_stack[--shard->free_top];
+    } else if (shard->high_water < (uint32_t)shard->nat_capacity) {
+        idx = shard->high_water++;
+    } else {
+        fprintf(stderr, "[CGNAT] NAT table full! Cannot create new entry.\n");
+        STAT_ADD(shard, table_full, 1);
+        return NULL;
+    }
+
+    nat_entry_t *entry = &shard->nat_table[idx];
+    entry->in_use = 1;
+    entry->timer.slot = TW_UNARMED;
+    shard->nat_entries_count++;
+    STAT_ADD(shard, entry_allocs, 1);
+    return entry;
+}
+
+static void release_nat_entry(cgnat_shard_t *shard, nat_entry_t *entry) {
+    entry->in_use = 0;
+    shard->free_stack[shard->free_top++] = (uint32_t)(entry - shard->nat_table);
+    shard->nat_entries_count--;
+    STAT_ADD(shard, entry_frees, 1);
+}
+
+/*
+ * Subscriber-session index. A new session joins the list right after the
+ * member the index points at, so the index only changes when a subscriber
+ * gains its first session or loses the member it points at.
+ */
+static int link_subscriber_session(cgnat_shard_t *shard, uint32_t idx) {
+    uint64_t key = shard->nat_table[idx].priv_ip;
+    uint64_t hash = flow_table_hash(key);
+    session_link_t *link = &shard->session_links[idx];
+    uint32_t head = flow_table_find(&shard->subscriber_sessions, key, hash);
+    if (head == FT_NOT_FOUND) {
+        link->next = link->prev = idx;
+        return flow_table_insert(&shard->subscriber_sessions, key, hash, idx);
+    }
+    link->prev = head;
+    link->next = shard->session_links[head].next;
+    shard->session_links[link->next].prev = idx;
+    shard->session_links[head].next = idx;
+    return 0;
+}
+
+static void unlink_subscriber_session(cgnat_shard_t *shard, uint32_t idx) {
+    uint64_t key = shard->nat_table[idx].priv_ip;
+    uint64_t hash = flow_table_hash(key);
+    session_link_t *link = &shard->session_links[idx];
+    if (link->next == idx) {
+        flow_table_remove(&shard->subscriber_sessions, key, hash);
+        return;
+    }
+    shard->session_links[link->prev].next = link->next;
+    shard->session_links[link->next].prev = link->prev;
+    if (flow_table_find(&shard->subscriber_sessions, key, hash) == idx) {
+        flow_table_update(&shard->subscriber_sessions, key, hash, link->next);
+    }
+}
+
+static void remove_flow_keys(cgnat_shard_t *shard, nat_entry_t *entry) {
+    uint64_t remote = remote_part(shard, entry->remote_ip, entry->remote_port);
+    flow_key_t out_key = outbound_key(entry->priv_ip, entry->priv_port, entry->protocol, remote);
+    flow_key_t in_key = inbound_key(entry->pub_ip, entry->pub_port, entry->protocol, remote);
+    flow_table_remove_key(&shard->outbound_flows, out_key, flow_table_hash_key(out_key));
+    if (shard->port_slots) {
+        shard->port_slots[entry_port_index(shard, entry)] = 0;
+    } else {
+        flow_table_remove_key(&shard->inbound_flows, in_key, flow_table_hash_key(in_key));
+    }
+}
+
+static int add_to_flow_tables(cgnat_shard_t *shard, nat_entry_t *entry) {
+    uint32_t idx = (uint32_t)(entry - shard->nat_table);
+    uint64_t remote = remote_part(shard, entry->remote_ip, entry->remote_port);
+    flow_key_t out_key = outbound_key(entry->priv_ip, entry->priv_port, entry->protocol, remote);
+    flow_key_t in_key = inbound_key(entry->pub_ip, entry->pub_port, entry->protocol, remote);
+
+    if (flow_table_insert_key(&shard->outbound_flows, out_key, flow_table_hash_key(out_key), idx) != 0) {
+        return -1;
+    }
+    if (shard->port_slots) {
+        shard->port_slots[entry_port_index(shard, entry)] = idx + 1;
+    } else if (flow_table_insert_key(&shard->inbound_flows, in_key, flow_table_hash_key(in_key), idx) != 0) {
+        flow_table_remove_key(&shard->outbound_flows, out_key, flow_table_hash_key(out_key));
+        return -1;
+    }
+    if (link_subscriber_session(shard, idx) != 0) {
+        remove_flow_keys(shard, entry);
+        return -1;
+    }
+    return 0;
+}
+
+static void remove_from_flow_tables(cgnat_shard_t *shard, nat_entry_t *entry) {
+    remove_flow_keys(shard, entry);
+    unlink_subscriber_session(shard, (uint32_t)(entry - shard->nat_table));
+}
+
+
+static void update_tcp_state(nat_entry_t *entry, packet_info_t *pkt) {
+    (void)pkt;
+
+    switch (entry->state) {
+        case STATE_CLOSED:
+            entry->state = STATE_SYN_SENT;
+            break;
+        case STATE_SYN_SENT:
+        case STATE_SYN_RECEIVED:
+            entry->state = STATE_ESTABLISHED;
+            break;
+        case STATE_ESTABLISHED:
+            break;
+        case STATE_FIN_WAIT:
+            entry->state = STATE_CLOSING;
+            break;
+        case STATE_CLOSING:
+            entry->state = STATE_TIME_WAIT;
+            break;
+        case STATE_TIME_WAIT:
+            entry->state = STATE_CLOSED;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Sessions sit on the wheel at the deadline computed when they were armed.
+ * Activity only bumps last_activity; the reaper re-arms lazily when the old
+ * deadline comes due. Closing TCP states are pulled forward immediately.
+ */
+static uint32_t session_deadline(const nat_entry_t *entry) {
+    if (entry->state == STATE_CLOSED || entry->state == STATE_TIME_WAIT) {
+        return (uint32_t)entry->last_activity;
+    }
+    int timeout = (entry->protocol == PROTO_TCP) ? TCP_TIMEOUT : UDP_TIMEOUT;
+    return (uint32_t)(entry->last_activity + timeout + 1);
+}
+
+static void track_tcp_packet(cgnat_shard_t *shard, nat_entry_t *entry, packet_info_t *pkt) {
+    conn_state_t old = entry->state;
+    update_tcp_state(entry, pkt);
+    if (entry->state != old) {
+        STAT_ADD(shard, sessions_by_state[old], -1);
+        STAT_ADD(shard, sessions_by_state[entry->state], 1);
+        sync_session(shard, entry, SYNC_REFRESH, (uint32_t)entry->last_activity);
+    }
+    if (entry->state == STATE_CLOSED || entry->state == STATE_TIME_WAIT) {
+        timer_wheel_arm(&shard->wheel, (uint32_t)(entry - shard->nat_table), session_deadline(entry));
+    }
+}
+
+/* Established-flow fast path, called with the shard lock held. */
+static void translate_outbound_hit(cgnat_shard_t *shard, nat_entry_t *entry, packet_info_t *pkt, time_t now) {
+    entry->last_activity = now;
+
+    if (pkt->protocol == PROTO_TCP) {
+        track_tcp_packet(shard, entry, pkt);
+    }
+    sync_refresh(shard, entry, (uint32_t)now);
+
+    pkt->src_ip = entry->pub_ip;
+    pkt->src_port = entry->pub_port;
+    STAT_ADD(shard, packets_translated, 1);
+}
+
+/* New session setup, called with the shard lock held. */
+static int translate_outbound_new(cgnat_t *cgnat, cgnat_shard_t *shard, packet_info_t *pkt,
+                                  int num_public_ips, time_t now) {
+    STAT_ADD(shard, lookup_misses, 1);
+    nat_entry_t *entry = allocate_nat_entry(shard);
+    if (!entry) {
+        STAT_ADD(shard, alloc_failures, 1);
+        return -1;
+    }
+
+    entry->priv_ip = pkt->src_ip;
+    entry->priv_port = pkt->src_port;
+    entry->protocol = pkt->protocol;
+    entry->remote_ip = pkt->dst_ip;
+    entry->remote_port = pkt->dst_port;
+
+    int allocated;
+    switch (cgnat->mode) {
+        case CGNAT_MODE_DETERMINISTIC:
+            allocated = allocate_block_port(cgnat, shard, entry);
+            break;
+        case CGNAT_MODE_PORT_BLOCKS:
+            allocated = allocate_from_blocks(cgnat, shard, num_public_ips, entry, (uint32_t)now);
+            break;
+        case CGNAT_MODE_APDM:
+            allocated = allocate_shared_port(cgnat, shard, num_public_ips, entry);
+            break;
+        default:
+            allocated = allocate_port(cgnat, shard, num_public_ips, entry);
+            break;
+    }
+    if (allocated != 0) {
+        release_nat_entry(shard, entry);
+        STAT_ADD(shard, alloc_failures, 1);
+        return -1;
+    }
+
+    if (add_to_flow_tables(shard, entry) != 0) {
+        release_port(shard, entry, (uint32_t)now);
+        release_nat_entry(shard, entry);
+        STAT_ADD(shard, alloc_failures, 1);
+        STAT_ADD(shard, table_full, 1);
+        return -1;
+    }
+
+    entry->state = (pkt->protocol == PROTO_TCP) ? STATE_SYN_SENT : STATE_UDP_ACTIVE;
+    STAT_ADD(shard, sessions_by_state[entry->state], 1);
+    entry->last_activity = now;
+
+    timer_wheel_start(&shard->wheel, (uint32_t)now);
+    timer_wheel_arm(&shard->wheel, (uint32_t)(entry - shard->nat_table), session_deadline(entry));
+
+    pkt->src_ip = entry->pub_ip;
+    pkt->src_port = entry->pub_port;
+    log_session(shard, entry, EVENT_SESSION_CREATE, (uint32_t)now);
+    sync_session(shard, entry, SYNC_CREATE, (uint32_t)now);
+
+    STAT_ADD(shard, total_connections, 1);
+    STAT_ADD(shard, active_connections, 1);
+    STAT_ADD(shard, packets_translated, 1);
+    return 0;
+}
+
+static void translate_inbound_hit(cgnat_shard_t *shard, nat_entry_t *entry, packet_info_t *pkt, time_t now) {
+    entry->last_activity = now;
+
+    if (pkt->protocol == PROTO_TCP) {
+        track_tcp_packet(shard, entry, pkt);
+    }
+    sync_refresh(shard, entry, (uint32_t)now);
+
+    pkt->dst_ip = entry->priv_ip;
+    pkt->dst_port = entry->priv_port;
+    STAT_ADD(shard, packets_translated, 1);
+}
+
+int cgnat_translate_outbound(cgnat_t *cgnat, packet_info_t *pkt) {
+    int num_public_ips = cgnat->num_public_ips;
+    if (num_public_ips == 0) {
+        fprintf(stderr, "[CGNAT] No public IPs configured\n");
+        return -1;
+    }
+
+    uint64_t start = latency_start();
+    cgnat_shard_t *shard = &cgnat->shards[shard_for_subscriber(cgnat, pkt->src_ip)];
+    time_t now = engine_now(cgnat);
+    int result = 0;
+    pthread_mutex_lock(&shard->lock);
+
+    nat_entry_t *entry = find_outbound_entry(shard, pkt->src_ip, pkt->src_port, pkt->protocol,
+                                             remote_part(shard, pkt->dst_ip, pkt->dst_port));
+    if (entry) {
+        translate_outbound_hit(shard, entry, pkt, now);
+    } else {
+        result = translate_outbound_new(cgnat, shard, pkt, num_public_ips, now);
+    }
+
+    latency_end(shard, CGNAT_OUTBOUND, start);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int cgnat_translate_inbound(cgnat_t *cgnat, packet_info_t *pkt) {
+    int shard_idx = shard_for_public_port(cgnat, pkt->dst_port);
+    if (shard_idx < 0) {
+        __atomic_fetch_add(&cgnat->low_port_drops, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    uint64_t start = latency_start();
+
+    cgnat_shard_t *shard = &cgnat->shards[shard_idx];
+    time_t now = engine_now(cgnat);
+    pthread_mutex_lock(&shard->lock);
+
+    nat_entry_t *entry = find_inbound_entry(cgnat, shard, pkt->dst_ip, pkt->dst_port, pkt->protocol,
+                                            remote_part(shard, pkt->src_ip, pkt->src_port));
+
+    if (!entry) {
+        STAT_ADD(shard, lookup_misses, 1);
+        STAT_ADD(shard, inbound_drops, 1);
+        latency_end(shard, CGNAT_INBOUND, start);
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    translate_inbound_hit(shard, entry, pkt, now);
+
+    latency_end(shard, CGNAT_INBOUND, start);
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+int cgnat_lookup_mapping(cgnat_t *cgnat, uint32_t priv_ip, uint16_t priv_port, uint8_t protocol,
+                         uint32_t *pub_ip, uint16_t *pub_port) {
+    cgnat_shard_t *shard = &cgnat->shards[shard_for_subscriber(cgnat, priv_ip)];
+    pthread_mutex_lock(&shard->lock);
+
+    nat_entry_t *entry = shard->endpoint_dependent ? NULL :
+                         find_outbound_entry(shard, priv_ip, priv_port, protocol, 0);
+    if (entry) {
+        *pub_ip = entry->pub_ip;
+        *pub_port = entry->pub_port;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return entry ? 0 : -1;
+}
+
+static int session_matches(const nat_entry_t *e, const cgnat_session_filter_t *f) {
+    return e->in_use && (!f->priv_ip || e->priv_ip == f->priv_ip) && (!f->pub_ip || e->pub_ip == f->pub_ip) &&
+           (!f->protocol || e->protocol == f->protocol) && (!f->state_mask || ((f->state_mask >> e->state) & 1));
+}
+
+static void session_info(const nat_entry_t *e, cgnat_session_t *out) {
+    out->priv_ip = e->priv_ip;
+    out->pub_ip = e->pub_ip;
+    out->remote_ip = e->remote_ip;
+    out->priv_port = e->priv_port;
+    out->pub_port = e->pub_port;
+    out->remote_port = e->remote_port;
+    out->protocol = e->protocol;
+    out->state = (uint8_t)e->state;
+    out->last_activity = e->last_activity;
+}
+
+/* Max-heap of slot indices, to keep the n lowest seen so far. */
+static void slot_heap_sift_down(uint32_t *heap, int n, int i) {
+    for (;;) {
+        int largest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && heap[l] > heap[largest]) largest = l;
+        if (r < n && heap[r] > heap[largest]) largest = r;
+        if (largest == i) {
+            return;
+        }
+        uint32_t t = heap[i]; heap[i] = heap[largest]; heap[largest] = t;
+        i = largest;
     }
-    
-    cgnat->num_public_ips = 0;
-    cgnat->nat_entries_count = 0;
-    cgnat->next_free_entry = 0;
-    
-    for (int i = 0; i < MAX_NAT_ENTRIES; i++) {
-        cgnat->nat_table[i].in_use = 0;
-        cgnat->nat_table[i].next_outbound = NULL;
-        cgnat->nat_table[i].next_inbound = NULL;
-    }
-    
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        cgnat->outbound_hash[i].head = NULL;
-        cgnat->inbound_hash[i].head = NULL;
-    }
-    
-    for (int i = 0; i < MAX_PUBLIC_IPS; i++) {
-        cgnat->next_port_index[i] = 0;
-        for (int j = 0; j < TOTAL_PORTS_PER_IP; j++) {
-            cgnat->port_pool[i][j].in_use = 0;
-            cgnat->port_pool[i][j].port = PORT_RANGE_START + j;
-        }
-    }
-    
-    cgnat->stats_total_connections = 0;
-    cgnat->stats_active_connections = 0;
-    cgnat->stats_port_exhaustion_events = 0;
-    cgnat->stats_packets_translated = 0;
-    
-    printf("[CGNAT] Initialized with support for %d customers\n", MAX_CUSTOMERS);
-    return cgnat;
 }
 
-void cgnat_destroy(cgnat_t *cgnat) {
-    if (!cgnat) return;
-    pthread_mutex_destroy(&cgnat->lock);
-    free(cgnat);
-    printf("[CGNAT] Destroyed and cleaned up\n");
+static void slot_heap_push(uint32_t *heap, int n, uint32_t slot) {
+    heap[n] = slot;
+    for (int i = n; i > 0 && heap[(i - 1) / 2] < heap[i]; i = (i - 1) / 2) {
+        uint32_t t = heap[i]; heap[i] = heap[(i - 1) / 2]; heap[(i - 1) / 2] = t;
+    }
 }
 
-int cgnat_add_public_ip(cgnat_t *cgnat, const char *ip_str) {
-    if (cgnat->num_public_ips >= MAX_PUBLIC_IPS) {
-        fprintf(stderr, "[CGNAT] Cannot add more than %d public IPs\n", MAX_PUBLIC_IPS);
-        return -1;
+/*
+ * One subscriber's sessions from slot `from` on: a walk over its list that
+ * keeps the max lowest matching slots, so pages come out in slot order like
+ * a full scan. Returns the count; *more is set when matches remain.
+ */
+static int list_subscriber_sessions(cgnat_shard_t *shard, const cgnat_session_filter_t *filter, uint32_t from,
+                                    cgnat_session_t *out, int max, uint32_t *next) {
+    uint32_t heap[CGNAT_LIST_MAX];
+    int n = 0, more = 0;
+    uint64_t key = filter->priv_ip;
+    uint32_t head = flow_table_find(&shard->subscriber_sessions, key, flow_table_hash(key));
+    if (head != FT_NOT_FOUND) {
+        uint32_t idx = head;
+        do {
+            if (idx >= from && session_matches(&shard->nat_table[idx], filter)) {
+                if (n < max) {
+                    slot_heap_push(heap, n++, idx);
+                } else {
+                    more = 1;
+                    if (idx < heap[0]) {
+                        heap[0] = idx;
+                        slot_heap_sift_down(heap, n, 0);
+                    }
+                }
+            }
+            idx = shard->session_links[idx].next;
+        } while (idx != head);
     }
-    
-    struct in_addr addr;
-    if (inet_pton(AF_INET, ip_str, &addr) != 1) {
-        fprintf(stderr, "[CGNAT] Invalid IP address: %s\n", ip_str);
-        return -1;
+    /* Heap sort leaves the slots ascending. */
+    for (int k = n - 1; k > 0; k--) {
+        uint32_t t = heap[0]; heap[0] = heap[k]; heap[k] = t;
+        slot_heap_sift_down(heap, k, 0);
     }
-    
-    uint32_t ip = ntohl(addr.s_addr);
-    cgnat->public_ips[cgnat->num_public_ips] = ip;
-    
-    for (int j = 0; j < TOTAL_PORTS_PER_IP; j++) {
-        cgnat->port_pool[cgnat->num_public_ips][j].pub_ip = ip;
+    for (int k = 0; k < n; k++) {
+        session_info(&shard->nat_table[heap[k]], &out[k]);
     }
-    
-    printf("[CGNAT] Added public IP: %s (%d ports available)\n", ip_str, TOTAL_PORTS_PER_IP);
-    cgnat->num_public_ips++;
-    return 0;
+    *next = more ? heap[n - 1] + 1 : UINT32_MAX;
+    return n;
 }
 
-static int allocate_port(cgnat_t *cgnat, uint32_t *pub_ip, uint16_t *pub_port) {
-    static int last_ip_index = 0;
-    
-    for (int attempt = 0; attempt < MAX_PUBLIC_IPS; attempt++) {
-        int ip_idx = (last_ip_index + attempt) % cgnat->num_public_ips;
-        int start_port_idx = cgnat->next_port_index[ip_idx];
-        
-        for (int i = 0; i < TOTAL_PORTS_PER_IP; i++) {
-            int port_idx = (start_port_idx + i) % TOTAL_PORTS_PER_IP;
-            
-            if (!cgnat->port_pool[ip_idx][port_idx].in_use) {
-                cgnat->port_pool[ip_idx][port_idx].in_use = 1;
-                *pub_ip = cgnat->port_pool[ip_idx][port_idx].pub_ip;
-                *pub_port = cgnat->port_pool[ip_idx][port_idx].port;
-                
-                cgnat->next_port_index[ip_idx] = (port_idx + 1) % TOTAL_PORTS_PER_IP;
-                last_ip_index = (ip_idx + 1) % cgnat->num_public_ips;
-                
-                return 0;
-            }
+/* The cursor holds the shard in its high half and the next slot to look at in the low half. */
+int cgnat_list_sessions(cgnat_t *cgnat, const cgnat_session_filter_t *filter, uint64_t *cursor,
+                        cgnat_session_t *out, int max) {
+    if (*cursor == CGNAT_CURSOR_END || max <= 0) {
+        return 0;
+    }
+    if (max > CGNAT_LIST_MAX) {
+        max = CGNAT_LIST_MAX;
+    }
+    int s = (int)(*cursor >> 32);
+    uint32_t slot = (uint32_t)*cursor;
+
+    if (filter->priv_ip) {
+        int owner = shard_for_subscriber(cgnat, filter->priv_ip);
+        if (s > owner) {
+            *cursor = CGNAT_CURSOR_END;
+            return 0;
         }
+        if (s < owner) {
+            slot = 0;
+        }
+        cgnat_shard_t *shard = &cgnat->shards[owner];
+        uint32_t next;
+        pthread_mutex_lock(&shard->lock);
+        int n = list_subscriber_sessions(shard, filter, slot, out, max, &next);
+        pthread_mutex_unlock(&shard->lock);
+        *cursor = next == UINT32_MAX ? CGNAT_CURSOR_END : ((uint64_t)owner << 32) | next;
+        return n;
     }
-    
-    cgnat->stats_port_exhaustion_events++;
-    fprintf(stderr, "[CGNAT] Port exhaustion! All ports in use.\n");
-    return -1;
+
+    if (s >= cgnat->num_shards) {
+        *cursor = CGNAT_CURSOR_END;
+        return 0;
+    }
+    cgnat_shard_t *shard = &cgnat->shards[s];
+    int n = 0;
+    pthread_mutex_lock(&shard->lock);
+    uint32_t high_water = shard->high_water;
+    if (slot > high_water) {
+        slot = high_water;      /* a stale or made-up cursor */
+    }
+    uint32_t end = high_water - slot > CGNAT_LIST_SCAN ? slot + CGNAT_LIST_SCAN : high_water;
+    for (; slot < end && n < max; slot++) {
+        if (session_matches(&shard->nat_table[slot], filter)) {
+            session_info(&shard->nat_table[slot], &out[n++]);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (slot < high_water) {
+        *cursor = ((uint64_t)s << 32) | slot;
+    } else {
+        *cursor = s + 1 < cgnat->num_shards ? (uint64_t)(s + 1) << 32 : CGNAT_CURSOR_END;
+    }
+    return n;
 }
 
-static void release_port(cgnat_t *cgnat, uint32_t pub_ip, uint16_t pub_port) {
-    for (int i = 0; i < cgnat->num_public_ips; i++) {
-        if (cgnat->public_ips[i] == pub_ip) {
-            int port_idx = pub_port - PORT_RANGE_START;
-            if (port_idx >= 0 && port_idx < TOTAL_PORTS_PER_IP) {
-                cgnat->port_pool[i][port_idx].in_use = 0;
-            }
-            return;
+/*
+ * Burst translation. Every packet of a burst is hashed and bucketed by shard
+ * first; each shard's packets are then handled under one lock hold in three
+ * passes: prefetch the flow-table groups, probe them and prefetch the hit
+ * entries, then resolve. By the time an entry is touched its cache lines are
+ * usually already in flight, so the per-packet dependent misses overlap.
+ */
+typedef struct {
+    uint64_t hash[CGNAT_MAX_BURST];
+    flow_key_t key[CGNAT_MAX_BURST];
+    uint32_t slot[CGNAT_MAX_BURST];
+    int16_t shard[CGNAT_MAX_BURST];
+    uint16_t order[CGNAT_MAX_BURST];
+    uint16_t shard_start[CGNAT_MAX_SHARDS + 1];
+} burst_ctx_t;
+
+/* Stable counting sort of packet indices by shard; -1 shards are skipped. */
+static void burst_group(burst_ctx_t *ctx, int count, int num_shards) {
+    uint16_t fill[CGNAT_MAX_SHARDS + 1] = {0};
+    for (int i = 0; i < count; i++) {
+        if (ctx->shard[i] >= 0) {
+            fill[ctx->shard[i] + 1]++;
+        }
+    }
+    for (int s = 0; s < num_shards; s++) {
+        fill[s + 1] += fill[s];
+    }
+    memcpy(ctx->shard_start, fill, sizeof(fill));
+    for (int i = 0; i < count; i++) {
+        if (ctx->shard[i] >= 0) {
+            ctx->order[fill[ctx->shard[i]]++] = (uint16_t)i;
+        }
+    }
+}
+
+static void burst_probe(burst_ctx_t *ctx, const flow_table_t *flows, cgnat_shard_t *shard, int lo, int hi) {
+    for (int k = lo; k < hi; k++) {
+        flow_table_prefetch(flows, ctx->hash[ctx->order[k]]);
+    }
+    for (int k = lo; k < hi; k++) {
+        int i = ctx->order[k];
+        ctx->slot[i] = flow_table_find_key(flows, ctx->key[i], ctx->hash[i]);
+        if (ctx->slot[i] != FT_NOT_FOUND) {
+            __builtin_prefetch(&shard->nat_table[ctx->slot[i]], 1);
+        }
+    }
+}
+
+/* Deterministic counterpart of burst_probe: the public port indexes its session directly. */
+static void burst_probe_blocks(const cgnat_t *cgnat, burst_ctx_t *ctx, cgnat_shard_t *shard,
+                               const packet_info_t *pkts, int lo, int hi) {
+    for (int k = lo; k < hi; k++) {
+        int i = ctx->order[k];
+        long pos = block_port_index(cgnat, shard, pkts[i].dst_ip, pkts[i].dst_port);
+        ctx->key[i].lo = (uint64_t)pos;
+        if (pos >= 0) {
+            __builtin_prefetch(&shard->port_slots[pos]);
+        }
+    }
+    for (int k = lo; k < hi; k++) {
+        int i = ctx->order[k];
+        uint32_t slot = (int64_t)ctx->key[i].lo < 0 ? 0 : shard->port_slots[ctx->key[i].lo];
+        ctx->slot[i] = slot ? slot - 1 : FT_NOT_FOUND;
+        if (slot) {
+            __builtin_prefetch(&shard->nat_table[slot - 1], 1);
         }
     }
 }
 
-static nat_entry_t* find_outbound_entry(cgnat_t *cgnat, uint32_t priv_ip, uint16_t priv_port, uint8_t protocol) {
-    uint32_t hash = hash_outbound(priv_ip, priv_port, protocol);
-    nat_entry_t *entry = cgnat->outbound_hash[hash].head;
-    
-    while (entry) {
-        if (entry->in_use &&
-            entry->priv_ip == priv_ip &&
-            entry->priv_port == priv_port &&
-            entry->protocol == protocol) {
-            return entry;
+static int translate_outbound_chunk(cgnat_t *cgnat, packet_info_t *pkts, int count, int *results, time_t now) {
+    uint64_t start = latency_start();
+    burst_ctx_t ctx;
+    int num_public_ips = cgnat->num_public_ips;
+    int translated = 0;
+
+    for (int i = 0; i < count; i++) {
+        ctx.shard[i] = (int16_t)shard_for_subscriber(cgnat, pkts[i].src_ip);
+        uint64_t remote = remote_part(&cgnat->shards[ctx.shard[i]], pkts[i].dst_ip, pkts[i].dst_port);
+        ctx.key[i] = outbound_key(pkts[i].src_ip, pkts[i].src_port, pkts[i].protocol, remote);
+        ctx.hash[i] = flow_table_hash_key(ctx.key[i]);
+    }
+    burst_group(&ctx, count, cgnat->num_shards);
+
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        int lo = ctx.shard_start[s], hi = ctx.shard_start[s + 1];
+        if (lo == hi) {
+            continue;
+        }
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        pthread_mutex_lock(&shard->lock);
+
+        burst_probe(&ctx, &shard->outbound_flows, shard, lo, hi);
+
+        for (int k = lo; k < hi; k++) {
+            int i = ctx.order[k];
+            uint32_t slot = ctx.slot[i];
+            /* An earlier packet in this burst may have created the flow. */
+            if (slot == FT_NOT_FOUND) {
+                slot = flow_table_find_key(&shard->outbound_flows, ctx.key[i], ctx.hash[i]);
+            }
+            if (slot != FT_NOT_FOUND) {
+                translate_outbound_hit(shard, &shard->nat_table[slot], &pkts[i], now);
+                results[i] = 0;
+            } else {
+                results[i] = translate_outbound_new(cgnat, shard, &pkts[i], num_public_ips, now);
+            }
+            translated += results[i] == 0;
+        }
+
+        if (hi == ctx.shard_start[cgnat->num_shards]) {
+            burst_latency_end(shard, CGNAT_OUTBOUND, start, count);
         }
-        entry = entry->next_outbound;
+        pthread_mutex_unlock(&shard->lock);
     }
-    return NULL;
+    return translated;
 }
 
-static nat_entry_t* find_inbound_entry(cgnat_t *cgnat, uint32_t pub_ip, uint16_t pub_port, uint8_t protocol) {
-    uint32_t hash = hash_inbound(pub_ip, pub_port, protocol);
-    nat_entry_t *entry = cgnat->inbound_hash[hash].head;
-    
-    while (entry) {
-        if (entry->in_use &&
-            entry->pub_ip == pub_ip &&
-            entry->pub_port == pub_port &&
-            entry->protocol == protocol) {
-            return entry;
+static int translate_inbound_chunk(cgnat_t *cgnat, packet_info_t *pkts, int count, int *results, time_t now) {
+    uint64_t start = latency_start();
+    burst_ctx_t ctx;
+    int translated = 0;
+
+    int blocks = cgnat->mode == CGNAT_MODE_DETERMINISTIC;
+    int low_ports = 0;
+
+    for (int i = 0; i < count; i++) {
+        ctx.shard[i] = (int16_t)shard_for_public_port(cgnat, pkts[i].dst_port);
+        low_ports += ctx.shard[i] < 0;
+        if (!blocks && ctx.shard[i] >= 0) {
+            uint64_t remote = remote_part(&cgnat->shards[ctx.shard[i]], pkts[i].src_ip, pkts[i].src_port);
+            ctx.key[i] = inbound_key(pkts[i].dst_ip, pkts[i].dst_port, pkts[i].protocol, remote);
+            ctx.hash[i] = flow_table_hash_key(ctx.key[i]);
+        }
+        results[i] = -1;
+    }
+    burst_group(&ctx, count, cgnat->num_shards);
+    if (low_ports) {
+        __atomic_fetch_add(&cgnat->low_port_drops, (uint64_t)low_ports, __ATOMIC_RELAXED);
+    }
+
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        int lo = ctx.shard_start[s], hi = ctx.shard_start[s + 1];
+        if (lo == hi) {
+            continue;
+        }
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        pthread_mutex_lock(&shard->lock);
+
+        if (blocks) {
+            burst_probe_blocks(cgnat, &ctx, shard, pkts, lo, hi);
+        } else {
+            burst_probe(&ctx, &shard->inbound_flows, shard, lo, hi);
+        }
+
+        for (int k = lo; k < hi; k++) {
+            int i = ctx.order[k];
+            if (ctx.slot[i] != FT_NOT_FOUND && shard->nat_table[ctx.slot[i]].protocol == pkts[i].protocol) {
+                translate_inbound_hit(shard, &shard->nat_table[ctx.slot[i]], &pkts[i], now);
+                results[i] = 0;
+                translated++;
+            } else {
+                STAT_ADD(shard, lookup_misses, ctx.slot[i] == FT_NOT_FOUND);
+                STAT_ADD(shard, inbound_drops, 1);
+            }
+        }
+
+        if (hi == ctx.shard_start[cgnat->num_shards]) {
+            burst_latency_end(shard, CGNAT_INBOUND, start, count);
         }
-        entry = entry->next_inbound;
+        pthread_mutex_unlock(&shard->lock);
     }
-    return NULL;
+    return translated;
 }
 
-static nat_entry_t* allocate_nat_entry(cgnat_t *cgnat) {
-    for (int i = 0; i < MAX_NAT_ENTRIES; i++) {
-        int idx = (cgnat->next_free_entry + i) % MAX_NAT_ENTRIES;
-        if (!cgnat->nat_table[idx].in_use) {
-            cgnat->nat_table[idx].in_use = 1;
-            cgnat->nat_table[idx].next_outbound = NULL;
-            cgnat->nat_table[idx].next_inbound = NULL;
-            cgnat->nat_entries_count++;
-            cgnat->next_free_entry = (idx + 1) % MAX_NAT_ENTRIES;
-            return &cgnat->nat_table[idx];
+int cgnat_translate_outbound_burst(cgnat_t *cgnat, packet_info_t *pkts, int count, int *results) {
+    if (cgnat->num_public_ips == 0) {
+        fprintf(stderr, "[CGNAT] No public IPs configured\n");
+        for (int i = 0; i < count; i++) {
+            results[i] = -1;
         }
+        return 0;
+    }
+
+    time_t now = engine_now(cgnat);
+    int translated = 0;
+    for (int off = 0; off < count; off += CGNAT_MAX_BURST) {
+        int n = count - off < CGNAT_MAX_BURST ? count - off : CGNAT_MAX_BURST;
+        translated += translate_outbound_chunk(cgnat, pkts + off, n, results + off, now);
     }
-    fprintf(stderr, "[CGNAT] NAT table full! Cannot create new entry.\n");
-    return NULL;
+    return translated;
 }
 
-static void add_to_hash_tables(cgnat_t *cgnat, nat_entry_t *entry) {
-    uint32_t out_hash = hash_outbound(entry->priv_ip, entry->priv_port, entry->protocol);
-    entry->next_outbound = cgnat->outbound_hash[out_hash].head;
-    cgnat->outbound_hash[out_hash].head = entry;
+int cgnat_translate_inbound_burst(cgnat_t *cgnat, packet_info_t *pkts, int count, int *results) {
+    time_t now = engine_now(cgnat);
+    int translated = 0;
+    for (int off = 0; off < count; off += CGNAT_MAX_BURST) {
+        int n = count - off < CGNAT_MAX_BURST ? count - off : CGNAT_MAX_BURST;
+        translated += translate_inbound_chunk(cgnat, pkts + off, n, results + off, now);
+    }
+    return translated;
 }
 
-static void add_to_inbound_hash(cgnat_t *cgnat, nat_entry_t *entry) {
-    uint32_t in_hash = hash_inbound(entry->pub_ip, entry->pub_port, entry->protocol);
-    entry->next_inbound = cgnat->inbound_hash[in_hash].head;
-    cgnat->inbound_hash[in_hash].head = entry;
+/* Teardown of a session whose timer is not armed. */
+static void delete_session(cgnat_shard_t *shard, nat_entry_t *entry, uint32_t now) {
+    log_session(shard, entry, EVENT_SESSION_DELETE, now);
+    sync_session(shard, entry, SYNC_DELETE, now);
+    remove_from_flow_tables(shard, entry);
+    release_port(shard, entry, now);
+    release_nat_entry(shard, entry);
+    STAT_ADD(shard, active_connections, -1);
+    STAT_ADD(shard, sessions_by_state[entry->state], -1);
 }
 
-static void remove_from_hash_tables(cgnat_t *cgnat, nat_entry_t *entry) {
-    uint32_t out_hash = hash_outbound(entry->priv_ip, entry->priv_port, entry->protocol);
-    nat_entry_t **curr = &cgnat->outbound_hash[out_hash].head;
-    while (*curr) {
-        if (*curr == entry) {
-            *curr = entry->next_outbound;
-            break;
+typedef struct {
+    cgnat_shard_t *shard;
+    int cleaned;
+} reap_ctx_t;
+
+static void expire_session(void *ctx, uint32_t idx, uint32_t now) {
+    reap_ctx_t *reap = (reap_ctx_t*)ctx;
+    cgnat_shard_t *shard = reap->shard;
+    nat_entry_t *entry = &shard->nat_table[idx];
+
+    uint32_t deadline = session_deadline(entry);
+    if ((int32_t)(deadline - now) > 0) {
+        timer_wheel_arm(&shard->wheel, idx, deadline);
+        return;
+    }
+
+    delete_session(shard, entry, now);
+    reap->cleaned++;
+}
+
+int cgnat_set_event_log(cgnat_t *cgnat, event_log_t *log) {
+    if (log && !event_log_ring(log, cgnat->num_shards - 1)) {
+        fprintf(stderr, "[CGNAT] Event log needs one ring per shard (%d)\n", cgnat->num_shards);
+        return -1;
+    }
+    if (log && cgnat->mode == CGNAT_MODE_DETERMINISTIC) {
+        printf("[CGNAT] Deterministic NAT: mappings are computed, not logged\n");
+    }
+
+    pthread_mutex_lock(&cgnat->lock);
+    cgnat->event_log = log;
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        shard->events = log && cgnat->mode != CGNAT_MODE_DETERMINISTIC ? event_log_ring(log, s) : NULL;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&cgnat->lock);
+    return 0;
+}
+
+void cgnat_set_sync(cgnat_t *cgnat, sync_ring_t *rings, uint32_t refresh_seconds) {
+    pthread_mutex_lock(&cgnat->lock);
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        shard->sync = rings ? &rings[s] : NULL;
+        shard->sync_refresh = refresh_seconds;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&cgnat->lock);
+}
+
+/*
+ * Standby: take the exact public port of a replicated session. Under APDM a
+ * port already in use is shared, as long as no session on it talks to the
+ * same remote; in port-block mode the port's block must be free or already
+ * the subscriber's.
+ */
+static int claim_port(cgnat_t *cgnat, cgnat_shard_t *shard, nat_entry_t *entry, uint32_t pub_ip,
+                      uint16_t pub_port, uint32_t now) {
+    int ip_idx = public_ip_index(cgnat, pub_ip);
+    int port_idx = pub_port - PORT_RANGE_START - shard->port_base;
+    if (ip_idx < 0 || port_idx < 0 || port_idx >= shard->port_count) {
+        return -1;
+    }
+    entry->pub_ip = pub_ip;
+    entry->pub_ip_index = ip_idx;
+    entry->pub_port = pub_port;
+    portmap_t *map = &shard->port_maps[ip_idx];
+
+    if (shard->port_refs && portmap_in_use(map, port_idx)) {
+        uint16_t *refs = &shard->port_refs[entry_port_index(shard, entry)];
+        uint64_t remote = remote_part(shard, entry->remote_ip, entry->remote_port);
+        flow_key_t key = inbound_key(pub_ip, pub_port, entry->protocol, remote);
+        if (*refs == UINT16_MAX ||
+            flow_table_find_key(&shard->inbound_flows, key, flow_table_hash_key(key)) != FT_NOT_FOUND) {
+            return -1;
         }
-        curr = &((*curr)->next_outbound);
+        (*refs)++;
+        STAT_ADD(shard, shared_ports, 1);
+        return 0;
     }
-    
-    uint32_t in_hash = hash_inbound(entry->pub_ip, entry->pub_port, entry->protocol);
-    curr = &cgnat->inbound_hash[in_hash].head;
-    while (*curr) {
-        if (*curr == entry) {
-            *curr = entry->next_inbound;
-            break;
+
+    uint32_t b = PORT_BLOCK_NIL;
+    if (shard->blocks) {
+        uint32_t block_idx = (uint32_t)port_idx / (uint32_t)shard->block_size;
+        if (block_idx >= (uint32_t)shard->blocks_per_ip) {
+            return -1;
         }
-        curr = &((*curr)->next_inbound);
+        b = (uint32_t)ip_idx * shard->blocks_per_ip + block_idx;
+        if (!portmap_in_use(&shard->block_maps[ip_idx], block_idx)) {
+            uint64_t key = entry->priv_ip;
+            uint32_t head = flow_table_find(&shard->subscribers, key, flow_table_hash(key));
+            if (portmap_alloc_range(&shard->block_maps[ip_idx], block_idx, 1, 0) < 0 ||
+                adopt_block(cgnat, shard, b, entry->priv_ip, head, now) != 0) {
+                return -1;
+            }
+        } else if (shard->blocks[b].owner != entry->priv_ip) {
+            return -1;
+        }
+    }
+
+    if (portmap_alloc_range(map, (uint32_t)port_idx, 1, 0) < 0) {
+        return -1;
+    }
+    if (shard->port_refs) {
+        shard->port_refs[entry_port_index(shard, entry)] = 1;
     }
+    if (b != PORT_BLOCK_NIL) {
+        shard->blocks[b].sessions++;
+    }
+    shard->ports_free--;
+    STAT_ADD(shard, ports_in_use, 1);
+    return 0;
 }
 
-static void update_tcp_state(nat_entry_t *entry, packet_info_t *pkt) {
-    (void)pkt;
-    
-    switch (entry->state) {
-        case STATE_CLOSED:
-            entry->state = STATE_SYN_SENT;
-            break;
-        case STATE_SYN_SENT:
-        case STATE_SYN_RECEIVED:
-            entry->state = STATE_ESTABLISHED;
-            break;
-        case STATE_ESTABLISHED:
-            break;
-        case STATE_FIN_WAIT:
-            entry->state = STATE_CLOSING;
+static void set_session_state(cgnat_shard_t *shard, nat_entry_t *entry, conn_state_t state, time_t last_activity) {
+    if (entry->state != state) {
+        STAT_ADD(shard, sessions_by_state[entry->state], -1);
+        STAT_ADD(shard, sessions_by_state[state], 1);
+        entry->state = state;
+    }
+    entry->last_activity = last_activity;
+    if (state == STATE_CLOSED || state == STATE_TIME_WAIT) {
+        timer_wheel_arm(&shard->wheel, (uint32_t)(entry - shard->nat_table), session_deadline(entry));
+    }
+}
+
+static int install_session(cgnat_t *cgnat, cgnat_shard_t *shard, const sync_record_t *record, uint32_t now) {
+    nat_entry_t *entry = allocate_nat_entry(shard);
+    if (!entry) {
+        return -1;
+    }
+    entry->priv_ip = record->priv_ip;
+    entry->priv_port = record->priv_port;
+    entry->protocol = record->protocol;
+    entry->remote_ip = record->remote_ip;
+    entry->remote_port = record->remote_port;
+    if (claim_port(cgnat, shard, entry, record->pub_ip, record->pub_port, now) != 0) {
+        release_nat_entry(shard, entry);
+        return -1;
+    }
+    if (add_to_flow_tables(shard, entry) != 0) {
+        release_port(shard, entry, now);
+        release_nat_entry(shard, entry);
+        return -1;
+    }
+
+    entry->state = (conn_state_t)record->state;
+    entry->last_activity = record->time;
+    STAT_ADD(shard, sessions_by_state[entry->state], 1);
+    timer_wheel_start(&shard->wheel, now);
+    timer_wheel_arm(&shard->wheel, (uint32_t)(entry - shard->nat_table), session_deadline(entry));
+    log_session(shard, entry, EVENT_SESSION_CREATE, now);
+    STAT_ADD(shard, total_connections, 1);
+    STAT_ADD(shard, active_connections, 1);
+    return 0;
+}
+
+static void drop_session(cgnat_shard_t *shard, nat_entry_t *entry, uint32_t now) {
+    timer_wheel_disarm(&shard->wheel, (uint32_t)(entry - shard->nat_table));
+    delete_session(shard, entry, now);
+}
+
+int cgnat_apply_sync(cgnat_t *cgnat, const sync_record_t *record) {
+    if (record->state >= CONN_STATES) {
+        return -1;
+    }
+    uint32_t now = (uint32_t)engine_now(cgnat);
+    cgnat_shard_t *shard = &cgnat->shards[shard_for_subscriber(cgnat, record->priv_ip)];
+    uint64_t remote = remote_part(shard, record->remote_ip, record->remote_port);
+    int result = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    nat_entry_t *entry = find_outbound_entry(shard, record->priv_ip, record->priv_port, record->protocol, remote);
+    switch (record->type) {
+        case SYNC_CREATE:
+            if (entry && entry->pub_ip == record->pub_ip && entry->pub_port == record->pub_port) {
+                set_session_state(shard, entry, (conn_state_t)record->state, record->time);
+                break;
+            }
+            if (entry) {
+                drop_session(shard, entry, now);
+            }
+            result = install_session(cgnat, shard, record, now);
             break;
-        case STATE_CLOSING:
-            entry->state = STATE_TIME_WAIT;
+        case SYNC_REFRESH:
+            if (entry) {
+                set_session_state(shard, entry, (conn_state_t)record->state, record->time);
+            } else {
+                result = -1;
+            }
             break;
-        case STATE_TIME_WAIT:
-            entry->state = STATE_CLOSED;
+        case SYNC_DELETE:
+            if (entry) {
+                drop_session(shard, entry, now);
+            } else {
+                result = -1;
+            }
             break;
         default:
+            result = -1;
             break;
     }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
 }
 
-int cgnat_translate_outbound(cgnat_t *cgnat, packet_info_t *pkt) {
-    pthread_mutex_lock(&cgnat->lock);
-    
-    if (cgnat->num_public_ips == 0) {
-        pthread_mutex_unlock(&cgnat->lock);
-        fprintf(stderr, "[CGNAT] No public IPs configured\n");
-        return -1;
-    }
-    
-    nat_entry_t *entry = find_outbound_entry(cgnat, pkt->src_ip, pkt->src_port, pkt->protocol);
-    
-    if (entry) {
-        entry->last_activity = time(NULL);
-        
-        if (pkt->protocol == PROTO_TCP) {
-            update_tcp_state(entry, pkt);
-        }
-        
-        pkt->src_ip = entry->pub_ip;
-        pkt->src_port = entry->pub_port;
-        cgnat->stats_packets_translated++;
-        pthread_mutex_unlock(&cgnat->lock);
-        return 0;
+void cgnat_sync_takeover(cgnat_t *cgnat, uint32_t refresh_seconds) {
+    time_t now = engine_now(cgnat);
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (uint32_t idx = 0; idx < shard->high_water; idx++) {
+            nat_entry_t *entry = &shard->nat_table[idx];
+            if (entry->in_use) {
+                time_t seen = entry->last_activity + refresh_seconds;
+                entry->last_activity = seen < now ? seen : now;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
     }
-    
-    entry = allocate_nat_entry(cgnat);
-    if (!entry) {
-        pthread_mutex_unlock(&cgnat->lock);
-        return -1;
+}
+
+void cgnat_flush_sessions(cgnat_t *cgnat) {
+    uint32_t now = (uint32_t)engine_now(cgnat);
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        cgnat_shard_t *shard = &cgnat->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (uint32_t idx = 0; idx < shard->high_water; idx++) {
+            if (shard->nat_table[idx].in_use) {
+                drop_session(shard, &shard->nat_table[idx], now);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
     }
-    
-    entry->priv_ip = pkt->src_ip;
-    entry->priv_port = pkt->src_port;
-    entry->protocol = pkt->protocol;
-    
-    if (allocate_port(cgnat, &entry->pub_ip, &entry->pub_port) != 0) {
-        entry->in_use = 0;
-        cgnat->nat_entries_count--;
-        pthread_mutex_unlock(&cgnat->lock);
+}
+
+void cgnat_set_time(cgnat_t *cgnat, time_t now) {
+    cgnat->manual_now = now;
+}
+
+int cgnat_deterministic_block(const cgnat_t *cgnat, uint32_t priv_ip,
+                              uint32_t *pub_ip, uint16_t *first_port, uint16_t *last_port) {
+    det_block_t block;
+    if (cgnat->mode != CGNAT_MODE_DETERMINISTIC || det_block_for(cgnat, priv_ip, &block) != 0 ||
+        block.ip_idx >= cgnat->num_public_ips) {
         return -1;
     }
-    
-    entry->state = (pkt->protocol == PROTO_TCP) ? STATE_SYN_SENT : STATE_UDP_ACTIVE;
-    entry->last_activity = time(NULL);
-    
-    add_to_hash_tables(cgnat, entry);
-    add_to_inbound_hash(cgnat, entry);
-    
-    pkt->src_ip = entry->pub_ip;
-    pkt->src_port = entry->pub_port;
-    
-    cgnat->stats_total_connections++;
-    cgnat->stats_active_connections++;
-    cgnat->stats_packets_translated++;
-    
-    pthread_mutex_unlock(&cgnat->lock);
+    int first = PORT_RANGE_START + cgnat->shards[block.shard].port_base + block.first;
+    *pub_ip = cgnat->public_ips[block.ip_idx];
+    *first_port = (uint16_t)first;
+    *last_port = (uint16_t)(first + cgnat->block_size - 1);
     return 0;
 }
 
-int cgnat_translate_inbound(cgnat_t *cgnat, packet_info_t *pkt) {
-    pthread_mutex_lock(&cgnat->lock);
-    
-    nat_entry_t *entry = find_inbound_entry(cgnat, pkt->dst_ip, pkt->dst_port, pkt->protocol);
-    
-    if (!entry) {
-        pthread_mutex_unlock(&cgnat->lock);
+int cgnat_deterministic_subscriber(const cgnat_t *cgnat, uint32_t pub_ip, uint16_t pub_port,
+                                   uint32_t *priv_ip) {
+    if (cgnat->mode != CGNAT_MODE_DETERMINISTIC) {
         return -1;
     }
-    
-    entry->last_activity = time(NULL);
-    
-    if (pkt->protocol == PROTO_TCP) {
-        update_tcp_state(entry, pkt);
+    int ip_idx = public_ip_index(cgnat, pub_ip);
+    int shard = shard_for_public_port(cgnat, pub_port);
+    if (ip_idx < 0 || shard < 0) {
+        return -1;
     }
-    
-    pkt->dst_ip = entry->priv_ip;
-    pkt->dst_port = entry->priv_port;
-    cgnat->stats_packets_translated++;
-    
-    pthread_mutex_unlock(&cgnat->lock);
+    int block = (pub_port - PORT_RANGE_START - cgnat->shards[shard].port_base) / cgnat->block_size;
+    if (block >= cgnat->det_blocks_per_slice) {
+        return -1;
+    }
+    uint32_t per_ip = (uint32_t)cgnat->det_blocks_per_slice * (uint32_t)cgnat->num_shards;
+    uint32_t sub = (uint32_t)ip_idx * per_ip + (uint32_t)block * (uint32_t)cgnat->num_shards + (uint32_t)shard;
+    if (sub >= cgnat->det_subscribers) {
+        return -1;
+    }
+    *priv_ip = cgnat->det_inside_base + sub;
     return 0;
 }
 
-void cgnat_cleanup_expired(cgnat_t *cgnat) {
-    pthread_mutex_lock(&cgnat->lock);
-    
-    time_t now = time(NULL);
+int cgnat_expire_sessions(cgnat_t *cgnat) {
+    uint32_t now = (uint32_t)engine_now(cgnat);
+    uint64_t hold_ticks = (uint64_t)(latency_ticks_per_sec() * CGNAT_REAP_HOLD_US / 1e6);
     int cleaned = 0;
-    
-    for (int i = 0; i < MAX_NAT_ENTRIES; i++) {
-        if (cgnat->nat_table[i].in_use) {
-            int timeout = (cgnat->nat_table[i].protocol == PROTO_TCP) ? TCP_TIMEOUT : UDP_TIMEOUT;
-            
-            if (cgnat->nat_table[i].state == STATE_CLOSED || 
-                cgnat->nat_table[i].state == STATE_TIME_WAIT ||
-                (now - cgnat->nat_table[i].last_activity > timeout)) {
-                
-                remove_from_hash_tables(cgnat, &cgnat->nat_table[i]);
-                release_port(cgnat, cgnat->nat_table[i].pub_ip, cgnat->nat_table[i].pub_port);
-                cgnat->nat_table[i].in_use = 0;
-                cgnat->nat_entries_count--;
-                cgnat->stats_active_connections--;
-                cleaned++;
+
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        reap_ctx_t reap = { .shard = &cgnat->shards[s], .cleaned = 0 };
+        int pending;
+
+        do {
+            pthread_mutex_lock(&reap.shard->lock);
+            uint64_t start = monotonic_ns();
+            uint64_t deadline = latency_ticks() + hold_ticks;
+            int done = 0, work;
+            do {
+                work = timer_wheel_advance(&reap.shard->wheel, now, CGNAT_REAP_BATCH, expire_session, &reap);
+                done += work;
+                pending = timer_wheel_pending(&reap.shard->wheel, now);
+            } while (pending && work > 0 && done < CGNAT_REAP_BUDGET && latency_ticks() < deadline);
+            uint64_t held = monotonic_ns() - start;
+            STAT_ADD(reap.shard, reap_slices, 1);
+            STAT_ADD(reap.shard, reap_hold_ns, held);
+            if (held > reap.shard->stats.reap_max_hold_ns) {
+                __atomic_store_n(&reap.shard->stats.reap_max_hold_ns, held, __ATOMIC_RELAXED);
             }
-        }
+            pthread_mutex_unlock(&reap.shard->lock);
+        } while (pending);
+
+        cleaned += reap.cleaned;
     }
-    
-    pthread_mutex_unlock(&cgnat->lock);
-    
+    return cleaned;
+}
+
+void cgnat_cleanup_expired(cgnat_t *cgnat) {
+    int cleaned = cgnat_expire_sessions(cgnat);
     if (cleaned > 0) {
         printf("[CGNAT] Cleaned up %d expired connections\n", cleaned);
     }
 }
 
+void cgnat_get_counters(const cgnat_t *cgnat, cgnat_counters_t *total) {
+    memset(total, 0, sizeof(*total));
+    /* Every counter is a sum except the last, which is a maximum. */
+    uint64_t *sum = (uint64_t*)total;
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        const uint64_t *c = (const uint64_t*)&cgnat->shards[s].stats;
+        for (size_t i = 0; i < offsetof(cgnat_counters_t, reap_max_hold_ns) / sizeof(uint64_t); i++) {
+            sum[i] += __atomic_load_n(&c[i], __ATOMIC_RELAXED);
+        }
+        uint64_t held = __atomic_load_n(&cgnat->shards[s].stats.reap_max_hold_ns, __ATOMIC_RELAXED);
+        if (held > total->reap_max_hold_ns) {
+            total->reap_max_hold_ns = held;
+        }
+    }
+    total->inbound_drops += __atomic_load_n(&cgnat->low_port_drops, __ATOMIC_RELAXED);
+}
+
+void cgnat_get_latency(const cgnat_t *cgnat, cgnat_direction_t dir, latency_hist_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        latency_hist_add(hist, &cgnat->shards[s].translate_latency[dir]);
+    }
+}
+
+void cgnat_get_burst_latency(const cgnat_t *cgnat, cgnat_direction_t dir, latency_hist_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+    for (int s = 0; s < cgnat->num_shards; s++) {
+        latency_hist_add(hist, &cgnat->shards[s].burst_latency[dir]);
+    }
+}
+
+void cgnat_get_pool_usage(const cgnat_t *cgnat, uint32_t *ports_per_ip) {
+    int num_public_ips = __atomic_load_n(&cgnat->num_public_ips, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_public_ips; i++) {
+        ports_per_ip[i] = 0;
+        for (int s = 0; s < cgnat->num_shards; s++) {
+            const cgnat_shard_t *shard = &cgnat->shards[s];
+            ports_per_ip[i] += (uint32_t)shard->port_count - portmap_free_count(&shard->port_maps[i]);
+        }
+    }
+}
+
 void cgnat_print_stats(cgnat_t *cgnat) {
-    pthread_mutex_lock(&cgnat->lock);
-    
+    cgnat_counters_t c;
+    cgnat_get_counters(cgnat, &c);
+
     printf("\n========== CGNAT Statistics ==========\n");
     printf("Public IPs configured: %d\n", cgnat->num_public_ips);
+    printf("Engine shards: %d\n", cgnat->num_shards);
+    if (cgnat->mode == CGNAT_MODE_DETERMINISTIC) {
+        printf("Port allocation: deterministic, %d-port block per subscriber\n", cgnat->block_size);
+    } else if (cgnat->mode == CGNAT_MODE_PORT_BLOCKS) {
+        printf("Port allocation: %d-port blocks on demand\n", cgnat->block_size);
+        printf("Port blocks in use: %lu (%lu claimed / %lu released)\n",
+               c.block_allocs - c.block_frees, c.block_allocs, c.block_frees);
+    } else if (cgnat->mode == CGNAT_MODE_APDM) {
+        printf("Port allocation: address-and-port-dependent, %lu sessions placed on shared ports\n",
+               c.shared_ports);
+    }
     printf("Total ports available: %d\n", cgnat->num_public_ips * TOTAL_PORTS_PER_IP);
-    printf("Total connections (lifetime): %lu\n", cgnat->stats_total_connections);
-    printf("Active connections: %lu\n", cgnat->stats_active_connections);
-    printf("Packets translated: %lu\n", cgnat->stats_packets_translated);
-    printf("Port exhaustion events: %lu\n", cgnat->stats_port_exhaustion_events);
-    
-    int ports_in_use = 0;
-    for (int i = 0; i < cgnat->num_public_ips; i++) {
-        for (int j = 0; j < TOTAL_PORTS_PER_IP; j++) {
-            if (cgnat->port_pool[i][j].in_use) {
-                ports_in_use++;
-            }
-        }
+    printf("Total connections (lifetime): %lu\n", c.total_connections);
+    printf("Active connections: %lu\n", c.active_connections);
+    printf("Packets translated: %lu\n", c.packets_translated);
+    printf("Port exhaustion events: %lu\n", c.port_exhaustion_events);
+    printf("Ports currently in use: %lu\n", c.ports_in_use);
+    if (cgnat->mode == CGNAT_MODE_APDM && c.ports_in_use > 0) {
+        printf("Sessions per busy public port: %.2f\n", (double)c.active_connections / c.ports_in_use);
+    }
+    printf("NAT table entries: %lu / %u\n", c.entry_allocs - c.entry_frees, cgnat->max_sessions);
+    printf("NAT entry allocs / frees: %lu / %lu\n", c.entry_allocs, c.entry_frees);
+    printf("Sessions by state: %lu syn-sent, %lu established, %lu closing, %lu time-wait, %lu closed, %lu udp\n",
+           c.sessions_by_state[STATE_SYN_SENT] + c.sessions_by_state[STATE_SYN_RECEIVED],
+           c.sessions_by_state[STATE_ESTABLISHED],
+           c.sessions_by_state[STATE_FIN_WAIT] + c.sessions_by_state[STATE_CLOSING],
+           c.sessions_by_state[STATE_TIME_WAIT], c.sessions_by_state[STATE_CLOSED],
+           c.sessions_by_state[STATE_UDP_ACTIVE]);
+    printf("Lookup misses: %lu, inbound drops: %lu\n", c.lookup_misses, c.inbound_drops);
+    printf("Allocation failures: %lu (%lu with a full table)\n", c.alloc_failures, c.table_full);
+    printf("Reaper worst lock hold: %.1f us\n", c.reap_max_hold_ns / 1000.0);
+    if (cgnat->event_log) {
+        event_log_stats_t log_stats;
+        event_log_get_stats(cgnat->event_log, &log_stats);
+        printf("Event log: %lu records written in %u files, %lu dropped, %lu write errors\n",
+               log_stats.written, log_stats.files, log_stats.dropped, log_stats.write_errors);
     }
-    printf("Ports currently in use: %d\n", ports_in_use);
-    printf("NAT table entries: %d / %d\n", cgnat->nat_entries_count, MAX_NAT_ENTRIES);
-    
+
     if (cgnat->num_public_ips > 0) {
-        double utilization = (double)ports_in_use / (cgnat->num_public_ips * TOTAL_PORTS_PER_IP) * 100.0;
+        double utilization = (double)c.ports_in_use / (cgnat->num_public_ips * TOTAL_PORTS_PER_IP) * 100.0;
         printf("Port pool utilization: %.2f%%\n", utilization);
     }
     printf("======================================\n\n");
-    
-    pthread_mutex_unlock(&cgnat->lock);
 }
@@ -5,18 +5,52 @@
 #include <netinet/in.h>
 #include <time.h>
 #include <pthread.h>
+#include "portmap.h"
+#include "timer_wheel.h"
+#include "flow_table.h"
+#include "arena.h"
+#include "event_log.h"
+#include "sync_ring.h"
+#include "latency.h"
 
+/* Defaults for cgnat_config_t; the real limits are set at init time. */
+#ifndef MAX_PUBLIC_IPS
 #define MAX_PUBLIC_IPS 10
+#endif
 #define MAX_CUSTOMERS 20000
 #define PORT_RANGE_START 1024
 #define PORT_RANGE_END 65535
 #define TOTAL_PORTS_PER_IP (PORT_RANGE_END - PORT_RANGE_START + 1)
+#ifndef MAX_NAT_ENTRIES
 #define MAX_NAT_ENTRIES 50000
-#define HASH_TABLE_SIZE 65536
+#endif
+#define CGNAT_MAX_SHARDS 16
 
 #define TCP_TIMEOUT 300
 #define UDP_TIMEOUT 60
 
+/* Largest burst handled under a single lock hold per shard. */
+#define CGNAT_MAX_BURST 256
+
+/*
+ * Translations timed per thread for the latency histograms: one call (or
+ * one burst chunk) in CGNAT_LATENCY_SAMPLE (a power of two, 1 to time all).
+ * A TSC read costs 20 ns or more under some hypervisors, so timing every
+ * packet would cost more than the histogram is worth.
+ */
+#ifndef CGNAT_LATENCY_SAMPLE
+#define CGNAT_LATENCY_SAMPLE 16
+#endif
+
+/*
+ * One reaper lock hold ends after CGNAT_REAP_BUDGET timers or, checked every
+ * CGNAT_REAP_BATCH, once CGNAT_REAP_HOLD_US have passed. A delete costs a
+ * few microseconds with cold caches, so the clock is what bounds the stall.
+ */
+#define CGNAT_REAP_BUDGET 128
+#define CGNAT_REAP_BATCH 16
+#define CGNAT_REAP_HOLD_US 50
+
 typedef enum {
     PROTO_TCP = 6,
     PROTO_UDP = 17
@@ -33,49 +67,196 @@ typedef enum {
     STATE_UDP_ACTIVE
 } conn_state_t;
 
+#define CONN_STATES (STATE_UDP_ACTIVE + 1)
+
+typedef enum {
+    CGNAT_MODE_DYNAMIC = 0,     /* ports drawn from the shared pool per session */
+    CGNAT_MODE_DETERMINISTIC,   /* RFC 7422: fixed port block per subscriber */
+    CGNAT_MODE_PORT_BLOCKS,     /* blocks handed to subscribers on demand */
+    CGNAT_MODE_APDM             /* address-and-port-dependent: a public port is
+                                   shared by sessions toward different remotes */
+} cgnat_mode_t;
+
+/* Fields are ordered to keep the entry at 56 bytes. */
 typedef struct nat_entry {
     uint32_t priv_ip;
     uint16_t priv_port;
+    uint16_t remote_port;
     uint32_t pub_ip;
     uint16_t pub_port;
-    uint8_t protocol;
+    uint16_t pub_ip_index;
+    uint32_t remote_ip;     /* destination of the packet that opened the session */
     conn_state_t state;
     time_t last_activity;
+    timer_node_t timer;
+    uint8_t protocol;
     uint8_t in_use;
-    struct nat_entry *next_outbound;
-    struct nat_entry *next_inbound;
+    uint32_t synced;        /* when the last sync record for it was pushed */
 } nat_entry_t;
 
+/*
+ * A subscriber's sessions form a circular list through one link pair per
+ * session slot; the shard's subscriber-session index points at any member.
+ */
 typedef struct {
-    uint32_t pub_ip;
-    uint16_t port;
-    uint8_t in_use;
-} port_entry_t;
+    uint32_t next;
+    uint32_t prev;
+} session_link_t;
+
+/*
+ * Port-block mode: block_size consecutive ports of one public IP, owned by a
+ * subscriber while any of its sessions use them. A subscriber's blocks are
+ * chained through `next`; the chain head is found through the shard's
+ * subscriber index.
+ */
+#define PORT_BLOCK_NIL 0xFFFFFFFFu
 
 typedef struct {
-    nat_entry_t *head;
-} hash_bucket_t;
+    uint32_t owner;         /* subscriber private IP */
+    uint32_t next;          /* next block of the same subscriber, or PORT_BLOCK_NIL */
+    uint32_t sessions;
+} port_block_t;
 
+/*
+ * Engine counters. Every shard keeps its own block, starting on a cache line
+ * of its own. Only the shard lock holder writes a block, with relaxed atomic
+ * stores. Readers sum the blocks with relaxed loads and never take a lock,
+ * so polling statistics cannot stall a worker.
+ */
+typedef struct {
+    uint64_t total_connections;
+    uint64_t active_connections;
+    uint64_t packets_translated;
+    uint64_t port_exhaustion_events;
+    uint64_t ports_in_use;
+    uint64_t entry_allocs;
+    uint64_t entry_frees;
+    uint64_t block_allocs;
+    uint64_t block_frees;
+    uint64_t shared_ports;      /* APDM: sessions placed on a port already in use */
+    uint64_t lookup_misses;     /* flow lookups that found no session, either direction */
+    uint64_t inbound_drops;     /* inbound packets that matched no session or no pool port */
+    uint64_t alloc_failures;    /* new sessions refused, for any reason */
+    uint64_t table_full;        /* ... of which the session table or a flow index was full */
+    uint64_t sessions_by_state[CONN_STATES];
+    uint64_t reap_slices;
+    uint64_t reap_hold_ns;
+    uint64_t reap_max_hold_ns;
+} __attribute__((aligned(64))) cgnat_counters_t;
+
+typedef enum {
+    CGNAT_OUTBOUND = 0,
+    CGNAT_INBOUND,
+    CGNAT_DIRECTIONS
+} cgnat_direction_t;
+
+/*
+ * One slice of the NAT engine. Each shard owns its own session table, flow
+ * indexes and a disjoint range of every public IP's port space, so a worker
+ * that only ever touches its own shard never contends with the others.
+ */
 typedef struct {
-    uint32_t public_ips[MAX_PUBLIC_IPS];
-    int num_public_ips;
-    
-    port_entry_t port_pool[MAX_PUBLIC_IPS][TOTAL_PORTS_PER_IP];
-    int next_port_index[MAX_PUBLIC_IPS];
-    
-    nat_entry_t nat_table[MAX_NAT_ENTRIES];
-    int nat_entries_count;
-    int next_free_entry;
-    
-    hash_bucket_t outbound_hash[HASH_TABLE_SIZE];
-    hash_bucket_t inbound_hash[HASH_TABLE_SIZE];
-    
-    uint64_t stats_total_connections;
-    uint64_t stats_active_connections;
-    uint64_t stats_port_exhaustion_events;
-    uint64_t stats_packets_translated;
-    
     pthread_mutex_t lock;
+    int id;
+
+    int port_base;          /* first port offset (from PORT_RANGE_START) owned by this shard */
+    int port_count;         /* ports per public IP owned by this shard */
+    portmap_t *port_maps;   /* one per public IP slot */
+    uint64_t *port_bits;
+    uint32_t port_map_words;
+    int ports_free;         /* free ports across every configured public IP */
+    int *next_port_index;
+    int next_ip_index;
+    uint32_t *port_slots;   /* deterministic mode: session slot + 1 per public port, 0 if free */
+    uint16_t *port_refs;    /* APDM: sessions sharing each public port */
+    int endpoint_dependent; /* APDM: flow keys include the remote endpoint */
+
+    portmap_t *block_maps;  /* port-block mode: free blocks, one map per public IP slot */
+    uint64_t *block_bits;
+    uint32_t block_map_words;
+    int block_size;
+    int blocks_per_ip;
+    port_block_t *blocks;   /* ip_idx * blocks_per_ip + block */
+    flow_table_t subscribers;   /* priv_ip -> first block of the subscriber's chain */
+
+    nat_entry_t *nat_table;
+    int nat_capacity;
+    int nat_entries_count;
+    uint32_t *free_stack;   /* released slot indices */
+    uint32_t free_top;
+    uint32_t high_water;    /* slots at or above this were never used */
+
+    flow_table_t subscriber_sessions;   /* priv_ip -> a slot in the subscriber's session list */
+    session_link_t *session_links;      /* per slot */
+
+    flow_table_t outbound_flows;    /* (priv_ip, priv_port, proto) -> slot */
+    flow_table_t inbound_flows;     /* (pub_ip, pub_port, proto) -> slot, dynamic mode only */
+
+    timer_wheel_t wheel;    /* session expiry, keyed by idle deadline */
+    event_ring_t *events;   /* mapping log, NULL when logging is off */
+    sync_ring_t *sync;      /* HA replication, NULL when no standby is attached */
+    uint32_t sync_refresh;  /* seconds between refresh records of a busy session */
+
+    cgnat_counters_t stats;
+    /*
+     * cgnat_translate_outbound/inbound latency, lock wait included, written
+     * like stats by the lock holder.
+     */
+    latency_hist_t translate_latency[CGNAT_DIRECTIONS];
+    /* Burst chunk time divided by its packets, one entry per sampled chunk. */
+    latency_hist_t burst_latency[CGNAT_DIRECTIONS];
+} __attribute__((aligned(64))) cgnat_shard_t;
+
+typedef struct {
+    uint32_t max_sessions;  /* NAT entries across all shards */
+    int max_public_ips;
+    int num_shards;
+    int hugepages;          /* back the state arena with 2 MB pages if possible */
+
+    /*
+     * Deterministic mode: subscribers det_inside_base .. + det_subscribers - 1
+     * each own block_size ports, laid out in order over the public IPs.
+     * A block size of 0 spreads max_public_ips evenly over the subscribers.
+     *
+     * Port-block mode: subscribers take block_size ports at a time (default
+     * 64), at most max_blocks_per_subscriber blocks each (0: no limit).
+     */
+    cgnat_mode_t mode;
+    uint32_t det_inside_base;
+    uint32_t det_subscribers;
+    int block_size;
+    int max_blocks_per_subscriber;
+} cgnat_config_t;
+
+typedef struct {
+    uint32_t *public_ips;
+    int num_public_ips;
+    int max_public_ips;
+    uint32_t max_sessions;
+
+    cgnat_mode_t mode;
+    uint32_t det_inside_base;
+    uint32_t det_subscribers;
+    int block_size;             /* ports per block in deterministic and port-block modes */
+    int det_blocks_per_slice;   /* blocks in one shard's slice of a public IP */
+    int max_blocks_per_subscriber;
+
+    int num_shards;
+    cgnat_shard_t shards[CGNAT_MAX_SHARDS];
+
+    arena_t arena;          /* every table above lives here */
+    event_log_t *event_log;
+
+    time_t manual_now;      /* external clock, 0 to follow time(NULL) */
+
+    pthread_mutex_t lock;   /* serializes configuration changes */
+
+    /*
+     * Inbound packets to ports below PORT_RANGE_START. No shard owns them,
+     * so any worker adds here atomically; cgnat_get_counters folds them
+     * into inbound_drops.
+     */
+    uint64_t low_port_drops __attribute__((aligned(64)));
 } cgnat_t;
 
 typedef struct {
@@ -87,15 +268,170 @@ typedef struct {
     size_t payload_len;
 } packet_info_t;
 
+void cgnat_config_default(cgnat_config_t *config);
+cgnat_t* cgnat_init_config(const cgnat_config_t *config);
 cgnat_t* cgnat_init(void);
+cgnat_t* cgnat_init_sharded(int num_shards);
 void cgnat_destroy(cgnat_t *cgnat);
 
+/*
+ * Warm restart. cgnat_snapshot_save writes the engine's live state to path:
+ * the arena holding every table, as it is, behind a versioned header with the
+ * configuration, each shard's allocator state and counters. Translation only
+ * stops for a fork() with every shard lock held; the child then writes its
+ * copy-on-write view of the arena while the shards carry on. The calling
+ * thread waits for the child, and the file is renamed into place once it is
+ * complete.
+ *
+ * cgnat_restore maps such a file as the arena of a new engine instead of
+ * rebuilding it. Tables link by index, so only the port maps' storage
+ * pointers and the timer wheels are redone. Session activity times and timers
+ * move forward by the time since the save (now of 0 is time(NULL)), so time
+ * spent down does not count as idle. Public IPs come back with the state;
+ * event logging is off until set again. NULL if the file does not match this
+ * build.
+ */
+int cgnat_snapshot_save(cgnat_t *cgnat, const char *path);
+cgnat_t* cgnat_restore(const char *path, time_t now);
+
 int cgnat_add_public_ip(cgnat_t *cgnat, const char *ip_str);
 
+/* Shard that owns a packet's flow, for steering packets to worker threads. */
+int cgnat_outbound_shard(const cgnat_t *cgnat, const packet_info_t *pkt);
+int cgnat_inbound_shard(const cgnat_t *cgnat, const packet_info_t *pkt);
+
 int cgnat_translate_outbound(cgnat_t *cgnat, packet_info_t *pkt);
 int cgnat_translate_inbound(cgnat_t *cgnat, packet_info_t *pkt);
 
+/*
+ * Public side of a subscriber's mapping, without refreshing it. -1 if none.
+ * Under APDM a mapping also depends on the remote, so this always fails.
+ */
+int cgnat_lookup_mapping(cgnat_t *cgnat, uint32_t priv_ip, uint16_t priv_port, uint8_t protocol,
+                         uint32_t *pub_ip, uint16_t *pub_port);
+
+/* A session as listed by cgnat_list_sessions. */
+typedef struct {
+    uint32_t priv_ip;
+    uint32_t pub_ip;
+    uint32_t remote_ip;
+    uint16_t priv_port;
+    uint16_t pub_port;
+    uint16_t remote_port;
+    uint8_t protocol;
+    uint8_t state;
+    time_t last_activity;
+} cgnat_session_t;
+
+/* Every set field must match; zeroed means everything. */
+typedef struct {
+    uint32_t priv_ip;       /* 0: any subscriber */
+    uint32_t pub_ip;        /* 0: any public IP */
+    uint8_t protocol;       /* 0: any */
+    uint8_t state_mask;     /* bit per conn_state_t, 0: any */
+} cgnat_session_filter_t;
+
+#define CGNAT_CURSOR_END UINT64_MAX
+#define CGNAT_LIST_MAX 256
+#define CGNAT_LIST_SCAN 4096    /* slots examined per lock hold on a full scan */
+
+/*
+ * Sessions matching filter, in (shard, slot) order, resuming at *cursor (0
+ * to start) and stopping after max (at most CGNAT_LIST_MAX) sessions or one
+ * bounded slice of work under a single shard lock. Returns how many were
+ * written and advances *cursor, which becomes CGNAT_CURSOR_END once nothing
+ * is left. A call can return 0 before the end; keep calling. Sessions
+ * created or expired between calls may or may not be listed.
+ *
+ * With a private IP in the filter only that subscriber's sessions are
+ * visited, through the subscriber-session index, instead of the table.
+ */
+int cgnat_list_sessions(cgnat_t *cgnat, const cgnat_session_filter_t *filter, uint64_t *cursor,
+                        cgnat_session_t *out, int max);
+
+/*
+ * Translate a burst of packets (typically 32-256, larger bursts are split).
+ * results[i] receives 0 or -1 for pkts[i]; returns the number translated.
+ * Each touched shard's lock is taken once per CGNAT_MAX_BURST packets.
+ */
+int cgnat_translate_outbound_burst(cgnat_t *cgnat, packet_info_t *pkts, int count, int *results);
+int cgnat_translate_inbound_burst(cgnat_t *cgnat, packet_info_t *pkts, int count, int *results);
+
+/*
+ * Record mapping creation and deletion in log, which needs a ring per shard;
+ * NULL stops logging. Dynamic and APDM modes log every session, port-block
+ * mode logs block claims and releases, and deterministic mode logs nothing
+ * since cgnat_deterministic_subscriber recovers any mapping. The log must
+ * outlive the engine or be detached first.
+ */
+int cgnat_set_event_log(cgnat_t *cgnat, event_log_t *log);
+
+/*
+ * HA replication, active side: push session records into rings[shard] (one
+ * per shard) from now on, refreshing busy sessions every refresh_seconds.
+ * NULL detaches. The rings must outlive the engine or be detached first.
+ */
+void cgnat_set_sync(cgnat_t *cgnat, sync_ring_t *rings, uint32_t refresh_seconds);
+
+/*
+ * Standby side: apply one record from the active engine, which must have
+ * the same mode, shard count and public IPs in the same order. A create
+ * takes exactly the public IP and port the active unit chose, replacing any
+ * session already held for the flow. -1 if the record does not fit this
+ * engine (a refresh or delete for an unknown session, or a taken port).
+ *
+ * A standby must not expire sessions itself; the active unit's deletes do
+ * that. cgnat_sync_takeover readies it to run on its own: refresh records
+ * are up to refresh_seconds behind the traffic, so every session is given
+ * that much activity (never past now) before the reaper sees it.
+ * cgnat_flush_sessions deletes every session, to start a standby over.
+ */
+int cgnat_apply_sync(cgnat_t *cgnat, const sync_record_t *record);
+void cgnat_sync_takeover(cgnat_t *cgnat, uint32_t refresh_seconds);
+void cgnat_flush_sessions(cgnat_t *cgnat);
+
+/* Drive the engine from an external clock; 0 returns to time(NULL). */
+void cgnat_set_time(cgnat_t *cgnat, time_t now);
+
+/*
+ * Deterministic mode only: the fixed public IP and port range of a
+ * subscriber, and the reverse computation from a public IP and port. -1 if
+ * the address is outside the configured subscriber range or pool.
+ */
+int cgnat_deterministic_block(const cgnat_t *cgnat, uint32_t priv_ip,
+                              uint32_t *pub_ip, uint16_t *first_port, uint16_t *last_port);
+int cgnat_deterministic_subscriber(const cgnat_t *cgnat, uint32_t pub_ip, uint16_t pub_port,
+                                   uint32_t *priv_ip);
+
+/* Expire idle sessions in bounded slices of CGNAT_REAP_BUDGET per lock hold. */
 void cgnat_cleanup_expired(cgnat_t *cgnat);
+
+/* Same as cgnat_cleanup_expired without logging; returns sessions expired. */
+int cgnat_expire_sessions(cgnat_t *cgnat);
 void cgnat_print_stats(cgnat_t *cgnat);
 
+/* Counters summed over every shard, without stopping any of them. */
+void cgnat_get_counters(const cgnat_t *cgnat, cgnat_counters_t *total);
+
+/*
+ * Latency of the sampled cgnat_translate_outbound or _inbound calls summed
+ * over every shard, in latency_ticks() units, without stopping any of them.
+ * Multiply counts by CGNAT_LATENCY_SAMPLE to estimate all calls. Burst
+ * calls are not included.
+ */
+void cgnat_get_latency(const cgnat_t *cgnat, cgnat_direction_t dir, latency_hist_t *hist);
+
+/*
+ * Per-packet latency of the burst calls: each sampled chunk of up to
+ * CGNAT_MAX_BURST packets, lock waits included, divided by its packets.
+ * Counts are chunks; multiply by CGNAT_LATENCY_SAMPLE to estimate all.
+ */
+void cgnat_get_burst_latency(const cgnat_t *cgnat, cgnat_direction_t dir, latency_hist_t *hist);
+
+/*
+ * Ports in use on each configured public IP (num_public_ips entries), read
+ * from the shards' port maps without locking them.
+ */
+void cgnat_get_pool_usage(const cgnat_t *cgnat, uint32_t *ports_per_ip);
+
 #endif
@@ -0,0 +1,778 @@
+#define _GNU_SOURCE
+#include "cgnat.h"
+#include "ha_sync.h"
+#include "pkt_rewrite.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+/*
+ * Packet dataplane over AF_PACKET TPACKET_V3 rings. Every worker owns one
+ * rx/tx ring pair on the inside interface and one on the outside interface,
+ * joined to a per-interface fanout group. The groups steer with a classic
+ * BPF copy of the engine's shard choice, so worker w only sees flows of
+ * shard w and never waits on another worker's shard lock. Received blocks
+ * are parsed, translated through the burst API and
+ * rewritten in place in the rx ring by pkt_rewrite; the rewritten frame is
+ * then placed in the opposite interface's tx ring. AF_PACKET has no way to hand an rx slot
+ * to the tx ring, so that placement is the single copy on the path.
+ */
+
+#define RX_BLOCK_SIZE (1u << 20)
+#define RX_BLOCK_NR 32
+#define TX_BLOCK_SIZE (1u << 20)
+#define TX_BLOCK_NR 8
+#define RING_FRAME_SIZE 2048
+#define RX_BLOCK_TIMEOUT_MS 10
+#define MAX_WORKERS CGNAT_MAX_SHARDS
+#define MAX_STEER_INSNS 24
+#define STANDBY_TAKEOVER_SECONDS 3
+
+/* Offset of frame data in a TPACKET_V3 tx slot without PACKET_TX_HAS_OFF. */
+#define TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+typedef struct {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t drop_parse;        /* not IPv4 TCP/UDP, truncated, oversized or a fragment */
+    uint64_t drop_nat;          /* no mapping or no port available */
+    uint64_t drop_tx_full;      /* egress tx ring had no free slot */
+    uint64_t drop_kernel;       /* rx ring overruns reported by the kernel */
+    uint64_t cross_shard;       /* translated on a shard this worker does not own */
+} ring_counters_t;
+
+typedef struct {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    uint8_t *rx_base;
+    unsigned rx_next;
+    uint8_t *tx_base;
+    unsigned tx_frames;
+    unsigned tx_next;
+    unsigned tx_pending;
+    ring_counters_t counters;
+} ring_t;
+
+typedef struct {
+    char name[IFNAMSIZ];
+    int ifindex;
+    uint8_t mac[ETH_ALEN];
+    uint8_t peer_mac[ETH_ALEN];  /* next hop frames leaving this side go to */
+    int fanout_id;
+    int outbound;                /* frames received here go out to the Internet */
+} port_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int started;
+    ring_t inside;
+    ring_t outside;
+} worker_t;
+
+/* Where a parsed packet sits in its rx slot. */
+typedef struct {
+    uint8_t *frame;
+    uint32_t len;           /* Ethernet header plus IPv4 total length */
+    int csum_partial;       /* L4 checksum left for offload by a local sender */
+} frame_ref_t;
+
+static cgnat_t *cgnat;
+static port_t inside_port;
+static port_t outside_port;
+static worker_t workers[MAX_WORKERS];
+static int num_workers = 1;
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+/* Counters have a single writer; the stats thread only reads them. */
+#define COUNT(ring, field, n) \
+    __atomic_store_n(&(ring)->counters.field, (ring)->counters.field + (n), __ATOMIC_RELAXED)
+#define READ_COUNT(ring, field) \
+    __atomic_load_n(&(ring)->counters.field, __ATOMIC_RELAXED)
+
+static int parse_mac(const char *str, uint8_t *mac) {
+    unsigned int b[ETH_ALEN];
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETH_ALEN) {
+        return -1;
+    }
+    for (int i = 0; i < ETH_ALEN; i++) {
+        if (b[i] > 0xFF) {
+            return -1;
+        }
+        mac[i] = (uint8_t)b[i];
+    }
+    return 0;
+}
+
+static int port_lookup(port_t *port, const char *name) {
+    struct ifreq ifr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) != 0) {
+        fprintf(stderr, "[CGNAT] Unknown interface %s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    snprintf(port->name, sizeof(port->name), "%s", name);
+    memcpy(port->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    port->ifindex = (int)if_nametoindex(name);
+    return port->ifindex > 0 ? 0 : -1;
+}
+
+/*
+ * Fanout program for port: the engine shard of an Ethernet/IPv4 frame, as
+ * cgnat_outbound_shard (private source IP) or cgnat_inbound_shard (public
+ * destination port) computes it, which is also the member index of the
+ * worker that owns the shard since workers join in order. Frames the
+ * engine would not route by shard (not IPv4, fragments, well-known ports)
+ * go to worker 0. Loads are relative to the network header, where the
+ * skb points when the fanout runs.
+ */
+static int steering_program(const port_t *port, struct sock_filter *prog) {
+    uint32_t shards = (uint32_t)cgnat->num_shards;
+    int n = 0;
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+    int not_ip = n;
+    prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 0);
+    if (port->outbound) {
+        if (cgnat->mode == CGNAT_MODE_DETERMINISTIC) {
+            /* Subscriber n of the range sits on shard n % per-IP blocks % shards. */
+            prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12);
+            prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, cgnat->det_inside_base);
+            prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, cgnat->det_subscribers, 3, 0);
+            prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+                                                     (uint32_t)cgnat->det_blocks_per_slice * shards);
+            prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards);
+            prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+        }
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 2654435761u);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    } else {
+        uint32_t span = TOTAL_PORTS_PER_IP / shards;
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 6);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1FFF, 14, 0);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF + 9);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROTO_TCP, 1, 0);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROTO_UDP, 0, 11);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0F);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF + 2);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, PORT_RANGE_START, 0, 5);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, PORT_RANGE_START);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, span);
+        /* The last shard also takes the ports left over by the division. */
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, shards - 1, 1, 0);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, shards - 1);
+    }
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    prog[not_ip].jf = (uint8_t)(n - 1 - not_ip - 1);
+    return n;
+}
+
+static int ring_open(ring_t *ring, const port_t *port) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (ring->fd < 0) {
+        fprintf(stderr, "[CGNAT] AF_PACKET socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        fprintf(stderr, "[CGNAT] TPACKET_V3 not supported: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct tpacket_req3 rx = {
+        .tp_block_size = RX_BLOCK_SIZE,
+        .tp_block_nr = RX_BLOCK_NR,
+        .tp_frame_size = RING_FRAME_SIZE,
+        .tp_frame_nr = RX_BLOCK_SIZE / RING_FRAME_SIZE * RX_BLOCK_NR,
+        .tp_retire_blk_tov = RX_BLOCK_TIMEOUT_MS,
+    };
+    struct tpacket_req3 tx = {
+        .tp_block_size = TX_BLOCK_SIZE,
+        .tp_block_nr = TX_BLOCK_NR,
+        .tp_frame_size = RING_FRAME_SIZE,
+        .tp_frame_nr = TX_BLOCK_SIZE / RING_FRAME_SIZE * TX_BLOCK_NR,
+    };
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) != 0 ||
+        setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) != 0) {
+        fprintf(stderr, "[CGNAT] Ring setup on %s: %s\n", port->name, strerror(errno));
+        return -1;
+    }
+
+    /* Our own transmissions would otherwise loop back into the rx ring. */
+    int one = 1;
+    setsockopt(ring->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+    setsockopt(ring->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    size_t rx_len = (size_t)RX_BLOCK_SIZE * RX_BLOCK_NR;
+    size_t tx_len = (size_t)TX_BLOCK_SIZE * TX_BLOCK_NR;
+    ring->map_len = rx_len + tx_len;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        fprintf(stderr, "[CGNAT] Ring mmap on %s: %s\n", port->name, strerror(errno));
+        ring->map = NULL;
+        return -1;
+    }
+    ring->rx_base = ring->map;
+    ring->tx_base = ring->map + rx_len;
+    ring->tx_frames = tx.tp_frame_nr;
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = port->ifindex;
+    if (bind(ring->fd, (struct sockaddr*)&sll, sizeof(sll)) != 0) {
+        fprintf(stderr, "[CGNAT] Bind to %s: %s\n", port->name, strerror(errno));
+        return -1;
+    }
+
+    if (num_workers > 1) {
+        struct sock_filter insns[MAX_STEER_INSNS];
+        struct sock_fprog prog = { .len = (unsigned short)steering_program(port, insns), .filter = insns };
+        int fanout = port->fanout_id | (PACKET_FANOUT_CBPF << 16);
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0 ||
+            setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog)) != 0) {
+            fprintf(stderr, "[CGNAT] Fanout on %s: %s\n", port->name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void ring_close(ring_t *ring) {
+    if (ring->map) {
+        munmap(ring->map, ring->map_len);
+    }
+    if (ring->fd > 0) {
+        close(ring->fd);
+    }
+}
+
+/* Next free tx slot, or NULL when the kernel has not drained the ring yet. */
+static struct tpacket3_hdr* tx_slot(ring_t *ring) {
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr*)(ring->tx_base + (size_t)ring->tx_next * RING_FRAME_SIZE);
+    uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+    if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT) {
+        return NULL;
+    }
+    return hdr;
+}
+
+static void tx_submit(ring_t *ring, struct tpacket3_hdr *hdr, uint32_t len) {
+    hdr->tp_len = len;
+    hdr->tp_snaplen = len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    ring->tx_next = (ring->tx_next + 1) % ring->tx_frames;
+    ring->tx_pending++;
+    COUNT(ring, tx_packets, 1);
+    COUNT(ring, tx_bytes, len);
+}
+
+static void tx_flush(ring_t *ring) {
+    if (ring->tx_pending) {
+        sendto(ring->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        ring->tx_pending = 0;
+    }
+}
+
+static int tx_frame(ring_t *ring, const uint8_t *frame, uint32_t len) {
+    struct tpacket3_hdr *hdr = tx_slot(ring);
+    if (!hdr) {
+        COUNT(ring, drop_tx_full, 1);
+        return -1;
+    }
+    memcpy((uint8_t*)hdr + TX_DATA_OFFSET, frame, len);
+    tx_submit(ring, hdr, len);
+    return 0;
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+/* Pull the 5-tuple out of an Ethernet/IPv4 TCP or UDP frame. */
+static int parse_frame(uint8_t *frame, uint32_t len, uint32_t status, packet_info_t *pkt, frame_ref_t *ref) {
+    /* GRO/GSO super-frames do not fit a tx slot; offloads must be off. */
+    if (len < ETH_HLEN || len > RING_FRAME_SIZE - TX_DATA_OFFSET || get16(frame + 12) != ETH_P_IP) {
+        return -1;
+    }
+    int total = pkt_parse(frame + ETH_HLEN, len - ETH_HLEN, pkt);
+    if (total < 0) {
+        return -1;
+    }
+    ref->frame = frame;
+    ref->len = ETH_HLEN + (uint32_t)total;
+    ref->csum_partial = (status & TP_STATUS_CSUMNOTREADY) != 0;
+    return 0;
+}
+
+static int is_public_ip(uint32_t ip) {
+    for (int i = 0; i < cgnat->num_public_ips; i++) {
+        if (cgnat->public_ips[i] == ip) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Answer ARP requests for the public pool so upstream routers can reach it. */
+static void answer_arp(ring_t *ring, const uint8_t *frame, uint32_t len) {
+    if (len < ETH_HLEN + 28 || get16(frame + 12) != ETH_P_ARP) {
+        return;
+    }
+    const uint8_t *arp = frame + ETH_HLEN;
+    if (get16(arp) != 1 || get16(arp + 2) != ETH_P_IP || get16(arp + 6) != 1 ||
+        !is_public_ip(get32(arp + 24))) {
+        return;
+    }
+
+    uint8_t reply[ETH_HLEN + 28];
+    memcpy(reply, frame + 6, ETH_ALEN);
+    memcpy(reply + 6, outside_port.mac, ETH_ALEN);
+    put16(reply + 12, ETH_P_ARP);
+    uint8_t *out = reply + ETH_HLEN;
+    memcpy(out, arp, 6);
+    put16(out + 6, 2);
+    memcpy(out + 8, outside_port.mac, ETH_ALEN);
+    memcpy(out + 14, arp + 24, 4);
+    memcpy(out + 18, arp + 8, 10);
+    tx_frame(ring, reply, sizeof(reply));
+}
+
+/*
+ * Translate one gathered burst and move the survivors to the egress ring.
+ * Frames leaving through `egress` get that side's MAC and next hop.
+ */
+static void forward_burst(ring_t *ingress, ring_t *egress, const port_t *out_port, int outbound,
+                          packet_info_t *pkts, frame_ref_t *refs, int count) {
+    int results[CGNAT_MAX_BURST];
+    int incremental[CGNAT_MAX_BURST];
+    uint8_t *bufs[CGNAT_MAX_BURST];
+    if (count == 0) {
+        return;
+    }
+
+    if (outbound) {
+        cgnat_translate_outbound_burst(cgnat, pkts, count, results);
+    } else {
+        cgnat_translate_inbound_burst(cgnat, pkts, count, results);
+    }
+
+    /* Partial checksums cannot be patched; those frames get a full recompute. */
+    for (int i = 0; i < count; i++) {
+        bufs[i] = refs[i].frame + ETH_HLEN;
+        incremental[i] = (results[i] == 0 && !refs[i].csum_partial) ? 0 : -1;
+    }
+    pkt_rewrite_burst(bufs, pkts, incremental, count);
+
+    for (int i = 0; i < count; i++) {
+        if (results[i] != 0) {
+            COUNT(ingress, drop_nat, 1);
+            continue;
+        }
+        if (refs[i].csum_partial) {
+            pkt_rewrite_full(bufs[i], &pkts[i]);
+        }
+        memcpy(refs[i].frame, out_port->peer_mac, ETH_ALEN);
+        memcpy(refs[i].frame + ETH_ALEN, out_port->mac, ETH_ALEN);
+        tx_frame(egress, refs[i].frame, refs[i].len);
+    }
+}
+
+/* Drain every block the kernel has handed over. Returns packets seen. */
+static int process_ring(ring_t *ingress, ring_t *egress, const port_t *out_port, int outbound, int shard) {
+    packet_info_t pkts[CGNAT_MAX_BURST];
+    frame_ref_t refs[CGNAT_MAX_BURST];
+    int seen = 0;
+
+    for (;;) {
+        struct tpacket_block_desc *block =
+            (struct tpacket_block_desc*)(ingress->rx_base + (size_t)ingress->rx_next * RX_BLOCK_SIZE);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            break;
+        }
+
+        uint32_t num = block->hdr.bh1.num_pkts;
+        struct tpacket3_hdr *hdr = (struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+        int count = 0;
+        uint64_t bytes = 0;
+
+        for (uint32_t i = 0; i < num; i++) {
+            uint8_t *frame = (uint8_t*)hdr + hdr->tp_mac;
+            uint32_t len = hdr->tp_snaplen;
+            bytes += hdr->tp_len;
+
+            if (parse_frame(frame, len, hdr->tp_status, &pkts[count], &refs[count]) == 0 &&
+                (outbound || is_public_ip(pkts[count].dst_ip))) {
+                int owner = outbound ? cgnat_outbound_shard(cgnat, &pkts[count])
+                                     : cgnat_inbound_shard(cgnat, &pkts[count]);
+                if (owner >= 0 && owner != shard) {
+                    COUNT(ingress, cross_shard, 1);
+                }
+                if (++count == CGNAT_MAX_BURST) {
+                    forward_burst(ingress, egress, out_port, outbound, pkts, refs, count);
+                    count = 0;
+                }
+            } else if (!outbound && len >= ETH_HLEN && get16(frame + 12) == ETH_P_ARP) {
+                answer_arp(ingress, frame, len);
+            } else {
+                COUNT(ingress, drop_parse, 1);
+            }
+            hdr = (struct tpacket3_hdr*)((uint8_t*)hdr + hdr->tp_next_offset);
+        }
+        forward_burst(ingress, egress, out_port, outbound, pkts, refs, count);
+
+        COUNT(ingress, rx_packets, num);
+        COUNT(ingress, rx_bytes, bytes);
+        seen += (int)num;
+
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ingress->rx_next = (ingress->rx_next + 1) % RX_BLOCK_NR;
+    }
+
+    tx_flush(egress);
+    tx_flush(ingress);
+    return seen;
+}
+
+static void* worker_main(void *arg) {
+    worker_t *worker = (worker_t*)arg;
+    struct pollfd fds[2] = {
+        { .fd = worker->inside.fd, .events = POLLIN },
+        { .fd = worker->outside.fd, .events = POLLIN },
+    };
+
+    while (running) {
+        int seen = process_ring(&worker->inside, &worker->outside, &outside_port, 1, worker->id);
+        seen += process_ring(&worker->outside, &worker->inside, &inside_port, 0, worker->id);
+        if (seen == 0) {
+            poll(fds, 2, 100);
+        }
+    }
+    return NULL;
+}
+
+static void poll_kernel_drops(ring_t *ring) {
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+        /* Reading resets the kernel counters; ours accumulate. */
+        __atomic_fetch_add(&ring->counters.drop_kernel, st.tp_drops, __ATOMIC_RELAXED);
+    }
+}
+
+static void print_ring(const char *label, ring_t *ring, ring_counters_t *last, double interval) {
+    ring_counters_t now = {
+        .rx_packets = READ_COUNT(ring, rx_packets),
+        .rx_bytes = READ_COUNT(ring, rx_bytes),
+        .tx_packets = READ_COUNT(ring, tx_packets),
+        .tx_bytes = READ_COUNT(ring, tx_bytes),
+        .drop_parse = READ_COUNT(ring, drop_parse),
+        .drop_nat = READ_COUNT(ring, drop_nat),
+        .drop_tx_full = READ_COUNT(ring, drop_tx_full),
+        .drop_kernel = READ_COUNT(ring, drop_kernel),
+        .cross_shard = READ_COUNT(ring, cross_shard),
+    };
+    printf("  %-14s rx %10.0f pps  tx %10.0f pps  drops: parse %lu nat %lu tx-full %lu kernel %lu"
+           "  cross-shard %lu\n",
+           label,
+           (now.rx_packets - last->rx_packets) / interval,
+           (now.tx_packets - last->tx_packets) / interval,
+           now.drop_parse, now.drop_nat, now.drop_tx_full, now.drop_kernel, now.cross_shard);
+    *last = now;
+}
+
+/* A restored engine only fits if it has the same pool, in order, and one shard per worker. */
+static int snapshot_matches(const cgnat_t *cgnat, const char **public_ips, int num_public) {
+    if (cgnat->num_shards != num_workers || cgnat->num_public_ips != num_public) {
+        return 0;
+    }
+    for (int i = 0; i < num_public; i++) {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, public_ips[i], &addr) != 1 || ntohl(addr.s_addr) != cgnat->public_ips[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int open_rings(void) {
+    for (int w = 0; w < num_workers; w++) {
+        workers[w].id = w;
+        if (ring_open(&workers[w].inside, &inside_port) != 0 ||
+            ring_open(&workers[w].outside, &outside_port) != 0) {
+            fprintf(stderr, "[CGNAT] Dataplane needs CAP_NET_RAW and TPACKET_V3 (Linux 4.11+)\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void start_workers(void) {
+    for (int w = 0; w < num_workers; w++) {
+        workers[w].started = pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]) == 0;
+    }
+    printf("[CGNAT] Dataplane running: inside %s, outside %s, %d worker%s\n",
+           inside_port.name, outside_port.name, num_workers, num_workers == 1 ? "" : "s");
+}
+
+/*
+ * Standby: follow the active unit until it has been in sync and then silent
+ * for STANDBY_TAKEOVER_SECONDS (it sends a heartbeat every second), then
+ * take over. The engine expires nothing meanwhile; the active unit's
+ * deletes do that.
+ */
+static void wait_for_takeover(ha_sync_t *sync) {
+    int was_synced = 0;
+    while (running) {
+        sleep(1);
+        ha_sync_stats_t stats;
+        ha_sync_get_stats(sync, &stats);
+        was_synced |= stats.synced;
+        if (was_synced && stats.silent_ms >= STANDBY_TAKEOVER_SECONDS * 1000) {
+            printf("[CGNAT] Active unit silent for %lu ms, taking over\n", stats.silent_ms);
+            ha_sync_promote(sync);
+            return;
+        }
+    }
+    ha_sync_stop(sync);
+}
+
+/*
+ * Tear down whatever main() got as far as starting. A snapshot is only
+ * written, and statistics only printed, after a run that started cleanly.
+ */
+static int shutdown_dataplane(ha_sync_t *sync, event_log_t *event_log, const char *snapshot_path, int status) {
+    for (int w = 0; w < num_workers; w++) {
+        if (workers[w].started) {
+            pthread_join(workers[w].thread, NULL);
+        }
+        ring_close(&workers[w].inside);
+        ring_close(&workers[w].outside);
+    }
+    ha_sync_stop(sync);
+    if (event_log) {
+        event_log_sync(event_log);
+    }
+    if (status == 0) {
+        if (snapshot_path) {
+            cgnat_snapshot_save(cgnat, snapshot_path);
+        }
+        cgnat_print_stats(cgnat);
+    }
+    cgnat_set_event_log(cgnat, NULL);
+    event_log_close(event_log);
+    cgnat_destroy(cgnat);
+    return status;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -i <inside-if> -o <outside-if> -p <public-ip> [-p ...]\n"
+            "          --inside-peer <mac> --outside-peer <mac> [-w workers] [-m sessions] [-s seconds]\n"
+            "          [-L log-path] [-S snapshot-path [-C seconds]] [--sync-listen endpoint | --standby endpoint]\n"
+            "  --inside-peer   next-hop MAC for frames sent towards subscribers\n"
+            "  --outside-peer  next-hop MAC for frames sent towards the Internet\n"
+            "  -w              worker threads, one engine shard each (default 1)\n"
+            "  -m              session capacity (default %d)\n"
+            "  -s              stats interval in seconds (default 1)\n"
+            "  -L              write the mapping event log to <log-path>.NNNNNN\n"
+            "  -S              restore sessions from <snapshot-path> if it exists, save them there on exit\n"
+            "  -C              also save a snapshot every <seconds> while running (default 0: only on exit)\n"
+            "  --sync-listen   serve session state to a standby on unix:<path>, <host>:<port> or <port>\n"
+            "  --standby       follow the active unit at <endpoint> and only start forwarding once it has\n"
+            "                  been silent for %d s\n",
+            prog, MAX_NAT_ENTRIES, STANDBY_TAKEOVER_SECONDS);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "inside", required_argument, NULL, 'i' },
+        { "outside", required_argument, NULL, 'o' },
+        { "public-ip", required_argument, NULL, 'p' },
+        { "inside-peer", required_argument, NULL, 'I' },
+        { "outside-peer", required_argument, NULL, 'O' },
+        { "workers", required_argument, NULL, 'w' },
+        { "max-sessions", required_argument, NULL, 'm' },
+        { "stats-interval", required_argument, NULL, 's' },
+        { "event-log", required_argument, NULL, 'L' },
+        { "snapshot", required_argument, NULL, 'S' },
+        { "checkpoint-interval", required_argument, NULL, 'C' },
+        { "sync-listen", required_argument, NULL, 'A' },
+        { "standby", required_argument, NULL, 'B' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *inside_name = NULL, *outside_name = NULL;
+    const char **public_ips = calloc((size_t)argc, sizeof(char*));
+    int num_public = 0;
+    cgnat_config_t config;
+    cgnat_config_default(&config);
+    int have_inside_peer = 0, have_outside_peer = 0;
+    int interval = 1;
+    const char *log_path = NULL;
+    event_log_t *event_log = NULL;
+    const char *snapshot_path = NULL;
+    int checkpoint_interval = 0;
+    const char *sync_listen = NULL, *standby_of = NULL;
+    ha_sync_t *sync = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "i:o:p:w:m:s:L:S:C:", options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': inside_name = optarg; break;
+            case 'o': outside_name = optarg; break;
+            case 'p': public_ips[num_public++] = optarg; break;
+            case 'I': have_inside_peer = parse_mac(optarg, inside_port.peer_mac) == 0; break;
+            case 'O': have_outside_peer = parse_mac(optarg, outside_port.peer_mac) == 0; break;
+            case 'w': num_workers = atoi(optarg); break;
+            case 'm': config.max_sessions = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 's': interval = atoi(optarg); break;
+            case 'L': log_path = optarg; break;
+            case 'S': snapshot_path = optarg; break;
+            case 'C': checkpoint_interval = atoi(optarg); break;
+            case 'A': sync_listen = optarg; break;
+            case 'B': standby_of = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (!inside_name || !outside_name || num_public == 0 || !have_inside_peer || !have_outside_peer ||
+        num_workers < 1 || num_workers > MAX_WORKERS || interval < 1 || checkpoint_interval < 0 ||
+        (checkpoint_interval && !snapshot_path) || (sync_listen && standby_of)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (port_lookup(&inside_port, inside_name) != 0 || port_lookup(&outside_port, outside_name) != 0) {
+        return 1;
+    }
+    inside_port.fanout_id = getpid() & 0xFFFF;
+    outside_port.fanout_id = (getpid() + 1) & 0xFFFF;
+    inside_port.outbound = 1;
+
+    config.num_shards = num_workers;
+    config.max_public_ips = num_public;
+    int restored = snapshot_path && access(snapshot_path, F_OK) == 0;
+    cgnat = restored ? cgnat_restore(snapshot_path, 0) : cgnat_init_config(&config);
+    if (!cgnat) {
+        return 1;
+    }
+    if (restored && !snapshot_matches(cgnat, public_ips, num_public)) {
+        fprintf(stderr, "[CGNAT] Snapshot %s was saved with other public IPs or worker count; "
+                "move it aside to start empty\n", snapshot_path);
+        return shutdown_dataplane(NULL, NULL, NULL, 1);
+    }
+    if (log_path) {
+        event_log_config_t log_config;
+        event_log_config_default(&log_config);
+        log_config.path = log_path;
+        event_log = event_log_open(&log_config, num_workers);
+        if (!event_log || cgnat_set_event_log(cgnat, event_log) != 0) {
+            return shutdown_dataplane(NULL, event_log, NULL, 1);
+        }
+    }
+    for (int i = 0; i < num_public && !restored; i++) {
+        if (cgnat_add_public_ip(cgnat, public_ips[i]) != 0) {
+            return shutdown_dataplane(NULL, event_log, NULL, 1);
+        }
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (sync_listen || standby_of) {
+        ha_sync_config_t sync_config;
+        ha_sync_config_default(&sync_config);
+        sync = sync_listen ? ha_sync_serve(cgnat, sync_listen, &sync_config) : ha_sync_follow(cgnat, standby_of);
+        if (!sync) {
+            return shutdown_dataplane(NULL, event_log, NULL, 1);
+        }
+    }
+    /*
+     * A standby only opens its rings once it takes over, or it would forward
+     * frames that queued up in them while the active unit handled them.
+     */
+    if (standby_of) {
+        wait_for_takeover(sync);
+        sync = NULL;
+    }
+    if (running) {
+        if (open_rings() != 0) {
+            return shutdown_dataplane(sync, event_log, NULL, 1);
+        }
+        start_workers();
+    }
+
+    ring_counters_t last_inside[MAX_WORKERS] = {{0}};
+    ring_counters_t last_outside[MAX_WORKERS] = {{0}};
+    int since_checkpoint = 0;
+    while (running) {
+        for (int t = 0; t < interval && running; t++) {
+            sleep(1);
+            cgnat_cleanup_expired(cgnat);
+            if (checkpoint_interval && ++since_checkpoint >= checkpoint_interval) {
+                cgnat_snapshot_save(cgnat, snapshot_path);
+                since_checkpoint = 0;
+            }
+        }
+        printf("[CGNAT] Ring counters:\n");
+        for (int w = 0; w < num_workers; w++) {
+            char label[32];
+            poll_kernel_drops(&workers[w].inside);
+            poll_kernel_drops(&workers[w].outside);
+            snprintf(label, sizeof(label), "w%d/%s", w, inside_port.name);
+            print_ring(label, &workers[w].inside, &last_inside[w], interval);
+            snprintf(label, sizeof(label), "w%d/%s", w, outside_port.name);
+            print_ring(label, &workers[w].outside, &last_outside[w], interval);
+        }
+        fflush(stdout);
+    }
+
+    return shutdown_dataplane(sync, event_log, snapshot_path, 0);
+}
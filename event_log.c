@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include "event_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Encoded records gathered before one write(2). */
+#define WRITE_BUFFER_RECORDS 8192
+#define IDLE_SLEEP_NS 1000000
+
+struct event_log {
+    char *path;
+    event_log_config_t config;
+    int num_rings;
+    event_ring_t *rings;
+    event_record_t *storage;
+
+    pthread_t writer;
+    int writer_started;
+    int stop;
+    uint64_t sync_requested;
+    uint64_t sync_done;
+
+    int fd;
+    uint32_t sequence;
+    uint64_t file_bytes;
+    uint8_t *buf;
+    size_t buf_used;
+    uint64_t buf_since_ns;      /* when the oldest buffered record was taken */
+
+    uint64_t written;
+    uint64_t write_errors;
+    uint64_t bytes;
+    uint32_t files;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void put16le(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32le(uint8_t *p, uint32_t v) {
+    put16le(p, (uint16_t)v);
+    put16le(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put64le(uint8_t *p, uint64_t v) {
+    put32le(p, (uint32_t)v);
+    put32le(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get16le(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32le(const uint8_t *p) {
+    return get16le(p) | (uint32_t)get16le(p + 2) << 16;
+}
+
+static uint64_t get64le(const uint8_t *p) {
+    return get32le(p) | (uint64_t)get32le(p + 4) << 32;
+}
+
+_Static_assert(sizeof(event_record_t) == EVENT_LOG_RECORD_SIZE, "record layout must match the file format");
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+static void encode_record(uint8_t *p, const event_record_t *r) {
+    put32le(p, r->time);
+    p[4] = r->type;
+    p[5] = r->protocol;
+    put16le(p + 6, r->priv_port);
+    put32le(p + 8, r->priv_ip);
+    put32le(p + 12, r->pub_ip);
+    put16le(p + 16, r->pub_port);
+    put16le(p + 18, r->port_count);
+    put32le(p + 20, r->remote_ip);
+    put16le(p + 24, r->remote_port);
+    put16le(p + 26, r->shard);
+    put32le(p + 28, 0);
+}
+#endif
+
+void event_log_decode_record(const uint8_t *p, event_record_t *r) {
+    r->time = get32le(p);
+    r->type = p[4];
+    r->protocol = p[5];
+    r->priv_port = get16le(p + 6);
+    r->priv_ip = get32le(p + 8);
+    r->pub_ip = get32le(p + 12);
+    r->pub_port = get16le(p + 16);
+    r->port_count = get16le(p + 18);
+    r->remote_ip = get32le(p + 20);
+    r->remote_port = get16le(p + 24);
+    r->shard = get16le(p + 26);
+}
+
+int event_log_decode_header(const uint8_t *p, uint64_t *created, uint32_t *sequence) {
+    if (memcmp(p, EVENT_LOG_MAGIC, 8) != 0 || get16le(p + 8) != EVENT_LOG_VERSION ||
+        get16le(p + 10) != EVENT_LOG_RECORD_SIZE) {
+        return -1;
+    }
+    *created = get64le(p + 16);
+    *sequence = get32le(p + 24);
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void file_name(const event_log_t *log, uint32_t sequence, char *name, size_t size) {
+    snprintf(name, size, "%s.%06u", log->path, sequence);
+}
+
+/* Continue numbering after the newest file already present for this path. */
+static uint32_t first_sequence(const char *path) {
+    char *dir_copy = strdup(path), *base_copy = strdup(path);
+    const char *dir = dirname(dir_copy), *base = basename(base_copy);
+    size_t base_len = strlen(base);
+    uint32_t next = 0;
+
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        char *end;
+        if (strncmp(de->d_name, base, base_len) != 0 || de->d_name[base_len] != '.') {
+            continue;
+        }
+        unsigned long seq = strtoul(de->d_name + base_len + 1, &end, 10);
+        if (*end == '\0' && end != de->d_name + base_len + 1 && seq + 1 > next) {
+            next = (uint32_t)(seq + 1);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    free(dir_copy);
+    free(base_copy);
+    return next;
+}
+
+static int open_file(event_log_t *log) {
+    char name[4096];
+    file_name(log, log->sequence, name, sizeof(name));
+    log->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0640);
+    if (log->fd < 0) {
+        fprintf(stderr, "[CGNAT] Cannot open event log %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    uint8_t header[EVENT_LOG_HEADER_SIZE] = {0};
+    memcpy(header, EVENT_LOG_MAGIC, 8);
+    put16le(header + 8, EVENT_LOG_VERSION);
+    put16le(header + 10, EVENT_LOG_RECORD_SIZE);
+    put64le(header + 16, (uint64_t)time(NULL));
+    put32le(header + 24, log->sequence);
+    if (write_all(log->fd, header, sizeof(header)) != 0) {
+        __atomic_store_n(&log->write_errors, log->write_errors + 1, __ATOMIC_RELAXED);
+    }
+    log->file_bytes = sizeof(header);
+    __atomic_store_n(&log->files, log->files + 1, __ATOMIC_RELAXED);
+
+    if (log->config.max_files > 0 && log->sequence >= (uint32_t)log->config.max_files) {
+        file_name(log, log->sequence - (uint32_t)log->config.max_files, name, sizeof(name));
+        unlink(name);
+    }
+    return 0;
+}
+
+static void rotate(event_log_t *log) {
+    close(log->fd);
+    log->sequence++;
+    open_file(log);
+}
+
+static void flush_buffer(event_log_t *log) {
+    if (log->buf_used == 0) {
+        return;
+    }
+    if (log->file_bytes + log->buf_used > log->config.rotate_bytes &&
+        log->file_bytes > EVENT_LOG_HEADER_SIZE) {
+        rotate(log);
+    }
+    if (log->fd >= 0 && write_all(log->fd, log->buf, log->buf_used) == 0) {
+        log->file_bytes += log->buf_used;
+        __atomic_store_n(&log->bytes, log->bytes + log->buf_used, __ATOMIC_RELAXED);
+        __atomic_store_n(&log->written, log->written + log->buf_used / EVENT_LOG_RECORD_SIZE,
+                         __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&log->write_errors, log->write_errors + 1, __ATOMIC_RELAXED);
+    }
+    log->buf_used = 0;
+}
+
+/* Move everything published so far out of one ring; returns records taken. */
+static size_t drain_ring(event_log_t *log, event_ring_t *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    size_t taken = (size_t)(head - tail);
+    const size_t capacity = (size_t)WRITE_BUFFER_RECORDS * EVENT_LOG_RECORD_SIZE;
+
+    if (taken > 0 && log->buf_used == 0) {
+        log->buf_since_ns = monotonic_ns();
+    }
+    if (log->config.sink) {
+        /* Hand the sink each contiguous run while the slots are still ours. */
+        for (uint64_t t = tail; t != head; ) {
+            size_t n = ring->mask + 1 - (size_t)(t & ring->mask);
+            n = n < head - t ? n : (size_t)(head - t);
+            log->config.sink(log->config.sink_ctx, &ring->records[t & ring->mask], n);
+            t += n;
+        }
+    }
+    while (tail != head) {
+        if (log->buf_used == capacity) {
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            flush_buffer(log);
+            log->buf_since_ns = monotonic_ns();
+        }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        /* Copy up to the ring's wrap point or the buffer's end in one go. */
+        size_t n = head - tail;
+        size_t to_wrap = ring->mask + 1 - (size_t)(tail & ring->mask);
+        size_t room = (capacity - log->buf_used) / EVENT_LOG_RECORD_SIZE;
+        n = n < to_wrap ? n : to_wrap;
+        n = n < room ? n : room;
+        memcpy(log->buf + log->buf_used, &ring->records[tail & ring->mask], n * EVENT_LOG_RECORD_SIZE);
+#else
+        size_t n = 1;
+        encode_record(log->buf + log->buf_used, &ring->records[tail & ring->mask]);
+#endif
+        log->buf_used += n * EVENT_LOG_RECORD_SIZE;
+        tail += n;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return taken;
+}
+
+static void* writer_main(void *arg) {
+    event_log_t *log = (event_log_t*)arg;
+    const uint64_t flush_ns = (uint64_t)log->config.flush_ms * 1000000ull;
+
+    for (;;) {
+        int stopping = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+        uint64_t sync = __atomic_load_n(&log->sync_requested, __ATOMIC_ACQUIRE);
+        size_t taken = 0;
+        for (int r = 0; r < log->num_rings; r++) {
+            taken += drain_ring(log, &log->rings[r]);
+        }
+        if (log->buf_used > 0 && monotonic_ns() - log->buf_since_ns >= flush_ns) {
+            flush_buffer(log);
+        }
+        /* Keep going without a pause only while producers are outrunning us. */
+        if (taken >= WRITE_BUFFER_RECORDS) {
+            continue;
+        }
+        if (sync != log->sync_done) {
+            flush_buffer(log);
+            __atomic_store_n(&log->sync_done, sync, __ATOMIC_RELEASE);
+        }
+        if (stopping && taken == 0) {
+            break;
+        }
+        struct timespec idle = { 0, IDLE_SLEEP_NS };
+        nanosleep(&idle, NULL);
+    }
+    flush_buffer(log);
+    return NULL;
+}
+
+void event_log_config_default(event_log_config_t *config) {
+    config->path = "cgnat-events";
+    config->ring_records = 1u << 16;
+    config->rotate_bytes = 64ull << 20;
+    config->max_files = 0;
+    config->flush_ms = 200;
+    config->sink = NULL;
+    config->sink_ctx = NULL;
+}
+
+event_log_t* event_log_open(const event_log_config_t *config, int num_rings) {
+    uint32_t size = 1;
+    while (size < config->ring_records && size < (1u << 30)) {
+        size <<= 1;
+    }
+    if (num_rings < 1 || config->rotate_bytes < EVENT_LOG_HEADER_SIZE || config->flush_ms < 0) {
+        fprintf(stderr, "[CGNAT] Invalid event log configuration\n");
+        return NULL;
+    }
+
+    event_log_t *log = calloc(1, sizeof(event_log_t));
+    if (!log) {
+        return NULL;
+    }
+    log->config = *config;
+    log->path = strdup(config->path);
+    log->num_rings = num_rings;
+    log->rings = aligned_alloc(64, sizeof(event_ring_t) * (size_t)num_rings);
+    log->storage = calloc((size_t)num_rings * size, sizeof(event_record_t));
+    log->buf = malloc((size_t)WRITE_BUFFER_RECORDS * EVENT_LOG_RECORD_SIZE);
+    log->fd = -1;
+    if (!log->path || !log->rings || !log->storage || !log->buf) {
+        fprintf(stderr, "[CGNAT] Failed to allocate event log rings\n");
+        event_log_close(log);
+        return NULL;
+    }
+    memset(log->rings, 0, sizeof(event_ring_t) * (size_t)num_rings);
+    for (int r = 0; r < num_rings; r++) {
+        log->rings[r].records = log->storage + (size_t)r * size;
+        log->rings[r].mask = size - 1;
+    }
+
+    log->sequence = first_sequence(log->path);
+    if (open_file(log) != 0) {
+        event_log_close(log);
+        return NULL;
+    }
+    if (pthread_create(&log->writer, NULL, writer_main, log) != 0) {
+        fprintf(stderr, "[CGNAT] Failed to start event log writer\n");
+        event_log_close(log);
+        return NULL;
+    }
+    log->writer_started = 1;
+
+    char name[4096];
+    file_name(log, log->sequence, name, sizeof(name));
+    printf("[CGNAT] Event log: writing %s, %u records per ring, rotating at %.0f MB\n",
+           name, size, log->config.rotate_bytes / 1048576.0);
+    return log;
+}
+
+void event_log_close(event_log_t *log) {
+    if (!log) return;
+    if (log->writer_started) {
+        __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(log->writer, NULL);
+    }
+    if (log->fd >= 0) {
+        fsync(log->fd);
+        close(log->fd);
+    }
+    free(log->buf);
+    free(log->storage);
+    free(log->rings);
+    free(log->path);
+    free(log);
+}
+
+void event_log_sync(event_log_t *log) {
+    uint64_t ticket = __atomic_add_fetch(&log->sync_requested, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&log->sync_done, __ATOMIC_ACQUIRE) < ticket) {
+        struct timespec wait = { 0, IDLE_SLEEP_NS };
+        nanosleep(&wait, NULL);
+    }
+}
+
+event_ring_t* event_log_ring(event_log_t *log, int ring) {
+    return ring >= 0 && ring < log->num_rings ? &log->rings[ring] : NULL;
+}
+
+void event_log_get_stats(event_log_t *log, event_log_stats_t *stats) {
+    stats->written = __atomic_load_n(&log->written, __ATOMIC_RELAXED);
+    stats->write_errors = __atomic_load_n(&log->write_errors, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&log->bytes, __ATOMIC_RELAXED);
+    stats->files = __atomic_load_n(&log->files, __ATOMIC_RELAXED);
+    stats->dropped = 0;
+    for (int r = 0; r < log->num_rings; r++) {
+        stats->dropped += __atomic_load_n(&log->rings[r].dropped, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "spsc_ring.h"
+
+/*
+ * Binary mapping log. The translation path pushes fixed-size records into a
+ * single-producer ring per engine shard (the shard lock already makes each
+ * shard's producer single) and never waits: a full ring drops the record and
+ * counts it. One writer thread drains every ring, encodes the records and
+ * appends them in large writes to size-rotated files.
+ *
+ * On disk, every file starts with a 32-byte header followed by 32-byte
+ * records, all fields little-endian:
+ *
+ *   header:  magic "CGNATLOG", u16 version, u16 record size, u32 reserved,
+ *            u64 creation time (unix seconds), u32 file sequence, u32 reserved
+ *   record:  u32 time, u8 type, u8 protocol, u16 private port,
+ *            u32 private ip, u32 public ip, u16 public port, u16 port count,
+ *            u32 remote ip, u16 remote port, u16 shard, u32 reserved
+ *
+ * Session records carry a port count of 1. Block records carry the first
+ * port of the block and its size, and no protocol, private port or remote.
+ */
+#define EVENT_LOG_MAGIC "CGNATLOG"
+#define EVENT_LOG_VERSION 1
+#define EVENT_LOG_HEADER_SIZE 32
+#define EVENT_LOG_RECORD_SIZE 32
+
+typedef enum {
+    EVENT_SESSION_CREATE = 1,
+    EVENT_SESSION_DELETE,
+    EVENT_BLOCK_ALLOC,
+    EVENT_BLOCK_RELEASE
+} event_type_t;
+
+typedef struct {
+    uint32_t time;
+    uint8_t type;
+    uint8_t protocol;
+    uint16_t priv_port;
+    uint32_t priv_ip;
+    uint32_t pub_ip;
+    uint16_t pub_port;
+    uint16_t port_count;
+    uint32_t remote_ip;
+    uint16_t remote_port;
+    uint16_t shard;
+    uint32_t reserved;
+} event_record_t;     /* same layout as on disk, so little-endian hosts copy it as is */
+
+SPSC_RING_DEFINE(event_ring, event_record_t)
+
+typedef struct {
+    const char *path;           /* files are <path>.<sequence> */
+    uint32_t ring_records;      /* per shard, rounded up to a power of two */
+    uint64_t rotate_bytes;      /* start a new file past this size */
+    int max_files;              /* delete older files beyond this many, 0 keeps all */
+    int flush_ms;               /* longest a record waits in a ring when traffic is light */
+    /*
+     * Optional consumer called on the writer thread with every batch of
+     * records as it leaves a ring, before it is written out. It must keep up:
+     * the rings fill while it runs.
+     */
+    void (*sink)(void *ctx, const event_record_t *records, size_t count);
+    void *sink_ctx;
+} event_log_config_t;
+
+typedef struct {
+    uint64_t written;           /* records on disk */
+    uint64_t dropped;           /* records lost to full rings */
+    uint64_t write_errors;
+    uint64_t bytes;
+    uint32_t files;             /* files opened so far */
+} event_log_stats_t;
+
+typedef struct event_log event_log_t;
+
+void event_log_config_default(event_log_config_t *config);
+
+/* Opens the first file and starts the writer thread. NULL on failure. */
+event_log_t* event_log_open(const event_log_config_t *config, int num_rings);
+
+/* Drains every ring, closes the current file and stops the writer. */
+void event_log_close(event_log_t *log);
+
+/* Wait until every record pushed before the call is written out. */
+void event_log_sync(event_log_t *log);
+
+event_ring_t* event_log_ring(event_log_t *log, int ring);
+void event_log_get_stats(event_log_t *log, event_log_stats_t *stats);
+
+/* Decoder side: parse one on-disk header or record. */
+int event_log_decode_header(const uint8_t *buf, uint64_t *created, uint32_t *sequence);
+void event_log_decode_record(const uint8_t *buf, event_record_t *record);
+
+#endif
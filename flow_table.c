@@ -0,0 +1,293 @@
+#include "flow_table.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY 0x00
+#define CTRL_DELETED 0x01
+#define CTRL_FULL 0x80
+#define OVERFLOW_STICKY 0xFF
+
+static uint32_t max_load(uint32_t capacity) {
+    return capacity - capacity / 8;
+}
+
+/* Bit i set when control byte i equals tag. */
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < FT_GROUP_SIZE; i++) {
+        mask |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+/* Bit i set when slot i is empty or deleted (high bit clear). */
+static inline uint32_t group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(group) ^ 0xFFFF;
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < FT_GROUP_SIZE; i++) {
+        mask |= (uint32_t)(ctrl[i] < CTRL_FULL) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline uint8_t hash_tag(uint64_t hash) {
+    return CTRL_FULL | (uint8_t)(hash & 0x7F);
+}
+
+static inline uint32_t hash_group(uint64_t hash) {
+    return (uint32_t)(hash >> 7);
+}
+
+uint64_t flow_table_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline uint8_t* slot_at(const flow_table_t *table, size_t i) {
+    return table->slots + i * table->slot_size;
+}
+
+static inline int is_wide(const flow_table_t *table) {
+    return table->slot_size == sizeof(ft_wide_slot_t);
+}
+
+static inline int slot_matches(const flow_table_t *table, const uint8_t *slot, flow_key_t key) {
+    if (((const ft_slot_t*)slot)->key != key.lo) {
+        return 0;
+    }
+    return is_wide(table) ? ((const ft_wide_slot_t*)slot)->key_hi == key.hi : key.hi == 0;
+}
+
+static inline uint32_t slot_value(const flow_table_t *table, const uint8_t *slot) {
+    return is_wide(table) ? ((const ft_wide_slot_t*)slot)->value : ((const ft_slot_t*)slot)->value;
+}
+
+static inline void slot_store(const flow_table_t *table, uint8_t *slot, flow_key_t key, uint32_t value) {
+    if (is_wide(table)) {
+        ((ft_wide_slot_t*)slot)->key = key.lo;
+        ((ft_wide_slot_t*)slot)->key_hi = key.hi;
+        ((ft_wide_slot_t*)slot)->value = value;
+    } else {
+        ((ft_slot_t*)slot)->key = key.lo;
+        ((ft_slot_t*)slot)->value = value;
+    }
+}
+
+static int alloc_arrays(flow_table_t *table, uint32_t capacity) {
+    table->ctrl = aligned_alloc(64, capacity);
+    table->slots = malloc((size_t)capacity * table->slot_size);
+    table->overflow = calloc(capacity / FT_GROUP_SIZE, 1);
+    if (!table->ctrl || !table->slots || !table->overflow) {
+        free(table->ctrl);
+        free(table->slots);
+        free(table->overflow);
+        return -1;
+    }
+    memset(table->ctrl, CTRL_EMPTY, capacity);
+    table->owns_storage = 1;
+    table->capacity = capacity;
+    table->group_mask = capacity / FT_GROUP_SIZE - 1;
+    table->size = 0;
+    return 0;
+}
+
+static uint32_t capacity_for(uint32_t max_entries) {
+    uint32_t capacity = FT_GROUP_SIZE;
+    while (capacity / 2 < max_entries) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static uint32_t slot_size_for(int wide) {
+    return wide ? sizeof(ft_wide_slot_t) : sizeof(ft_slot_t);
+}
+
+int flow_table_init(flow_table_t *table, uint32_t max_entries) {
+    table->slot_size = slot_size_for(0);
+    return alloc_arrays(table, capacity_for(max_entries));
+}
+
+size_t flow_table_storage_size(uint32_t max_entries, int wide) {
+    uint32_t capacity = capacity_for(max_entries);
+    return (size_t)capacity * (1 + slot_size_for(wide)) + capacity / FT_GROUP_SIZE;
+}
+
+void flow_table_init_storage(flow_table_t *table, uint32_t max_entries, void *storage, int wide) {
+    uint32_t capacity = capacity_for(max_entries);
+    /* Zeroed control bytes are all empty, so nothing here touches storage. */
+    table->ctrl = storage;
+    table->slots = (uint8_t*)storage + capacity;
+    table->slot_size = slot_size_for(wide);
+    table->overflow = table->slots + (size_t)capacity * table->slot_size;
+    table->owns_storage = 0;
+    table->capacity = capacity;
+    table->group_mask = capacity / FT_GROUP_SIZE - 1;
+    table->size = 0;
+}
+
+void flow_table_free(flow_table_t *table) {
+    if (table->owns_storage) {
+        free(table->ctrl);
+        free(table->slots);
+        free(table->overflow);
+    }
+    table->ctrl = NULL;
+    table->slots = NULL;
+    table->overflow = NULL;
+}
+
+void flow_table_clear(flow_table_t *table) {
+    memset(table->ctrl, CTRL_EMPTY, table->capacity);
+    memset(table->overflow, 0, table->capacity / FT_GROUP_SIZE);
+    table->size = 0;
+}
+
+static uint8_t* find_slot(const flow_table_t *table, flow_key_t key, uint64_t hash) {
+    uint8_t tag = hash_tag(hash);
+    uint32_t group = hash_group(hash) & table->group_mask;
+
+    for (uint32_t step = 1; step <= table->group_mask + 1; step++) {
+        const uint8_t *ctrl = table->ctrl + (size_t)group * FT_GROUP_SIZE;
+        size_t base = (size_t)group * FT_GROUP_SIZE;
+
+        uint32_t match = group_match(ctrl, tag);
+        while (match) {
+            uint8_t *slot = slot_at(table, base + __builtin_ctz(match));
+            if (slot_matches(table, slot, key)) {
+                return slot;
+            }
+            match &= match - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            return NULL;
+        }
+        group = (group + step) & table->group_mask;
+    }
+    return NULL;
+}
+
+uint32_t flow_table_find_key(const flow_table_t *table, flow_key_t key, uint64_t hash) {
+    const uint8_t *slot = find_slot(table, key, hash);
+    return slot ? slot_value(table, slot) : FT_NOT_FOUND;
+}
+
+uint32_t flow_table_find(const flow_table_t *table, uint64_t key, uint64_t hash) {
+    flow_key_t wide_key = { key, 0 };
+    return flow_table_find_key(table, wide_key, hash);
+}
+
+static void place(flow_table_t *table, flow_key_t key, uint64_t hash, uint32_t value) {
+    uint32_t group = hash_group(hash) & table->group_mask;
+
+    for (uint32_t step = 1; ; step++) {
+        uint8_t *ctrl = table->ctrl + (size_t)group * FT_GROUP_SIZE;
+        uint32_t free_mask = group_match_free(ctrl);
+        if (free_mask) {
+            int i = __builtin_ctz(free_mask);
+            ctrl[i] = hash_tag(hash);
+            slot_store(table, slot_at(table, (size_t)group * FT_GROUP_SIZE + i), key, value);
+            table->size++;
+            return;
+        }
+        if (table->overflow[group] != OVERFLOW_STICKY) {
+            table->overflow[group]++;
+        }
+        group = (group + step) & table->group_mask;
+    }
+}
+
+int flow_table_insert_key(flow_table_t *table, flow_key_t key, uint64_t hash, uint32_t value) {
+    if (table->size >= max_load(table->capacity)) {
+        return -1;
+    }
+    place(table, key, hash, value);
+    return 0;
+}
+
+int flow_table_insert(flow_table_t *table, uint64_t key, uint64_t hash, uint32_t value) {
+    flow_key_t wide_key = { key, 0 };
+    return flow_table_insert_key(table, wide_key, hash, value);
+}
+
+int flow_table_update_key(flow_table_t *table, flow_key_t key, uint64_t hash, uint32_t value) {
+    uint8_t *slot = find_slot(table, key, hash);
+    if (!slot) {
+        return -1;
+    }
+    slot_store(table, slot, key, value);
+    return 0;
+}
+
+int flow_table_update(flow_table_t *table, uint64_t key, uint64_t hash, uint32_t value) {
+    flow_key_t wide_key = { key, 0 };
+    return flow_table_update_key(table, wide_key, hash, value);
+}
+
+/* A key no longer probes past group: once none does, its tombstones can go. */
+static void release_group(flow_table_t *table, uint32_t group) {
+    uint8_t *count = &table->overflow[group];
+    if (*count == OVERFLOW_STICKY || --*count > 0) {
+        return;
+    }
+    uint8_t *ctrl = table->ctrl + (size_t)group * FT_GROUP_SIZE;
+    uint32_t deleted = group_match(ctrl, CTRL_DELETED);
+    while (deleted) {
+        ctrl[__builtin_ctz(deleted)] = CTRL_EMPTY;
+        deleted &= deleted - 1;
+    }
+}
+
+int flow_table_remove_key(flow_table_t *table, flow_key_t key, uint64_t hash) {
+    uint8_t tag = hash_tag(hash);
+    uint32_t home = hash_group(hash) & table->group_mask;
+    uint32_t group = home;
+
+    for (uint32_t step = 1; step <= table->group_mask + 1; step++) {
+        uint8_t *ctrl = table->ctrl + (size_t)group * FT_GROUP_SIZE;
+        size_t base = (size_t)group * FT_GROUP_SIZE;
+
+        uint32_t match = group_match(ctrl, tag);
+        while (match) {
+            int i = __builtin_ctz(match);
+            if (slot_matches(table, slot_at(table, base + i), key)) {
+                /* Only keys that probed past this group need its slot to read as taken. */
+                ctrl[i] = table->overflow[group] ? CTRL_DELETED : CTRL_EMPTY;
+                table->size--;
+                /* Walk the groups this key was placed past. */
+                for (uint32_t back = 1, g = home; back < step; back++) {
+                    release_group(table, g);
+                    g = (g + back) & table->group_mask;
+                }
+                return 0;
+            }
+            match &= match - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            return -1;
+        }
+        group = (group + step) & table->group_mask;
+    }
+    return -1;
+}
+
+int flow_table_remove(flow_table_t *table, uint64_t key, uint64_t hash) {
+    flow_key_t wide_key = { key, 0 };
+    return flow_table_remove_key(table, wide_key, hash);
+}
@@ -0,0 +1,102 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Open-addressing flow index in the style of a Swiss table. Slots are grouped
+ * sixteen at a time; each group has one control byte per slot holding a 7-bit
+ * tag of the hash, so a probe compares all sixteen tags with one SSE2
+ * instruction and only touches a slot's key on a tag match. Keys and values
+ * are stored inline, values are 32-bit indices into the caller's table.
+ *
+ * Control bytes: 0x00 empty, 0x01 deleted, 0x80 | tag full. Zeroed memory is
+ * therefore an empty table.
+ *
+ * Each group also counts the live keys whose probe passed over it while it
+ * was full. A removal leaves a tombstone only in a group with such keys, and
+ * steps the counts back down along its own probe; a group that reaches zero
+ * turns its tombstones back to empty on the spot. Tombstones never pile up,
+ * so the table is never rebuilt and inserts never allocate.
+ *
+ * Keys are 64-bit by default. A wide table stores 128-bit keys for tuples
+ * that do not pack into 64 bits; narrow tables treat the high half as zero.
+ */
+#define FT_GROUP_SIZE 16
+#define FT_NOT_FOUND 0xFFFFFFFFu
+
+typedef struct {
+    uint64_t key;
+    uint32_t value;
+} __attribute__((packed)) ft_slot_t;
+
+typedef struct {
+    uint64_t key;
+    uint64_t key_hi;
+    uint32_t value;
+} __attribute__((packed)) ft_wide_slot_t;
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} flow_key_t;
+
+typedef struct {
+    uint8_t *ctrl;
+    uint8_t *slots;         /* ft_slot_t or ft_wide_slot_t */
+    uint8_t *overflow;      /* per group: live keys probed past it, sticky at 255 */
+    uint32_t slot_size;
+    uint32_t group_mask;
+    uint32_t capacity;
+    uint32_t size;
+    int owns_storage;
+} flow_table_t;
+
+/*
+ * Size the table for max_entries live keys at a load factor of at most 1/2,
+ * so probes stay short at the session limit. Inserts past that still work
+ * up to 7/8 of capacity.
+ */
+int flow_table_init(flow_table_t *table, uint32_t max_entries);
+void flow_table_free(flow_table_t *table);
+/* Drop every entry, keeping the capacity. */
+void flow_table_clear(flow_table_t *table);
+
+/*
+ * Same table over caller-provided storage: flow_table_storage_size bytes,
+ * 64-byte aligned and zeroed. flow_table_free leaves the storage alone.
+ * wide selects 128-bit keys.
+ */
+size_t flow_table_storage_size(uint32_t max_entries, int wide);
+void flow_table_init_storage(flow_table_t *table, uint32_t max_entries, void *storage, int wide);
+
+uint64_t flow_table_hash(uint64_t key);
+
+/* Equals flow_table_hash(key.lo) when key.hi is zero. */
+static inline uint64_t flow_table_hash_key(flow_key_t key) {
+    return flow_table_hash(key.lo + key.hi * 0x9E3779B97F4A7C15ULL);
+}
+
+/* Start pulling in the group a lookup for hash will probe first. */
+static inline void flow_table_prefetch(const flow_table_t *table, uint64_t hash) {
+    uint32_t group = (uint32_t)(hash >> 7) & table->group_mask;
+    __builtin_prefetch(table->ctrl + (size_t)group * FT_GROUP_SIZE);
+    __builtin_prefetch(table->slots + (size_t)group * FT_GROUP_SIZE * table->slot_size);
+}
+
+uint32_t flow_table_find(const flow_table_t *table, uint64_t key, uint64_t hash);
+
+/* Insert a key known to be absent. Returns -1 if the table is full. */
+int flow_table_insert(flow_table_t *table, uint64_t key, uint64_t hash, uint32_t value);
+/* Rewrite the value of a present key in place. Returns -1 if it is absent. */
+int flow_table_update(flow_table_t *table, uint64_t key, uint64_t hash, uint32_t value);
+int flow_table_remove(flow_table_t *table, uint64_t key, uint64_t hash);
+
+/* The same operations with 128-bit keys, hashed by flow_table_hash_key. */
+uint32_t flow_table_find_key(const flow_table_t *table, flow_key_t key, uint64_t hash);
+int flow_table_insert_key(flow_table_t *table, flow_key_t key, uint64_t hash, uint32_t value);
+int flow_table_update_key(flow_table_t *table, flow_key_t key, uint64_t hash, uint32_t value);
+int flow_table_remove_key(flow_table_t *table, flow_key_t key, uint64_t hash);
+
+#endif
@@ -0,0 +1,770 @@
+#define _GNU_SOURCE
+#include "ha_sync.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define HA_MAGIC "CGNATSYN"
+#define IDLE_SLEEP_NS 1000000
+#define HEARTBEAT_NS 1000000000ull
+#define POLL_MS 200
+#define RECONNECT_MS 1000
+
+#define FRAME_HELLO 'H'
+#define FRAME_CREATE 'C'
+#define FRAME_REFRESH 'R'
+#define FRAME_DELETE 'D'
+#define FRAME_SYNCED 'S'
+#define FRAME_TIME 'T'
+#define FRAME_CHECK 'K'
+
+#define HELLO_SIZE 19       /* without the public IPs */
+#define CREATE_SIZE 25
+#define REFRESH_SIZE 19
+#define DELETE_SIZE 14
+#define SYNCED_SIZE 5
+#define TIME_SIZE 9
+#define CHECK_SIZE 13
+#define FRAME_MAX (HELLO_SIZE + 4 * 0xFFFF)
+/* Both directions buffer whole frames; the largest hello must fit. */
+#define BUFFER_SIZE (FRAME_MAX > 256 * 1024 ? FRAME_MAX : 256 * 1024)
+
+struct ha_sync {
+    cgnat_t *cgnat;
+    ha_sync_config_t config;
+    int standby;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int listen_fd;
+    int fd;
+
+    pthread_t thread;
+    int thread_started;
+    int stop;
+    uint64_t check_requested;
+    uint64_t check_done;
+
+    /* active side */
+    sync_ring_t *rings;
+    sync_record_t *storage;
+    uint8_t *buf;
+    size_t buf_used;
+    int broken;                 /* the standby went away mid-write */
+    uint64_t last_time_ns;
+
+    /* standby side */
+    uint64_t last_frame_ns;
+    uint64_t batch_stamp;       /* unix ns of the last time frame not yet accounted for */
+
+    ha_sync_stats_t stats;      /* written by the thread only */
+};
+
+#define STAT_SET(sync, field, v) __atomic_store_n(&(sync)->stats.field, (v), __ATOMIC_RELAXED)
+#define STAT_ADD(sync, field, n) STAT_SET(sync, field, (sync)->stats.field + (n))
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void idle(void) {
+    struct timespec wait = { 0, IDLE_SLEEP_NS };
+    nanosleep(&wait, NULL);
+}
+
+static uint8_t* put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    return p + 2;
+}
+
+static uint8_t* put32(uint8_t *p, uint32_t v) {
+    return put16(put16(p, (uint16_t)v), (uint16_t)(v >> 16));
+}
+
+static uint8_t* put64(uint8_t *p, uint64_t v) {
+    return put32(put32(p, (uint32_t)v), (uint32_t)(v >> 32));
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t get64(const uint8_t *p) {
+    return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+/* "unix:<path>", "<host>:<port>" or "<port>" on the loopback address. */
+static int parse_endpoint(ha_sync_t *sync, const char *endpoint) {
+    memset(&sync->addr, 0, sizeof(sync->addr));
+    if (strncmp(endpoint, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un*)&sync->addr;
+        if (strlen(endpoint + 5) == 0 || strlen(endpoint + 5) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, endpoint + 5);
+        sync->addr_len = sizeof(*un);
+        return 0;
+    }
+
+    char host[256] = "127.0.0.1";
+    const char *port = endpoint;
+    const char *colon = strrchr(endpoint, ':');
+    if (colon) {
+        size_t len = (size_t)(colon - endpoint);
+        if (len == 0 || len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, endpoint, len);
+        host[len] = '\0';
+        port = colon + 1;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV };
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    memcpy(&sync->addr, res->ai_addr, res->ai_addrlen);
+    sync->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* Frames are batched already; do not let Nagle hold the tail of a batch back. */
+static void set_nodelay(ha_sync_t *sync) {
+    int one = 1;
+    if (sync->addr.ss_family != AF_UNIX) {
+        setsockopt(sync->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+/*
+ * Order-independent digest of every mapping: the sum of a hash of each
+ * session's flow and public address.
+ */
+static uint64_t engine_digest(cgnat_t *cgnat, uint32_t *sessions) {
+    cgnat_session_filter_t all = { 0 };
+    cgnat_session_t batch[CGNAT_LIST_MAX];
+    uint64_t cursor = 0;
+    uint64_t digest = 0;
+    *sessions = 0;
+    while (cursor != CGNAT_CURSOR_END) {
+        int n = cgnat_list_sessions(cgnat, &all, &cursor, batch, CGNAT_LIST_MAX);
+        for (int i = 0; i < n; i++) {
+            const cgnat_session_t *s = &batch[i];
+            uint64_t flow = flow_table_hash(((uint64_t)s->priv_ip << 32) | (uint64_t)s->priv_port << 16 | s->protocol);
+            uint64_t remote = flow_table_hash(((uint64_t)s->remote_ip << 16) | s->remote_port);
+            uint64_t pub = flow_table_hash(((uint64_t)s->pub_ip << 16) | s->pub_port);
+            digest += flow_table_hash(flow ^ remote * 3) ^ pub;
+        }
+        *sessions += (uint32_t)n;
+    }
+    return digest;
+}
+
+/* ---- active side ---- */
+
+static void flush_out(ha_sync_t *sync) {
+    const uint8_t *p = sync->buf;
+    size_t len = sync->buf_used;
+    sync->buf_used = 0;
+    while (len > 0 && !sync->broken) {
+        ssize_t n = send(sync->fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            sync->broken = 1;
+            break;
+        }
+        STAT_ADD(sync, bytes, (uint64_t)n);
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+/* Room for a frame of len bytes at the end of the send buffer, NULL if it can never fit. */
+static uint8_t* frame(ha_sync_t *sync, size_t len) {
+    if (len > BUFFER_SIZE) {
+        fprintf(stderr, "[HA] Frame of %zu bytes exceeds the %d byte buffer\n", len, BUFFER_SIZE);
+        sync->broken = 1;
+        return NULL;
+    }
+    if (sync->buf_used + len > BUFFER_SIZE) {
+        flush_out(sync);
+    }
+    uint8_t *p = sync->buf + sync->buf_used;
+    sync->buf_used += len;
+    return p;
+}
+
+static void put_time(ha_sync_t *sync) {
+    uint8_t *p = frame(sync, TIME_SIZE);
+    if (!p) {
+        return;
+    }
+    *p++ = FRAME_TIME;
+    put64(p, realtime_ns());
+    sync->last_time_ns = monotonic_ns();
+}
+
+static void put_record(ha_sync_t *sync, const sync_record_t *r) {
+    uint8_t *p;
+    switch (r->type) {
+        case SYNC_CREATE:
+        case SYNC_REFRESH:
+            p = frame(sync, r->type == SYNC_CREATE ? CREATE_SIZE : REFRESH_SIZE);
+            if (!p) {
+                return;
+            }
+            *p++ = r->type == SYNC_CREATE ? FRAME_CREATE : FRAME_REFRESH;
+            *p++ = r->protocol;
+            *p++ = r->state;
+            p = put16(put32(p, r->priv_ip), r->priv_port);
+            p = put16(put32(p, r->remote_ip), r->remote_port);
+            if (r->type == SYNC_CREATE) {
+                p = put16(put32(p, r->pub_ip), r->pub_port);
+            }
+            put32(p, r->time);
+            break;
+        case SYNC_DELETE:
+            p = frame(sync, DELETE_SIZE);
+            if (!p) {
+                return;
+            }
+            *p++ = FRAME_DELETE;
+            *p++ = r->protocol;
+            p = put16(put32(p, r->priv_ip), r->priv_port);
+            put16(put32(p, r->remote_ip), r->remote_port);
+            break;
+        default:
+            return;
+    }
+    STAT_ADD(sync, records, 1);
+}
+
+static void put_hello(ha_sync_t *sync) {
+    cgnat_t *cgnat = sync->cgnat;
+    uint8_t *p = frame(sync, HELLO_SIZE + 4 * (size_t)cgnat->num_public_ips);
+    if (!p) {
+        return;
+    }
+    *p++ = FRAME_HELLO;
+    memcpy(p, HA_MAGIC, 8);
+    p = put16(p + 8, HA_SYNC_VERSION);
+    *p++ = (uint8_t)cgnat->mode;
+    *p++ = (uint8_t)cgnat->num_shards;
+    p = put16(put32(p, sync->config.refresh_seconds), (uint16_t)cgnat->num_public_ips);
+    for (int i = 0; i < cgnat->num_public_ips; i++) {
+        p = put32(p, cgnat->public_ips[i]);
+    }
+}
+
+/* Send everything published so far; a time frame leads each batch. */
+static size_t drain_rings(ha_sync_t *sync) {
+    size_t taken = 0;
+    for (int r = 0; r < sync->cgnat->num_shards; r++) {
+        sync_ring_t *ring = &sync->rings[r];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        if (head != tail && taken == 0) {
+            put_time(sync);
+        }
+        taken += (size_t)(head - tail);
+        for (; tail != head; tail++) {
+            put_record(sync, &ring->records[tail & ring->mask]);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    return taken;
+}
+
+static uint64_t rings_dropped(ha_sync_t *sync) {
+    uint64_t dropped = 0;
+    for (int r = 0; r < sync->cgnat->num_shards; r++) {
+        dropped += __atomic_load_n(&sync->rings[r].dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+/* The standby only ever reads; anything readable means it closed. */
+static int standby_gone(ha_sync_t *sync) {
+    struct pollfd pfd = { .fd = sync->fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+static void serve_standby(ha_sync_t *sync) {
+    cgnat_t *cgnat = sync->cgnat;
+    sync->broken = 0;
+    sync->buf_used = 0;
+    STAT_SET(sync, connected, 1);
+    STAT_SET(sync, synced, 0);
+    STAT_ADD(sync, connects, 1);
+    put_hello(sync);
+
+    /*
+     * Attach the rings, then list every session. Whatever changes while the
+     * list is taken is also in the rings and is sent after the list entry it
+     * supersedes, so the standby ends up with the current state.
+     */
+    for (int r = 0; r < cgnat->num_shards; r++) {
+        sync_ring_t *ring = &sync->rings[r];
+        ring->head = ring->tail = ring->tail_cache = ring->dropped = 0;
+    }
+    cgnat_set_sync(cgnat, sync->rings, sync->config.refresh_seconds);
+
+    cgnat_session_filter_t all = { 0 };
+    cgnat_session_t batch[CGNAT_LIST_MAX];
+    uint64_t cursor = 0;
+    uint32_t sessions = 0;
+    while (cursor != CGNAT_CURSOR_END && !sync->broken && !__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE)) {
+        int n = cgnat_list_sessions(cgnat, &all, &cursor, batch, CGNAT_LIST_MAX);
+        for (int i = 0; i < n; i++) {
+            sync_record_t record = {
+                .type = SYNC_CREATE, .protocol = batch[i].protocol, .state = batch[i].state,
+                .priv_port = batch[i].priv_port, .pub_port = batch[i].pub_port, .priv_ip = batch[i].priv_ip,
+                .pub_ip = batch[i].pub_ip, .remote_ip = batch[i].remote_ip,
+                .remote_port = batch[i].remote_port, .time = (uint32_t)batch[i].last_activity,
+            };
+            put_record(sync, &record);
+        }
+        sessions += (uint32_t)n;
+        drain_rings(sync);
+    }
+    uint8_t *p = frame(sync, SYNCED_SIZE);
+    if (p) {
+        *p++ = FRAME_SYNCED;
+        put32(p, sessions);
+    }
+    flush_out(sync);
+    STAT_SET(sync, bulk_sessions, sessions);
+    STAT_SET(sync, synced, 1);
+    printf("[HA] Standby connected, sent %u sessions\n", sessions);
+
+    while (!sync->broken && !__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE)) {
+        uint64_t check = __atomic_load_n(&sync->check_requested, __ATOMIC_ACQUIRE);
+        size_t taken = drain_rings(sync);
+        if (rings_dropped(sync) > 0) {
+            fprintf(stderr, "[HA] Sync ring overflow, sending the standby everything again\n");
+            STAT_ADD(sync, overflows, 1);
+            break;
+        }
+        if (check != sync->check_done) {
+            uint32_t count;
+            uint64_t digest = engine_digest(cgnat, &count);
+            p = frame(sync, CHECK_SIZE);
+            if (p) {
+                *p++ = FRAME_CHECK;
+                put64(put32(p, count), digest);
+            }
+            flush_out(sync);
+            STAT_ADD(sync, checks, 1);
+            __atomic_store_n(&sync->check_done, check, __ATOMIC_RELEASE);
+        }
+        if (monotonic_ns() - sync->last_time_ns >= HEARTBEAT_NS) {
+            put_time(sync);
+        }
+        /* Caught up: send what is buffered and wait for more. */
+        if (taken < 1024) {
+            flush_out(sync);
+            if (standby_gone(sync)) {
+                break;
+            }
+            idle();
+        }
+    }
+
+    cgnat_set_sync(cgnat, NULL, 0);
+    close(sync->fd);
+    sync->fd = -1;
+    STAT_SET(sync, connected, 0);
+    STAT_SET(sync, synced, 0);
+    __atomic_store_n(&sync->check_done, __atomic_load_n(&sync->check_requested, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+    if (!__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE)) {
+        printf("[HA] Standby disconnected\n");
+    }
+}
+
+static void* serve_main(void *arg) {
+    ha_sync_t *sync = arg;
+    while (!__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE)) {
+        /* Checks asked for with nobody to send them to are done at once. */
+        __atomic_store_n(&sync->check_done, __atomic_load_n(&sync->check_requested, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+        struct pollfd pfd = { .fd = sync->listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, POLL_MS) <= 0) {
+            continue;
+        }
+        sync->fd = accept4(sync->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sync->fd >= 0) {
+            set_nodelay(sync);
+            serve_standby(sync);
+        }
+    }
+    return NULL;
+}
+
+/* ---- standby side ---- */
+
+static int hello_matches(ha_sync_t *sync, const uint8_t *p, uint32_t *refresh) {
+    cgnat_t *cgnat = sync->cgnat;
+    if (memcmp(p, HA_MAGIC, 8) != 0 || get16(p + 8) != HA_SYNC_VERSION) {
+        fprintf(stderr, "[HA] Active unit speaks another sync protocol\n");
+        return 0;
+    }
+    *refresh = get32(p + 12);
+    int ips = get16(p + 16);
+    int same = p[10] == (uint8_t)cgnat->mode && p[11] == cgnat->num_shards && ips == cgnat->num_public_ips;
+    for (int i = 0; same && i < ips; i++) {
+        same = get32(p + 18 + 4 * i) == cgnat->public_ips[i];
+    }
+    if (!same) {
+        fprintf(stderr, "[HA] Active unit has another mode, shard count or public IP list\n");
+    }
+    return same;
+}
+
+static void decode_session(const uint8_t *p, sync_record_t *r, int with_public) {
+    r->protocol = p[0];
+    r->state = p[1];
+    r->priv_ip = get32(p + 2);
+    r->priv_port = get16(p + 6);
+    r->remote_ip = get32(p + 8);
+    r->remote_port = get16(p + 12);
+    p += 14;
+    if (with_public) {
+        r->pub_ip = get32(p);
+        r->pub_port = get16(p + 4);
+        p += 6;
+    }
+    r->time = get32(p);
+}
+
+/*
+ * Apply the complete frames in buf; returns bytes consumed, or -1 if the
+ * stream cannot be followed.
+ */
+static long apply_frames(ha_sync_t *sync, const uint8_t *buf, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        const uint8_t *p = buf + pos;
+        size_t need;
+        switch (p[0]) {
+            case FRAME_HELLO: need = len - pos >= HELLO_SIZE ? HELLO_SIZE + 4 * (size_t)get16(p + 17) : HELLO_SIZE; break;
+            case FRAME_CREATE: need = CREATE_SIZE; break;
+            case FRAME_REFRESH: need = REFRESH_SIZE; break;
+            case FRAME_DELETE: need = DELETE_SIZE; break;
+            case FRAME_SYNCED: need = SYNCED_SIZE; break;
+            case FRAME_TIME: need = TIME_SIZE; break;
+            case FRAME_CHECK: need = CHECK_SIZE; break;
+            default:
+                fprintf(stderr, "[HA] Unknown frame type 0x%02x\n", p[0]);
+                return -1;
+        }
+        if (len - pos < need) {
+            break;
+        }
+        p++;
+
+        sync_record_t record = { 0 };
+        switch (buf[pos]) {
+            case FRAME_HELLO: {
+                uint32_t refresh;
+                if (!hello_matches(sync, p, &refresh)) {
+                    __atomic_store_n(&sync->stop, 1, __ATOMIC_RELEASE);
+                    return -1;
+                }
+                STAT_SET(sync, refresh_seconds, refresh);
+                STAT_SET(sync, synced, 0);
+                cgnat_flush_sessions(sync->cgnat);
+                break;
+            }
+            case FRAME_CREATE:
+            case FRAME_REFRESH:
+                record.type = buf[pos] == FRAME_CREATE ? SYNC_CREATE : SYNC_REFRESH;
+                decode_session(p, &record, record.type == SYNC_CREATE);
+                goto apply;
+            case FRAME_DELETE:
+                record.type = SYNC_DELETE;
+                record.protocol = p[0];
+                record.priv_ip = get32(p + 1);
+                record.priv_port = get16(p + 5);
+                record.remote_ip = get32(p + 7);
+                record.remote_port = get16(p + 11);
+            apply:
+                /*
+                 * During the bulk pass the rings also carry deletes and
+                 * refreshes of sessions that went before they were listed.
+                 */
+                if (cgnat_apply_sync(sync->cgnat, &record) != 0 && sync->stats.synced) {
+                    STAT_ADD(sync, apply_errors, 1);
+                }
+                STAT_ADD(sync, records, 1);
+                break;
+            case FRAME_SYNCED:
+                STAT_SET(sync, bulk_sessions, get32(p));
+                STAT_SET(sync, synced, 1);
+                printf("[HA] In sync with the active unit: %u sessions\n", get32(p));
+                break;
+            case FRAME_TIME:
+                sync->batch_stamp = get64(p);
+                break;
+            case FRAME_CHECK: {
+                uint32_t count;
+                uint64_t digest = engine_digest(sync->cgnat, &count);
+                int match = count == get32(p) && digest == get64(p + 4);
+                STAT_ADD(sync, checks, 1);
+                if (!match) {
+                    STAT_ADD(sync, check_failures, 1);
+                }
+                printf("[HA] Check: %u sessions here, %u on the active unit, mappings %s\n",
+                       count, get32(p), match ? "identical" : "DIFFER");
+                break;
+            }
+        }
+        pos += need;
+    }
+    return (long)pos;
+}
+
+static void follow_active(ha_sync_t *sync) {
+    uint8_t *buf = sync->buf;
+    size_t used = 0;
+    uint64_t received = 0;
+    STAT_SET(sync, connected, 1);
+    STAT_SET(sync, synced, 0);
+    STAT_ADD(sync, connects, 1);
+    sync->last_frame_ns = monotonic_ns();
+
+    while (!__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = sync->fd, .events = POLLIN };
+        if (poll(&pfd, 1, POLL_MS) <= 0) {
+            continue;
+        }
+        ssize_t n = recv(sync->fd, buf + used, BUFFER_SIZE - used, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        STAT_ADD(sync, bytes, (uint64_t)n);
+        received += (uint64_t)n;
+        sync->last_frame_ns = monotonic_ns();
+        used += (size_t)n;
+        long consumed = apply_frames(sync, buf, used);
+        if (consumed < 0 || (consumed == 0 && used == BUFFER_SIZE)) {
+            break;
+        }
+        memmove(buf, buf + consumed, used - (size_t)consumed);
+        used -= (size_t)consumed;
+        if (sync->batch_stamp) {
+            uint64_t now = realtime_ns();
+            latency_record(&sync->stats.lag, now > sync->batch_stamp ? now - sync->batch_stamp : 0);
+            sync->batch_stamp = 0;
+        }
+    }
+    close(sync->fd);
+    sync->fd = -1;
+    STAT_SET(sync, connected, 0);
+    /* A dying active unit may still accept a connection it never serves. */
+    if (received > 0 && !__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE)) {
+        printf("[HA] Lost the active unit\n");
+    }
+}
+
+static void* follow_main(void *arg) {
+    ha_sync_t *sync = arg;
+    int reported = 0;
+    while (!__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE)) {
+        sync->fd = socket(sync->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sync->fd >= 0 && connect(sync->fd, (struct sockaddr*)&sync->addr, sync->addr_len) == 0) {
+            reported = 0;
+            set_nodelay(sync);
+            follow_active(sync);
+            continue;
+        }
+        if (!reported) {
+            fprintf(stderr, "[HA] Cannot reach the active unit (%s), retrying\n", strerror(errno));
+            reported = 1;
+        }
+        if (sync->fd >= 0) {
+            close(sync->fd);
+            sync->fd = -1;
+        }
+        for (int waited = 0; waited < RECONNECT_MS && !__atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE);
+             waited += POLL_MS) {
+            struct timespec wait = { 0, POLL_MS * 1000000L };
+            nanosleep(&wait, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* ---- setup ---- */
+
+void ha_sync_config_default(ha_sync_config_t *config) {
+    config->ring_records = 1u << 18;
+    config->refresh_seconds = 10;
+}
+
+static ha_sync_t* sync_alloc(cgnat_t *cgnat, const char *endpoint) {
+    ha_sync_t *sync = calloc(1, sizeof(ha_sync_t));
+    if (!sync) {
+        return NULL;
+    }
+    sync->cgnat = cgnat;
+    sync->listen_fd = -1;
+    sync->fd = -1;
+    sync->buf = malloc(BUFFER_SIZE);
+    if (!sync->buf || parse_endpoint(sync, endpoint) != 0) {
+        fprintf(stderr, "[HA] Invalid sync endpoint %s\n", endpoint);
+        free(sync->buf);
+        free(sync);
+        return NULL;
+    }
+    return sync;
+}
+
+ha_sync_t* ha_sync_serve(cgnat_t *cgnat, const char *endpoint, const ha_sync_config_t *config) {
+    uint32_t size = 1;
+    while (size < config->ring_records && size < (1u << 30)) {
+        size <<= 1;
+    }
+    ha_sync_t *sync = sync_alloc(cgnat, endpoint);
+    if (!sync) {
+        return NULL;
+    }
+    sync->config = *config;
+    sync->rings = aligned_alloc(64, sizeof(sync_ring_t) * (size_t)cgnat->num_shards);
+    sync->storage = calloc((size_t)cgnat->num_shards * size, sizeof(sync_record_t));
+    if (!sync->rings || !sync->storage) {
+        fprintf(stderr, "[HA] Failed to allocate sync rings\n");
+        ha_sync_stop(sync);
+        return NULL;
+    }
+    memset(sync->rings, 0, sizeof(sync_ring_t) * (size_t)cgnat->num_shards);
+    for (int r = 0; r < cgnat->num_shards; r++) {
+        sync->rings[r].records = sync->storage + (size_t)r * size;
+        sync->rings[r].mask = size - 1;
+    }
+
+    if (sync->addr.ss_family == AF_UNIX) {
+        unlink(((struct sockaddr_un*)&sync->addr)->sun_path);
+    }
+    int one = 1;
+    sync->listen_fd = socket(sync->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sync->listen_fd < 0 ||
+        setsockopt(sync->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(sync->listen_fd, (struct sockaddr*)&sync->addr, sync->addr_len) != 0 ||
+        listen(sync->listen_fd, 1) != 0) {
+        fprintf(stderr, "[HA] Cannot listen on %s: %s\n", endpoint, strerror(errno));
+        ha_sync_stop(sync);
+        return NULL;
+    }
+    printf("[HA] Serving a standby on %s (refresh every %u s, %u records per ring)\n",
+           endpoint, config->refresh_seconds, size);
+    if (pthread_create(&sync->thread, NULL, serve_main, sync) != 0) {
+        ha_sync_stop(sync);
+        return NULL;
+    }
+    sync->thread_started = 1;
+    return sync;
+}
+
+ha_sync_t* ha_sync_follow(cgnat_t *cgnat, const char *endpoint) {
+    ha_sync_t *sync = sync_alloc(cgnat, endpoint);
+    if (!sync) {
+        return NULL;
+    }
+    sync->standby = 1;
+    printf("[HA] Standby for the active unit at %s\n", endpoint);
+    if (pthread_create(&sync->thread, NULL, follow_main, sync) != 0) {
+        ha_sync_stop(sync);
+        return NULL;
+    }
+    sync->thread_started = 1;
+    return sync;
+}
+
+int ha_sync_check(ha_sync_t *sync) {
+    if (sync->standby || !__atomic_load_n(&sync->stats.synced, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    uint64_t sent = __atomic_load_n(&sync->stats.checks, __ATOMIC_RELAXED);
+    uint64_t ticket = __atomic_add_fetch(&sync->check_requested, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&sync->check_done, __ATOMIC_ACQUIRE) < ticket) {
+        idle();
+    }
+    return __atomic_load_n(&sync->stats.checks, __ATOMIC_RELAXED) > sent ? 0 : -1;
+}
+
+void ha_sync_get_stats(ha_sync_t *sync, ha_sync_stats_t *stats) {
+    ha_sync_stats_t *s = &sync->stats;
+    memset(stats, 0, sizeof(*stats));
+    stats->records = __atomic_load_n(&s->records, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    stats->bulk_sessions = __atomic_load_n(&s->bulk_sessions, __ATOMIC_RELAXED);
+    stats->connects = __atomic_load_n(&s->connects, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&s->overflows, __ATOMIC_RELAXED);
+    stats->apply_errors = __atomic_load_n(&s->apply_errors, __ATOMIC_RELAXED);
+    stats->checks = __atomic_load_n(&s->checks, __ATOMIC_RELAXED);
+    stats->check_failures = __atomic_load_n(&s->check_failures, __ATOMIC_RELAXED);
+    stats->connected = __atomic_load_n(&s->connected, __ATOMIC_RELAXED);
+    stats->synced = __atomic_load_n(&s->synced, __ATOMIC_RELAXED);
+    stats->refresh_seconds = __atomic_load_n(&s->refresh_seconds, __ATOMIC_RELAXED);
+    if (sync->standby) {
+        uint64_t last = __atomic_load_n(&sync->last_frame_ns, __ATOMIC_RELAXED);
+        stats->silent_ms = last ? (monotonic_ns() - last) / 1000000 : 0;
+    }
+    latency_hist_add(&stats->lag, &s->lag);
+}
+
+void ha_sync_stop(ha_sync_t *sync) {
+    if (!sync) return;
+    if (sync->thread_started) {
+        __atomic_store_n(&sync->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(sync->thread, NULL);
+    }
+    if (sync->listen_fd >= 0) {
+        close(sync->listen_fd);
+        if (sync->addr.ss_family == AF_UNIX) {
+            unlink(((struct sockaddr_un*)&sync->addr)->sun_path);
+        }
+    }
+    free(sync->storage);
+    free(sync->rings);
+    free(sync->buf);
+    free(sync);
+}
+
+void ha_sync_promote(ha_sync_t *sync) {
+    cgnat_t *cgnat = sync->cgnat;
+    uint32_t refresh = __atomic_load_n(&sync->stats.refresh_seconds, __ATOMIC_RELAXED);
+    ha_sync_stop(sync);
+    cgnat_sync_takeover(cgnat, refresh);
+    printf("[HA] Promoted to active: sessions are given %u s of grace\n", refresh);
+}
@@ -0,0 +1,86 @@
+#ifndef HA_SYNC_H
+#define HA_SYNC_H
+
+#include "cgnat.h"
+#include "latency.h"
+
+/*
+ * Active/standby replication over one TCP or Unix stream connection. The
+ * active unit serves the stream; a standby connects, gets every session in
+ * a bulk pass and then the engine's sync records as they happen, and
+ * applies them to an engine of its own with the same mode, shard count and
+ * public IPs, so it holds the same public IP and port for every flow.
+ *
+ * The stream is a sequence of frames, a type byte followed by a fixed
+ * little-endian payload:
+ *
+ *   'H' hello:   "CGNATSYN", u16 version, u8 mode, u8 shards, u32 refresh
+ *                seconds, u16 public IP count, u32 per public IP
+ *   'C' create:  u8 protocol, u8 state, u32 private ip, u16 private port,
+ *                u32 remote ip, u16 remote port, u32 public ip,
+ *                u16 public port, u32 last activity        (25 bytes)
+ *   'R' refresh: create without the public address         (19 bytes)
+ *   'D' delete:  u8 protocol, u32 private ip, u16 private port,
+ *                u32 remote ip, u16 remote port            (14 bytes)
+ *   'S' synced:  u32 sessions in the bulk pass that just ended
+ *   'T' time:    u64 unix ns when the records that follow left the rings,
+ *                also sent once a second as a heartbeat
+ *   'K' check:   u32 sessions, u64 digest of the active engine's mappings
+ *
+ * A ring overflow on the active side drops the standby, which reconnects,
+ * empties its engine and is sent everything again.
+ *
+ * Endpoints are "unix:<path>", "<host>:<port>" or "<port>" (localhost).
+ */
+#define HA_SYNC_VERSION 1
+
+typedef struct {
+    uint32_t ring_records;      /* per shard, rounded up to a power of two */
+    uint32_t refresh_seconds;   /* longest a busy session's standby copy lags its traffic */
+} ha_sync_config_t;
+
+typedef struct {
+    uint64_t records;           /* session frames sent (active) or applied (standby) */
+    uint64_t bytes;             /* stream bytes sent or received */
+    uint64_t bulk_sessions;     /* sessions in the latest bulk pass */
+    uint64_t connects;          /* standbys served, or connections made */
+    uint64_t overflows;         /* active: standbys dropped for a full ring */
+    uint64_t apply_errors;      /* standby: records that did not fit the engine once in sync */
+    uint64_t checks;            /* check frames sent or verified */
+    uint64_t check_failures;    /* standby: checks whose digest differed */
+    uint64_t silent_ms;         /* standby: since the last frame arrived */
+    int connected;
+    int synced;                 /* the bulk pass to the current standby has completed */
+    uint32_t refresh_seconds;   /* the active unit's, once known */
+    latency_hist_t lag;         /* standby: ns from leaving the active rings to applied */
+} ha_sync_stats_t;
+
+typedef struct ha_sync ha_sync_t;
+
+void ha_sync_config_default(ha_sync_config_t *config);
+
+/* Active side: listen on endpoint and serve one standby at a time. */
+ha_sync_t* ha_sync_serve(cgnat_t *cgnat, const char *endpoint, const ha_sync_config_t *config);
+
+/*
+ * Standby side: follow the active unit at endpoint, reconnecting until
+ * stopped. The engine must not expire sessions on its own meanwhile.
+ */
+ha_sync_t* ha_sync_follow(cgnat_t *cgnat, const char *endpoint);
+
+/*
+ * Active side: send a digest of every mapping for the standby to compare
+ * against its own, after the records pushed so far, and wait until it is
+ * sent. Only meaningful while the engine is idle. -1 without a standby.
+ */
+int ha_sync_check(ha_sync_t *sync);
+
+void ha_sync_get_stats(ha_sync_t *sync, ha_sync_stats_t *stats);
+
+/* Stop and free; the active side detaches its rings from the engine first. */
+void ha_sync_stop(ha_sync_t *sync);
+
+/* Standby: stop following and make the engine ready to translate on its own. */
+void ha_sync_promote(ha_sync_t *sync);
+
+#endif
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include "ha_sync.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ * Runs an active or a standby engine over the HA sync stream, for trying the
+ * replication between two processes. The active side drives its engine with
+ * synthetic traffic at a fixed rate of new sessions, reports stream
+ * bandwidth, then checks the standby's copy, expires everything and checks
+ * again. The standby reports replication lag and exits with the outcome.
+ * Both sides must be given the same mode, shard count and capacity.
+ */
+
+#define INSIDE_BASE 0x64400000u     /* 100.64.0.0 */
+#define PUBLIC_BASE 0xCB007101u     /* 203.0.113.1 */
+#define REMOTE_BASE 0xC6336400u     /* 198.51.100.0 */
+#define FLOWS_PER_SUBSCRIBER 16
+#define TICK_NS 1000000
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double lag_ms(const latency_hist_t *h, double q) {
+    return latency_quantile(h, q) / 1e6;
+}
+
+static int parse_mode(const char *s, cgnat_mode_t *mode) {
+    static const char *names[] = { "dynamic", "deterministic", "blocks", "apdm" };
+    static const cgnat_mode_t modes[] = {
+        CGNAT_MODE_DYNAMIC, CGNAT_MODE_DETERMINISTIC, CGNAT_MODE_PORT_BLOCKS, CGNAT_MODE_APDM,
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(s, names[i]) == 0) {
+            *mode = modes[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Both sides build the same engine from the same options. */
+static cgnat_t* create_engine(cgnat_mode_t mode, int shards, uint32_t sessions) {
+    cgnat_config_t config;
+    cgnat_config_default(&config);
+    config.max_sessions = sessions;
+    config.num_shards = shards;
+    config.mode = mode;
+    config.max_public_ips = (int)(((uint64_t)sessions * 11 / 10 + 64511) / 64512);
+    if (mode == CGNAT_MODE_DETERMINISTIC) {
+        config.det_inside_base = INSIDE_BASE;
+        config.det_subscribers = (sessions + FLOWS_PER_SUBSCRIBER - 1) / FLOWS_PER_SUBSCRIBER;
+    } else if (mode == CGNAT_MODE_PORT_BLOCKS) {
+        config.block_size = 64;
+        config.max_public_ips *= 4;
+    }
+    cgnat_t *cgnat = cgnat_init_config(&config);
+    if (!cgnat) {
+        return NULL;
+    }
+    for (int i = 0; i < config.max_public_ips; i++) {
+        struct in_addr addr = { .s_addr = htonl(PUBLIC_BASE + (uint32_t)i) };
+        if (cgnat_add_public_ip(cgnat, inet_ntoa(addr)) != 0) {
+            cgnat_destroy(cgnat);
+            return NULL;
+        }
+    }
+    return cgnat;
+}
+
+/* Session n: three TCP flows to one UDP, sixteen per subscriber. */
+static packet_info_t synthetic_flow(uint32_t n) {
+    packet_info_t pkt = {
+        .src_ip = INSIDE_BASE + n / FLOWS_PER_SUBSCRIBER,
+        .src_port = (uint16_t)(20000 + n % FLOWS_PER_SUBSCRIBER),
+        .dst_ip = REMOTE_BASE + n % 251,
+        .dst_port = (n & 3) == 3 ? 53 : 443,
+        .protocol = (n & 3) == 3 ? PROTO_UDP : PROTO_TCP,
+        .payload_len = 100,
+    };
+    return pkt;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s active  [-e endpoint] [-r new-per-second] [-t seconds] [-x packets-per-new] [-R refresh]\n"
+            "                    [-M mode] [-w shards] [-m sessions]\n"
+            "       %s standby [-e endpoint] [-M mode] [-w shards] [-m sessions]\n"
+            "  -e  unix:<path>, <host>:<port> or <port> (default 5093)\n"
+            "  -r  new sessions per second (default 100000)\n"
+            "  -t  seconds of traffic (default 10)\n"
+            "  -x  established packets sent per new session (default 4)\n"
+            "  -R  refresh interval for busy sessions in seconds (default 10)\n"
+            "  -M  dynamic, deterministic, blocks or apdm (default dynamic)\n"
+            "  -w  engine shards (default 4)\n"
+            "  -m  session capacity (default 2000000)\n",
+            prog, prog);
+}
+
+static int wait_for_standby(ha_sync_t *sync) {
+    ha_sync_stats_t stats;
+    printf("[HA] Waiting for a standby\n");
+    fflush(stdout);
+    do {
+        usleep(10000);
+        ha_sync_get_stats(sync, &stats);
+    } while (!stats.synced && running);
+    return running ? 0 : -1;
+}
+
+static int run_active(cgnat_t *cgnat, const char *endpoint, uint32_t rate, int seconds, uint32_t per_new,
+                      uint32_t refresh) {
+    ha_sync_config_t config;
+    ha_sync_config_default(&config);
+    config.refresh_seconds = refresh;
+    ha_sync_t *sync = ha_sync_serve(cgnat, endpoint, &config);
+    if (!sync) {
+        return 1;
+    }
+    if (wait_for_standby(sync) != 0) {
+        ha_sync_stop(sync);
+        return 1;
+    }
+
+    /*
+     * Every 1 ms tick opens rate/1000 sessions and sends per_new established
+     * packets for each, round-robin over those already open.
+     */
+    uint32_t opened = 0, next_busy = 0;
+    uint64_t packets = 0, failed = 0;
+    double start = monotonic_seconds();
+    double report = start + 1;
+    uint64_t tick = 0;
+    ha_sync_stats_t stats, last;
+    ha_sync_get_stats(sync, &last);
+    uint64_t base_bytes = last.bytes, base_records = last.records;
+    while (running && monotonic_seconds() < start + seconds) {
+        cgnat_set_time(cgnat, time(NULL));
+        uint32_t target = (uint32_t)((tick + 1) * rate / 1000);
+        for (; opened < target; opened++) {
+            packet_info_t pkt = synthetic_flow(opened);
+            failed += cgnat_translate_outbound(cgnat, &pkt) != 0;
+            for (uint32_t k = 0; k < per_new && opened > 0; k++) {
+                pkt = synthetic_flow(next_busy);
+                failed += cgnat_translate_outbound(cgnat, &pkt) != 0;
+                next_busy = next_busy + 1 < opened ? next_busy + 1 : 0;
+            }
+            packets += 1 + per_new;
+        }
+        tick++;
+        double now = monotonic_seconds();
+        if (now >= report) {
+            ha_sync_get_stats(sync, &stats);
+            printf("[HA] %6u sessions opened  %9lu records  %8.2f Mbit/s  overflows %lu\n",
+                   opened, stats.records - last.records, (stats.bytes - last.bytes) * 8 / 1e6,
+                   stats.overflows);
+            fflush(stdout);
+            last = stats;
+            report += 1;
+        }
+        double wake = start + (double)tick * TICK_NS / 1e9;
+        if (wake > now) {
+            struct timespec wait = { 0, (long)((wake - now) * 1e9) };
+            nanosleep(&wait, NULL);
+        }
+    }
+    double elapsed = monotonic_seconds() - start;
+    ha_sync_get_stats(sync, &stats);
+    uint64_t bytes = stats.bytes - base_bytes, records = stats.records - base_records;
+    int status = stats.overflows ? 1 : 0;
+
+    cgnat_counters_t counters;
+    cgnat_get_counters(cgnat, &counters);
+    printf("[HA] Traffic: %u sessions in %.1f s (%.0f new/s), %lu packets, %lu refused, %lu active\n",
+           opened, elapsed, opened / elapsed, packets, failed, counters.active_connections);
+    printf("[HA] Stream:  %lu records, %.1f MB, %.1f bytes per new session, %.2f Mbit/s\n",
+           records, bytes / 1e6, opened ? (double)bytes / opened : 0.0, bytes * 8 / elapsed / 1e6);
+    if (ha_sync_check(sync) != 0) {
+        fprintf(stderr, "[HA] Standby went away before the check\n");
+        status = 1;
+    }
+
+    /*
+     * Idle every session out so the standby sees the deletes too. The clock
+     * skips ahead a second at a time, and each second's deletes take as long
+     * as opening those sessions did, rather than coming all at once.
+     */
+    ha_sync_get_stats(sync, &last);
+    time_t now = time(NULL);
+    for (time_t t = now; t <= now + TCP_TIMEOUT + seconds + 1 && running; t++) {
+        cgnat_set_time(cgnat, t);
+        int expired = 0, n;
+        while ((n = cgnat_expire_sessions(cgnat)) > 0) {
+            expired += n;
+        }
+        if (expired > 0) {
+            usleep((useconds_t)((uint64_t)expired * 1000000 / rate));
+        }
+    }
+    cgnat_get_counters(cgnat, &counters);
+    if (ha_sync_check(sync) != 0) {
+        fprintf(stderr, "[HA] Standby went away before the check\n");
+        status = 1;
+    }
+    ha_sync_get_stats(sync, &stats);
+    printf("[HA] Expired everything: %lu active, %lu delete records, overflows %lu\n",
+           counters.active_connections, stats.records - last.records, stats.overflows);
+    status |= stats.overflows != 0;
+    ha_sync_stop(sync);
+    return status;
+}
+
+static int run_standby(cgnat_t *cgnat, const char *endpoint) {
+    ha_sync_t *sync = ha_sync_follow(cgnat, endpoint);
+    if (!sync) {
+        return 1;
+    }
+    ha_sync_stats_t stats, last;
+    ha_sync_get_stats(sync, &last);
+    int seen_checks = 0;
+    while (running) {
+        sleep(1);
+        ha_sync_get_stats(sync, &stats);
+        cgnat_counters_t counters;
+        cgnat_get_counters(cgnat, &counters);
+        if (stats.records != last.records) {
+            printf("[HA] %9lu records  %8.2f Mbit/s  %8lu sessions  lag p50 %.3f ms p99 %.3f ms max %.3f ms\n",
+                   stats.records - last.records, (stats.bytes - last.bytes) * 8 / 1e6,
+                   counters.active_connections, lag_ms(&stats.lag, 0.5), lag_ms(&stats.lag, 0.99),
+                   lag_ms(&stats.lag, 1.0));
+            fflush(stdout);
+        }
+        last = stats;
+        seen_checks |= stats.checks > 0;
+        if (seen_checks && !stats.connected) {
+            break;
+        }
+    }
+    ha_sync_get_stats(sync, &stats);
+    printf("[HA] Applied %lu records (%lu did not fit), %lu checks, %lu failed; "
+           "lag p50 %.3f ms p99 %.3f ms p99.9 %.3f ms max %.3f ms\n",
+           stats.records, stats.apply_errors, stats.checks, stats.check_failures,
+           lag_ms(&stats.lag, 0.5), lag_ms(&stats.lag, 0.99), lag_ms(&stats.lag, 0.999),
+           lag_ms(&stats.lag, 1.0));
+    ha_sync_stop(sync);
+    return stats.checks > 0 && stats.check_failures == 0 && stats.apply_errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || (strcmp(argv[1], "active") != 0 && strcmp(argv[1], "standby") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    int active = strcmp(argv[1], "active") == 0;
+    const char *endpoint = "5093";
+    uint32_t rate = 100000, per_new = 4, refresh = 10, sessions = 2000000;
+    int seconds = 10, shards = 4;
+    cgnat_mode_t mode = CGNAT_MODE_DYNAMIC;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "e:r:t:x:R:M:w:m:")) != -1) {
+        switch (opt) {
+            case 'e': endpoint = optarg; break;
+            case 'r': rate = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'x': per_new = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'R': refresh = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'M':
+                if (parse_mode(optarg, &mode) != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'w': shards = atoi(optarg); break;
+            case 'm': sessions = (uint32_t)strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (rate == 0 || seconds < 1 || refresh == 0 || shards < 1 || shards > CGNAT_MAX_SHARDS || sessions == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cgnat_t *cgnat = create_engine(mode, shards, sessions);
+    if (!cgnat) {
+        return 1;
+    }
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    int status = active ? run_active(cgnat, endpoint, rate, seconds, per_new, refresh)
+                        : run_standby(cgnat, endpoint);
+    cgnat_destroy(cgnat);
+    return status;
+}
@@ -0,0 +1,964 @@
+#define _GNU_SOURCE
+#include "history.h"
+#include "flow_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+_Static_assert(sizeof(history_record_t) == HISTORY_RECORD_SIZE, "record layout must match the file format");
+
+#define INITIAL_OPEN 65536
+
+/* Records go to disk little-endian; a no-op on little-endian hosts. */
+static void record_to_le(history_record_t *r) {
+    r->pub_ip = htole32(r->pub_ip);
+    r->pub_port = htole16(r->pub_port);
+    r->port_count = htole16(r->port_count);
+    r->start = htole32(r->start);
+    r->end = htole32(r->end);
+    r->priv_ip = htole32(r->priv_ip);
+    r->priv_port = htole16(r->priv_port);
+    r->remote_ip = htole32(r->remote_ip);
+    r->remote_port = htole16(r->remote_port);
+}
+
+static void record_from_le(history_record_t *r) {
+    r->pub_ip = le32toh(r->pub_ip);
+    r->pub_port = le16toh(r->pub_port);
+    r->port_count = le16toh(r->port_count);
+    r->start = le32toh(r->start);
+    r->end = le32toh(r->end);
+    r->priv_ip = le32toh(r->priv_ip);
+    r->priv_port = le16toh(r->priv_port);
+    r->remote_ip = le32toh(r->remote_ip);
+    r->remote_port = le16toh(r->remote_port);
+}
+
+/*
+ * Header: magic, u16 version, u16 record size, u32 record count,
+ * u32 start, u32 end, u16 largest port count, 6 bytes reserved.
+ */
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t start;
+    uint32_t end;
+    uint16_t max_port_count;
+    uint8_t reserved[6];
+} history_header_t;
+
+_Static_assert(sizeof(history_header_t) == HISTORY_HEADER_SIZE, "header layout must match the file format");
+
+static int compare_records(const void *a, const void *b) {
+    const history_record_t *x = a, *y = b;
+    if (x->pub_ip != y->pub_ip) return x->pub_ip < y->pub_ip ? -1 : 1;
+    if (x->pub_port != y->pub_port) return x->pub_port < y->pub_port ? -1 : 1;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return 0;
+}
+
+static int covers(const history_record_t *r, uint16_t pub_port, uint32_t t) {
+    return pub_port >= r->pub_port && pub_port - r->pub_port < r->port_count && r->start <= t && t <= r->end;
+}
+
+/* ---- writer ---- */
+
+static int history_query_open(history_t *h, uint32_t t, history_record_t **out);
+
+#define INITIAL_CLOSED 4096
+#define SEAL_QUEUE 4            /* partitions waiting for the disk before ingest holds off */
+
+/* Doubly linked: an open mapping leaves its chain when it closes. */
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+} port_link_t;
+
+/* A partition handed to the sealer: sorted, then written and dropped. */
+typedef struct seal_job {
+    struct seal_job *next;
+    uint32_t start;
+    uint32_t end;
+    history_record_t *records;
+    size_t count;
+    uint16_t max_ports;
+    int sorted;                 /* readers may search records from here on */
+} seal_job_t;
+
+struct history_writer {
+    char *dir;
+    uint32_t partition_seconds;
+    pthread_mutex_t lock;       /* ingest against live lookups and the sealer */
+    pthread_cond_t work;        /* a job queued, or closing */
+    pthread_cond_t progress;    /* a job sorted or written */
+
+    int started;
+    uint32_t part_start;        /* partition being built: [part_start, part_end) */
+    uint32_t part_end;
+    uint32_t sealed_until;      /* records before this belong to a sealed partition */
+    uint32_t newest;
+    uint32_t max_ports;         /* largest port count seen, bounds index probes */
+
+    /* Mappings without a delete yet; port_count 0 marks a free slot. */
+    history_record_t *open;
+    uint32_t open_capacity;
+    uint32_t open_high;
+    uint32_t *open_free;
+    uint32_t open_free_top;
+    flow_table_t open_index;
+    void *open_index_storage;
+    flow_table_t open_ports;    /* (pub_ip, pub_port) -> chain of open slots */
+    port_link_t *open_links;
+
+    /* Mappings that ended while this partition was being built. */
+    history_record_t *closed;
+    uint32_t closed_count;
+    uint32_t closed_capacity;
+    flow_table_t closed_ports;  /* (pub_ip, pub_port) -> chain of closed entries */
+    uint32_t *closed_next;
+
+    /* Closed mappings that reach past part_end: they start the next closed list. */
+    history_record_t *carry;
+    uint32_t carry_count;
+    uint32_t carry_capacity;
+
+    /* Sealing runs on its own thread so ingest never waits for qsort or fsync. */
+    pthread_t sealer;
+    int sealer_running;
+    int stopping;
+    seal_job_t *jobs;           /* oldest first; the head is being sealed */
+    seal_job_t *jobs_tail;
+    int job_count;
+};
+
+static flow_key_t open_key(const history_record_t *r) {
+    flow_key_t key = {
+        ((uint64_t)r->pub_ip << 24) | ((uint64_t)r->pub_port << 8) | r->protocol,
+        ((uint64_t)r->remote_ip << 16) | r->remote_port
+    };
+    return key;
+}
+
+static uint64_t port_key(uint32_t pub_ip, uint32_t pub_port) {
+    return ((uint64_t)pub_ip << 16) | pub_port;
+}
+
+static void note_ports(history_writer_t *w, const history_record_t *r) {
+    if (r->port_count > w->max_ports) {
+        w->max_ports = r->port_count;
+    }
+}
+
+/* Chains keep their head in the index; new entries go in right behind it. */
+static int link_open(history_writer_t *w, uint32_t slot) {
+    uint64_t key = port_key(w->open[slot].pub_ip, w->open[slot].pub_port);
+    uint64_t hash = flow_table_hash(key);
+    port_link_t *link = &w->open_links[slot];
+    uint32_t head = flow_table_find(&w->open_ports, key, hash);
+    if (head == FT_NOT_FOUND) {
+        link->next = link->prev = FT_NOT_FOUND;
+        return flow_table_insert(&w->open_ports, key, hash, slot);
+    }
+    link->prev = head;
+    link->next = w->open_links[head].next;
+    if (link->next != FT_NOT_FOUND) {
+        w->open_links[link->next].prev = slot;
+    }
+    w->open_links[head].next = slot;
+    return 0;
+}
+
+static void unlink_open(history_writer_t *w, uint32_t slot) {
+    port_link_t *link = &w->open_links[slot];
+    if (link->next != FT_NOT_FOUND) {
+        w->open_links[link->next].prev = link->prev;
+    }
+    if (link->prev != FT_NOT_FOUND) {
+        w->open_links[link->prev].next = link->next;
+        return;
+    }
+    uint64_t key = port_key(w->open[slot].pub_ip, w->open[slot].pub_port);
+    uint64_t hash = flow_table_hash(key);
+    if (link->next != FT_NOT_FOUND) {
+        flow_table_update(&w->open_ports, key, hash, link->next);
+    } else {
+        flow_table_remove(&w->open_ports, key, hash);
+    }
+}
+
+static int link_closed(history_writer_t *w, uint32_t i) {
+    uint64_t key = port_key(w->closed[i].pub_ip, w->closed[i].pub_port);
+    uint64_t hash = flow_table_hash(key);
+    uint32_t head = flow_table_find(&w->closed_ports, key, hash);
+    if (head == FT_NOT_FOUND) {
+        w->closed_next[i] = FT_NOT_FOUND;
+        return flow_table_insert(&w->closed_ports, key, hash, i);
+    }
+    w->closed_next[i] = w->closed_next[head];
+    w->closed_next[head] = i;
+    return 0;
+}
+
+static int index_init(history_writer_t *w, uint32_t capacity) {
+    size_t size = flow_table_storage_size(capacity, 1);
+    void *storage = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!storage) {
+        return -1;
+    }
+    memset(storage, 0, size);
+    flow_table_init_storage(&w->open_index, capacity, storage, 1);
+    w->open_index_storage = storage;
+    return 0;
+}
+
+/* Double the open set and rebuild both of its indexes. */
+static int grow_open(history_writer_t *w) {
+    uint32_t capacity = w->open_capacity ? w->open_capacity * 2 : INITIAL_OPEN;
+    history_record_t *open = realloc(w->open, capacity * sizeof(history_record_t));
+    if (open) w->open = open;
+    uint32_t *free_slots = realloc(w->open_free, capacity * sizeof(uint32_t));
+    if (free_slots) w->open_free = free_slots;
+    port_link_t *links = realloc(w->open_links, capacity * sizeof(port_link_t));
+    if (links) w->open_links = links;
+    if (!open || !free_slots || !links) {
+        return -1;
+    }
+
+    flow_table_t ports;
+    void *old_storage = w->open_index_storage;
+    if (flow_table_init(&ports, capacity) != 0) {
+        return -1;
+    }
+    if (index_init(w, capacity) != 0) {
+        flow_table_free(&ports);
+        return -1;
+    }
+    free(old_storage);
+    flow_table_free(&w->open_ports);
+    w->open_ports = ports;
+    for (uint32_t i = 0; i < w->open_high; i++) {
+        if (w->open[i].port_count) {
+            flow_key_t key = open_key(&w->open[i]);
+            flow_table_insert_key(&w->open_index, key, flow_table_hash_key(key), i);
+            link_open(w, i);
+        }
+    }
+    w->open_capacity = capacity;
+    return 0;
+}
+
+/* Double the closed list and rebuild its port index. */
+static int grow_closed(history_writer_t *w) {
+    uint32_t capacity = w->closed_capacity ? w->closed_capacity * 2 : INITIAL_CLOSED;
+    history_record_t *closed = realloc(w->closed, capacity * sizeof(history_record_t));
+    if (closed) w->closed = closed;
+    uint32_t *next = realloc(w->closed_next, capacity * sizeof(uint32_t));
+    if (next) w->closed_next = next;
+    flow_table_t ports;
+    if (!closed || !next || flow_table_init(&ports, capacity) != 0) {
+        return -1;
+    }
+    flow_table_free(&w->closed_ports);
+    w->closed_ports = ports;
+    for (uint32_t i = 0; i < w->closed_count; i++) {
+        link_closed(w, i);
+    }
+    w->closed_capacity = capacity;
+    return 0;
+}
+
+static void add_open(history_writer_t *w, const history_record_t *r) {
+    if (w->open_free_top == 0 && w->open_high == w->open_capacity && grow_open(w) != 0) {
+        return;
+    }
+    uint32_t slot = w->open_free_top > 0 ? w->open_free[--w->open_free_top] : w->open_high++;
+    flow_key_t key = open_key(r);
+    uint64_t hash = flow_table_hash_key(key);
+    w->open[slot] = *r;
+    note_ports(w, r);
+    if (flow_table_insert_key(&w->open_index, key, hash, slot) != 0 || link_open(w, slot) != 0) {
+        /* Index undersized: grow rebuilds both with this entry. */
+        if (grow_open(w) != 0) {
+            flow_table_remove_key(&w->open_index, key, hash);
+            w->open[slot].port_count = 0;
+            w->open_free[w->open_free_top++] = slot;
+        }
+    }
+}
+
+static void add_carry(history_writer_t *w, const history_record_t *r) {
+    if (w->carry_count == w->carry_capacity) {
+        uint32_t capacity = w->carry_capacity ? w->carry_capacity * 2 : 256;
+        history_record_t *carry = realloc(w->carry, capacity * sizeof(history_record_t));
+        if (!carry) {
+            return;
+        }
+        w->carry = carry;
+        w->carry_capacity = capacity;
+    }
+    w->carry[w->carry_count++] = *r;
+}
+
+static void add_closed(history_writer_t *w, const history_record_t *r) {
+    if (w->closed_count == w->closed_capacity && grow_closed(w) != 0) {
+        return;
+    }
+    uint32_t i = w->closed_count++;
+    w->closed[i] = *r;
+    note_ports(w, r);
+    if (link_closed(w, i) != 0 && grow_closed(w) != 0) {
+        w->closed_count--;
+        return;
+    }
+    if (r->end >= w->part_end) {
+        add_carry(w, r);
+    }
+}
+
+/* The open mapping with this key, moved to the closed list with its end set. */
+static int close_open(history_writer_t *w, flow_key_t key, uint32_t end) {
+    uint64_t hash = flow_table_hash_key(key);
+    uint32_t slot = flow_table_find_key(&w->open_index, key, hash);
+    if (slot == FT_NOT_FOUND) {
+        return -1;
+    }
+    history_record_t r = w->open[slot];
+    r.end = end >= r.start ? end : r.start;
+    add_closed(w, &r);
+    flow_table_remove_key(&w->open_index, key, hash);
+    unlink_open(w, slot);
+    w->open[slot].port_count = 0;
+    w->open_free[w->open_free_top++] = slot;
+    return 0;
+}
+
+static void partition_name(const char *dir, uint32_t start, uint32_t end, char *name, size_t size) {
+    snprintf(name, size, "%s/%010u-%010u.hist", dir, start, end);
+}
+
+/* Records stay in host order: live lookups may be searching them meanwhile. */
+static int write_partition(const char *dir, const seal_job_t *job) {
+    history_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTORY_MAGIC, 8);
+    header.version = htole16(HISTORY_VERSION);
+    header.record_size = htole16(HISTORY_RECORD_SIZE);
+    header.count = htole32((uint32_t)job->count);
+    header.start = htole32(job->start);
+    header.end = htole32(job->end);
+    header.max_port_count = htole16(job->max_ports);
+
+    char name[4096], tmp[4200];
+    partition_name(dir, job->start, job->end, name, sizeof(name));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(&header, sizeof(header), 1, f) == 1;
+    history_record_t chunk[256];
+    for (size_t i = 0; ok && i < job->count; i += 256) {
+        size_t n = job->count - i < 256 ? job->count - i : 256;
+        memcpy(chunk, job->records + i, n * sizeof(history_record_t));
+        for (size_t k = 0; k < n; k++) {
+            record_to_le(&chunk[k]);
+        }
+        ok = fwrite(chunk, sizeof(history_record_t), n, f) == n;
+    }
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f) {
+        ok &= fclose(f) == 0;
+    }
+    if (!ok || rename(tmp, name) != 0) {
+        fprintf(stderr, "[CGNAT] Failed to write history partition %s: %s\n", name, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Drop closed mappings that only started after the end, clip the ones that
+ * reach past it, then sort. Open mappings were clipped when copied.
+ */
+static void prepare_job(seal_job_t *job) {
+    size_t n = 0;
+    uint16_t max_ports = 1;
+    for (size_t i = 0; i < job->count; i++) {
+        history_record_t r = job->records[i];
+        if (r.start >= job->end) {
+            continue;
+        }
+        if (r.end >= job->end) {
+            r.end = job->end - 1;
+            r.flags |= HISTORY_OPEN;
+        }
+        if (r.port_count > max_ports) {
+            max_ports = r.port_count;
+        }
+        job->records[n++] = r;
+    }
+    job->count = n;
+    job->max_ports = max_ports;
+    qsort(job->records, n, sizeof(history_record_t), compare_records);
+}
+
+static void* seal_thread(void *arg) {
+    history_writer_t *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->jobs && !w->stopping) {
+            pthread_cond_wait(&w->work, &w->lock);
+        }
+        seal_job_t *job = w->jobs;
+        if (!job) {
+            break;
+        }
+        pthread_mutex_unlock(&w->lock);
+        prepare_job(job);
+
+        pthread_mutex_lock(&w->lock);
+        job->sorted = 1;
+        pthread_cond_broadcast(&w->progress);
+        pthread_mutex_unlock(&w->lock);
+        write_partition(w->dir, job);
+
+        pthread_mutex_lock(&w->lock);
+        w->jobs = job->next;
+        if (!w->jobs) {
+            w->jobs_tail = NULL;
+        }
+        w->job_count--;
+        pthread_cond_broadcast(&w->progress);
+        free(job->records);
+        free(job);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*
+ * Close the current partition at end: its closed list and a clipped copy
+ * of every open mapping go to the sealer as one job, and the carried
+ * mappings start the next closed list. Ingest only copies memory here.
+ */
+static void seal_partition(history_writer_t *w, uint32_t end) {
+    while (w->job_count >= SEAL_QUEUE) {
+        pthread_cond_wait(&w->progress, &w->lock);
+    }
+
+    uint32_t open_count = w->open_high - w->open_free_top;
+    seal_job_t *job = calloc(1, sizeof(seal_job_t));
+    history_record_t *closed = malloc((size_t)w->closed_capacity * sizeof(history_record_t));
+    history_record_t *records = job && closed ?
+        realloc(w->closed, ((size_t)w->closed_count + open_count + 1) * sizeof(history_record_t)) : NULL;
+    if (!records) {
+        fprintf(stderr, "[CGNAT] Out of memory sealing history partition %u-%u, dropped\n", w->part_start, end);
+        free(job);
+        free(closed);
+        w->closed_count = 0;
+    } else {
+        size_t n = w->closed_count;
+        for (uint32_t i = 0; i < w->open_high; i++) {
+            if (w->open[i].port_count && w->open[i].start < end) {
+                history_record_t r = w->open[i];
+                r.end = end - 1;
+                r.flags |= HISTORY_OPEN;
+                records[n++] = r;
+            }
+        }
+        *job = (seal_job_t){ .start = w->part_start, .end = end, .records = records, .count = n };
+        if (w->jobs_tail) {
+            w->jobs_tail->next = job;
+        } else {
+            w->jobs = job;
+        }
+        w->jobs_tail = job;
+        w->job_count++;
+        pthread_cond_signal(&w->work);
+        w->closed = closed;
+        w->closed_count = 0;
+    }
+    flow_table_clear(&w->closed_ports);
+
+    w->sealed_until = end;
+    w->part_start = end;
+    w->part_end = (end / w->partition_seconds + 1) * w->partition_seconds;
+
+    /* add_closed refills carry with whatever also reaches past the new end. */
+    uint32_t carried = w->carry_count;
+    w->carry_count = 0;
+    for (uint32_t i = 0; i < carried; i++) {
+        history_record_t r = w->carry[i];
+        add_closed(w, &r);
+    }
+}
+
+static void apply(history_writer_t *w, const event_record_t *e) {
+    int block = e->type == EVENT_BLOCK_ALLOC || e->type == EVENT_BLOCK_RELEASE;
+    history_record_t r = {
+        .pub_ip = e->pub_ip, .pub_port = e->pub_port, .port_count = e->port_count ? e->port_count : 1,
+        .start = e->time, .end = e->time, .priv_ip = e->priv_ip, .priv_port = e->priv_port,
+        .protocol = e->protocol, .flags = block ? HISTORY_BLOCK : 0,
+        .remote_ip = e->remote_ip, .remote_port = e->remote_port,
+    };
+    flow_key_t key = open_key(&r);
+
+    if (e->type == EVENT_SESSION_CREATE || e->type == EVENT_BLOCK_ALLOC) {
+        /* A create for a mapping still open means its delete was lost. */
+        close_open(w, key, e->time);
+        add_open(w, &r);
+    } else if (close_open(w, key, e->time) != 0) {
+        /* Created before the history began: only the end is known. */
+        add_closed(w, &r);
+    }
+}
+
+void history_writer_add(history_writer_t *w, const event_record_t *records, size_t count) {
+    pthread_mutex_lock(&w->lock);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t t = records[i].time;
+        if (!w->started) {
+            w->part_start = t - t % w->partition_seconds;
+            w->part_end = w->part_start + w->partition_seconds;
+            w->sealed_until = w->part_start;
+            w->started = 1;
+        }
+        if (t < w->sealed_until) {
+            continue;
+        }
+        while (t >= w->part_end + HISTORY_SEAL_DELAY) {
+            seal_partition(w, w->part_end);
+        }
+        apply(w, &records[i]);
+        if (t > w->newest) {
+            w->newest = t;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+void history_event_sink(void *ctx, const event_record_t *records, size_t count) {
+    history_writer_add((history_writer_t*)ctx, records, count);
+}
+
+/* Probe every start port whose block could reach pub_port, in both indexes. */
+static int lookup_current(history_writer_t *w, uint32_t pub_ip, uint16_t pub_port, uint32_t t,
+                          history_record_t *out, int max) {
+    int found = 0;
+    uint32_t low_port = pub_port + 1u > w->max_ports ? pub_port + 1u - w->max_ports : 0;
+    for (uint32_t port = low_port; port <= pub_port && found < max; port++) {
+        uint64_t key = port_key(pub_ip, port);
+        uint64_t hash = flow_table_hash(key);
+        uint32_t i = flow_table_find(&w->closed_ports, key, hash);
+        for (; i != FT_NOT_FOUND && found < max; i = w->closed_next[i]) {
+            if (covers(&w->closed[i], pub_port, t)) {
+                out[found++] = w->closed[i];
+            }
+        }
+        uint32_t slot = flow_table_find(&w->open_ports, key, hash);
+        for (; slot != FT_NOT_FOUND && found < max; slot = w->open_links[slot].next) {
+            /* Still active: it holds the port up to now, whatever the query time. */
+            history_record_t r = w->open[slot];
+            r.end = t > w->newest ? t : w->newest;
+            if (covers(&r, pub_port, t)) {
+                r.flags |= HISTORY_OPEN;
+                out[found++] = r;
+            }
+        }
+    }
+    return found;
+}
+
+/* The same search as history_query, over a sorted job still in memory. */
+static int lookup_job(const seal_job_t *job, uint32_t pub_ip, uint16_t pub_port, uint32_t t,
+                      history_record_t *out, int max) {
+    uint32_t low_port = pub_port + 1u > job->max_ports ? pub_port + 1u - job->max_ports : 0;
+    uint64_t low = port_key(pub_ip, low_port);
+    size_t lo = 0, hi = job->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (port_key(job->records[mid].pub_ip, job->records[mid].pub_port) < low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int found = 0;
+    for (size_t i = lo; i < job->count && found < max; i++) {
+        const history_record_t *r = &job->records[i];
+        if (r->pub_ip != pub_ip || r->pub_port > pub_port) {
+            break;
+        }
+        if (covers(r, pub_port, t)) {
+            out[found++] = *r;
+        }
+    }
+    return found;
+}
+
+static seal_job_t* find_job(history_writer_t *w, uint32_t t) {
+    for (seal_job_t *job = w->jobs; job; job = job->next) {
+        if (t >= job->start && t < job->end) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+int history_writer_lookup(history_writer_t *w, uint32_t pub_ip, uint16_t pub_port, uint32_t t,
+                          history_record_t *out, int max) {
+    int found;
+    pthread_mutex_lock(&w->lock);
+    if (!w->started || t >= w->part_start) {
+        found = lookup_current(w, pub_ip, pub_port, t, out, max);
+    } else {
+        /* Still with the sealer: wait for the sort, never for the disk. */
+        seal_job_t *job;
+        while ((job = find_job(w, t)) != NULL && !job->sorted) {
+            pthread_cond_wait(&w->progress, &w->lock);
+        }
+        found = job ? lookup_job(job, pub_ip, pub_port, t, out, max) : -1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+/* Pick up after the newest partition on disk, reloading the mappings open at its end. */
+static void resume(history_writer_t *w) {
+    history_t *h = history_open(w->dir);
+    uint32_t first, last;
+    if (!h || history_range(h, &first, &last) != 0) {
+        history_close(h);
+        return;
+    }
+
+    history_record_t *open = NULL;
+    int count = history_query_open(h, last, &open);
+    for (int i = 0; i < count; i++) {
+        history_record_t r = open[i];
+        r.flags &= (uint8_t)~HISTORY_OPEN;
+        add_open(w, &r);
+    }
+    free(open);
+    history_close(h);
+
+    w->started = 1;
+    w->sealed_until = last + 1;
+    w->newest = last;
+    w->part_start = last + 1;
+    w->part_end = (w->part_start / w->partition_seconds + 1) * w->partition_seconds;
+    printf("[CGNAT] History: resuming after partition ending %u, %d mappings still open\n", last + 1, count);
+}
+
+history_writer_t* history_writer_open(const char *dir, uint32_t partition_seconds) {
+    if (partition_seconds < 1) {
+        return NULL;
+    }
+    if (mkdir(dir, 0750) != 0 && errno != EEXIST) {
+        fprintf(stderr, "[CGNAT] Cannot create history directory %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    history_writer_t *w = calloc(1, sizeof(history_writer_t));
+    if (!w) {
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->progress, NULL);
+    w->partition_seconds = partition_seconds;
+    w->max_ports = 1;
+    if (!(w->dir = strdup(dir)) || grow_open(w) != 0 || grow_closed(w) != 0) {
+        history_writer_close(w);
+        return NULL;
+    }
+    resume(w);
+    if (pthread_create(&w->sealer, NULL, seal_thread, w) != 0) {
+        fprintf(stderr, "[CGNAT] Cannot start history sealer: %s\n", strerror(errno));
+        history_writer_close(w);
+        return NULL;
+    }
+    w->sealer_running = 1;
+    return w;
+}
+
+void history_writer_close(history_writer_t *w) {
+    if (!w) return;
+    if (w->sealer_running) {
+        pthread_mutex_lock(&w->lock);
+        if (w->started && w->newest >= w->part_start) {
+            while (w->newest >= w->part_end) {
+                seal_partition(w, w->part_end);
+            }
+            seal_partition(w, w->newest + 1);
+        }
+        /* The sealer drains the queue before it sees this. */
+        w->stopping = 1;
+        pthread_cond_signal(&w->work);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->sealer, NULL);
+    }
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->progress);
+    pthread_mutex_destroy(&w->lock);
+    free(w->open_index_storage);
+    flow_table_free(&w->open_ports);
+    flow_table_free(&w->closed_ports);
+    free(w->open);
+    free(w->open_free);
+    free(w->open_links);
+    free(w->closed);
+    free(w->closed_next);
+    free(w->carry);
+    free(w->dir);
+    free(w);
+}
+
+/* ---- reader ---- */
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    const uint8_t *map;     /* mapped on first use */
+    size_t size;
+} partition_t;
+
+struct history {
+    char *dir;
+    partition_t *parts;
+    int count;
+    int capacity;
+    struct timespec mtime;      /* of the directory at the last scan */
+    time_t scanned;             /* when that scan ran, 0 before the first */
+};
+
+static int compare_parts(const void *a, const void *b) {
+    const partition_t *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static void unmap_parts(history_t *h) {
+    for (int i = 0; i < h->count; i++) {
+        if (h->parts[i].map) {
+            munmap((void*)h->parts[i].map, h->parts[i].size);
+        }
+    }
+    free(h->parts);
+    h->parts = NULL;
+    h->count = 0;
+    h->capacity = 0;
+}
+
+static int known_part(const history_t *h, int sorted, uint32_t start, uint32_t end) {
+    int lo = 0, hi = sorted - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (h->parts[mid].start == start) {
+            return h->parts[mid].end == end;
+        }
+        if (h->parts[mid].start < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Add partitions sealed since the last scan; the ones already mapped stay
+ * mapped. Nothing is read while the directory's mtime is unchanged, except
+ * right after a change: a rename within the same timestamp tick leaves the
+ * mtime as it was, so it is trusted once it is more than a second old.
+ */
+static int scan_dir(history_t *h) {
+    struct stat st;
+    if (stat(h->dir, &st) != 0) {
+        return -1;
+    }
+    if (h->scanned && st.st_mtim.tv_sec == h->mtime.tv_sec && st.st_mtim.tv_nsec == h->mtime.tv_nsec &&
+        h->scanned > st.st_mtim.tv_sec + 1) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    DIR *d = opendir(h->dir);
+    if (!d) {
+        return -1;
+    }
+    int sorted = h->count;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned start, end;
+        char tail[8];
+        if (sscanf(de->d_name, "%10u-%10u.%7s", &start, &end, tail) != 3 || strcmp(tail, "hist") != 0 ||
+            end <= start || known_part(h, sorted, start, end)) {
+            continue;
+        }
+        if (h->count == h->capacity) {
+            int capacity = h->capacity ? h->capacity * 2 : 256;
+            partition_t *parts = realloc(h->parts, (size_t)capacity * sizeof(partition_t));
+            if (!parts) {
+                break;
+            }
+            h->parts = parts;
+            h->capacity = capacity;
+        }
+        h->parts[h->count++] = (partition_t){ .start = start, .end = end };
+    }
+    closedir(d);
+    if (h->count > sorted) {
+        qsort(h->parts, (size_t)h->count, sizeof(partition_t), compare_parts);
+    }
+    h->mtime = st.st_mtim;
+    h->scanned = now;
+    return 0;
+}
+
+history_t* history_open(const char *dir) {
+    history_t *h = calloc(1, sizeof(history_t));
+    if (!h || !(h->dir = strdup(dir)) || scan_dir(h) != 0) {
+        history_close(h);
+        return NULL;
+    }
+    return h;
+}
+
+void history_close(history_t *h) {
+    if (!h) return;
+    unmap_parts(h);
+    free(h->dir);
+    free(h);
+}
+
+int history_range(history_t *h, uint32_t *first, uint32_t *last) {
+    if (h->count == 0) {
+        return -1;
+    }
+    *first = h->parts[0].start;
+    *last = h->parts[h->count - 1].end - 1;
+    return 0;
+}
+
+static const history_header_t* map_part(history_t *h, partition_t *p) {
+    if (!p->map) {
+        char name[4096];
+        partition_name(h->dir, p->start, p->end, name, sizeof(name));
+        int fd = open(name, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < HISTORY_HEADER_SIZE) {
+            if (fd >= 0) close(fd);
+            return NULL;
+        }
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        const history_header_t *hdr = map;
+        if (memcmp(hdr->magic, HISTORY_MAGIC, 8) != 0 || le16toh(hdr->version) != HISTORY_VERSION ||
+            le16toh(hdr->record_size) != HISTORY_RECORD_SIZE ||
+            HISTORY_HEADER_SIZE + (size_t)le32toh(hdr->count) * HISTORY_RECORD_SIZE > (size_t)st.st_size) {
+            munmap(map, (size_t)st.st_size);
+            return NULL;
+        }
+        p->map = map;
+        p->size = (size_t)st.st_size;
+    }
+    return (const history_header_t*)p->map;
+}
+
+static partition_t* find_part(history_t *h, uint32_t t) {
+    int lo = 0, hi = h->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (t < h->parts[mid].start) {
+            hi = mid - 1;
+        } else if (t >= h->parts[mid].end) {
+            lo = mid + 1;
+        } else {
+            return &h->parts[mid];
+        }
+    }
+    return NULL;
+}
+
+static history_record_t record_at(const history_header_t *hdr, uint32_t i) {
+    history_record_t r;
+    memcpy(&r, (const uint8_t*)hdr + HISTORY_HEADER_SIZE + (size_t)i * HISTORY_RECORD_SIZE, sizeof(r));
+    record_from_le(&r);
+    return r;
+}
+
+int history_query(history_t *h, uint32_t pub_ip, uint16_t pub_port, uint32_t t,
+                  history_record_t *out, int max) {
+    partition_t *p = find_part(h, t);
+    if (!p && (h->count == 0 || t >= h->parts[h->count - 1].end)) {
+        /* Partitions may have been sealed since the directory was read. */
+        scan_dir(h);
+        p = find_part(h, t);
+    }
+    const history_header_t *hdr = p ? map_part(h, p) : NULL;
+    if (!hdr) {
+        return -1;
+    }
+
+    /* A block starting up to max_port_count - 1 ports below can still cover the port. */
+    uint32_t count = le32toh(hdr->count);
+    uint32_t span = le16toh(hdr->max_port_count);
+    uint32_t low_port = pub_port + 1u > span ? pub_port + 1u - span : 0;
+    uint64_t low = ((uint64_t)pub_ip << 16) | low_port;
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        history_record_t r = record_at(hdr, mid);
+        if ((((uint64_t)r.pub_ip << 16) | r.pub_port) < low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int found = 0;
+    for (uint32_t i = lo; i < count && found < max; i++) {
+        history_record_t r = record_at(hdr, i);
+        if (r.pub_ip != pub_ip || r.pub_port > pub_port) {
+            break;
+        }
+        if (covers(&r, pub_port, t)) {
+            out[found++] = r;
+        }
+    }
+    return found;
+}
+
+/* Copies of the records still open at the end of the partition covering t. */
+static int history_query_open(history_t *h, uint32_t t, history_record_t **out) {
+    partition_t *p = find_part(h, t);
+    const history_header_t *hdr = p ? map_part(h, p) : NULL;
+    *out = NULL;
+    if (!hdr) {
+        return 0;
+    }
+    uint32_t count = le32toh(hdr->count);
+    *out = malloc(((size_t)count + 1) * sizeof(history_record_t));
+    if (!*out) {
+        return 0;
+    }
+    int n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        history_record_t r = record_at(hdr, i);
+        if ((r.flags & HISTORY_OPEN) && r.end == p->end - 1) {
+            (*out)[n++] = r;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,96 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "event_log.h"
+
+/*
+ * Mapping history: which subscriber held a public IP and port at a given
+ * time, kept long after the engine has forgotten the session. It is built
+ * from the event log's create/delete (or block claim/release) records, off
+ * the translation path, and stored as one immutable file per time partition.
+ *
+ * A partition file holds every mapping active at any point in its time
+ * range, sorted by (public ip, public port, start). Mappings that straddle
+ * partitions are repeated in each one they overlap, clipped to its end and
+ * flagged HISTORY_OPEN, so a query only ever maps the one file covering T
+ * and binary-searches it.
+ *
+ * Files are <dir>/<start>-<end>.hist (unix seconds, end exclusive), written
+ * to a temporary name and renamed into place, so readers never see a partial
+ * partition and nothing is ever rewritten. A writer that restarts picks up
+ * from the last partition, including the mappings still open at its end.
+ */
+#define HISTORY_MAGIC "CGNATHIS"
+#define HISTORY_VERSION 1
+#define HISTORY_HEADER_SIZE 32
+#define HISTORY_RECORD_SIZE 32
+
+#define HISTORY_OPEN 0x01       /* still active at the partition's end */
+#define HISTORY_BLOCK 0x02      /* a port block: pub_port .. pub_port + port_count - 1 */
+
+/* On disk: little-endian, same field order. */
+typedef struct {
+    uint32_t pub_ip;
+    uint16_t pub_port;
+    uint16_t port_count;
+    uint32_t start;
+    uint32_t end;           /* last second the mapping was active */
+    uint32_t priv_ip;
+    uint16_t priv_port;
+    uint8_t protocol;
+    uint8_t flags;
+    uint32_t remote_ip;
+    uint16_t remote_port;
+    uint16_t reserved;
+} history_record_t;
+
+typedef struct history_writer history_writer_t;
+
+/* partition_seconds: length of a partition, e.g. 3600. */
+history_writer_t* history_writer_open(const char *dir, uint32_t partition_seconds);
+
+/*
+ * Feed event records. They may arrive slightly out of order across shards;
+ * a partition is only sealed once records are HISTORY_SEAL_DELAY seconds
+ * past its end. Sorting and writing happen on the writer's own thread, so
+ * this only waits for the disk when several partitions are queued behind
+ * it. Records older than the last sealed partition are ignored, which makes
+ * re-ingesting the same log files harmless.
+ */
+#define HISTORY_SEAL_DELAY 10
+void history_writer_add(history_writer_t *writer, const event_record_t *records, size_t count);
+
+/* Event log sink, for event_log_config_t.sink with the writer as context. */
+void history_event_sink(void *ctx, const event_record_t *records, size_t count);
+
+/*
+ * Mappings not yet on disk that cover (ip, port) at t: the partition being
+ * built, found through an index on (ip, port), or one the sealer is still
+ * writing. Returns -1 when t falls in a partition already on disk.
+ */
+int history_writer_lookup(history_writer_t *writer, uint32_t pub_ip, uint16_t pub_port, uint32_t t,
+                          history_record_t *out, int max);
+
+/* Seals everything ingested so far, the last partition up to the newest record, and waits for the disk. */
+void history_writer_close(history_writer_t *writer);
+
+typedef struct history history_t;
+
+history_t* history_open(const char *dir);
+void history_close(history_t *history);
+
+/*
+ * Mappings that covered (ip, port) at time t, at most max of them; returns
+ * how many were found or -1 if no partition covers t. Several can match:
+ * a port can change hands within a second, and under APDM one port serves
+ * several subscribers toward different remotes.
+ */
+int history_query(history_t *history, uint32_t pub_ip, uint16_t pub_port, uint32_t t,
+                  history_record_t *out, int max);
+
+/* Time range covered by sealed partitions; 0 when there are none. */
+int history_range(history_t *history, uint32_t *first, uint32_t *last);
+
+#endif
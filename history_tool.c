@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include "history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ * Builds and queries the mapping history store: ingest turns event log files
+ * into time partitions, query answers who held a public address and port at
+ * a given moment.
+ */
+
+#define READ_RECORDS 4096
+#define MAX_RESULTS 64
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static const char *ip_str(uint32_t ip, char *buf) {
+    struct in_addr addr = { .s_addr = htonl(ip) };
+    return inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+static const char *time_str(uint32_t t, char *buf, size_t size) {
+    time_t tt = (time_t)t;
+    struct tm tm;
+    strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&tt, &tm));
+    return buf;
+}
+
+/* Unix seconds or YYYY-MM-DDTHH:MM:SSZ. */
+static int parse_time(const char *s, uint32_t *t) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (end && (*end == '\0' || strcmp(end, "Z") == 0)) {
+        *t = (uint32_t)timegm(&tm);
+        return 0;
+    }
+    char *num_end;
+    unsigned long v = strtoul(s, &num_end, 10);
+    if (*s == '\0' || *num_end != '\0' || v > UINT32_MAX) {
+        return -1;
+    }
+    *t = (uint32_t)v;
+    return 0;
+}
+
+static int ingest_file(history_writer_t *writer, const char *path, uint64_t *total) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    uint8_t header[EVENT_LOG_HEADER_SIZE];
+    uint64_t created;
+    uint32_t sequence;
+    if (fread(header, sizeof(header), 1, f) != 1 || event_log_decode_header(header, &created, &sequence) != 0) {
+        fprintf(stderr, "%s: not a version %d event log\n", path, EVENT_LOG_VERSION);
+        fclose(f);
+        return -1;
+    }
+
+    static uint8_t buf[READ_RECORDS * EVENT_LOG_RECORD_SIZE];
+    static event_record_t records[READ_RECORDS];
+    size_t n;
+    while ((n = fread(buf, EVENT_LOG_RECORD_SIZE, READ_RECORDS, f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            event_log_decode_record(buf + i * EVENT_LOG_RECORD_SIZE, &records[i]);
+        }
+        history_writer_add(writer, records, n);
+        *total += n;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int cmd_ingest(const char *dir, uint32_t partition_seconds, int argc, char **argv) {
+    history_writer_t *writer = history_writer_open(dir, partition_seconds);
+    if (!writer) {
+        fprintf(stderr, "Cannot open history in %s\n", dir);
+        return 1;
+    }
+    double start = now_ms();
+    uint64_t total = 0;
+    int failed = 0;
+    for (int i = 0; i < argc; i++) {
+        failed |= ingest_file(writer, argv[i], &total) != 0;
+    }
+    history_writer_close(writer);
+    double ms = now_ms() - start;
+    fprintf(stderr, "%lu records ingested in %.1f ms (%.2f M records/s)\n",
+            total, ms, ms > 0 ? total / ms / 1e3 : 0.0);
+    return failed;
+}
+
+static int cmd_query(const char *dir, int argc, char **argv) {
+    struct in_addr addr;
+    char *end;
+    uint32_t t;
+    if (argc != 3 || inet_pton(AF_INET, argv[0], &addr) != 1) {
+        fprintf(stderr, "query needs: public-ip port time\n");
+        return 1;
+    }
+    unsigned long port = strtoul(argv[1], &end, 10);
+    if (*end || port > 65535 || parse_time(argv[2], &t) != 0) {
+        fprintf(stderr, "Bad port or time\n");
+        return 1;
+    }
+
+    double start = now_ms();
+    history_t *history = history_open(dir);
+    if (!history) {
+        fprintf(stderr, "Cannot open history in %s\n", dir);
+        return 1;
+    }
+    history_record_t found[MAX_RESULTS];
+    int n = history_query(history, ntohl(addr.s_addr), (uint16_t)port, t, found, MAX_RESULTS);
+    double ms = now_ms() - start;
+    history_close(history);
+    if (n < 0) {
+        fprintf(stderr, "No partition covers %s\n", argv[2]);
+        return 2;
+    }
+
+    for (int i = 0; i < n; i++) {
+        history_record_t *r = &found[i];
+        char priv[INET_ADDRSTRLEN], remote[INET_ADDRSTRLEN], from[32], to[32];
+        time_str(r->start, from, sizeof(from));
+        time_str(r->end, to, sizeof(to));
+        if (r->flags & HISTORY_BLOCK) {
+            printf("%s block %u-%u  %s .. %s%s\n", ip_str(r->priv_ip, priv), r->pub_port,
+                   r->pub_port + r->port_count - 1u, from, to, (r->flags & HISTORY_OPEN) ? "+" : "");
+        } else {
+            printf("%s:%u %s  %s .. %s%s  remote %s:%u\n", ip_str(r->priv_ip, priv), r->priv_port,
+                   r->protocol == 6 ? "tcp" : r->protocol == 17 ? "udp" : "-", from, to,
+                   (r->flags & HISTORY_OPEN) ? "+" : "", ip_str(r->remote_ip, remote), r->remote_port);
+        }
+    }
+    fprintf(stderr, "%d mapping%s, %.3f ms\n", n, n == 1 ? "" : "s", ms);
+    return n > 0 ? 0 : 2;
+}
+
+static int cmd_info(const char *dir) {
+    history_t *history = history_open(dir);
+    uint32_t first, last;
+    if (!history || history_range(history, &first, &last) != 0) {
+        fprintf(stderr, "No history in %s\n", dir);
+        history_close(history);
+        return 1;
+    }
+    char from[32], to[32];
+    printf("%s .. %s (%u .. %u)\n", time_str(first, from, sizeof(from)), time_str(last, to, sizeof(to)),
+           first, last);
+    history_close(history);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -d dir [-P seconds] ingest event-log-file...\n"
+            "       %s -d dir query public-ip port time\n"
+            "       %s -d dir info\n"
+            "  -d  history directory\n"
+            "  -P  partition length for ingest (default 3600)\n"
+            "  time is unix seconds or YYYY-MM-DDTHH:MM:SSZ; a + after the end time\n"
+            "  means the mapping was still active when its partition closed\n",
+            prog, prog, prog);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = NULL;
+    uint32_t partition_seconds = 3600;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:P:")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 'P': partition_seconds = (uint32_t)strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (!dir || optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *cmd = argv[optind++];
+    if (strcmp(cmd, "ingest") == 0 && optind < argc && partition_seconds > 0) {
+        return cmd_ingest(dir, partition_seconds, argc - optind, argv + optind);
+    } else if (strcmp(cmd, "query") == 0) {
+        return cmd_query(dir, argc - optind, argv + optind);
+    } else if (strcmp(cmd, "info") == 0) {
+        return cmd_info(dir);
+    }
+    usage(argv[0]);
+    return 1;
+}
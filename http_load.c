@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * HTTP load generator for the management API. Holds a fixed number of
+ * keep-alive connections open from one epoll loop, each with one request
+ * outstanding at a time, and reports throughput and the latency
+ * distribution (request written to response fully read).
+ */
+
+#define MAX_EVENTS 1024
+#define RESPONSE_BUFFER 131072
+
+typedef struct {
+    int fd;
+    int connected;
+    size_t sent;                /* of the request */
+    uint64_t start_ns;
+    char *buf;
+    size_t len;
+} load_conn_t;
+
+static struct sockaddr_in target;
+static char request[4096];
+static size_t request_len;
+static int epfd;
+
+static uint32_t *latencies_us;
+static size_t latency_count;
+static size_t latency_cap;
+
+static uint64_t completed;
+static uint64_t errors;
+static uint64_t non_2xx;
+static uint64_t reconnects;
+static uint64_t bytes_read;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void record_latency(uint64_t ns) {
+    if (latency_count == latency_cap) {
+        latency_cap = latency_cap ? latency_cap * 2 : 65536;
+        uint32_t *grown = realloc(latencies_us, latency_cap * sizeof(uint32_t));
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        latencies_us = grown;
+    }
+    latencies_us[latency_count++] = (uint32_t)(ns / 1000);
+}
+
+static int conn_open(load_conn_t *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr*)&target, sizeof(target)) != 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->connected = 0;
+    c->sent = 0;
+    c->len = 0;
+    c->start_ns = now_ns();
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void conn_reopen(load_conn_t *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    reconnects++;
+    if (conn_open(c) != 0) {
+        errors++;
+    }
+}
+
+static void conn_want(load_conn_t *c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* Writes what is left of the request; 0 when it has all been sent. */
+static int conn_send(load_conn_t *c) {
+    while (c->sent < request_len) {
+        ssize_t n = send(c->fd, request + c->sent, request_len - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 1 : -1;
+        }
+        c->sent += (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Length of the complete response at the start of buf, 0 if more is
+ * needed, -1 if it cannot be parsed. *keep_alive is cleared when the
+ * server announced it will close.
+ */
+static long response_length(const char *buf, size_t len, int *status, int *keep_alive) {
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (!end) {
+        return len > 16384 ? -1 : 0;
+    }
+    size_t head = (size_t)(end - buf) + 4;
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    *status = atoi(buf + 9);
+    *keep_alive = 1;
+
+    long content_length = -1;
+    int chunked = 0;
+    const char *line = memchr(buf, '\n', head) + 1;
+    while (line < buf + head - 2) {
+        const char *eol = memchr(line, '\n', (size_t)(buf + head - line));
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtol(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = memmem(line, (size_t)(eol - line), "chunked", 7) != NULL;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            *keep_alive = memmem(line, (size_t)(eol - line), "close", 5) == NULL;
+        }
+        line = eol + 1;
+    }
+
+    if (*status == 204 || *status == 304) {
+        return (long)head;     /* never a body */
+    }
+    if (chunked) {
+        size_t pos = head;
+        for (;;) {
+            const char *crlf = memmem(buf + pos, len - pos, "\r\n", 2);
+            if (!crlf) {
+                return 0;
+            }
+            unsigned long size = strtoul(buf + pos, NULL, 16);
+            pos = (size_t)(crlf - buf) + 2 + size + 2;
+            if (pos > len) {
+                return 0;
+            }
+            if (size == 0) {
+                return (long)pos;
+            }
+        }
+    }
+    if (content_length < 0) {
+        return -1;
+    }
+    return head + (size_t)content_length <= len ? (long)(head + (size_t)content_length) : 0;
+}
+
+/*
+ * Reads what is available and sends the next request once a response is
+ * complete. Returns 1 if the server closed after answering, -1 on error;
+ * either way the connection must be reopened.
+ */
+static int conn_receive(load_conn_t *c) {
+    int eof = 0;
+    while (c->len < RESPONSE_BUFFER) {
+        ssize_t n = recv(c->fd, c->buf + c->len, RESPONSE_BUFFER - c->len, 0);
+        if (n == 0) {
+            eof = 1;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            return -1;
+        }
+        c->len += (size_t)n;
+        bytes_read += (uint64_t)n;
+    }
+
+    int status = 0, keep_alive = 1;
+    long size = response_length(c->buf, c->len, &status, &keep_alive);
+    if (size < 0) {
+        return -1;
+    }
+    if (size == 0) {
+        return eof || c->len == RESPONSE_BUFFER ? -1 : 0;
+    }
+    uint64_t t = now_ns();
+    record_latency(t - c->start_ns);
+    completed++;
+    if (status < 200 || status > 299) {
+        non_2xx++;
+    }
+    if (!keep_alive || eof) {
+        return 1;
+    }
+
+    /* One request in flight: anything past this response is unexpected. */
+    memmove(c->buf, c->buf + size, c->len - (size_t)size);
+    c->len -= (size_t)size;
+    c->sent = 0;
+    c->start_ns = t;
+    int r = conn_send(c);
+    if (r < 0) {
+        return -1;
+    }
+    if (r > 0) {
+        conn_want(c, EPOLLOUT);
+    }
+    return 0;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(double p) {
+    if (latency_count == 0) {
+        return 0.0;
+    }
+    size_t i = (size_t)(p * (double)(latency_count - 1) + 0.5);
+    return latencies_us[i] / 1e3;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c connections] [-d seconds] [-P path] [-H header]... host:port\n"
+            "  -c  concurrent keep-alive connections (default 1000)\n"
+            "  -d  test duration in seconds (default 5)\n"
+            "  -P  request path (default /api/stats)\n"
+            "  -H  extra request header, e.g. 'Accept-Encoding: gzip'\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    int connections = 1000;
+    int duration = 5;
+    const char *path = "/api/stats";
+    char headers[2048] = "";
+    size_t headers_len = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:P:H:")) != -1) {
+        switch (opt) {
+            case 'c': connections = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'P': path = optarg; break;
+            case 'H': {
+                int n = snprintf(headers + headers_len, sizeof(headers) - headers_len, "%s\r\n", optarg);
+                if (n < 0 || (size_t)n >= sizeof(headers) - headers_len) {
+                    fprintf(stderr, "Too many headers\n");
+                    return 1;
+                }
+                headers_len += (size_t)n;
+                break;
+            }
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || connections <= 0 || duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char host[256];
+    const char *colon = strrchr(argv[optind], ':');
+    if (!colon || (size_t)(colon - argv[optind]) >= sizeof(host)) {
+        usage(argv[0]);
+        return 1;
+    }
+    memcpy(host, argv[optind], (size_t)(colon - argv[optind]));
+    host[colon - argv[optind]] = '\0';
+    target.sin_family = AF_INET;
+    target.sin_port = htons((uint16_t)atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+        fprintf(stderr, "Bad address %s\n", host);
+        return 1;
+    }
+    request_len = (size_t)snprintf(request, sizeof(request),
+                                   "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: http_load\r\n%s\r\n",
+                                   path, argv[optind], headers);
+
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < (rlim_t)connections + 64) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    load_conn_t *conns = calloc((size_t)connections, sizeof(load_conn_t));
+    char *buffers = malloc((size_t)connections * RESPONSE_BUFFER);
+    if (epfd < 0 || !conns || !buffers) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < connections; i++) {
+        conns[i].buf = buffers + (size_t)i * RESPONSE_BUFFER;
+        if (conn_open(&conns[i]) != 0) {
+            perror("connect");
+            return 1;
+        }
+    }
+
+    printf("Load test: %d connections, %d s, GET %s from %s\n", connections, duration, path, argv[optind]);
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t)duration * 1000000000ull;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now;
+    while ((now = now_ns()) < deadline) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            load_conn_t *c = events[i].data.ptr;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                errors++;
+                conn_reopen(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (!c->connected) {
+                    c->connected = 1;
+                    c->start_ns = now_ns();
+                }
+                int r = conn_send(c);
+                if (r < 0) {
+                    errors++;
+                    conn_reopen(c);
+                    continue;
+                }
+                if (r == 0) {
+                    conn_want(c, EPOLLIN);
+                }
+            }
+            if (events[i].events & EPOLLIN) {
+                int r = conn_receive(c);
+                if (r != 0) {
+                    errors += r < 0;
+                    conn_reopen(c);
+                }
+            }
+        }
+    }
+    double seconds = (double)(now - start) / 1e9;
+
+    qsort(latencies_us, latency_count, sizeof(uint32_t), compare_u32);
+    printf("  Requests:     %lu (%lu non-2xx)\n", completed, non_2xx);
+    printf("  Errors:       %lu, reconnects %lu\n", errors, reconnects);
+    printf("  Throughput:   %.0f req/s, %.1f MB/s\n", completed / seconds, bytes_read / seconds / 1e6);
+    printf("  Latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           percentile_ms(0.50), percentile_ms(0.90), percentile_ms(0.99), percentile_ms(0.999),
+           percentile_ms(1.0));
+
+    for (int i = 0; i < connections; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    free(buffers);
+    free(conns);
+    free(latencies_us);
+    close(epfd);
+    return completed > 0 && errors == 0 ? 0 : 1;
+}
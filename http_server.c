@@ -0,0 +1,732 @@
+#define _GNU_SOURCE
+#include "http_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 64
+#define READ_CHUNK 16384
+
+typedef struct worker worker_t;
+
+struct http_conn {
+    int fd;
+    worker_t *worker;
+    uint32_t events;            /* currently registered with epoll */
+    int close_after;            /* close once the output is written */
+    int handled;                /* a response was queued for the current request */
+    int minor_version;          /* of the current request */
+    time_t last_active;
+
+    http_producer_t produce;    /* streamed response in progress */
+    void (*release)(void *ctx);
+    void *stream_ctx;
+    int chunked;
+    int stream_waiting;         /* the producer returned HTTP_STREAM_WAIT */
+    int out_failed;             /* output could not be queued: close after what is */
+
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+
+    http_conn_t *prev;
+    http_conn_t *next;
+};
+
+struct worker {
+    http_server_t *server;
+    pthread_t thread;
+    int epfd;
+    int wakefd;
+    http_conn_t *conns;         /* every open connection, for the idle sweep */
+
+    uint64_t accepted;
+    uint64_t open;
+    uint64_t requests;
+    uint64_t bad_requests;
+    uint64_t idle_closed;
+};
+
+struct http_server {
+    http_server_config_t config;
+    int listen_fd;
+    int stop;
+    int num_workers;
+    worker_t *workers;
+};
+
+/* Per-worker counters are written by their worker only; see http_server_get_stats. */
+#define WORKER_ADD(w, field, n) __atomic_store_n(&(w)->field, (w)->field + (uint64_t)(n), __ATOMIC_RELAXED)
+
+static int listen_marker;       /* epoll data for the listening socket */
+static int wake_marker;         /* ... and for the stop eventfd */
+
+void http_server_config_default(http_server_config_t *config) {
+    config->port = 5000;
+    config->workers = 4;
+    config->backlog = 4096;
+    config->idle_timeout_sec = 60;
+    config->handler = NULL;
+    config->ctx = NULL;
+}
+
+static int reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t size = *cap ? *cap : 4096;
+    while (size < need) {
+        size *= 2;
+    }
+    char *p = realloc(*buf, size);
+    if (!p) {
+        return -1;
+    }
+    *buf = p;
+    *cap = size;
+    return 0;
+}
+
+static void stream_end(http_conn_t *c) {
+    if (c->release) {
+        c->release(c->stream_ctx);
+    }
+    c->produce = NULL;
+    c->release = NULL;
+    c->stream_ctx = NULL;
+    c->stream_waiting = 0;
+}
+
+static void conn_close(http_conn_t *c) {
+    worker_t *w = c->worker;
+    stream_end(c);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev) c->prev->next = c->next; else w->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    WORKER_ADD(w, open, -1);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/*
+ * Read while the output backlog is small; write while anything is pending
+ * or a stream has more to produce.
+ */
+static void conn_update_events(http_conn_t *c) {
+    uint32_t events = 0;
+    if (!c->close_after && c->out_len - c->out_sent < HTTP_OUTPUT_HIGH_WATER &&
+        c->in_len < HTTP_MAX_HEADER + HTTP_MAX_BODY) {
+        events |= EPOLLIN;
+    }
+    if (c->out_sent < c->out_len || (c->produce && !c->stream_waiting)) {
+        events |= EPOLLOUT;
+    }
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = c };
+        epoll_ctl(c->worker->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+/* Room for len more bytes of output, reclaiming what has been sent. NULL closes the connection. */
+static char* out_reserve(http_conn_t *c, size_t len) {
+    if (c->out_failed) {
+        return NULL;
+    }
+    if (c->out_sent > 0 && (c->out_sent == c->out_len || c->out_sent >= c->out_cap / 2)) {
+        memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    if (reserve(&c->out, &c->out_cap, c->out_len + len) != 0) {
+        c->close_after = 1;
+        c->out_failed = 1;
+        return NULL;
+    }
+    return c->out + c->out_len;
+}
+
+static int queue_header(http_conn_t *c, const char *status, const char *content_type, const char *length,
+                        const char *extra_headers) {
+    char header[1024];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "%s"
+                     "Connection: %s\r\n"
+                     "%s"
+                     "\r\n",
+                     status, content_type, length, c->close_after ? "close" : "keep-alive",
+                     extra_headers ? extra_headers : "");
+    char *out;
+    if (n < 0 || (size_t)n >= sizeof(header) || !(out = out_reserve(c, (size_t)n))) {
+        c->close_after = 1;
+        return -1;
+    }
+    memcpy(out, header, (size_t)n);
+    c->out_len += (size_t)n;
+    c->handled = 1;
+    return 0;
+}
+
+void http_respond(http_conn_t *c, const char *status, const char *content_type,
+                  const char *extra_headers, const void *body, size_t len) {
+    char length[48];
+    snprintf(length, sizeof(length), "Content-Length: %zu\r\n", len);
+    char *out;
+    if (queue_header(c, status, content_type, length, extra_headers) != 0 || !(out = out_reserve(c, len))) {
+        return;
+    }
+    memcpy(out, body, len);
+    c->out_len += len;
+}
+
+void http_respond_prepared(http_conn_t *c, const char *head, size_t head_len,
+                           const void *body, size_t body_len) {
+    const char *connection = c->close_after ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+    struct iovec iov[3] = {
+        { (void*)head, head_len },
+        { (void*)connection, strlen(connection) },
+        { (void*)body, body_len },
+    };
+    c->handled = 1;
+
+    size_t sent = 0;
+    if (c->out_sent == c->out_len && !c->produce) {
+        ssize_t n;
+        do {
+            n = writev(c->fd, iov, 3);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            c->close_after = 1;     /* conn_flush closes it */
+            return;
+        }
+        sent = n > 0 ? (size_t)n : 0;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        size_t len = iov[i].iov_len - sent;
+        char *out = out_reserve(c, len);
+        if (!out) {
+            return;
+        }
+        memcpy(out, (const char*)iov[i].iov_base + sent, len);
+        c->out_len += len;
+        sent = 0;
+    }
+}
+
+void http_respond_stream(http_conn_t *c, const char *status, const char *content_type,
+                         const char *extra_headers, http_producer_t produce, void (*release)(void *ctx),
+                         void *ctx) {
+    c->chunked = c->minor_version >= 1;
+    if (!c->chunked) {
+        c->close_after = 1;
+    }
+    if (queue_header(c, status, content_type, c->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                     extra_headers) != 0) {
+        if (release) {
+            release(ctx);
+        }
+        return;
+    }
+    c->produce = produce;
+    c->release = release;
+    c->stream_ctx = ctx;
+}
+
+void http_stream_write(http_conn_t *c, const void *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    char size[24];
+    int n = c->chunked ? snprintf(size, sizeof(size), "%zx\r\n", len) : 0;
+    char *out = out_reserve(c, (size_t)n + len + 2);
+    if (!out) {
+        return;
+    }
+    memcpy(out, size, (size_t)n);
+    memcpy(out + n, data, len);
+    c->out_len += (size_t)n + len;
+    if (c->chunked) {
+        memcpy(out + n + len, "\r\n", 2);
+        c->out_len += 2;
+    }
+}
+
+/* Run the producer until enough output is queued or the body is done. */
+static void conn_produce(http_conn_t *c) {
+    while (c->produce && !c->stream_waiting && !c->out_failed && c->out_len - c->out_sent < HTTP_STREAM_LOW_WATER) {
+        int r = c->produce(c, c->stream_ctx);
+        if (r == HTTP_STREAM_WAIT) {
+            c->stream_waiting = 1;
+        } else if (r == HTTP_STREAM_DONE) {
+            if (c->chunked) {
+                char *out = out_reserve(c, 5);
+                if (out) {
+                    memcpy(out, "0\r\n\r\n", 5);
+                    c->out_len += 5;
+                }
+            } else {
+                c->close_after = 1;
+            }
+            stream_end(c);
+        }
+    }
+    if (c->out_failed) {
+        stream_end(c);
+    }
+}
+
+static void respond_error(http_conn_t *c, const char *status) {
+    char body[128];
+    int n = snprintf(body, sizeof(body), "{\"error\": \"%s\"}", status);
+    c->close_after = 1;
+    http_respond(c, status, "application/json", NULL, body, (size_t)n);
+    WORKER_ADD(c->worker, bad_requests, 1);
+}
+
+static size_t find_header_end(const char *buf, size_t len) {
+    for (size_t i = 3; i < len; i++) {
+        if (buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n' && buf[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+const char* http_header(const http_request_t *req, const char *name, char *out, size_t size) {
+    size_t len = strlen(name);
+    for (const char *line = req->headers; *line; ) {
+        const char *eol = strstr(line, "\r\n");
+        if (!eol) {
+            break;
+        }
+        if ((size_t)(eol - line) > len && strncasecmp(line, name, len) == 0 && line[len] == ':') {
+            const char *v = line + len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) v++;
+            const char *end = eol;
+            while (end > v && (end[-1] == ' ' || end[-1] == '\t')) end--;
+            size_t n = (size_t)(end - v);
+            if (n >= size) {
+                return NULL;
+            }
+            memcpy(out, v, n);
+            out[n] = '\0';
+            return out;
+        }
+        line = eol + 2;
+    }
+    return NULL;
+}
+
+const char* http_query_param(const http_request_t *req, const char *name, char *out, size_t size) {
+    size_t len = strlen(name);
+    for (const char *p = req->query; p && *p; ) {
+        if (strncmp(p, name, len) == 0 && (p[len] == '=' || p[len] == '&' || p[len] == '\0')) {
+            const char *v = p[len] == '=' ? p + len + 1 : p + len;
+            size_t n = strcspn(v, "&");
+            if (n >= size) {
+                return NULL;
+            }
+            memcpy(out, v, n);
+            out[n] = '\0';
+            return out;
+        }
+        p = strchr(p, '&');
+        if (p) p++;
+    }
+    return NULL;
+}
+
+/*
+ * Parse a NUL-terminated copy of the request line and headers; req points
+ * into it. -1 if malformed.
+ */
+static int parse_request(char *head, http_request_t *req, size_t *body_len) {
+    char *eol = strstr(head, "\r\n");
+    char *sp1 = strchr(head, ' ');
+    if (!eol || !sp1 || sp1 > eol) {
+        return -1;
+    }
+    *eol = '\0';
+    char *target = sp1 + 1;
+    char *sp2 = strchr(target, ' ');
+    int minor;
+    char tail;
+    if ((size_t)(sp1 - head) >= sizeof(req->method) || !sp2 || target[0] != '/' ||
+        sscanf(sp2 + 1, "HTTP/1.%d%c", &minor, &tail) != 1) {
+        return -1;
+    }
+    memcpy(req->method, head, (size_t)(sp1 - head));
+    req->method[sp1 - head] = '\0';
+    *sp2 = '\0';
+    char *q = strchr(target, '?');
+    if (q) {
+        *q = '\0';
+    }
+    if (strlen(target) >= sizeof(req->path)) {
+        return -1;
+    }
+    strcpy(req->path, target);
+    req->query = q ? q + 1 : "";
+    req->minor_version = minor;
+    req->headers = eol + 2;
+
+    char value[64];
+    req->keep_alive = minor >= 1;
+    if (http_header(req, "Connection", value, sizeof(value))) {
+        if (strcasecmp(value, "close") == 0) {
+            req->keep_alive = 0;
+        } else if (strcasecmp(value, "keep-alive") == 0) {
+            req->keep_alive = 1;
+        }
+    }
+    *body_len = 0;
+    if (http_header(req, "Content-Length", value, sizeof(value))) {
+        char *end;
+        unsigned long n = strtoul(value, &end, 10);
+        if (*end || n > HTTP_MAX_BODY) {
+            return -1;
+        }
+        *body_len = n;
+    }
+    if (http_header(req, "Transfer-Encoding", value, sizeof(value))) {
+        return -1;      /* no chunked request bodies */
+    }
+    return 0;
+}
+
+/* Handle every complete request buffered, in order, until the output backs up. */
+static void conn_process(http_conn_t *c) {
+    worker_t *w = c->worker;
+    size_t consumed = 0;
+    static __thread char head[HTTP_MAX_HEADER + 1];
+
+    while (!c->close_after && !c->produce && c->out_len - c->out_sent < HTTP_OUTPUT_HIGH_WATER) {
+        const char *start = c->in + consumed;
+        size_t avail = c->in_len - consumed;
+        size_t header_len = find_header_end(start, avail < HTTP_MAX_HEADER ? avail : HTTP_MAX_HEADER);
+        if (header_len == 0) {
+            if (avail >= HTTP_MAX_HEADER) {
+                respond_error(c, "431 Request Header Fields Too Large");
+            }
+            break;
+        }
+
+        http_request_t req;
+        size_t body_len;
+        memcpy(head, start, header_len);
+        head[header_len] = '\0';
+        if (parse_request(head, &req, &body_len) != 0) {
+            respond_error(c, "400 Bad Request");
+            break;
+        }
+        if (avail < header_len + body_len) {
+            break;      /* body still arriving */
+        }
+
+        c->close_after = !req.keep_alive;
+        c->handled = 0;
+        c->minor_version = req.minor_version;
+        w->server->config.handler(c, &req, w->server->config.ctx);
+        if (!c->handled) {
+            respond_error(c, "500 Internal Server Error");
+        }
+        conn_produce(c);
+        WORKER_ADD(w, requests, 1);
+        consumed += header_len + body_len;
+    }
+
+    if (consumed > 0) {
+        memmove(c->in, c->in + consumed, c->in_len - consumed);
+        c->in_len -= consumed;
+    }
+}
+
+/* Write what the socket takes; 0 keeps the connection, -1 closes it. */
+static int conn_flush(http_conn_t *c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    c->out_sent = c->out_len = 0;
+    return c->close_after && !c->produce ? -1 : 0;
+}
+
+static int conn_read(http_conn_t *c) {
+    for (;;) {
+        size_t limit = HTTP_MAX_HEADER + HTTP_MAX_BODY;
+        if (c->in_len >= limit) {
+            return 0;
+        }
+        size_t want = limit - c->in_len < READ_CHUNK ? limit - c->in_len : READ_CHUNK;
+        if (reserve(&c->in, &c->in_cap, c->in_len + want) != 0) {
+            return -1;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, want, 0);
+        if (n > 0) {
+            c->in_len += (size_t)n;
+            if ((size_t)n < want) {
+                return 0;
+            }
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+}
+
+static void conn_event(http_conn_t *c, uint32_t events) {
+    c->last_active = time(NULL);
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(c);
+        return;
+    }
+    if ((events & EPOLLIN) && conn_read(c) != 0) {
+        conn_close(c);
+        return;
+    }
+    /* Writing first frees room for a stream or requests held back by a full output queue. */
+    if (conn_flush(c) != 0) {
+        conn_close(c);
+        return;
+    }
+    conn_produce(c);
+    conn_process(c);
+    if (conn_flush(c) != 0) {
+        conn_close(c);
+        return;
+    }
+    conn_update_events(c);
+}
+
+/* Give every waiting stream on this worker another turn. */
+static void wake_streams(worker_t *w) {
+    uint64_t count;
+    if (read(w->wakefd, &count, sizeof(count)) < 0) {
+        /* already drained */
+    }
+    time_t now = time(NULL);
+    for (http_conn_t *c = w->conns, *next; c; c = next) {
+        next = c->next;
+        if (!c->stream_waiting) {
+            continue;
+        }
+        c->stream_waiting = 0;
+        c->last_active = now;       /* a live stream is not idle */
+        conn_produce(c);
+        conn_process(c);
+        if (conn_flush(c) != 0) {
+            conn_close(c);
+            continue;
+        }
+        conn_update_events(c);
+    }
+}
+
+static void accept_connections(worker_t *w) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        int fd = accept4(w->server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("[WEB] Accept failed");
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        http_conn_t *c = calloc(1, sizeof(http_conn_t));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->worker = w;
+        c->events = EPOLLIN;
+        c->last_active = time(NULL);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->next = w->conns;
+        if (w->conns) w->conns->prev = c;
+        w->conns = c;
+        WORKER_ADD(w, accepted, 1);
+        WORKER_ADD(w, open, 1);
+    }
+}
+
+static void sweep_idle(worker_t *w, time_t now) {
+    int timeout = w->server->config.idle_timeout_sec;
+    for (http_conn_t *c = w->conns, *next; c; c = next) {
+        next = c->next;
+        if (timeout > 0 && now - c->last_active > timeout) {
+            WORKER_ADD(w, idle_closed, 1);
+            conn_close(c);
+        }
+    }
+}
+
+static void* worker_main(void *arg) {
+    worker_t *w = (worker_t*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+
+    while (!__atomic_load_n(&w->server->stop, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            if (p == &listen_marker) {
+                accept_connections(w);
+            } else if (p == &wake_marker) {
+                wake_streams(w);
+            } else {
+                conn_event((http_conn_t*)p, events[i].events);
+            }
+        }
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            sweep_idle(w, now);
+            last_sweep = now;
+        }
+    }
+    while (w->conns) {
+        conn_close(w->conns);
+    }
+    return NULL;
+}
+
+http_server_t* http_server_start(const http_server_config_t *config) {
+    if (!config->handler || config->workers < 1) {
+        return NULL;
+    }
+    http_server_t *server = calloc(1, sizeof(http_server_t));
+    if (!server) {
+        return NULL;
+    }
+    server->config = *config;
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0) {
+        perror("[WEB] Socket creation failed");
+        free(server);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons((uint16_t)config->port)
+    };
+    if (bind(server->listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(server->listen_fd, config->backlog) < 0) {
+        perror("[WEB] Bind/listen failed");
+        close(server->listen_fd);
+        free(server);
+        return NULL;
+    }
+
+    server->workers = calloc((size_t)config->workers, sizeof(worker_t));
+    if (!server->workers) {
+        http_server_stop(server);
+        return NULL;
+    }
+    for (int i = 0; i < config->workers; i++) {
+        worker_t *w = &server->workers[i];
+        w->server = server;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event lev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_marker };
+        struct epoll_event wev = { .events = EPOLLIN, .data.ptr = &wake_marker };
+        if (w->epfd < 0 || w->wakefd < 0 ||
+            epoll_ctl(w->epfd, EPOLL_CTL_ADD, server->listen_fd, &lev) != 0 ||
+            epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &wev) != 0 ||
+            pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            perror("[WEB] Worker setup failed");
+            if (w->epfd >= 0) close(w->epfd);
+            if (w->wakefd >= 0) close(w->wakefd);
+            http_server_stop(server);
+            return NULL;
+        }
+        server->num_workers++;
+    }
+    return server;
+}
+
+void http_server_stop(http_server_t *server) {
+    if (!server) return;
+    __atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < server->num_workers; i++) {
+        uint64_t one = 1;
+        if (write(server->workers[i].wakefd, &one, sizeof(one)) < 0) {
+            /* the worker still sees stop within a second */
+        }
+    }
+    for (int i = 0; i < server->num_workers; i++) {
+        worker_t *w = &server->workers[i];
+        pthread_join(w->thread, NULL);
+        close(w->epfd);
+        close(w->wakefd);
+    }
+    close(server->listen_fd);
+    free(server->workers);
+    free(server);
+}
+
+void http_server_wake_streams(http_server_t *server) {
+    for (int i = 0; i < server->num_workers; i++) {
+        uint64_t one = 1;
+        if (write(server->workers[i].wakefd, &one, sizeof(one)) < 0) {
+            /* counter saturated: a wakeup is pending anyway */
+        }
+    }
+}
+
+void http_server_get_stats(http_server_t *server, http_server_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < server->num_workers; i++) {
+        worker_t *w = &server->workers[i];
+        stats->accepted += __atomic_load_n(&w->accepted, __ATOMIC_RELAXED);
+        stats->open += __atomic_load_n(&w->open, __ATOMIC_RELAXED);
+        stats->requests += __atomic_load_n(&w->requests, __ATOMIC_RELAXED);
+        stats->bad_requests += __atomic_load_n(&w->bad_requests, __ATOMIC_RELAXED);
+        stats->idle_closed += __atomic_load_n(&w->idle_closed, __ATOMIC_RELAXED);
+    }
+}
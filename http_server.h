@@ -0,0 +1,120 @@
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * HTTP/1.1 server for the management API. A few worker threads each run
+ * their own epoll loop over non-blocking sockets and accept from one shared
+ * listening socket (EPOLLEXCLUSIVE), so a connection lives on the worker
+ * that accepted it. Requests are read incrementally and may be pipelined;
+ * responses are queued on the connection in order and written as the socket
+ * takes them, so a slow client only ever holds up itself. Connections stay
+ * open unless the client asks otherwise or sits idle past the timeout.
+ *
+ * The handler runs on a worker thread, concurrently with the other workers.
+ */
+#define HTTP_MAX_HEADER 16384       /* request line plus headers */
+#define HTTP_MAX_BODY 65536         /* request bodies are read and ignored */
+#define HTTP_OUTPUT_HIGH_WATER (1u << 20)   /* stop reading while this much is unsent */
+
+typedef struct {
+    char method[8];
+    char path[2048];            /* target up to '?' */
+    const char *query;          /* after '?', "" if none */
+    int minor_version;          /* HTTP/1.x */
+    int keep_alive;
+    const char *headers;        /* raw header lines, NUL-terminated */
+} http_request_t;
+
+typedef struct http_conn http_conn_t;
+
+typedef void (*http_handler_t)(http_conn_t *conn, const http_request_t *req, void *ctx);
+
+typedef struct {
+    int port;
+    int workers;
+    int backlog;
+    int idle_timeout_sec;
+    http_handler_t handler;
+    void *ctx;
+} http_server_config_t;
+
+typedef struct {
+    uint64_t accepted;
+    uint64_t open;
+    uint64_t requests;
+    uint64_t bad_requests;
+    uint64_t idle_closed;
+} http_server_stats_t;
+
+typedef struct http_server http_server_t;
+
+void http_server_config_default(http_server_config_t *config);
+
+/* Binds, listens and starts the workers. NULL on failure. */
+http_server_t* http_server_start(const http_server_config_t *config);
+
+/* Stops the workers and closes every connection. */
+void http_server_stop(http_server_t *server);
+
+void http_server_get_stats(http_server_t *server, http_server_stats_t *stats);
+
+/* Header value with surrounding blanks trimmed, NULL if absent. Names are case-insensitive. */
+const char* http_header(const http_request_t *req, const char *name, char *out, size_t size);
+
+/* Query parameter value as sent (not percent-decoded), NULL if absent. */
+const char* http_query_param(const http_request_t *req, const char *name, char *out, size_t size);
+
+/*
+ * Queue a complete response. Content-Length and Connection are added;
+ * extra_headers, if not NULL, are further "Name: value\r\n" lines. Every
+ * request must get exactly one response.
+ */
+void http_respond(http_conn_t *conn, const char *status, const char *content_type,
+                  const char *extra_headers, const void *body, size_t len);
+
+/*
+ * Queue a response whose status line and headers were formatted ahead of
+ * time: head ends with the last header line, and Connection and the blank
+ * line are added here. When nothing else is waiting on the connection it
+ * goes out in one writev straight from head and body, and only what the
+ * socket does not take is copied, so neither needs to outlive the call.
+ */
+void http_respond_prepared(http_conn_t *conn, const char *head, size_t head_len,
+                           const void *body, size_t body_len);
+
+/*
+ * Streamed response of unknown length. The headers are queued now, then
+ * produce runs on the worker, right away and again whenever less than
+ * HTTP_STREAM_LOW_WATER is waiting to be sent. It appends body data with
+ * http_stream_write, at least some per call unless it is finished, and
+ * returns HTTP_STREAM_MORE while more is to come or HTTP_STREAM_DONE when
+ * the body is complete. A producer with nothing to send yet (an event
+ * stream) returns HTTP_STREAM_WAIT instead and is called again after the
+ * next http_server_wake_streams. HTTP/1.1 clients get chunked encoding and
+ * keep the connection; HTTP/1.0 clients get the raw body, ended by closing.
+ * release, if not NULL, gets ctx once the stream ends or the connection goes
+ * away. Later pipelined requests wait.
+ */
+#define HTTP_STREAM_LOW_WATER 65536
+
+#define HTTP_STREAM_MORE 0
+#define HTTP_STREAM_DONE 1
+#define HTTP_STREAM_WAIT 2
+
+typedef int (*http_producer_t)(http_conn_t *conn, void *ctx);
+
+void http_respond_stream(http_conn_t *conn, const char *status, const char *content_type,
+                         const char *extra_headers, http_producer_t produce, void (*release)(void *ctx),
+                         void *ctx);
+void http_stream_write(http_conn_t *conn, const void *data, size_t len);
+
+/*
+ * Run every waiting producer again, each on its own worker. Safe from any
+ * thread; costs one eventfd write per worker however many streams are open.
+ */
+void http_server_wake_streams(http_server_t *server);
+
+#endif
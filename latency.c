@@ -0,0 +1,65 @@
+#define _GNU_SOURCE
+#include "latency.h"
+#include <time.h>
+
+uint64_t latency_bucket_lower(int b) {
+    if (b < LATENCY_SUB_BUCKETS) {
+        return (uint64_t)b;
+    }
+    int octave = b >> LATENCY_SUB_BITS;
+    uint64_t sub = (uint64_t)(b & (LATENCY_SUB_BUCKETS - 1));
+    return (LATENCY_SUB_BUCKETS + sub) << (octave - 1);
+}
+
+void latency_hist_add(latency_hist_t *dst, const latency_hist_t *src) {
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        dst->count[b] += __atomic_load_n(&src->count[b], __ATOMIC_RELAXED);
+    }
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+uint64_t latency_quantile(const latency_hist_t *h, double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        total += h->count[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)(total - 1)) + 1;
+    uint64_t seen = 0;
+    int b = 0;
+    while (b < LATENCY_BUCKETS - 1 && (seen += h->count[b]) < rank) {
+        b++;
+    }
+    return latency_bucket_lower(b + 1);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+double latency_ticks_per_sec(void) {
+    static double rate;
+    double r;
+    __atomic_load(&rate, &r, __ATOMIC_RELAXED);
+    if (r > 0) {
+        return r;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    /* 20 ms against the monotonic clock gives the TSC rate to well under 0.1%. */
+    uint64_t ns0 = monotonic_ns(), t0 = latency_ticks();
+    struct timespec pause = { 0, 20 * 1000 * 1000 };
+    nanosleep(&pause, NULL);
+    uint64_t ns1 = monotonic_ns(), t1 = latency_ticks();
+    r = (double)(t1 - t0) * 1e9 / (double)(ns1 - ns0);
+#else
+    r = 1e9;
+#endif
+    __atomic_store(&rate, &r, __ATOMIC_RELAXED);
+    return r;
+}
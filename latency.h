@@ -0,0 +1,84 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Log-linear latency histogram in clock ticks. Each power of two is split
+ * into LATENCY_SUB_BUCKETS linear steps, so a bucket's width is at most 25%
+ * of its lower bound. 128 buckets reach 2^33 ticks (about 3 s of TSC at
+ * 3 GHz); anything longer lands in the last one.
+ *
+ * Recording is a bit scan and two stores, meant for hot paths. A histogram
+ * has exactly one writer at a time (the engine keeps one per shard, written
+ * under the shard lock), which uses relaxed atomic stores so readers can sum
+ * histograms without stopping it.
+ */
+#define LATENCY_SUB_BITS 2
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS 128
+
+typedef struct {
+    uint64_t count[LATENCY_BUCKETS];
+    uint64_t sum;           /* ticks */
+} latency_hist_t;
+
+/* TSC on x86, monotonic nanoseconds elsewhere. */
+static inline uint64_t latency_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * For the end of a timed section. Plain rdtsc may run before earlier loads
+ * have completed, which hides exactly the cache misses worth measuring;
+ * rdtscp waits for them.
+ */
+static inline uint64_t latency_ticks_end(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int aux;
+    return __rdtscp(&aux);
+#else
+    return latency_ticks();
+#endif
+}
+
+static inline int latency_bucket(uint64_t ticks) {
+    if (ticks < LATENCY_SUB_BUCKETS) {
+        return (int)ticks;
+    }
+    int msb = 63 - __builtin_clzll(ticks);
+    int b = ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+            (int)((ticks >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+/* Single writer only: see above. */
+static inline void latency_record(latency_hist_t *h, uint64_t ticks) {
+    int b = latency_bucket(ticks);
+    __atomic_store_n(&h->count[b], h->count[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + ticks, __ATOMIC_RELAXED);
+}
+
+/* Smallest tick count that falls in bucket b (b may be LATENCY_BUCKETS). */
+uint64_t latency_bucket_lower(int b);
+
+/* Add src into dst, reading src with relaxed loads. */
+void latency_hist_add(latency_hist_t *dst, const latency_hist_t *src);
+
+/* Upper bound in ticks of the bucket holding quantile q (0..1); 0 if empty. */
+uint64_t latency_quantile(const latency_hist_t *h, double q);
+
+/* Ticks per second, measured once against CLOCK_MONOTONIC on first use. */
+double latency_ticks_per_sec(void);
+
+#endif
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include "event_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ * Prints the records of one or more event log files as text or CSV, oldest
+ * file first in the order given. Records can be filtered to those naming a
+ * given private or public address.
+ */
+
+#define READ_RECORDS 4096
+
+static int csv;
+static int have_filter;
+static uint32_t filter_ip;
+static uint64_t counts[EVENT_BLOCK_RELEASE + 1];
+
+static const char *type_name(uint8_t type) {
+    switch (type) {
+        case EVENT_SESSION_CREATE: return "create";
+        case EVENT_SESSION_DELETE: return "delete";
+        case EVENT_BLOCK_ALLOC: return "block-alloc";
+        case EVENT_BLOCK_RELEASE: return "block-release";
+        default: return "unknown";
+    }
+}
+
+static const char *ip_str(uint32_t ip, char *buf) {
+    struct in_addr addr = { .s_addr = htonl(ip) };
+    return inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+static void print_record(const event_record_t *r) {
+    char when[32], priv[INET_ADDRSTRLEN], pub[INET_ADDRSTRLEN], remote[INET_ADDRSTRLEN];
+    time_t t = (time_t)r->time;
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+    const char *proto = r->protocol == 6 ? "tcp" : r->protocol == 17 ? "udp" : "-";
+    int block = r->type == EVENT_BLOCK_ALLOC || r->type == EVENT_BLOCK_RELEASE;
+
+    ip_str(r->priv_ip, priv);
+    ip_str(r->pub_ip, pub);
+    ip_str(r->remote_ip, remote);
+    if (csv) {
+        printf("%s,%s,%s,%s,%u,%s,%u,%u,%s,%u,%u\n", when, type_name(r->type), proto, priv, r->priv_port,
+               pub, r->pub_port, r->pub_port + r->port_count - 1u, block ? "" : remote, r->remote_port,
+               r->shard);
+    } else if (block) {
+        printf("%s %-13s %s -> %s:%u-%u\n", when, type_name(r->type), priv, pub, r->pub_port,
+               r->pub_port + r->port_count - 1u);
+    } else {
+        printf("%s %-13s %s %s:%u -> %s:%u remote %s:%u\n", when, type_name(r->type), proto, priv,
+               r->priv_port, pub, r->pub_port, remote, r->remote_port);
+    }
+}
+
+static int decode_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t header[EVENT_LOG_HEADER_SIZE];
+    uint64_t created;
+    uint32_t sequence;
+    if (fread(header, sizeof(header), 1, f) != 1 || event_log_decode_header(header, &created, &sequence) != 0) {
+        fprintf(stderr, "%s: not a version %d event log\n", path, EVENT_LOG_VERSION);
+        fclose(f);
+        return -1;
+    }
+
+    static uint8_t buf[READ_RECORDS * EVENT_LOG_RECORD_SIZE];
+    size_t n;
+    while ((n = fread(buf, EVENT_LOG_RECORD_SIZE, READ_RECORDS, f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            event_record_t r;
+            event_log_decode_record(buf + i * EVENT_LOG_RECORD_SIZE, &r);
+            if (have_filter && r.priv_ip != filter_ip && r.pub_ip != filter_ip) {
+                continue;
+            }
+            if (r.type <= EVENT_BLOCK_RELEASE) {
+                counts[r.type]++;
+            }
+            print_record(&r);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c] [-a address] file...\n"
+            "  -c  CSV: time,event,protocol,private ip,private port,public ip,first port,last port,\n"
+            "       remote ip,remote port,shard\n"
+            "  -a  only records with this private or public address\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "ca:")) != -1) {
+        switch (opt) {
+            case 'c': csv = 1; break;
+            case 'a': {
+                struct in_addr addr;
+                if (inet_pton(AF_INET, optarg, &addr) != 1) {
+                    fprintf(stderr, "Bad address: %s\n", optarg);
+                    return 1;
+                }
+                filter_ip = ntohl(addr.s_addr);
+                have_filter = 1;
+                break;
+            }
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        failed |= decode_file(argv[i]) != 0;
+    }
+    fprintf(stderr, "%lu created, %lu deleted, %lu blocks allocated, %lu blocks released\n",
+            counts[EVENT_SESSION_CREATE], counts[EVENT_SESSION_DELETE],
+            counts[EVENT_BLOCK_ALLOC], counts[EVENT_BLOCK_RELEASE]);
+    return failed;
+}
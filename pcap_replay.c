@@ -0,0 +1,656 @@
+#define _GNU_SOURCE
+#include "cgnat.h"
+#include "pkt_rewrite.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Offline replay of a subscriber-side capture through the engine. The input
+ * pcap or pcapng file is mapped copy-on-write so packets are rewritten where
+ * they lie. Packets from a private prefix take the outbound path; packets to
+ * a private prefix are return traffic and are first put back into their
+ * outside form (destination = the subscriber's public mapping) and then run
+ * through the inbound path. The output capture is therefore what the outside
+ * interface would have seen. Packet timestamps drive the engine clock, so
+ * sessions expire exactly as they would have during the trace.
+ */
+
+#define MAX_PRIVATE_PREFIXES 16
+#define REPLAY_BURST 64
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+
+/* Headers must be captured even when the payload was cut by the snaplen. */
+#define MIN_CAPTURED_HEADERS 80
+
+typedef struct {
+    uint32_t net;
+    uint32_t mask;
+} prefix_t;
+
+/* One packet as found in the capture. */
+typedef struct {
+    uint8_t *data;
+    uint32_t caplen;
+    uint32_t origlen;
+    uint64_t ts_ns;
+    int linktype;
+} capture_pkt_t;
+
+typedef struct {
+    uint8_t *map;
+    size_t size;
+    size_t pos;
+    int pcapng;
+    int swapped;
+    int nanosecond;             /* pcap timestamp fraction is in ns */
+    int linktype;               /* pcap file link type */
+    int if_linktype[64];        /* pcapng interface link types */
+    uint64_t if_tick_ns[64];    /* pcapng interface timestamp unit, in ns */
+    uint64_t if_tick_den[64];   /* ... or its divisor for sub-ns units */
+    int if_count;
+    uint64_t last_ts_ns;
+} capture_t;
+
+typedef struct {
+    FILE *out;
+    int linktype;
+    uint64_t written;
+    uint64_t skipped_linktype;
+} pcap_writer_t;
+
+/* Packets waiting for one burst translation, all in the same direction. */
+typedef struct {
+    packet_info_t pkts[REPLAY_BURST];
+    uint8_t *l3[REPLAY_BURST];
+    capture_pkt_t frames[REPLAY_BURST];
+    int count;
+    int outbound;
+} pending_t;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t outbound;
+    uint64_t inbound;
+    uint64_t outbound_failed;
+    uint64_t inbound_no_mapping;
+    uint64_t not_ipv4;
+    uint64_t not_subscriber;
+    uint64_t expired;
+} replay_counters_t;
+
+static prefix_t private_prefixes[MAX_PRIVATE_PREFIXES];
+static int num_private_prefixes;
+
+static uint16_t rd16(const capture_t *cap, const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return cap->swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t rd32(const capture_t *cap, const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return cap->swapped ? __builtin_bswap32(v) : v;
+}
+
+static int parse_prefix(const char *str, prefix_t *prefix) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s", str);
+    int bits = 32;
+    char *slash = strchr(buf, '/');
+    if (slash) {
+        *slash = '\0';
+        bits = atoi(slash + 1);
+    }
+    struct in_addr addr;
+    if (inet_pton(AF_INET, buf, &addr) != 1 || bits < 0 || bits > 32) {
+        return -1;
+    }
+    prefix->mask = bits ? 0xFFFFFFFFu << (32 - bits) : 0;
+    prefix->net = ntohl(addr.s_addr) & prefix->mask;
+    return 0;
+}
+
+static int is_private(uint32_t ip) {
+    for (int i = 0; i < num_private_prefixes; i++) {
+        if ((ip & private_prefixes[i].mask) == private_prefixes[i].net) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int capture_open(capture_t *cap, const char *path) {
+    memset(cap, 0, sizeof(*cap));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "[CGNAT] Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 24) {
+        fprintf(stderr, "[CGNAT] %s is not a capture file\n", path);
+        close(fd);
+        return -1;
+    }
+    /* Private writable mapping: rewrites land in copy-on-write pages. */
+    cap->size = (size_t)st.st_size;
+    cap->map = mmap(NULL, cap->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cap->map == MAP_FAILED) {
+        fprintf(stderr, "[CGNAT] Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise(cap->map, cap->size, MADV_SEQUENTIAL);
+
+    uint32_t magic;
+    memcpy(&magic, cap->map, sizeof(magic));
+    switch (magic) {
+        case 0xA1B2C3D4: break;
+        case 0xD4C3B2A1: cap->swapped = 1; break;
+        case 0xA1B23C4D: cap->nanosecond = 1; break;
+        case 0x4D3CB2A1: cap->swapped = 1; cap->nanosecond = 1; break;
+        case 0x0A0D0D0A: cap->pcapng = 1; break;
+        default:
+            fprintf(stderr, "[CGNAT] %s: unknown capture format\n", path);
+            munmap(cap->map, cap->size);
+            return -1;
+    }
+    if (!cap->pcapng) {
+        cap->linktype = (int)(rd32(cap, cap->map + 20) & 0xFFFF);
+        cap->pos = 24;
+    }
+    return 0;
+}
+
+static void pcapng_interface(capture_t *cap, const uint8_t *body, uint32_t body_len) {
+    if (cap->if_count >= 64 || body_len < 8) {
+        return;
+    }
+    int id = cap->if_count++;
+    cap->if_linktype[id] = rd16(cap, body);
+    cap->if_tick_ns[id] = 1000;     /* default if_tsresol is microseconds */
+    cap->if_tick_den[id] = 1;
+
+    uint32_t off = 8;
+    while (off + 4 <= body_len) {
+        uint16_t code = rd16(cap, body + off);
+        uint16_t len = rd16(cap, body + off + 2);
+        if (code == 0 || off + 4 + len > body_len) {
+            break;
+        }
+        if (code == 9 && len >= 1) {
+            uint8_t res = body[off + 4];
+            uint64_t units = 1;
+            for (int i = 0; i < (res & 0x7F) && units < (1ULL << 60); i++) {
+                units *= (res & 0x80) ? 2 : 10;
+            }
+            /* One tick is 1/units seconds. */
+            if (units <= 1000000000ULL) {
+                cap->if_tick_ns[id] = 1000000000ULL / units;
+                cap->if_tick_den[id] = 1;
+            } else {
+                cap->if_tick_ns[id] = 1;
+                cap->if_tick_den[id] = units / 1000000000ULL;
+            }
+        }
+        off += 4 + ((len + 3u) & ~3u);
+    }
+}
+
+static int capture_next_pcapng(capture_t *cap, capture_pkt_t *pkt) {
+    while (cap->pos + 12 <= cap->size) {
+        uint8_t *block = cap->map + cap->pos;
+        uint32_t type;
+        memcpy(&type, block, sizeof(type));
+
+        if (type == 0x0A0D0D0A) {
+            /* New section: its byte order and interfaces start over. */
+            uint32_t bom;
+            memcpy(&bom, block + 8, sizeof(bom));
+            cap->swapped = (bom == 0x4D3C2B1A);
+            cap->if_count = 0;
+        }
+        uint32_t total = rd32(cap, block + 4);
+        if (total < 12 || cap->pos + total > cap->size) {
+            return 0;
+        }
+        type = rd32(cap, block);
+        cap->pos += total;
+        uint8_t *body = block + 8;
+        uint32_t body_len = total - 12;
+
+        if (type == 1) {
+            pcapng_interface(cap, body, body_len);
+        } else if (type == 6 && body_len >= 20) {
+            uint32_t id = rd32(cap, body);
+            if (id >= (uint32_t)cap->if_count) {
+                continue;
+            }
+            uint64_t ticks = (uint64_t)rd32(cap, body + 4) << 32 | rd32(cap, body + 8);
+            pkt->caplen = rd32(cap, body + 12);
+            pkt->origlen = rd32(cap, body + 16);
+            if (pkt->caplen > body_len - 20) {
+                continue;
+            }
+            pkt->data = body + 20;
+            pkt->ts_ns = ticks * cap->if_tick_ns[id] / cap->if_tick_den[id];
+            pkt->linktype = cap->if_linktype[id];
+            cap->last_ts_ns = pkt->ts_ns;
+            return 1;
+        } else if (type == 3 && body_len >= 4 && cap->if_count > 0) {
+            /* Simple packet block: no timestamp, reuse the previous one. */
+            pkt->origlen = rd32(cap, body);
+            pkt->caplen = pkt->origlen < body_len - 4 ? pkt->origlen : body_len - 4;
+            pkt->data = body + 4;
+            pkt->ts_ns = cap->last_ts_ns;
+            pkt->linktype = cap->if_linktype[0];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns 1 and fills pkt, or 0 at the end of the capture. */
+static int capture_next(capture_t *cap, capture_pkt_t *pkt) {
+    if (cap->pcapng) {
+        return capture_next_pcapng(cap, pkt);
+    }
+    if (cap->pos + 16 > cap->size) {
+        return 0;
+    }
+    const uint8_t *rec = cap->map + cap->pos;
+    uint32_t caplen = rd32(cap, rec + 8);
+    if (cap->pos + 16 + caplen > cap->size) {
+        return 0;
+    }
+    pkt->ts_ns = (uint64_t)rd32(cap, rec) * 1000000000ULL +
+                 (uint64_t)rd32(cap, rec + 4) * (cap->nanosecond ? 1 : 1000);
+    pkt->caplen = caplen;
+    pkt->origlen = rd32(cap, rec + 12);
+    pkt->data = cap->map + cap->pos + 16;
+    pkt->linktype = cap->linktype;
+    cap->pos += 16 + caplen;
+    return 1;
+}
+
+/* Offset of the IPv4 header in a frame, or -1. */
+static int l3_offset(const capture_pkt_t *pkt) {
+    const uint8_t *d = pkt->data;
+    switch (pkt->linktype) {
+        case LINKTYPE_ETHERNET: {
+            uint32_t off = 12;
+            while (off + 4 <= pkt->caplen && (d[off] << 8 | d[off + 1]) == 0x8100) {
+                off += 4;   /* 802.1Q tag */
+            }
+            if (off + 2 > pkt->caplen || (d[off] << 8 | d[off + 1]) != 0x0800) {
+                return -1;
+            }
+            return (int)off + 2;
+        }
+        case LINKTYPE_LINUX_SLL:
+            if (pkt->caplen < 16 || (d[14] << 8 | d[15]) != 0x0800) {
+                return -1;
+            }
+            return 16;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static int writer_open(pcap_writer_t *w, const char *path) {
+    memset(w, 0, sizeof(*w));
+    w->linktype = -1;
+    if (!path) {
+        return 0;
+    }
+    w->out = fopen(path, "wb");
+    if (!w->out) {
+        fprintf(stderr, "[CGNAT] Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(w->out, NULL, _IOFBF, 1 << 20);
+    return 0;
+}
+
+static void writer_packet(pcap_writer_t *w, const capture_pkt_t *pkt) {
+    if (!w->out) {
+        return;
+    }
+    if (w->linktype < 0) {
+        /* Classic microsecond pcap, link type of the first packet written. */
+        uint32_t header[6] = { 0xA1B2C3D4, 2 | (4u << 16), 0, 0, 262144, (uint32_t)pkt->linktype };
+        fwrite(header, sizeof(header), 1, w->out);
+        w->linktype = pkt->linktype;
+    }
+    if (pkt->linktype != w->linktype) {
+        w->skipped_linktype++;
+        return;
+    }
+    uint32_t rec[4] = {
+        (uint32_t)(pkt->ts_ns / 1000000000ULL),
+        (uint32_t)(pkt->ts_ns % 1000000000ULL / 1000),
+        pkt->caplen,
+        pkt->origlen,
+    };
+    fwrite(rec, sizeof(rec), 1, w->out);
+    fwrite(pkt->data, pkt->caplen, 1, w->out);
+    w->written++;
+}
+
+static void flush_pending(cgnat_t *cgnat, pending_t *pending, pcap_writer_t *writer, replay_counters_t *c) {
+    int results[REPLAY_BURST];
+    if (pending->count == 0) {
+        return;
+    }
+
+    if (pending->outbound) {
+        cgnat_translate_outbound_burst(cgnat, pending->pkts, pending->count, results);
+        pkt_rewrite_burst(pending->l3, pending->pkts, results, pending->count);
+    } else {
+        /* Buffers already hold the outside form; the engine maps it back. */
+        cgnat_translate_inbound_burst(cgnat, pending->pkts, pending->count, results);
+    }
+
+    for (int i = 0; i < pending->count; i++) {
+        if (results[i] != 0) {
+            if (pending->outbound) {
+                c->outbound_failed++;
+            } else {
+                c->inbound_no_mapping++;
+            }
+            continue;
+        }
+        writer_packet(writer, &pending->frames[i]);
+    }
+    pending->count = 0;
+}
+
+typedef struct {
+    uint64_t total_connections;
+    uint64_t active_connections;
+    int ports_in_use;
+} engine_snapshot_t;
+
+static void engine_snapshot(cgnat_t *cgnat, engine_snapshot_t *snap) {
+    cgnat_counters_t c;
+    cgnat_get_counters(cgnat, &c);
+    snap->total_connections = c.total_connections;
+    snap->active_connections = c.active_connections;
+    snap->ports_in_use = (int)c.ports_in_use;
+}
+
+static void print_timeline_row(cgnat_t *cgnat, double offset, double span, engine_snapshot_t *last,
+                               uint64_t expired) {
+    engine_snapshot_t snap;
+    engine_snapshot(cgnat, &snap);
+    double utilization = (double)snap.ports_in_use / (cgnat->num_public_ips * TOTAL_PORTS_PER_IP) * 100.0;
+    printf("  %+9.0fs %10lu %10d %8.3f%% %10.1f %10lu\n", offset, snap.active_connections,
+           snap.ports_in_use, utilization,
+           (double)(snap.total_connections - last->total_connections) / span, expired);
+    *last = snap;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-p public-ip]... [-n private-prefix]... [-s shards] [-m sessions] [-i seconds]\n"
+            "          [-L log-path]\n"
+            "          input.pcap|input.pcapng [output.pcap]\n"
+            "  -p  public pool address (default 203.0.113.1-10)\n"
+            "  -n  subscriber prefix (default 10/8, 100.64/10, 172.16/12, 192.168/16)\n"
+            "  -s  engine shards (default 1)\n"
+            "  -m  session capacity (default %d)\n"
+            "  -i  port-utilization timeline interval in trace seconds (default 10)\n"
+            "  -L  write the mapping event log to <log-path>.NNNNNN\n",
+            prog, MAX_NAT_ENTRIES);
+}
+
+int main(int argc, char **argv) {
+    const char **public_ips = calloc((size_t)argc, sizeof(char*));
+    int num_public = 0;
+    cgnat_config_t config;
+    cgnat_config_default(&config);
+    int interval = 10;
+    const char *log_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:n:s:m:i:L:")) != -1) {
+        switch (opt) {
+            case 'p': public_ips[num_public++] = optarg; break;
+            case 'n':
+                if (num_private_prefixes == MAX_PRIVATE_PREFIXES ||
+                    parse_prefix(optarg, &private_prefixes[num_private_prefixes]) != 0) {
+                    fprintf(stderr, "[CGNAT] Bad private prefix: %s\n", optarg);
+                    return 1;
+                }
+                num_private_prefixes++;
+                break;
+            case 's': config.num_shards = atoi(optarg); break;
+            case 'm': config.max_sessions = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'i': interval = atoi(optarg); break;
+            case 'L': log_path = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || interval < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *input = argv[optind];
+    const char *output = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    if (num_private_prefixes == 0) {
+        const char *defaults[] = { "10.0.0.0/8", "100.64.0.0/10", "172.16.0.0/12", "192.168.0.0/16" };
+        for (int i = 0; i < 4; i++) {
+            parse_prefix(defaults[i], &private_prefixes[num_private_prefixes++]);
+        }
+    }
+
+    capture_t cap;
+    pcap_writer_t writer;
+    if (capture_open(&cap, input) != 0 || writer_open(&writer, output) != 0) {
+        return 1;
+    }
+
+    if (num_public > 0) {
+        config.max_public_ips = num_public;
+    }
+    cgnat_t *cgnat = cgnat_init_config(&config);
+    if (!cgnat) {
+        return 1;
+    }
+    event_log_t *event_log = NULL;
+    if (log_path) {
+        event_log_config_t log_config;
+        event_log_config_default(&log_config);
+        log_config.path = log_path;
+        event_log = event_log_open(&log_config, config.num_shards);
+        if (!event_log || cgnat_set_event_log(cgnat, event_log) != 0) {
+            cgnat_destroy(cgnat);
+            return 1;
+        }
+    }
+    if (num_public == 0) {
+        for (int i = 1; i <= 10; i++) {
+            char ip[32];
+            snprintf(ip, sizeof(ip), "203.0.113.%d", i);
+            cgnat_add_public_ip(cgnat, ip);
+        }
+    }
+    for (int i = 0; i < num_public; i++) {
+        if (cgnat_add_public_ip(cgnat, public_ips[i]) != 0) {
+            cgnat_destroy(cgnat);
+            return 1;
+        }
+    }
+
+    printf("\nReplaying %s (%s)\n\n", input, cap.pcapng ? "pcapng" : "pcap");
+    printf("Port-utilization timeline (every %d trace seconds):\n", interval);
+    printf("  %10s %10s %10s %9s %10s %10s\n", "trace time", "sessions", "ports", "util", "new/s", "expired");
+
+    static pending_t pending;
+    replay_counters_t c;
+    memset(&c, 0, sizeof(c));
+    engine_snapshot_t last_row, last_second;
+    memset(&last_row, 0, sizeof(last_row));
+    memset(&last_second, 0, sizeof(last_second));
+    uint64_t peak_new_per_sec = 0;
+    uint64_t row_expired = 0;
+    uint64_t first_sec = 0, clock_sec = 0, next_row = 0, last_row_sec = 0;
+    int started = 0;
+
+    double wall_start = monotonic_seconds();
+    capture_pkt_t frame;
+    while (capture_next(&cap, &frame)) {
+        uint64_t sec = frame.ts_ns / 1000000000ULL;
+        c.packets++;
+        c.bytes += frame.origlen;
+
+        if (!started) {
+            started = 1;
+            first_sec = clock_sec = sec;
+            next_row = sec + (uint64_t)interval;
+            last_row_sec = sec;
+            cgnat_set_time(cgnat, (time_t)sec);
+        } else if (sec > clock_sec) {
+            /* Advance the engine clock one trace second at a time. */
+            flush_pending(cgnat, &pending, &writer, &c);
+            clock_sec = sec;
+            cgnat_set_time(cgnat, (time_t)sec);
+            int expired = cgnat_expire_sessions(cgnat);
+            c.expired += (uint64_t)expired;
+            row_expired += (uint64_t)expired;
+
+            engine_snapshot_t snap;
+            engine_snapshot(cgnat, &snap);
+            if (snap.total_connections - last_second.total_connections > peak_new_per_sec) {
+                peak_new_per_sec = snap.total_connections - last_second.total_connections;
+            }
+            last_second = snap;
+
+            while (sec >= next_row) {
+                print_timeline_row(cgnat, (double)(next_row - first_sec), interval, &last_row, row_expired);
+                last_row_sec = next_row;
+                row_expired = 0;
+                next_row += (uint64_t)interval;
+            }
+        }
+
+        int l3 = l3_offset(&frame);
+        packet_info_t pkt;
+        if (l3 < 0 || frame.origlen < (uint32_t)l3) {
+            c.not_ipv4++;
+            continue;
+        }
+        uint32_t captured = frame.caplen - (uint32_t)l3;
+        uint32_t wire = frame.origlen - (uint32_t)l3;
+        if ((captured < wire && captured < MIN_CAPTURED_HEADERS) ||
+            pkt_parse(frame.data + l3, wire, &pkt) < 0) {
+            c.not_ipv4++;
+            continue;
+        }
+
+        int outbound;
+        if (is_private(pkt.src_ip)) {
+            outbound = 1;
+            c.outbound++;
+        } else if (is_private(pkt.dst_ip)) {
+            outbound = 0;
+            c.inbound++;
+        } else {
+            c.not_subscriber++;
+            continue;
+        }
+
+        if (pending.count == REPLAY_BURST || (pending.count > 0 && pending.outbound != outbound)) {
+            flush_pending(cgnat, &pending, &writer, &c);
+        }
+        if (!outbound) {
+            /* Return traffic: restore the outside destination the engine expects. */
+            uint32_t pub_ip;
+            uint16_t pub_port;
+            if (cgnat_lookup_mapping(cgnat, pkt.dst_ip, pkt.dst_port, pkt.protocol, &pub_ip, &pub_port) != 0) {
+                c.inbound_no_mapping++;
+                continue;
+            }
+            pkt.dst_ip = pub_ip;
+            pkt.dst_port = pub_port;
+            pkt_rewrite(frame.data + l3, &pkt);
+        }
+
+        pending.outbound = outbound;
+        pending.pkts[pending.count] = pkt;
+        pending.l3[pending.count] = frame.data + l3;
+        pending.frames[pending.count] = frame;
+        pending.count++;
+    }
+    flush_pending(cgnat, &pending, &writer, &c);
+    if (started && clock_sec + 1 > last_row_sec) {
+        /* Partial interval at the end of the trace. */
+        print_timeline_row(cgnat, (double)(clock_sec + 1 - first_sec), (double)(clock_sec + 1 - last_row_sec),
+                           &last_row, row_expired);
+    }
+    double wall = monotonic_seconds() - wall_start;
+
+    engine_snapshot_t final;
+    engine_snapshot(cgnat, &final);
+    double trace_seconds = started ? (double)(clock_sec - first_sec + 1) : 0.0;
+
+    printf("\n========== Replay Summary ==========\n");
+    printf("Packets read: %lu (%.1f MB)\n", c.packets, c.bytes / 1e6);
+    printf("Outbound / return packets: %lu / %lu\n", c.outbound, c.inbound);
+    printf("Skipped: %lu not IPv4 TCP/UDP, %lu not subscriber traffic\n", c.not_ipv4, c.not_subscriber);
+    printf("Dropped: %lu outbound (no port or table full), %lu return (no mapping)\n",
+           c.outbound_failed, c.inbound_no_mapping);
+    printf("Replay time: %.3f s for %.0f s of trace (%.1fx real time)\n",
+           wall, trace_seconds, wall > 0 ? trace_seconds / wall : 0.0);
+    printf("Throughput: %.0f packets/sec, %.1f Mbit/sec\n",
+           wall > 0 ? c.packets / wall : 0.0, wall > 0 ? c.bytes * 8 / wall / 1e6 : 0.0);
+    printf("Sessions created: %lu (%.1f/s average over the trace, %lu/s peak)\n",
+           final.total_connections,
+           trace_seconds > 0 ? final.total_connections / trace_seconds : 0.0, peak_new_per_sec);
+    printf("Sessions expired during the trace: %lu\n", c.expired);
+    if (writer.out) {
+        printf("Packets written to %s: %lu", output, writer.written);
+        if (writer.skipped_linktype) {
+            printf(" (%lu skipped: link type differs from the first packet)", writer.skipped_linktype);
+        }
+        printf("\n");
+        fclose(writer.out);
+    }
+    if (event_log) {
+        event_log_stats_t log_stats;
+        event_log_sync(event_log);
+        event_log_get_stats(event_log, &log_stats);
+        printf("Event log: %lu records in %u files (%.1f MB), %lu dropped\n", log_stats.written,
+               log_stats.files, log_stats.bytes / 1e6, log_stats.dropped);
+    }
+    printf("====================================\n");
+
+    munmap(cap.map, cap.size);
+    cgnat_set_event_log(cgnat, NULL);
+    event_log_close(event_log);
+    cgnat_destroy(cgnat);
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "pkt_rewrite.h"
+
+static inline uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+/* One's-complement delta for replacing old with new: ~m + m'. */
+static inline uint32_t csum_delta32(uint32_t old, uint32_t new) {
+    return (~old >> 16) + (~old & 0xFFFF) + (new >> 16) + (new & 0xFFFF);
+}
+
+static inline uint32_t csum_delta16(uint16_t old, uint16_t new) {
+    return (uint16_t)~old + (uint32_t)new;
+}
+
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'). */
+static inline uint16_t csum_apply(uint16_t check, uint32_t delta) {
+    return (uint16_t)~csum_fold((uint16_t)~check + delta);
+}
+
+static inline int l4_check_offset(uint8_t protocol) {
+    return protocol == PROTO_TCP ? 16 : 6;
+}
+
+int pkt_parse(const uint8_t *ip, uint32_t len, packet_info_t *pkt) {
+    if (len < 20 || (ip[0] >> 4) != 4) {
+        return -1;
+    }
+    uint32_t ihl = (ip[0] & 0x0F) * 4u;
+    uint32_t total = get16(ip + 2);
+    if (ihl < 20 || total < ihl || total > len) {
+        return -1;
+    }
+    /* Only unfragmented datagrams carry a port pair we can rewrite. */
+    if (get16(ip + 6) & 0x3FFF) {
+        return -1;
+    }
+
+    uint8_t protocol = ip[9];
+    uint32_t l4_len = total - ihl;
+    const uint8_t *l4 = ip + ihl;
+    if (protocol == PROTO_TCP) {
+        if (l4_len < 20 || (l4[12] >> 4) * 4u > l4_len) {
+            return -1;
+        }
+        pkt->payload_len = l4_len - (l4[12] >> 4) * 4u;
+    } else if (protocol == PROTO_UDP) {
+        if (l4_len < 8) {
+            return -1;
+        }
+        pkt->payload_len = l4_len - 8;
+    } else {
+        return -1;
+    }
+
+    pkt->src_ip = get32(ip + 12);
+    pkt->dst_ip = get32(ip + 16);
+    pkt->src_port = get16(l4);
+    pkt->dst_port = get16(l4 + 2);
+    pkt->protocol = protocol;
+    return (int)total;
+}
+
+void pkt_rewrite(uint8_t *ip, const packet_info_t *pkt) {
+    uint8_t *l4 = ip + (ip[0] & 0x0F) * 4u;
+
+    uint32_t addr_delta = csum_delta32(get32(ip + 12), pkt->src_ip) +
+                          csum_delta32(get32(ip + 16), pkt->dst_ip);
+    uint32_t l4_delta = addr_delta +
+                        csum_delta16(get16(l4), pkt->src_port) +
+                        csum_delta16(get16(l4 + 2), pkt->dst_port);
+
+    put32(ip + 12, pkt->src_ip);
+    put32(ip + 16, pkt->dst_ip);
+    put16(ip + 10, csum_apply(get16(ip + 10), addr_delta));
+
+    put16(l4, pkt->src_port);
+    put16(l4 + 2, pkt->dst_port);
+
+    uint8_t *check = l4 + l4_check_offset(pkt->protocol);
+    uint16_t old = get16(check);
+    if (pkt->protocol == PROTO_UDP) {
+        if (old == 0) {
+            return;     /* sender did not compute one */
+        }
+        uint16_t updated = csum_apply(old, l4_delta);
+        put16(check, updated ? updated : 0xFFFF);
+        return;
+    }
+    put16(check, csum_apply(old, l4_delta));
+}
+
+void pkt_rewrite_burst(uint8_t *const *bufs, const packet_info_t *pkts, const int *results, int count) {
+    for (int i = 0; i < count; i++) {
+        if (i + 1 < count) {
+            __builtin_prefetch(bufs[i + 1], 1);
+        }
+        if (!results || results[i] == 0) {
+            pkt_rewrite(bufs[i], &pkts[i]);
+        }
+    }
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, uint32_t len) {
+    while (len > 1) {
+        sum += get16(data);
+        data += 2;
+        len -= 2;
+    }
+    if (len) {
+        sum += (uint32_t)data[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold_full(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+void pkt_rewrite_full(uint8_t *ip, const packet_info_t *pkt) {
+    uint32_t ihl = (ip[0] & 0x0F) * 4u;
+    uint32_t l4_len = get16(ip + 2) - ihl;
+    uint8_t *l4 = ip + ihl;
+
+    put32(ip + 12, pkt->src_ip);
+    put32(ip + 16, pkt->dst_ip);
+    put16(ip + 10, 0);
+    put16(ip + 10, csum_fold_full(csum_add(0, ip, ihl)));
+
+    put16(l4, pkt->src_port);
+    put16(l4 + 2, pkt->dst_port);
+
+    uint8_t *check = l4 + l4_check_offset(pkt->protocol);
+    put16(check, 0);
+    uint32_t sum = csum_add(0, ip + 12, 8) + pkt->protocol + l4_len;
+    uint16_t folded = csum_fold_full(csum_add(sum, l4, l4_len));
+    if (pkt->protocol == PROTO_UDP && folded == 0) {
+        folded = 0xFFFF;
+    }
+    put16(check, folded);
+}
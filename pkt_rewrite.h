@@ -0,0 +1,33 @@
+#ifndef PKT_REWRITE_H
+#define PKT_REWRITE_H
+
+#include <stdint.h>
+#include "cgnat.h"
+
+/*
+ * In-place IPv4/TCP/UDP header rewrite. Buffers start at the IPv4 header.
+ * pkt_rewrite patches the IP and L4 checksums incrementally (RFC 1624) from
+ * the address and port words that change, so its cost does not depend on
+ * the payload length. A UDP checksum of zero means "not computed" and is
+ * left alone; a rewritten UDP checksum that folds to zero is sent as 0xFFFF.
+ */
+
+/*
+ * Fill pkt from the headers. Returns the IPv4 total length, or -1 if the
+ * buffer is not an unfragmented IPv4 TCP/UDP packet that fits in len.
+ */
+int pkt_parse(const uint8_t *ip, uint32_t len, packet_info_t *pkt);
+
+/* Rewrite addresses and ports to pkt's, patching checksums incrementally. */
+void pkt_rewrite(uint8_t *ip, const packet_info_t *pkt);
+
+/* Rewrite bufs[i] to pkts[i] where results[i] is 0; results may be NULL. */
+void pkt_rewrite_burst(uint8_t *const *bufs, const packet_info_t *pkts, const int *results, int count);
+
+/*
+ * Rewrite and recompute both checksums over the whole packet. Needed when
+ * the L4 checksum field still holds a partial sum left for offload.
+ */
+void pkt_rewrite_full(uint8_t *ip, const packet_info_t *pkt);
+
+#endif
@@ -0,0 +1,161 @@
+#include "portmap.h"
+
+static uint32_t summary_words(uint32_t nwords) {
+    return (nwords + 63) / 64;
+}
+
+uint32_t portmap_storage_words(uint32_t nbits) {
+    uint32_t nwords = (nbits + 63) / 64;
+    return nwords + summary_words(nwords);
+}
+
+static void mark_word_full(portmap_t *map, uint32_t w) {
+    uint32_t sw = w >> 6;
+    map->summary[sw] |= 1ULL << (w & 63);
+    if (map->summary[sw] == ~0ULL) {
+        map->top |= 1ULL << sw;
+    }
+}
+
+void portmap_init(portmap_t *map, uint32_t nbits, uint64_t *storage) {
+    map->nbits = nbits;
+    map->nwords = (nbits + 63) / 64;
+    map->nfree = nbits;
+    map->words = storage;
+    map->summary = storage + map->nwords;
+
+    /* Everything past the end reads as permanently in use. */
+    uint32_t nsum = summary_words(map->nwords);
+    map->top = nsum < 64 ? ~0ULL << nsum : 0;
+    if (map->nwords & 63) {
+        map->summary[nsum - 1] |= ~0ULL << (map->nwords & 63);
+    }
+    if (nbits & 63) {
+        map->words[map->nwords - 1] |= ~0ULL << (nbits & 63);
+        if (map->words[map->nwords - 1] == ~0ULL) {
+            mark_word_full(map, map->nwords - 1);
+        }
+    }
+    if (nsum > 0 && map->summary[nsum - 1] == ~0ULL) {
+        map->top |= 1ULL << (nsum - 1);
+    }
+}
+
+void portmap_attach(portmap_t *map, uint64_t *storage) {
+    map->words = storage;
+    map->summary = storage + map->nwords;
+}
+
+/* First word at or after w with a free bit, or -1. */
+static int next_free_word(const portmap_t *map, uint32_t w) {
+    uint32_t sw = w >> 6;
+    uint64_t bits = ~map->summary[sw] & (~0ULL << (w & 63));
+    if (bits) {
+        return (int)(sw * 64 + __builtin_ctzll(bits));
+    }
+    if (sw == 63) {
+        return -1;
+    }
+    bits = ~map->top & (~0ULL << (sw + 1));
+    if (!bits) {
+        return -1;
+    }
+    sw = __builtin_ctzll(bits);
+    return (int)(sw * 64 + __builtin_ctzll(~map->summary[sw]));
+}
+
+static int find_free_from(const portmap_t *map, uint32_t hint) {
+    uint32_t w = hint >> 6;
+    uint64_t bits = ~map->words[w] & (~0ULL << (hint & 63));
+    if (bits) {
+        return (int)(w * 64 + __builtin_ctzll(bits));
+    }
+    if (w + 1 >= map->nwords) {
+        return -1;
+    }
+    int next = next_free_word(map, w + 1);
+    if (next < 0) {
+        return -1;
+    }
+    return next * 64 + __builtin_ctzll(~map->words[next]);
+}
+
+static void mark_used(portmap_t *map, uint32_t idx) {
+    uint32_t w = idx >> 6;
+    map->words[w] |= 1ULL << (idx & 63);
+    if (map->words[w] == ~0ULL) {
+        mark_word_full(map, w);
+    }
+    __atomic_store_n(&map->nfree, map->nfree - 1, __ATOMIC_RELAXED);
+}
+
+int portmap_alloc_from(portmap_t *map, uint32_t hint) {
+    if (map->nfree == 0) {
+        return -1;
+    }
+    if (hint >= map->nbits) {
+        hint = 0;
+    }
+
+    int idx = find_free_from(map, hint);
+    if (idx < 0) {
+        idx = find_free_from(map, 0);
+        if (idx < 0) {
+            return -1;
+        }
+    }
+
+    mark_used(map, (uint32_t)idx);
+    return idx;
+}
+
+/* First free index in [from, end), or -1. Ranges are short: scan the words. */
+static int find_free_between(const portmap_t *map, uint32_t from, uint32_t end) {
+    while (from < end) {
+        uint32_t w = from >> 6;
+        uint64_t bits = ~map->words[w] & (~0ULL << (from & 63));
+        uint32_t word_end = (w + 1) * 64;
+        if (end < word_end) {
+            bits &= ~(~0ULL << (end & 63));
+        }
+        if (bits) {
+            return (int)(w * 64 + __builtin_ctzll(bits));
+        }
+        from = word_end;
+    }
+    return -1;
+}
+
+int portmap_alloc_range(portmap_t *map, uint32_t first, uint32_t count, uint32_t hint) {
+    uint32_t end = first + count;
+    if (map->nfree == 0 || end > map->nbits) {
+        return -1;
+    }
+    uint32_t start = first + (hint < count ? hint : 0);
+
+    int idx = find_free_between(map, start, end);
+    if (idx < 0) {
+        idx = find_free_between(map, first, start);
+        if (idx < 0) {
+            return -1;
+        }
+    }
+    mark_used(map, (uint32_t)idx);
+    return idx;
+}
+
+void portmap_release(portmap_t *map, uint32_t idx) {
+    if (idx >= map->nbits || !portmap_in_use(map, idx)) {
+        return;
+    }
+    uint32_t w = idx >> 6;
+    uint32_t sw = w >> 6;
+    map->words[w] &= ~(1ULL << (idx & 63));
+    map->summary[sw] &= ~(1ULL << (w & 63));
+    map->top &= ~(1ULL << sw);
+    __atomic_store_n(&map->nfree, map->nfree + 1, __ATOMIC_RELAXED);
+}
+
+int portmap_in_use(const portmap_t *map, uint32_t idx) {
+    return (map->words[idx >> 6] >> (idx & 63)) & 1;
+}
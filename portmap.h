@@ -0,0 +1,47 @@
+#ifndef PORTMAP_H
+#define PORTMAP_H
+
+#include <stdint.h>
+
+/*
+ * Two-level bitmap allocator. A set bit in `words` marks an index in use, a
+ * set bit in `summary` marks a fully used word and a set bit in `top` marks a
+ * fully used summary word, so a free index is found with three ctz steps.
+ * Zeroed storage is an empty map, which keeps initialization cheap.
+ */
+#define PORTMAP_MAX_BITS (64u * 64u * 64u)
+
+typedef struct {
+    uint64_t *words;
+    uint64_t *summary;
+    uint64_t top;
+    uint32_t nbits;
+    uint32_t nwords;
+    uint32_t nfree;         /* stored atomically: see portmap_free_count */
+} portmap_t;
+
+/* Number of uint64_t words of storage needed for an nbits map. */
+uint32_t portmap_storage_words(uint32_t nbits);
+
+/* storage must hold portmap_storage_words(nbits) zeroed words. */
+void portmap_init(portmap_t *map, uint32_t nbits, uint64_t *storage);
+
+/* Point an initialized map at its storage again after both have moved. */
+void portmap_attach(portmap_t *map, uint64_t *storage);
+
+/* Allocate the first free index at or after hint, wrapping around. -1 if full. */
+int portmap_alloc_from(portmap_t *map, uint32_t hint);
+/*
+ * Allocate within [first, first + count) only, starting the search at
+ * first + hint and wrapping inside the range. -1 if the range is full.
+ */
+int portmap_alloc_range(portmap_t *map, uint32_t first, uint32_t count, uint32_t hint);
+void portmap_release(portmap_t *map, uint32_t idx);
+int portmap_in_use(const portmap_t *map, uint32_t idx);
+
+/* Free indices, readable without the lock that serializes the map's writers. */
+static inline uint32_t portmap_free_count(const portmap_t *map) {
+    return __atomic_load_n(&map->nfree, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+
+/*
+ * Single-producer, single-consumer record ring, shared by the event log and
+ * HA sync. head is only written by the producer and tail only by the
+ * consumer; each sits on its own cache line with the other side's last seen
+ * value. A full ring never blocks the producer: the record is counted in
+ * dropped instead. The consumer reads records[tail & mask] up to an acquire
+ * load of head and publishes tail with a release store.
+ *
+ * SPSC_RING_DEFINE(name, record_type) declares name_t and name_push().
+ */
+#define SPSC_RING_DEFINE(name, record_type)                                             \
+typedef struct {                                                                        \
+    uint64_t head;                                                                      \
+    uint64_t tail_cache;                                                                \
+    uint64_t dropped;                                                                   \
+    char pad0[40];                                                                      \
+    uint64_t tail;                                                                      \
+    char pad1[56];                                                                      \
+    record_type *records;                                                               \
+    uint32_t mask;                                                                      \
+} __attribute__((aligned(64))) name##_t;                                                \
+                                                                                        \
+/* Producer side; the caller must be the ring's only producer at the time. */           \
+static inline void name##_push(name##_t *ring, const record_type *record) {            \
+    uint64_t head = ring->head;                                                         \
+    if (head - ring->tail_cache > ring->mask) {                                         \
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);              \
+        if (head - ring->tail_cache > ring->mask) {                                     \
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);      \
+            return;                                                                     \
+        }                                                                               \
+    }                                                                                   \
+    ring->records[head & ring->mask] = *record;                                         \
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);                          \
+}
+
+#endif
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include "stats_stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define HISTORY_ROWS_PER_CALL 256
+
+typedef struct {
+    time_t t;
+    uint64_t active_connections;
+    uint64_t ports_in_use;
+    uint64_t packets_per_sec;
+    uint64_t connections_per_sec;
+    uint64_t exhaustion_per_sec;
+} stats_sample_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+} stats_event_t;
+
+struct stats_stream {
+    cgnat_t *cgnat;
+    http_server_t *http;
+    pthread_t sampler;
+
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    int stop;
+
+    /*
+     * Sample and event n (counted from 1) live at index n % size. The
+     * sampler writes a slot under the write lock; clients copy out under
+     * the read lock.
+     */
+    pthread_rwlock_t lock;
+    uint64_t latest;        /* 0 until the first sample */
+    stats_sample_t samples[STATS_STREAM_SECONDS];
+    stats_event_t events[STATS_STREAM_BACKLOG];
+};
+
+typedef struct {
+    stats_stream_t *stream;
+    uint64_t next;          /* next live event to send */
+    uint64_t history_next;  /* next history row; 0 when none is due */
+    uint64_t history_end;
+} stream_client_t;
+
+/* Event text, grown as needed; a failed allocation drops the event. */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} event_buf_t;
+
+static void event_printf(event_buf_t *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void event_printf(event_buf_t *b, const char *fmt, ...) {
+    for (;;) {
+        if (b->failed) {
+            return;
+        }
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            b->failed = 1;
+            return;
+        }
+        if ((size_t)n < b->cap - b->len) {
+            b->len += (size_t)n;
+            return;
+        }
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap - b->len <= (size_t)n) {
+            cap *= 2;
+        }
+        char *grown = realloc(b->data, cap);
+        if (!grown) {
+            b->failed = 1;
+            return;
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t per_sec(uint64_t now, uint64_t before, uint64_t elapsed_ms) {
+    return now > before && elapsed_ms > 0 ? (now - before) * 1000 / elapsed_ms : 0;
+}
+
+/* The "stats" event: same field names as /api/stats, plus the rates. */
+static void format_event(event_buf_t *b, uint64_t id, const stats_sample_t *s, const cgnat_t *cgnat,
+                         const cgnat_counters_t *c, const uint32_t *ports_per_ip, int num_public_ips) {
+    uint64_t total_ports = (uint64_t)num_public_ips * TOTAL_PORTS_PER_IP;
+    uint64_t nat_entries = c->entry_allocs - c->entry_frees;
+    const uint64_t *states = c->sessions_by_state;
+
+    event_printf(b, "id: %lu\nevent: stats\ndata: {\"timestamp\": %ld, \"num_public_ips\": %d, "
+                 "\"total_ports\": %lu, \"ports_in_use\": %lu, \"ports_available\": %lu, "
+                 "\"port_utilization\": %.2f, \"total_connections\": %lu, \"active_connections\": %lu, "
+                 "\"packets_translated\": %lu, \"port_exhaustion_events\": %lu, "
+                 "\"nat_table_entries\": %lu, \"nat_table_capacity\": %u, \"nat_table_utilization\": %.2f, "
+                 "\"lookup_misses\": %lu, \"inbound_drops\": %lu, \"allocation_failures\": %lu, "
+                 "\"packets_per_sec\": %lu, \"connections_per_sec\": %lu, \"exhaustion_per_sec\": %lu, "
+                 "\"public_ips\": [",
+                 id, (long)s->t, num_public_ips, total_ports, s->ports_in_use, total_ports - s->ports_in_use,
+                 total_ports ? (double)s->ports_in_use / (double)total_ports * 100.0 : 0.0,
+                 c->total_connections, c->active_connections, c->packets_translated, c->port_exhaustion_events,
+                 nat_entries, cgnat->max_sessions, (double)nat_entries / cgnat->max_sessions * 100.0,
+                 c->lookup_misses, c->inbound_drops, c->alloc_failures,
+                 s->packets_per_sec, s->connections_per_sec, s->exhaustion_per_sec);
+    for (int i = 0; i < num_public_ips; i++) {
+        struct in_addr addr = { .s_addr = htonl(cgnat->public_ips[i]) };
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        event_printf(b, "%s{\"ip\": \"%s\", \"ports_used\": %u, \"ports_available\": %u}",
+                     i ? ", " : "", ip, ports_per_ip[i], TOTAL_PORTS_PER_IP - ports_per_ip[i]);
+    }
+    event_printf(b, "], \"connection_states\": {\"closed\": %lu, \"syn_sent\": %lu, \"syn_received\": %lu, "
+                 "\"established\": %lu, \"fin_wait\": %lu, \"closing\": %lu, \"time_wait\": %lu, "
+                 "\"udp_active\": %lu}}\n\n",
+                 states[STATE_CLOSED], states[STATE_SYN_SENT], states[STATE_SYN_RECEIVED],
+                 states[STATE_ESTABLISHED], states[STATE_FIN_WAIT], states[STATE_CLOSING],
+                 states[STATE_TIME_WAIT], states[STATE_UDP_ACTIVE]);
+}
+
+static void* sampler_main(void *arg) {
+    stats_stream_t *st = arg;
+    uint32_t *ports_per_ip = calloc((size_t)st->cgnat->max_public_ips, sizeof(uint32_t));
+    if (!ports_per_ip) {
+        fprintf(stderr, "[WEB] Stats sampler: out of memory\n");
+        return NULL;
+    }
+    cgnat_counters_t prev;
+    cgnat_get_counters(st->cgnat, &prev);
+    uint64_t prev_ms = monotonic_ms();
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&st->stop_lock);
+    while (!st->stop) {
+        deadline.tv_sec++;
+        while (!st->stop && pthread_cond_timedwait(&st->stop_cond, &st->stop_lock, &deadline) != ETIMEDOUT) {
+        }
+        if (st->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&st->stop_lock);
+
+        /* The only engine reads, whatever the number of viewers: both are lock-free. */
+        cgnat_counters_t c;
+        cgnat_get_counters(st->cgnat, &c);
+        int num_public_ips = __atomic_load_n(&st->cgnat->num_public_ips, __ATOMIC_ACQUIRE);
+        cgnat_get_pool_usage(st->cgnat, ports_per_ip);
+        uint64_t now_ms = monotonic_ms();
+
+        stats_sample_t s = {
+            .t = time(NULL),
+            .active_connections = c.active_connections,
+            .packets_per_sec = per_sec(c.packets_translated, prev.packets_translated, now_ms - prev_ms),
+            .connections_per_sec = per_sec(c.total_connections, prev.total_connections, now_ms - prev_ms),
+            .exhaustion_per_sec = per_sec(c.port_exhaustion_events, prev.port_exhaustion_events, now_ms - prev_ms),
+        };
+        for (int i = 0; i < num_public_ips; i++) {
+            s.ports_in_use += ports_per_ip[i];
+        }
+        prev = c;
+        prev_ms = now_ms;
+
+        uint64_t id = st->latest + 1;
+        event_buf_t b = { 0 };
+        format_event(&b, id, &s, st->cgnat, &c, ports_per_ip, num_public_ips);
+        if (b.failed) {
+            b.len = 0;      /* publish the sample anyway, with an empty event */
+        }
+
+        pthread_rwlock_wrlock(&st->lock);
+        stats_event_t *e = &st->events[id % STATS_STREAM_BACKLOG];
+        char *old = e->data;
+        e->data = b.data;
+        e->len = b.len;
+        st->samples[id % STATS_STREAM_SECONDS] = s;
+        st->latest = id;
+        pthread_rwlock_unlock(&st->lock);
+        free(old);
+
+        http_server_wake_streams(st->http);
+        pthread_mutex_lock(&st->stop_lock);
+    }
+    pthread_mutex_unlock(&st->stop_lock);
+    free(ports_per_ip);
+    return NULL;
+}
+
+stats_stream_t* stats_stream_start(cgnat_t *cgnat, http_server_t *http) {
+    stats_stream_t *st = calloc(1, sizeof(stats_stream_t));
+    if (!st) {
+        return NULL;
+    }
+    st->cgnat = cgnat;
+    st->http = http;
+    pthread_mutex_init(&st->stop_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&st->stop_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_rwlock_init(&st->lock, NULL);
+    if (pthread_create(&st->sampler, NULL, sampler_main, st) != 0) {
+        pthread_rwlock_destroy(&st->lock);
+        pthread_cond_destroy(&st->stop_cond);
+        pthread_mutex_destroy(&st->stop_lock);
+        free(st);
+        return NULL;
+    }
+    return st;
+}
+
+/* Up to HISTORY_ROWS_PER_CALL rows of the history event; rows overwritten meanwhile are skipped. */
+static void write_history(http_conn_t *conn, stream_client_t *cl) {
+    stats_stream_t *st = cl->stream;
+    char buf[HISTORY_ROWS_PER_CALL * 96 + 128];
+    char *p = buf;
+    int first = cl->history_next == 0;
+
+    pthread_rwlock_rdlock(&st->lock);
+    uint64_t oldest = st->latest >= STATS_STREAM_SECONDS ? st->latest - STATS_STREAM_SECONDS + 1 : 1;
+    if (first) {
+        cl->history_next = oldest;
+        p += sprintf(p, "event: history\ndata: {\"fields\": [\"t\", \"active_connections\", \"ports_in_use\", "
+                     "\"packets_per_sec\", \"connections_per_sec\", \"exhaustion_per_sec\"], \"samples\": [\n");
+    } else if (cl->history_next < oldest) {
+        cl->history_next = oldest;
+    }
+    p += sprintf(p, "data: ");
+    for (int i = 0; i < HISTORY_ROWS_PER_CALL && cl->history_next <= cl->history_end; i++) {
+        const stats_sample_t *s = &st->samples[cl->history_next % STATS_STREAM_SECONDS];
+        p += sprintf(p, "%s[%ld, %lu, %lu, %lu, %lu, %lu]", first && i == 0 ? "" : ", ", (long)s->t,
+                     s->active_connections, s->ports_in_use, s->packets_per_sec, s->connections_per_sec,
+                     s->exhaustion_per_sec);
+        cl->history_next++;
+    }
+    pthread_rwlock_unlock(&st->lock);
+
+    p += sprintf(p, "\n");
+    if (cl->history_next > cl->history_end) {
+        p += sprintf(p, "data: ]}\nid: %lu\n\n", cl->history_end);
+        cl->next = cl->history_end + 1;
+        cl->history_end = 0;
+    }
+    http_stream_write(conn, buf, (size_t)(p - buf));
+}
+
+static int produce_events(http_conn_t *conn, void *ctx) {
+    stream_client_t *cl = ctx;
+    stats_stream_t *st = cl->stream;
+    if (cl->history_end) {
+        write_history(conn, cl);
+        return HTTP_STREAM_MORE;
+    }
+
+    pthread_rwlock_rdlock(&st->lock);
+    if (cl->next > st->latest) {
+        pthread_rwlock_unlock(&st->lock);
+        return HTTP_STREAM_WAIT;
+    }
+    if (st->latest - cl->next >= STATS_STREAM_BACKLOG) {
+        cl->next = st->latest;
+    }
+    for (; cl->next <= st->latest; cl->next++) {
+        const stats_event_t *e = &st->events[cl->next % STATS_STREAM_BACKLOG];
+        http_stream_write(conn, e->data, e->len);
+    }
+    pthread_rwlock_unlock(&st->lock);
+    return HTTP_STREAM_MORE;
+}
+
+void stats_stream_serve(stats_stream_t *st, http_conn_t *conn, const http_request_t *req) {
+    stream_client_t *cl = calloc(1, sizeof(stream_client_t));
+    if (!cl) {
+        const char *body = "{\"error\": \"Out of memory\"}";
+        http_respond(conn, "500 Internal Server Error", "application/json", NULL, body, strlen(body));
+        return;
+    }
+    cl->stream = st;
+
+    char value[32];
+    char *end;
+    pthread_rwlock_rdlock(&st->lock);
+    uint64_t latest = st->latest;
+    pthread_rwlock_unlock(&st->lock);
+    uint64_t last = http_header(req, "Last-Event-ID", value, sizeof(value)) ? strtoull(value, &end, 10) : 0;
+    if (last > 0 && *end == '\0' && last <= latest && latest - last < STATS_STREAM_BACKLOG) {
+        cl->next = last + 1;
+    } else if (latest > 0) {
+        cl->history_end = latest;
+    } else {
+        cl->next = 1;
+    }
+
+    http_respond_stream(conn, "200 OK", "text/event-stream",
+                        "Access-Control-Allow-Origin: *\r\nCache-Control: no-cache\r\n",
+                        produce_events, free, cl);
+    http_stream_write(conn, "retry: 2000\n\n", 13);
+}
+
+void stats_stream_stop(stats_stream_t *st) {
+    if (!st) {
+        return;
+    }
+    pthread_mutex_lock(&st->stop_lock);
+    st->stop = 1;
+    pthread_cond_signal(&st->stop_cond);
+    pthread_mutex_unlock(&st->stop_lock);
+    pthread_join(st->sampler, NULL);
+}
+
+void stats_stream_destroy(stats_stream_t *st) {
+    if (!st) {
+        return;
+    }
+    for (int i = 0; i < STATS_STREAM_BACKLOG; i++) {
+        free(st->events[i].data);
+    }
+    pthread_rwlock_destroy(&st->lock);
+    pthread_cond_destroy(&st->stop_cond);
+    pthread_mutex_destroy(&st->stop_lock);
+    free(st);
+}
@@ -0,0 +1,39 @@
+#ifndef STATS_STREAM_H
+#define STATS_STREAM_H
+
+#include "cgnat.h"
+#include "http_server.h"
+
+/*
+ * Live statistics for any number of dashboards at a fixed engine cost. One
+ * sampler thread reads the engine's counters once a second into a ring
+ * covering the last hour and formats that second's Server-Sent Event once:
+ * the current gauges, per-second rates since the previous sample, port use
+ * per public IP and sessions per state. Every /api/stream client is handed
+ * the same event text.
+ *
+ * A new client first gets the ring as one "history" event. A client that
+ * reconnects with Last-Event-ID resumes from the next event if it is still
+ * held, and one that falls more than STATS_STREAM_BACKLOG events behind
+ * skips to the latest, since every event carries absolute values.
+ */
+#define STATS_STREAM_SECONDS 3600
+#define STATS_STREAM_BACKLOG 32
+
+typedef struct stats_stream stats_stream_t;
+
+/* Starts the sampler; it wakes http's waiting streams after each sample. */
+stats_stream_t* stats_stream_start(cgnat_t *cgnat, http_server_t *http);
+
+/* Respond to a request for the event stream. */
+void stats_stream_serve(stats_stream_t *stream, http_conn_t *conn, const http_request_t *req);
+
+/*
+ * Shutdown is in two steps around http_server_stop: the sampler must stop
+ * waking the server before it goes away, and streams still being served
+ * read the ring until it has.
+ */
+void stats_stream_stop(stats_stream_t *stream);
+void stats_stream_destroy(stats_stream_t *stream);
+
+#endif
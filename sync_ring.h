@@ -0,0 +1,39 @@
+#ifndef SYNC_RING_H
+#define SYNC_RING_H
+
+#include <stdint.h>
+#include "spsc_ring.h"
+
+/*
+ * Session replication records, engine side. With sync rings attached the
+ * engine pushes a record under the shard lock when a session is created,
+ * changes TCP state or is deleted, and when it carries traffic again after
+ * being quiet for the refresh interval, so an established flow costs one
+ * compare per packet, not a record. The rings are the event log's
+ * (spsc_ring.h) and never block: a full ring counts the record as dropped,
+ * and the consumer has to start the standby over (ha_sync.c does).
+ */
+typedef enum {
+    SYNC_CREATE = 1,
+    SYNC_REFRESH,
+    SYNC_DELETE
+} sync_type_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t protocol;
+    uint8_t state;
+    uint8_t reserved;
+    uint16_t priv_port;
+    uint16_t pub_port;      /* create only */
+    uint32_t priv_ip;
+    uint32_t pub_ip;        /* create only */
+    uint32_t remote_ip;
+    uint16_t remote_port;
+    uint16_t reserved2;
+    uint32_t time;          /* last activity, unix seconds */
+} sync_record_t;
+
+SPSC_RING_DEFINE(sync_ring, sync_record_t)
+
+#endif
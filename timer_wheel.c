@@ -0,0 +1,139 @@
+#include "timer_wheel.h"
+
+static timer_node_t* node_at(const timer_wheel_t *wheel, uint32_t idx) {
+    return (timer_node_t*)(wheel->base + (size_t)idx * wheel->stride);
+}
+
+/* Highest level whose lower digits are all zero at tick t. */
+static int boundary_level(uint32_t t) {
+    if (t == 0) {
+        return TW_LEVELS - 1;
+    }
+    int level = __builtin_ctz(t) / 6;
+    return level < TW_LEVELS - 1 ? level : TW_LEVELS - 1;
+}
+
+static uint16_t slot_for(const timer_wheel_t *wheel, uint32_t expires) {
+    if ((int32_t)(expires - wheel->current) <= 0) {
+        return wheel->current & (TW_SLOTS - 1);
+    }
+    int level = (31 - __builtin_clz(expires ^ wheel->current)) / 6;
+    return (uint16_t)(level * TW_SLOTS + ((expires >> (6 * level)) & (TW_SLOTS - 1)));
+}
+
+static void link_node(timer_wheel_t *wheel, uint32_t idx, timer_node_t *node) {
+    uint16_t slot = slot_for(wheel, node->expires);
+    node->slot = slot;
+    node->prev = TW_NIL;
+    node->next = wheel->heads[slot];
+    if (node->next != TW_NIL) {
+        node_at(wheel, node->next)->prev = idx;
+    }
+    wheel->heads[slot] = idx;
+}
+
+static void unlink_node(timer_wheel_t *wheel, timer_node_t *node) {
+    if (node->prev != TW_NIL) {
+        node_at(wheel, node->prev)->next = node->next;
+    } else {
+        wheel->heads[node->slot] = node->next;
+    }
+    if (node->next != TW_NIL) {
+        node_at(wheel, node->next)->prev = node->prev;
+    }
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, void *base, size_t stride, size_t node_offset) {
+    for (int i = 0; i < TW_LEVELS * TW_SLOTS; i++) {
+        wheel->heads[i] = TW_NIL;
+    }
+    wheel->current = 0;
+    wheel->cascade_level = 0;
+    wheel->started = 0;
+    wheel->armed = 0;
+    wheel->base = (char*)base + node_offset;
+    wheel->stride = stride;
+}
+
+void timer_wheel_start(timer_wheel_t *wheel, uint32_t now) {
+    if (!wheel->started) {
+        wheel->current = now;
+        wheel->cascade_level = 0;
+        wheel->started = 1;
+    }
+}
+
+void timer_wheel_arm(timer_wheel_t *wheel, uint32_t idx, uint32_t expires) {
+    timer_node_t *node = node_at(wheel, idx);
+    if (node->slot != TW_UNARMED) {
+        unlink_node(wheel, node);
+    } else {
+        wheel->armed++;
+    }
+    node->expires = expires;
+    link_node(wheel, idx, node);
+}
+
+void timer_wheel_disarm(timer_wheel_t *wheel, uint32_t idx) {
+    timer_node_t *node = node_at(wheel, idx);
+    if (node->slot == TW_UNARMED) {
+        return;
+    }
+    unlink_node(wheel, node);
+    node->slot = TW_UNARMED;
+    wheel->armed--;
+}
+
+int timer_wheel_advance(timer_wheel_t *wheel, uint32_t now, int budget,
+                        timer_expire_fn expire, void *ctx) {
+    int done = 0;
+
+    while (done < budget && timer_wheel_pending(wheel, now)) {
+        /* Redistribute higher-level slots that come due at this tick. */
+        while (wheel->cascade_level > 0 && done < budget) {
+            int level = wheel->cascade_level;
+            uint16_t slot = level * TW_SLOTS + ((wheel->current >> (6 * level)) & (TW_SLOTS - 1));
+            uint32_t idx = wheel->heads[slot];
+            if (idx == TW_NIL) {
+                wheel->cascade_level--;
+                continue;
+            }
+            timer_node_t *node = node_at(wheel, idx);
+            unlink_node(wheel, node);
+            link_node(wheel, idx, node);
+            done++;
+        }
+        if (wheel->cascade_level > 0) {
+            break;
+        }
+
+        uint32_t idx = wheel->heads[wheel->current & (TW_SLOTS - 1)];
+        if (idx != TW_NIL) {
+            if (done >= budget) {
+                break;
+            }
+            timer_node_t *node = node_at(wheel, idx);
+            unlink_node(wheel, node);
+            node->slot = TW_UNARMED;
+            wheel->armed--;
+            expire(ctx, idx, now);
+            done++;
+            continue;
+        }
+
+        wheel->current++;
+        wheel->cascade_level = boundary_level(wheel->current);
+        done++;
+    }
+
+    /* Nothing armed: jump straight to the present instead of ticking. */
+    if (wheel->started && wheel->armed == 0 && (int32_t)(now - wheel->current) >= 0) {
+        wheel->current = now + 1;
+        wheel->cascade_level = 0;
+    }
+    return done;
+}
+
+int timer_wheel_pending(const timer_wheel_t *wheel, uint32_t now) {
+    return wheel->started && wheel->armed > 0 && (int32_t)(now - wheel->current) >= 0;
+}
@@ -0,0 +1,60 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hierarchical timing wheel over intrusive timer nodes addressed by 32-bit
+ * index. Ticks are absolute seconds; six levels of 64 slots cover the full
+ * 32-bit range, so a timer is always placed by the highest 6-bit digit in
+ * which its expiry differs from the current tick and never needs clamping.
+ * Expiry is driven incrementally with a caller-supplied work budget.
+ */
+#define TW_LEVELS 6
+#define TW_SLOTS 64
+#define TW_NIL 0xFFFFFFFFu
+
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+    uint32_t expires;
+    uint16_t slot;      /* level * TW_SLOTS + slot, or TW_UNARMED */
+} timer_node_t;
+
+#define TW_UNARMED 0xFFFF
+
+typedef struct {
+    uint32_t heads[TW_LEVELS * TW_SLOTS];
+    uint32_t current;       /* next tick to expire */
+    int cascade_level;      /* highest level still to cascade at `current` */
+    int started;
+    uint32_t armed;
+    char *base;             /* node i lives at base + i * stride */
+    size_t stride;
+} timer_wheel_t;
+
+/*
+ * Called for every node whose slot comes due. The node is already unlinked;
+ * the callback re-arms it with an expiry after `now` to keep it alive.
+ */
+typedef void (*timer_expire_fn)(void *ctx, uint32_t idx, uint32_t now);
+
+void timer_wheel_init(timer_wheel_t *wheel, void *base, size_t stride, size_t node_offset);
+
+/* Set the starting tick; later calls are ignored. */
+void timer_wheel_start(timer_wheel_t *wheel, uint32_t now);
+
+void timer_wheel_arm(timer_wheel_t *wheel, uint32_t idx, uint32_t expires);
+void timer_wheel_disarm(timer_wheel_t *wheel, uint32_t idx);
+
+/*
+ * Advance towards `now`, doing at most `budget` units of work (one per timer
+ * cascaded or expired). Returns the work done; the wheel is caught up when
+ * timer_wheel_pending() is zero afterwards.
+ */
+int timer_wheel_advance(timer_wheel_t *wheel, uint32_t now, int budget,
+                        timer_expire_fn expire, void *ctx);
+int timer_wheel_pending(const timer_wheel_t *wheel, uint32_t now);
+
+#endif
@@ -1,13 +1,21 @@
+#define _GNU_SOURCE
 #include "cgnat.h"
+#include "history.h"
+#include "http_server.h"
+#include "asset_cache.h"
+#include "stats_stream.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #define PORT 5000
 #define BUFFER_SIZE 65536
@@ -15,85 +23,59 @@
 static cgnat_t *global_cgnat = NULL;
 static volatile int server_running = 1;
 
+/* Mapping history (-H): sealed partitions on disk plus the one being built. */
+static history_writer_t *history_writer = NULL;
+static history_t *history_reader = NULL;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;   /* the reader maps and rescans lazily */
+static event_log_t *history_events = NULL;
+
+static http_server_t *http = NULL;
+static asset_cache_t *assets = NULL;
+static stats_stream_t *stats_stream = NULL;
+
 void signal_handler(int sig) {
     (void)sig;
     server_running = 0;
 }
 
-void send_http_response(int client_socket, const char *status, const char *content_type, const char *body) {
-    char header[1024];
-    snprintf(header, sizeof(header),
-        "HTTP/1.1 %s\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "Access-Control-Allow-Origin: *\r\n"
-        "Cache-Control: no-cache\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        status, content_type, strlen(body));
-    
-    send(client_socket, header, strlen(header), 0);
-    send(client_socket, body, strlen(body), 0);
+void send_http_response(http_conn_t *conn, const char *status, const char *content_type, const char *body) {
+    http_respond(conn, status, content_type,
+                 "Access-Control-Allow-Origin: *\r\n"
+                 "Cache-Control: no-cache\r\n",
+                 body, strlen(body));
 }
 
-void serve_dashboard(int client_socket) {
-    FILE *fp = fopen("dashboard.html", "r");
-    if (!fp) {
+/* dashboard.html comes from the asset cache: preformatted, gzipped, revalidated by ETag. */
+void serve_dashboard(http_conn_t *conn, const http_request_t *req) {
+    if (!assets || asset_cache_serve(assets, conn, req) != 0) {
         const char *error = "<html><body><h1>Dashboard not found</h1></body></html>";
-        send_http_response(client_socket, "404 Not Found", "text/html", error);
-        return;
+        send_http_response(conn, "404 Not Found", "text/html", error);
     }
-    
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    char *content = malloc(fsize + 1);
-    fread(content, 1, fsize, fp);
-    content[fsize] = 0;
-    fclose(fp);
-    
-    send_http_response(client_socket, "200 OK", "text/html; charset=utf-8", content);
-    free(content);
 }
 
-void get_ip_pool_stats(cgnat_t *cgnat, int *ports_per_ip) {
-    for (int i = 0; i < cgnat->num_public_ips; i++) {
-        ports_per_ip[i] = 0;
-        for (int j = 0; j < TOTAL_PORTS_PER_IP; j++) {
-            if (cgnat->port_pool[i][j].in_use) {
-                ports_per_ip[i]++;
-            }
-        }
-    }
-}
-
-void get_connection_states(cgnat_t *cgnat, int *state_counts) {
-    memset(state_counts, 0, 8 * sizeof(int));
-    for (int i = 0; i < MAX_NAT_ENTRIES; i++) {
-        if (cgnat->nat_table[i].in_use) {
-            state_counts[cgnat->nat_table[i].state]++;
-        }
-    }
-}
-
-void serve_api_stats(int client_socket) {
+void serve_api_stats(http_conn_t *conn) {
     char json[BUFFER_SIZE];
     char *ptr = json;
     int remaining = BUFFER_SIZE;
     
-    pthread_mutex_lock(&global_cgnat->lock);
-    
-    int ports_per_ip[MAX_PUBLIC_IPS] = {0};
-    get_ip_pool_stats(global_cgnat, ports_per_ip);
+    /* Everything below is kept up to date by the engine: no lock, no table scan. */
+    uint32_t *ports_per_ip = calloc(global_cgnat->max_public_ips, sizeof(uint32_t));
+    if (!ports_per_ip) {
+        send_http_response(conn, "500 Internal Server Error", "text/plain", "Out of memory");
+        return;
+    }
+    int num_public_ips = __atomic_load_n(&global_cgnat->num_public_ips, __ATOMIC_ACQUIRE);
+    cgnat_get_pool_usage(global_cgnat, ports_per_ip);
     
-    int state_counts[8] = {0};
-    get_connection_states(global_cgnat, state_counts);
+    cgnat_counters_t counters;
+    cgnat_get_counters(global_cgnat, &counters);
+    uint64_t *state_counts = counters.sessions_by_state;
+    uint64_t nat_entries = counters.entry_allocs - counters.entry_frees;
     
-    int total_ports = global_cgnat->num_public_ips * TOTAL_PORTS_PER_IP;
+    int total_ports = num_public_ips * TOTAL_PORTS_PER_IP;
     int ports_in_use = 0;
-    for (int i = 0; i < global_cgnat->num_public_ips; i++) {
-        ports_in_use += ports_per_ip[i];
+    for (int i = 0; i < num_public_ips; i++) {
+        ports_in_use += (int)ports_per_ip[i];
     }
     
     int written = snprintf(ptr, remaining, "{\n");
@@ -110,38 +92,50 @@ void serve_api_stats(int client_socket) {
         "  \"active_connections\": %lu,\n"
         "  \"packets_translated\": %lu,\n"
         "  \"port_exhaustion_events\": %lu,\n"
-        "  \"nat_table_entries\": %d,\n"
-        "  \"nat_table_capacity\": %d,\n"
-        "  \"nat_table_utilization\": %.2f,\n",
+        "  \"nat_table_entries\": %lu,\n"
+        "  \"nat_table_capacity\": %u,\n"
+        "  \"nat_table_utilization\": %.2f,\n"
+        "  \"nat_entry_allocs\": %lu,\n"
+        "  \"nat_entry_frees\": %lu,\n"
+        "  \"lookup_misses\": %lu,\n"
+        "  \"inbound_drops\": %lu,\n"
+        "  \"allocation_failures\": %lu,\n"
+        "  \"table_full_events\": %lu,\n",
         time(NULL),
-        global_cgnat->num_public_ips,
+        num_public_ips,
         total_ports,
         ports_in_use,
         total_ports - ports_in_use,
         total_ports > 0 ? (double)ports_in_use / total_ports * 100.0 : 0.0,
-        global_cgnat->stats_total_connections,
-        global_cgnat->stats_active_connections,
-        global_cgnat->stats_packets_translated,
-        global_cgnat->stats_port_exhaustion_events,
-        global_cgnat->nat_entries_count,
-        MAX_NAT_ENTRIES,
-        (double)global_cgnat->nat_entries_count / MAX_NAT_ENTRIES * 100.0
+        counters.total_connections,
+        counters.active_connections,
+        counters.packets_translated,
+        counters.port_exhaustion_events,
+        nat_entries,
+        global_cgnat->max_sessions,
+        (double)nat_entries / global_cgnat->max_sessions * 100.0,
+        counters.entry_allocs,
+        counters.entry_frees,
+        counters.lookup_misses,
+        counters.inbound_drops,
+        counters.alloc_failures,
+        counters.table_full
     );
     ptr += written; remaining -= written;
     
     written = snprintf(ptr, remaining, "  \"public_ips\": [\n");
     ptr += written; remaining -= written;
     
-    for (int i = 0; i < global_cgnat->num_public_ips; i++) {
+    for (int i = 0; i < num_public_ips; i++) {
         struct in_addr addr;
         addr.s_addr = htonl(global_cgnat->public_ips[i]);
         char ip_str[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &addr, ip_str, INET_ADDRSTRLEN);
         
         written = snprintf(ptr, remaining,
-            "    {\"ip\": \"%s\", \"ports_used\": %d, \"ports_available\": %d}%s\n",
+            "    {\"ip\": \"%s\", \"ports_used\": %u, \"ports_available\": %u}%s\n",
             ip_str, ports_per_ip[i], TOTAL_PORTS_PER_IP - ports_per_ip[i],
-            i < global_cgnat->num_public_ips - 1 ? "," : ""
+            i < num_public_ips - 1 ? "," : ""
         );
         ptr += written; remaining -= written;
     }
@@ -150,14 +144,14 @@ void serve_api_stats(int client_socket) {
     ptr += written; remaining -= written;
     
     written = snprintf(ptr, remaining,
-        "    \"closed\": %d,\n"
-        "    \"syn_sent\": %d,\n"
-        "    \"syn_received\": %d,\n"
-        "    \"established\": %d,\n"
-        "    \"fin_wait\": %d,\n"
-        "    \"closing\": %d,\n"
-        "    \"time_wait\": %d,\n"
-        "    \"udp_active\": %d\n"
+        "    \"closed\": %lu,\n"
+        "    \"syn_sent\": %lu,\n"
+        "    \"syn_received\": %lu,\n"
+        "    \"established\": %lu,\n"
+        "    \"fin_wait\": %lu,\n"
+        "    \"closing\": %lu,\n"
+        "    \"time_wait\": %lu,\n"
+        "    \"udp_active\": %lu\n"
         "  }\n",
         state_counts[0], state_counts[1], state_counts[2], state_counts[3],
         state_counts[4], state_counts[5], state_counts[6], state_counts[7]
@@ -166,86 +160,423 @@ void serve_api_stats(int client_socket) {
     
     written = snprintf(ptr, remaining, "}\n");
     
-    pthread_mutex_unlock(&global_cgnat->lock);
-    
-    send_http_response(client_socket, "200 OK", "application/json", json);
+    free(ports_per_ip);
+    send_http_response(conn, "200 OK", "application/json", json);
 }
 
-void serve_api_connections(int client_socket) {
-    char json[BUFFER_SIZE];
-    char *ptr = json;
-    int remaining = BUFFER_SIZE;
-    
-    pthread_mutex_lock(&global_cgnat->lock);
-    
-    int written = snprintf(ptr, remaining, "{\n  \"connections\": [\n");
-    ptr += written; remaining -= written;
-    
-    int count = 0;
-    int first = 1;
-    for (int i = 0; i < MAX_NAT_ENTRIES && count < 100; i++) {
-        if (global_cgnat->nat_table[i].in_use) {
-            struct in_addr priv_addr, pub_addr;
-            priv_addr.s_addr = htonl(global_cgnat->nat_table[i].priv_ip);
-            pub_addr.s_addr = htonl(global_cgnat->nat_table[i].pub_ip);
-            
-            char priv_ip[INET_ADDRSTRLEN], pub_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &priv_addr, priv_ip, INET_ADDRSTRLEN);
-            inet_ntop(AF_INET, &pub_addr, pub_ip, INET_ADDRSTRLEN);
-            
-            const char *proto = (global_cgnat->nat_table[i].protocol == PROTO_TCP) ? "TCP" : "UDP";
-            const char *states[] = {"CLOSED", "SYN_SENT", "SYN_RECV", "ESTABLISHED", 
-                                   "FIN_WAIT", "CLOSING", "TIME_WAIT", "UDP_ACTIVE"};
-            
-            written = snprintf(ptr, remaining,
-                "    %s{\"priv_ip\": \"%s\", \"priv_port\": %u, "
-                "\"pub_ip\": \"%s\", \"pub_port\": %u, "
-                "\"protocol\": \"%s\", \"state\": \"%s\", "
-                "\"age\": %ld}\n",
-                first ? "" : ",",
-                priv_ip, global_cgnat->nat_table[i].priv_port,
-                pub_ip, global_cgnat->nat_table[i].pub_port,
-                proto, states[global_cgnat->nat_table[i].state],
-                time(NULL) - global_cgnat->nat_table[i].last_activity
-            );
-            ptr += written; remaining -= written;
-            
-            count++;
-            first = 0;
+/* Prometheus text output, grown as needed; a failed allocation is reported once at the end. */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} metrics_buf_t;
+
+static void metrics_printf(metrics_buf_t *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(metrics_buf_t *m, const char *fmt, ...) {
+    for (;;) {
+        if (m->failed) {
+            return;
+        }
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(m->data + m->len, m->cap - m->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t)n < m->cap - m->len) {
+            m->len += (size_t)n;
+            return;
         }
+        size_t cap = m->cap * 2 + (n > 0 ? (size_t)n : 0);
+        char *data = realloc(m->data, cap);
+        if (!data) {
+            m->failed = 1;
+            return;
+        }
+        m->data = data;
+        m->cap = cap;
     }
-    
-    written = snprintf(ptr, remaining, "  ],\n  \"total\": %d,\n  \"showing\": %d\n}\n",
-        global_cgnat->nat_entries_count, count);
-    
-    pthread_mutex_unlock(&global_cgnat->lock);
-    
-    send_http_response(client_socket, "200 OK", "application/json", json);
 }
 
-void handle_client(int client_socket) {
-    char buffer[4096];
-    int bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-    
-    if (bytes_read <= 0) {
-        close(client_socket);
+static void metric_header(metrics_buf_t *m, const char *name, const char *type, const char *help) {
+    metrics_printf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metric_value(metrics_buf_t *m, const char *name, const char *type, const char *help, uint64_t value) {
+    metric_header(m, name, type, help);
+    metrics_printf(m, "%s %lu\n", name, value);
+}
+
+/* The engine times one call in CGNAT_LATENCY_SAMPLE; counts are scaled back up to all calls. */
+static void metric_latency(metrics_buf_t *m, const char *name, const char *direction, const latency_hist_t *h,
+                           double ticks_per_sec) {
+    uint64_t cumulative = 0;
+    for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+        cumulative += h->count[b] * CGNAT_LATENCY_SAMPLE;
+        metrics_printf(m, "%s_bucket{direction=\"%s\",le=\"%.4g\"} %lu\n",
+                       name, direction, (double)latency_bucket_lower(b + 1) / ticks_per_sec, cumulative);
+    }
+    cumulative += h->count[LATENCY_BUCKETS - 1] * CGNAT_LATENCY_SAMPLE;
+    metrics_printf(m, "%s_bucket{direction=\"%s\",le=\"+Inf\"} %lu\n", name, direction, cumulative);
+    metrics_printf(m, "%s_sum{direction=\"%s\"} %.9f\n",
+                   name, direction, (double)h->sum * CGNAT_LATENCY_SAMPLE / ticks_per_sec);
+    metrics_printf(m, "%s_count{direction=\"%s\"} %lu\n", name, direction, cumulative);
+}
+
+/* Like /api/stats, everything here is read from counters without locking a shard. */
+void serve_metrics(http_conn_t *conn) {
+    static const char *state_names[CONN_STATES] = {
+        "closed", "syn_sent", "syn_received", "established", "fin_wait", "closing", "time_wait", "udp_active"
+    };
+    metrics_buf_t m = { .data = malloc(32768), .cap = 32768 };
+    uint32_t *ports_per_ip = calloc(global_cgnat->max_public_ips, sizeof(uint32_t));
+    if (!m.data || !ports_per_ip) {
+        free(m.data);
+        free(ports_per_ip);
+        send_http_response(conn, "500 Internal Server Error", "text/plain", "Out of memory");
         return;
     }
-    
-    buffer[bytes_read] = '\0';
-    
-    if (strncmp(buffer, "GET / ", 6) == 0 || strncmp(buffer, "GET /index.html", 15) == 0) {
-        serve_dashboard(client_socket);
-    } else if (strncmp(buffer, "GET /api/stats", 14) == 0) {
-        serve_api_stats(client_socket);
-    } else if (strncmp(buffer, "GET /api/connections", 20) == 0) {
-        serve_api_connections(client_socket);
+    int num_public_ips = __atomic_load_n(&global_cgnat->num_public_ips, __ATOMIC_ACQUIRE);
+    cgnat_get_pool_usage(global_cgnat, ports_per_ip);
+    cgnat_counters_t c;
+    cgnat_get_counters(global_cgnat, &c);
+
+    metric_value(&m, "cgnat_sessions_created_total", "counter", "Sessions created.", c.total_connections);
+    metric_value(&m, "cgnat_sessions_active", "gauge", "Sessions currently in the table.", c.active_connections);
+    metric_value(&m, "cgnat_session_capacity", "gauge", "Session table capacity.", global_cgnat->max_sessions);
+    metric_value(&m, "cgnat_packets_translated_total", "counter", "Packets translated, both directions.",
+                 c.packets_translated);
+    metric_value(&m, "cgnat_port_exhaustion_events_total", "counter", "Allocations that found no free port.",
+                 c.port_exhaustion_events);
+    metric_value(&m, "cgnat_ports_in_use", "gauge", "Public ports in use across the pool.", c.ports_in_use);
+    metric_value(&m, "cgnat_session_entry_allocs_total", "counter", "Session table slots taken.", c.entry_allocs);
+    metric_value(&m, "cgnat_session_entry_frees_total", "counter", "Session table slots released.", c.entry_frees);
+    metric_value(&m, "cgnat_port_block_allocs_total", "counter", "Port blocks claimed by subscribers.",
+                 c.block_allocs);
+    metric_value(&m, "cgnat_port_block_frees_total", "counter", "Port blocks released.", c.block_frees);
+    metric_value(&m, "cgnat_shared_port_sessions_total", "counter",
+                 "APDM sessions placed on a public port already in use.", c.shared_ports);
+    metric_value(&m, "cgnat_lookup_misses_total", "counter", "Flow lookups that found no session.",
+                 c.lookup_misses);
+    metric_value(&m, "cgnat_inbound_drops_total", "counter", "Inbound packets that matched no session.",
+                 c.inbound_drops);
+    metric_value(&m, "cgnat_allocation_failures_total", "counter", "New sessions refused.", c.alloc_failures);
+    metric_value(&m, "cgnat_table_full_total", "counter", "New sessions refused because a table was full.",
+                 c.table_full);
+    metric_value(&m, "cgnat_reap_slices_total", "counter", "Expiry passes, one per shard lock hold.",
+                 c.reap_slices);
+    metric_header(&m, "cgnat_reap_hold_seconds_total", "counter", "Time the reaper held shard locks.");
+    metrics_printf(&m, "cgnat_reap_hold_seconds_total %.9f\n", c.reap_hold_ns / 1e9);
+    metric_header(&m, "cgnat_reap_max_hold_seconds", "gauge", "Longest single reaper lock hold.");
+    metrics_printf(&m, "cgnat_reap_max_hold_seconds %.9f\n", c.reap_max_hold_ns / 1e9);
+
+    metric_header(&m, "cgnat_sessions", "gauge", "Sessions by connection state.");
+    for (int i = 0; i < CONN_STATES; i++) {
+        metrics_printf(&m, "cgnat_sessions{state=\"%s\"} %lu\n", state_names[i], c.sessions_by_state[i]);
+    }
+
+    metric_header(&m, "cgnat_public_ip_ports_in_use", "gauge", "Ports in use on each public IP.");
+    for (int i = 0; i < num_public_ips; i++) {
+        struct in_addr addr = { .s_addr = htonl(global_cgnat->public_ips[i]) };
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, ip_str, INET_ADDRSTRLEN);
+        metrics_printf(&m, "cgnat_public_ip_ports_in_use{ip=\"%s\"} %u\n", ip_str, ports_per_ip[i]);
+    }
+    metric_header(&m, "cgnat_public_ip_port_utilization", "gauge", "Fraction of each public IP's ports in use.");
+    for (int i = 0; i < num_public_ips; i++) {
+        struct in_addr addr = { .s_addr = htonl(global_cgnat->public_ips[i]) };
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, ip_str, INET_ADDRSTRLEN);
+        metrics_printf(&m, "cgnat_public_ip_port_utilization{ip=\"%s\"} %.6f\n", ip_str,
+                       (double)ports_per_ip[i] / TOTAL_PORTS_PER_IP);
+    }
+
+    double ticks_per_sec = latency_ticks_per_sec();
+    latency_hist_t h;
+    metric_header(&m, "cgnat_translate_latency_seconds", "histogram",
+                  "Single-packet translation latency, shard lock wait included; sampled, counts scaled.");
+    cgnat_get_latency(global_cgnat, CGNAT_OUTBOUND, &h);
+    metric_latency(&m, "cgnat_translate_latency_seconds", "outbound", &h, ticks_per_sec);
+    cgnat_get_latency(global_cgnat, CGNAT_INBOUND, &h);
+    metric_latency(&m, "cgnat_translate_latency_seconds", "inbound", &h, ticks_per_sec);
+    metric_header(&m, "cgnat_burst_latency_seconds", "histogram",
+                  "Burst translation latency per packet, shard lock waits included; sampled, counts are bursts.");
+    cgnat_get_burst_latency(global_cgnat, CGNAT_OUTBOUND, &h);
+    metric_latency(&m, "cgnat_burst_latency_seconds", "outbound", &h, ticks_per_sec);
+    cgnat_get_burst_latency(global_cgnat, CGNAT_INBOUND, &h);
+    metric_latency(&m, "cgnat_burst_latency_seconds", "inbound", &h, ticks_per_sec);
+
+    http_server_stats_t hs;
+    http_server_get_stats(http, &hs);
+    metric_value(&m, "cgnat_http_connections_accepted_total", "counter", "Management API connections accepted.",
+                 hs.accepted);
+    metric_value(&m, "cgnat_http_connections_open", "gauge", "Management API connections open.", hs.open);
+    metric_value(&m, "cgnat_http_requests_total", "counter", "Management API requests served.", hs.requests);
+    metric_value(&m, "cgnat_http_bad_requests_total", "counter", "Malformed management API requests.",
+                 hs.bad_requests);
+
+    free(ports_per_ip);
+    if (m.failed) {
+        send_http_response(conn, "500 Internal Server Error", "text/plain", "Out of memory");
+    } else {
+        http_respond(conn, "200 OK", "text/plain; version=0.0.4; charset=utf-8", "Cache-Control: no-cache\r\n",
+                     m.data, m.len);
+    }
+    free(m.data);
+}
+
+/*
+ * /api/connections streams one page of sessions in slot order, built from
+ * short lock holds in the engine and sent with chunked encoding, so neither
+ * the page size nor the table size is bounded by a buffer.
+ */
+#define CONNECTIONS_DEFAULT_LIMIT 100
+#define CONNECTIONS_MAX_LIMIT 100000
+#define CONNECTIONS_IDLE_CALLS 64   /* empty engine calls before yielding to the event loop */
+
+static const char *conn_state_names[CONN_STATES] = {
+    "CLOSED", "SYN_SENT", "SYN_RECV", "ESTABLISHED", "FIN_WAIT", "CLOSING", "TIME_WAIT", "UDP_ACTIVE"
+};
+
+typedef struct {
+    cgnat_session_filter_t filter;
+    uint64_t cursor;
+    int remaining;
+    int count;
+    time_t now;
+    cgnat_session_t sessions[CGNAT_LIST_MAX];
+    char buf[CGNAT_LIST_MAX * 256 + 256];
+} connections_stream_t;
+
+static int produce_connections(http_conn_t *conn, void *ctx) {
+    connections_stream_t *st = ctx;
+    int n = 0;
+    for (int calls = 0; n == 0 && st->remaining > 0 && st->cursor != CGNAT_CURSOR_END; calls++) {
+        if (calls == CONNECTIONS_IDLE_CALLS) {
+            /* A long stretch without matches: send a little whitespace and come back. */
+            http_stream_write(conn, " ", 1);
+            return HTTP_STREAM_MORE;
+        }
+        int max = st->remaining < CGNAT_LIST_MAX ? st->remaining : CGNAT_LIST_MAX;
+        n = cgnat_list_sessions(global_cgnat, &st->filter, &st->cursor, st->sessions, max);
+    }
+
+    char *ptr = st->buf;
+    for (int i = 0; i < n; i++) {
+        const cgnat_session_t *c = &st->sessions[i];
+        struct in_addr priv_addr = { .s_addr = htonl(c->priv_ip) };
+        struct in_addr pub_addr = { .s_addr = htonl(c->pub_ip) };
+        struct in_addr remote_addr = { .s_addr = htonl(c->remote_ip) };
+        char priv_ip[INET_ADDRSTRLEN], pub_ip[INET_ADDRSTRLEN], remote_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &priv_addr, priv_ip, INET_ADDRSTRLEN);
+        inet_ntop(AF_INET, &pub_addr, pub_ip, INET_ADDRSTRLEN);
+        inet_ntop(AF_INET, &remote_addr, remote_ip, INET_ADDRSTRLEN);
+        ptr += sprintf(ptr,
+            "%s    {\"priv_ip\": \"%s\", \"priv_port\": %u, "
+            "\"pub_ip\": \"%s\", \"pub_port\": %u, "
+            "\"remote_ip\": \"%s\", \"remote_port\": %u, "
+            "\"protocol\": \"%s\", \"state\": \"%s\", \"age\": %ld}",
+            st->count + i ? ",\n" : "", priv_ip, c->priv_port, pub_ip, c->pub_port, remote_ip, c->remote_port,
+            c->protocol == PROTO_TCP ? "TCP" : "UDP", conn_state_names[c->state], (long)(st->now - c->last_activity));
+    }
+    st->count += n;
+    st->remaining -= n;
+
+    int done = st->remaining == 0 || st->cursor == CGNAT_CURSOR_END;
+    if (done) {
+        cgnat_counters_t counters;
+        cgnat_get_counters(global_cgnat, &counters);
+        ptr += sprintf(ptr, "%s  ],\n  \"total\": %lu,\n  \"showing\": %d,\n", st->count ? "\n" : "",
+                       counters.active_connections, st->count);
+        if (st->cursor == CGNAT_CURSOR_END) {
+            ptr += sprintf(ptr, "  \"next_cursor\": null\n}\n");
+        } else {
+            ptr += sprintf(ptr, "  \"next_cursor\": \"%lu\"\n}\n", st->cursor);
+        }
+    }
+    http_stream_write(conn, st->buf, (size_t)(ptr - st->buf));
+    return done ? HTTP_STREAM_DONE : HTTP_STREAM_MORE;
+}
+
+static int parse_connections_filter(const http_request_t *req, connections_stream_t *st, const char **error) {
+    char arg[128];
+    struct in_addr addr;
+    if (http_query_param(req, "priv_ip", arg, sizeof(arg))) {
+        if (inet_pton(AF_INET, arg, &addr) != 1 || addr.s_addr == 0) {
+            *error = "Bad priv_ip";
+            return -1;
+        }
+        st->filter.priv_ip = ntohl(addr.s_addr);
+    }
+    if (http_query_param(req, "pub_ip", arg, sizeof(arg))) {
+        if (inet_pton(AF_INET, arg, &addr) != 1 || addr.s_addr == 0) {
+            *error = "Bad pub_ip";
+            return -1;
+        }
+        st->filter.pub_ip = ntohl(addr.s_addr);
+    }
+    if (http_query_param(req, "protocol", arg, sizeof(arg))) {
+        if (strcasecmp(arg, "tcp") == 0) {
+            st->filter.protocol = PROTO_TCP;
+        } else if (strcasecmp(arg, "udp") == 0) {
+            st->filter.protocol = PROTO_UDP;
+        } else {
+            *error = "protocol must be tcp or udp";
+            return -1;
+        }
+    }
+    /* state=ESTABLISHED or a comma-separated list, names as listed. */
+    if (http_query_param(req, "state", arg, sizeof(arg))) {
+        for (char *name = strtok(arg, ","); name; name = strtok(NULL, ",")) {
+            int i = 0;
+            while (i < CONN_STATES && strcasecmp(name, conn_state_names[i]) != 0) {
+                i++;
+            }
+            if (i == CONN_STATES) {
+                *error = "Unknown state";
+                return -1;
+            }
+            st->filter.state_mask |= (uint8_t)(1u << i);
+        }
+    }
+    st->remaining = CONNECTIONS_DEFAULT_LIMIT;
+    char *end;
+    if (http_query_param(req, "limit", arg, sizeof(arg))) {
+        long limit = strtol(arg, &end, 10);
+        if (*end || limit < 1 || limit > CONNECTIONS_MAX_LIMIT) {
+            *error = "limit must be 1 to 100000";
+            return -1;
+        }
+        st->remaining = (int)limit;
+    }
+    if (http_query_param(req, "cursor", arg, sizeof(arg))) {
+        st->cursor = strtoull(arg, &end, 10);
+        if (*end || arg[0] == '\0' || arg[0] == '-') {
+            *error = "Bad cursor";
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void serve_api_connections(http_conn_t *conn, const http_request_t *req) {
+    connections_stream_t *st = calloc(1, sizeof(connections_stream_t));
+    if (!st) {
+        send_http_response(conn, "500 Internal Server Error", "text/plain", "Out of memory");
+        return;
+    }
+    const char *error;
+    if (parse_connections_filter(req, st, &error) != 0) {
+        char body[128];
+        snprintf(body, sizeof(body), "{\"error\": \"%s\"}", error);
+        send_http_response(conn, "400 Bad Request", "application/json", body);
+        free(st);
+        return;
+    }
+    st->now = time(NULL);
+    http_respond_stream(conn, "200 OK", "application/json",
+                        "Access-Control-Allow-Origin: *\r\nCache-Control: no-cache\r\n",
+                        produce_connections, free, st);
+    static const char head[] = "{\n  \"connections\": [\n";
+    http_stream_write(conn, head, sizeof(head) - 1);
+}
+
+void serve_api_lookup(http_conn_t *conn, const http_request_t *req) {
+    if (!history_reader) {
+        send_http_response(conn, "503 Service Unavailable", "application/json",
+                           "{\"error\": \"History not enabled (start with -H dir)\"}");
+        return;
+    }
+
+    char ip_arg[64], port_arg[16], t_arg[24];
+    struct in_addr addr;
+    char *end;
+    if (!http_query_param(req, "ip", ip_arg, sizeof(ip_arg)) || inet_pton(AF_INET, ip_arg, &addr) != 1 ||
+        !http_query_param(req, "port", port_arg, sizeof(port_arg))) {
+        send_http_response(conn, "400 Bad Request", "application/json",
+                           "{\"error\": \"Expected ip=<address>&port=<port>[&t=<unix time>]\"}");
+        return;
+    }
+    unsigned long port = strtoul(port_arg, &end, 10);
+    if (*end || port > 65535) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\": \"Bad port\"}");
+        return;
+    }
+    uint32_t t = (uint32_t)time(NULL);
+    if (http_query_param(req, "t", t_arg, sizeof(t_arg))) {
+        t = (uint32_t)strtoul(t_arg, &end, 10);
+        if (*end) {
+            send_http_response(conn, "400 Bad Request", "application/json", "{\"error\": \"Bad time\"}");
+            return;
+        }
+    }
+
+    /* The writer answers for what is not on disk yet, the default t=now included. */
+    history_record_t found[16];
+    uint32_t pub_ip = ntohl(addr.s_addr);
+    int n = history_writer_lookup(history_writer, pub_ip, (uint16_t)port, t, found, 16);
+    const char *source = "live";
+    if (n < 0) {
+        pthread_mutex_lock(&history_lock);
+        n = history_query(history_reader, pub_ip, (uint16_t)port, t, found, 16);
+        pthread_mutex_unlock(&history_lock);
+        source = "partition";
+    }
+
+    char json[8192];
+    char *ptr = json;
+    int remaining = sizeof(json);
+    int written = snprintf(ptr, remaining, "{\n  \"ip\": \"%s\", \"port\": %lu, \"t\": %u, \"source\": \"%s\",\n"
+                           "  \"mappings\": [\n", ip_arg, port, t, source);
+    ptr += written; remaining -= written;
+    for (int i = 0; i < n; i++) {
+        history_record_t *r = &found[i];
+        struct in_addr priv_addr = { .s_addr = htonl(r->priv_ip) };
+        struct in_addr remote_addr = { .s_addr = htonl(r->remote_ip) };
+        char priv_ip[INET_ADDRSTRLEN], remote_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &priv_addr, priv_ip, INET_ADDRSTRLEN);
+        inet_ntop(AF_INET, &remote_addr, remote_ip, INET_ADDRSTRLEN);
+        const char *proto = r->protocol == PROTO_TCP ? "TCP" : r->protocol == PROTO_UDP ? "UDP" : "";
+
+        written = snprintf(ptr, remaining,
+            "    {\"priv_ip\": \"%s\", \"priv_port\": %u, \"protocol\": \"%s\", "
+            "\"first_port\": %u, \"last_port\": %u, \"start\": %u, \"end\": %u, "
+            "\"open\": %s, \"block\": %s, \"remote_ip\": \"%s\", \"remote_port\": %u}%s\n",
+            priv_ip, r->priv_port, proto, r->pub_port, r->pub_port + r->port_count - 1u, r->start, r->end,
+            (r->flags & HISTORY_OPEN) ? "true" : "false", (r->flags & HISTORY_BLOCK) ? "true" : "false",
+            remote_ip, r->remote_port, i < n - 1 ? "," : "");
+        ptr += written; remaining -= written;
+    }
+    snprintf(ptr, remaining, "  ]\n}\n");
+    send_http_response(conn, "200 OK", "application/json", json);
+}
+
+void handle_request(http_conn_t *conn, const http_request_t *req, void *ctx) {
+    (void)ctx;
+    if (strcmp(req->method, "GET") != 0) {
+        send_http_response(conn, "405 Method Not Allowed", "application/json", "{\"error\": \"Method not allowed\"}");
+    } else if (strcmp(req->path, "/") == 0 || strcmp(req->path, "/index.html") == 0) {
+        serve_dashboard(conn, req);
+    } else if (strcmp(req->path, "/metrics") == 0) {
+        serve_metrics(conn);
+    } else if (strcmp(req->path, "/api/stats") == 0) {
+        serve_api_stats(conn);
+    } else if (strcmp(req->path, "/api/stream") == 0) {
+        stats_stream_t *stream = __atomic_load_n(&stats_stream, __ATOMIC_ACQUIRE);
+        if (stream) {
+            stats_stream_serve(stream, conn, req);
+        } else {
+            send_http_response(conn, "503 Service Unavailable", "application/json",
+                               "{\"error\": \"Stats stream not running\"}");
+        }
+    } else if (strcmp(req->path, "/api/connections") == 0) {
+        serve_api_connections(conn, req);
+    } else if (strcmp(req->path, "/api/lookup") == 0) {
+        serve_api_lookup(conn, req);
     } else {
         const char *msg = "{\"error\": \"Not found\"}";
-        send_http_response(client_socket, "404 Not Found", "application/json", msg);
+        send_http_response(conn, "404 Not Found", "application/json", msg);
     }
-    
-    close(client_socket);
 }
 
 void* traffic_simulator(void *arg) {
@@ -276,9 +607,49 @@ void* traffic_simulator(void *arg) {
     return NULL;
 }
 
-int main(void) {
+/*
+ * Keep mapping history under dir: the event log goes to dir/events and its
+ * writer thread feeds the history store as it drains the rings.
+ */
+static int enable_history(const char *dir) {
+    history_writer = history_writer_open(dir, 3600);
+    if (!history_writer) {
+        return -1;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/events", dir);
+    event_log_config_t log_config;
+    event_log_config_default(&log_config);
+    log_config.path = path;
+    log_config.sink = history_event_sink;
+    log_config.sink_ctx = history_writer;
+    history_events = event_log_open(&log_config, global_cgnat->num_shards);
+    history_reader = history_open(dir);
+    if (!history_events || !history_reader || cgnat_set_event_log(global_cgnat, history_events) != 0) {
+        return -1;
+    }
+    printf("[WEB] Mapping history in %s\n", dir);
+    return 0;
+}
+
+int main(int argc, char **argv) {
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+
+    const char *history_dir = NULL;
+    int port = PORT;
+    int workers = 0;
+    int arg;
+    while ((arg = getopt(argc, argv, "H:p:w:")) != -1) {
+        switch (arg) {
+            case 'H': history_dir = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-H history-dir] [-p port] [-w http-workers]\n", argv[0]);
+                return 1;
+        }
+    }
     
     printf("[WEB] Initializing CGNAT system...\n");
     global_cgnat = cgnat_init();
@@ -292,43 +663,66 @@ int main(void) {
         snprintf(ip, sizeof(ip), "203.0.113.%d", i);
         cgnat_add_public_ip(global_cgnat, ip);
     }
+    if (history_dir && enable_history(history_dir) != 0) {
+        fprintf(stderr, "[WEB] Failed to enable mapping history in %s\n", history_dir);
+        return 1;
+    }
     
+    /* Only the main thread takes SIGINT/SIGTERM, so sigsuspend() below sees them. */
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    assets = asset_cache_open();
+    if (assets) {
+        asset_cache_add(assets, "/", "dashboard.html", "text/html; charset=utf-8");
+        asset_cache_add(assets, "/index.html", "dashboard.html", "text/html; charset=utf-8");
+    }
+
     pthread_t sim_thread;
     pthread_create(&sim_thread, NULL, traffic_simulator, NULL);
     
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("[WEB] Socket creation failed");
-        return 1;
+    /* One descriptor per keep-alive connection; take whatever the hard limit allows. */
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
     }
-    
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    struct sockaddr_in address = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = INADDR_ANY,
-        .sin_port = htons(PORT)
-    };
-    
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("[WEB] Bind failed");
-        close(server_fd);
-        return 1;
+
+    http_server_config_t http_config;
+    http_server_config_default(&http_config);
+    http_config.port = port;
+    if (workers > 0) {
+        http_config.workers = workers;
     }
-    
-    if (listen(server_fd, 10) < 0) {
-        perror("[WEB] Listen failed");
-        close(server_fd);
+    http_config.handler = handle_request;
+    http = http_server_start(&http_config);
+    if (!http) {
+        perror("[WEB] HTTP server start failed");
+        server_running = 0;
+        pthread_join(sim_thread, NULL);
+        asset_cache_close(assets);
+        cgnat_destroy(global_cgnat);
         return 1;
     }
     
+    /* Started after the server it wakes; requests before that get 503. */
+    __atomic_store_n(&stats_stream, stats_stream_start(global_cgnat, http), __ATOMIC_RELEASE);
+    if (!stats_stream) {
+        fprintf(stderr, "[WEB] Stats stream unavailable\n");
+    }
+
     printf("\n");
     printf("╔════════════════════════════════════════════════════════╗\n");
     printf("║        CGNAT Web Dashboard Started                    ║\n");
     printf("║                                                        ║\n");
-    printf("║  Dashboard: http://0.0.0.0:5000                       ║\n");
-    printf("║  API Stats: http://0.0.0.0:5000/api/stats             ║\n");
+    printf("║  Dashboard: http://0.0.0.0:%-5d                      ║\n", port);
+    printf("║  API Stats: http://0.0.0.0:%-5d/api/stats            ║\n", port);
+    printf("║  Lookup:    http://0.0.0.0:%d/api/lookup?ip=&port=&t=║\n", port);
+    printf("║  Stream:    http://0.0.0.0:%-5d/api/stream (SSE)     ║\n", port);
+    printf("║  HTTP/1.1 keep-alive, %2d epoll workers                 ║\n", http_config.workers);
     printf("║  Traffic simulation running in background...          ║\n");
     printf("║                                                        ║\n");
     printf("║  Press Ctrl+C to stop                                 ║\n");
@@ -336,23 +730,22 @@ int main(void) {
     printf("\n");
     
     while (server_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_socket = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            if (server_running) {
-                perror("[WEB] Accept failed");
-            }
-            continue;
-        }
-        
-        handle_client(client_socket);
+        sigsuspend(&old_mask);
     }
     
     printf("\n[WEB] Shutting down...\n");
+    stats_stream_stop(stats_stream);
+    http_server_stop(http);
+    stats_stream_destroy(stats_stream);
+    asset_cache_close(assets);
     pthread_join(sim_thread, NULL);
-    close(server_fd);
+    if (history_events) {
+        event_log_sync(history_events);
+        cgnat_set_event_log(global_cgnat, NULL);
+        event_log_close(history_events);
+    }
+    history_close(history_reader);
+    history_writer_close(history_writer);
     cgnat_destroy(global_cgnat);
     
     return 0;